@@ -14,6 +14,9 @@ SICursor *SI_NewCursor(void *ctx) {
   c->total = 0;
   c->ctx = ctx;
   c->error = SI_CURSOR_OK;
+  c->Next = NULL;
+  c->CurrentKey = NULL;
+  c->Release = NULL;
 
   return c;
 }
@@ -0,0 +1,209 @@
+#include "index.h"
+#include "key.h"
+#include "util/khash.h"
+#include "rmutil/alloc.h"
+
+/* The pending changes of a deferred index, by id */
+KHASH_MAP_INIT_STR(siDeferredChanges, SIChange *);
+
+typedef struct {
+  SIIndex inner;
+  SIKeyCmpFunc *cmpFuncs;
+  size_t numFuncs;
+  khash_t(siDeferredChanges) *pending;
+} deferredIndex;
+
+/* A pending change in a flush batch. The sort comparator takes no context, so
+ * each entry points back to its index */
+typedef struct {
+  SIChange *ch;
+  deferredIndex *idx;
+} deferredEntry;
+
+/* Deletions come first, followed by the additions in key order */
+int deferredEntry_cmp(const void *p1, const void *p2) {
+  const deferredEntry *e1 = p1, *e2 = p2;
+  if (e1->ch->type != e2->ch->type) {
+    return e1->ch->type == SI_CHDEL ? -1 : 1;
+  }
+  if (e1->ch->type == SI_CHDEL) {
+    return 0;
+  }
+  for (size_t i = 0; i < e1->idx->numFuncs; i++) {
+    int rc =
+        e1->idx->cmpFuncs[i](&e1->ch->v.vals[i], &e2->ch->v.vals[i], NULL);
+    if (rc != 0) {
+      return rc;
+    }
+  }
+  return 0;
+}
+
+/* Buffer the changes. Like the compound index, we take ownership of the ids
+ * of additions, while deleted ids are copied */
+int deferredIndex_Apply(void *ctx, SIChangeSet cs) {
+  deferredIndex *idx = ctx;
+
+  for (size_t i = 0; i < cs.numChanges; i++) {
+    SIChange ch = cs.changes[i];
+    if (ch.type == SI_CHADD && ch.v.len != idx->numFuncs) {
+      return SI_INDEX_ERROR;
+    }
+
+    SIChange *pch;
+    khiter_t k = kh_get(siDeferredChanges, idx->pending, ch.id);
+    if (k != kh_end(idx->pending)) {
+      // the last write wins. We keep the id we already own, as it is the key
+      pch = kh_value(idx->pending, k);
+      if (pch->type == SI_CHADD) {
+        SIValueVector_Free(&pch->v);
+      }
+      if (ch.type == SI_CHADD) {
+        free(ch.id);
+      }
+    } else {
+      pch = malloc(sizeof(SIChange));
+      pch->id = ch.type == SI_CHADD ? ch.id : strdup(ch.id);
+      int rc;
+      k = kh_put(siDeferredChanges, idx->pending, pch->id, &rc);
+      kh_value(idx->pending, k) = pch;
+    }
+
+    pch->type = ch.type;
+    if (ch.type == SI_CHADD) {
+      pch->v = SI_NewValueVector(ch.v.len);
+      for (size_t j = 0; j < ch.v.len; j++) {
+        SIValueVector_Append(&pch->v, SIValue_Copy(ch.v.vals[j]));
+      }
+    }
+  }
+
+  return SI_INDEX_OK;
+}
+
+int SIDeferredIndex_Flush(void *ctx) {
+  deferredIndex *idx = ctx;
+  size_t num = kh_size(idx->pending);
+  if (num == 0) {
+    return SI_INDEX_OK;
+  }
+
+  deferredEntry *entries = calloc(num, sizeof(deferredEntry));
+  size_t n = 0;
+  for (khiter_t k = kh_begin(idx->pending); k != kh_end(idx->pending); ++k) {
+    if (kh_exist(idx->pending, k)) {
+      entries[n++] =
+          (deferredEntry){.ch = kh_value(idx->pending, k), .idx = idx};
+    }
+  }
+  // inserting in key order, consecutive inserts descend mostly the same,
+  // already cached, skiplist path
+  qsort(entries, n, sizeof(deferredEntry), deferredEntry_cmp);
+
+  SIChangeSet cs = SI_NewChangeSet(n);
+  for (size_t i = 0; i < n; i++) {
+    SIChangeSet_AddCahnge(&cs, *entries[i].ch);
+  }
+
+  int rc = SIIndex_ApplyEach(idx->inner, cs, NULL, NULL);
+
+  // the inner index owns the added ids now, or they were freed if rejected
+  for (size_t i = 0; i < n; i++) {
+    SIChange *ch = entries[i].ch;
+    if (ch->type == SI_CHDEL) {
+      free(ch->id);
+    } else {
+      SIValueVector_Free(&ch->v);
+    }
+    free(ch);
+  }
+  kh_clear(siDeferredChanges, idx->pending);
+  SIChangeSet_Free(&cs);
+  free(entries);
+  return rc;
+}
+
+size_t SIDeferredIndex_Pending(void *ctx) {
+  return kh_size(((deferredIndex *)ctx)->pending);
+}
+
+SIIndex SIDeferredIndex_Inner(void *ctx) {
+  return ((deferredIndex *)ctx)->inner;
+}
+
+/* Reads apply the pending changes first, so they always see the writes that
+ * preceded them */
+SICursor *deferredIndex_Find(void *ctx, SIQuery *q) {
+  deferredIndex *idx = ctx;
+  if (SIDeferredIndex_Flush(idx) != SI_INDEX_OK) {
+    // some of the pending changes were dropped, the results would be stale
+    SICursor *c = SI_NewCursor(NULL);
+    c->error = SI_CURSOR_ERROR;
+    return c;
+  }
+  return idx->inner.Find(idx->inner.ctx, q);
+}
+
+void deferredIndex_Traverse(void *ctx, IndexVisitor cb, void *visitCtx) {
+  deferredIndex *idx = ctx;
+  SIDeferredIndex_Flush(idx);
+  idx->inner.Traverse(idx->inner.ctx, cb, visitCtx);
+}
+
+int deferredIndex_DeleteWhere(void *ctx, SIQuery *q, IndexVisitor cb,
+                              void *visitCtx, size_t *num,
+                              SIGarbage **garbage) {
+  deferredIndex *idx = ctx;
+  SIDeferredIndex_Flush(idx);
+  return idx->inner.DeleteWhere(idx->inner.ctx, q, cb, visitCtx, num, garbage);
+}
+
+size_t deferredIndex_Len(void *ctx) {
+  deferredIndex *idx = ctx;
+  SIDeferredIndex_Flush(idx);
+  return idx->inner.Len(idx->inner.ctx);
+}
+
+size_t deferredIndex_Estimate(void *ctx, struct SIQueryPlan *plan) {
+  deferredIndex *idx = ctx;
+  SIDeferredIndex_Flush(idx);
+  return idx->inner.Estimate(idx->inner.ctx, plan);
+}
+
+void deferredIndex_Free(void *ctx) {
+  deferredIndex *idx = ctx;
+  for (khiter_t k = kh_begin(idx->pending); k != kh_end(idx->pending); ++k) {
+    if (kh_exist(idx->pending, k)) {
+      SIChange *ch = kh_value(idx->pending, k);
+      if (ch->type == SI_CHADD) {
+        SIValueVector_Free(&ch->v);
+      }
+      free(ch->id);
+      free(ch);
+    }
+  }
+  kh_destroy(siDeferredChanges, idx->pending);
+  idx->inner.Free(idx->inner.ctx);
+  free(idx->cmpFuncs);
+  free(idx);
+}
+
+SIIndex SI_NewDeferredIndex(SIIndex inner, SISpec *spec) {
+  deferredIndex *idx = malloc(sizeof(deferredIndex));
+  idx->inner = inner;
+  idx->pending = kh_init(siDeferredChanges);
+  idx->numFuncs = spec->numProps;
+  idx->cmpFuncs = calloc(spec->numProps, sizeof(SIKeyCmpFunc));
+  for (size_t i = 0; i < spec->numProps; i++) {
+    idx->cmpFuncs[i] = SI_KeyCmpFunc(spec->properties[i].type);
+  }
+
+  return (SIIndex){.ctx = idx,
+                   .Apply = deferredIndex_Apply,
+                   .Find = deferredIndex_Find,
+                   .Traverse = deferredIndex_Traverse,
+                   .DeleteWhere = deferredIndex_DeleteWhere,
+                   .Len = deferredIndex_Len,
+                   .Estimate = deferredIndex_Estimate,
+                   .Free = deferredIndex_Free};
+}
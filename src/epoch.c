@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <sched.h>
+#include <string.h>
+#include "epoch.h"
+#include "rmutil/alloc.h"
+
+/* A reader slot, on a cache line of its own so readers don't contend */
+typedef struct {
+  int inUse;
+  uint64_t epoch;
+  char pad[48];
+} siEpochSlot;
+
+typedef struct {
+  void *ptr;
+  SIEpochFreeFunc fn;
+  uint64_t epoch;
+} siRetired;
+
+struct siEpoch {
+  siEpochSlot slots[SI_EPOCH_MAX_READERS];
+  uint64_t epoch;
+
+  // retired pointers in the order they were retired, so their epochs never
+  // decrease. The ones before head are already freed
+  siRetired *retired;
+  size_t head;
+  size_t len;
+  size_t cap;
+};
+
+SIEpoch *SI_NewEpoch() {
+  SIEpoch *e = calloc(1, sizeof(SIEpoch));
+  e->epoch = 1;
+  return e;
+}
+
+int SIEpoch_Enter(SIEpoch *e) {
+  for (;;) {
+    for (int i = 0; i < SI_EPOCH_MAX_READERS; i++) {
+      int free = 0;
+      if (!__atomic_load_n(&e->slots[i].inUse, __ATOMIC_RELAXED) &&
+          __atomic_compare_exchange_n(&e->slots[i].inUse, &free, 1, 0,
+                                      __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        // the writer treats the slot as inside from the moment it is taken,
+        // whatever epoch it still holds
+        __atomic_store_n(&e->slots[i].epoch,
+                         __atomic_load_n(&e->epoch, __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+        return i;
+      }
+    }
+    sched_yield();
+  }
+}
+
+void SIEpoch_Exit(SIEpoch *e, int slot) {
+  __atomic_store_n(&e->slots[slot].inUse, 0, __ATOMIC_RELEASE);
+}
+
+void SIEpoch_Retire(SIEpoch *e, void *ptr, SIEpochFreeFunc fn) {
+  if (e->len == e->cap) {
+    // reuse the freed prefix before growing
+    if (e->head) {
+      memmove(e->retired, &e->retired[e->head],
+              (e->len - e->head) * sizeof(siRetired));
+      e->len -= e->head;
+      e->head = 0;
+    }
+    if (e->len == e->cap) {
+      e->cap = e->cap ? e->cap * 2 : 64;
+      e->retired = realloc(e->retired, e->cap * sizeof(siRetired));
+    }
+  }
+  e->retired[e->len++] =
+      (siRetired){ptr, fn, __atomic_load_n(&e->epoch, __ATOMIC_RELAXED)};
+}
+
+size_t SIEpoch_Collect(SIEpoch *e) {
+  uint64_t epoch = __atomic_load_n(&e->epoch, __ATOMIC_RELAXED);
+  int advance = 1;
+  for (int i = 0; i < SI_EPOCH_MAX_READERS && advance; i++) {
+    if (__atomic_load_n(&e->slots[i].inUse, __ATOMIC_SEQ_CST) &&
+        __atomic_load_n(&e->slots[i].epoch, __ATOMIC_SEQ_CST) != epoch) {
+      advance = 0;
+    }
+  }
+  if (advance) {
+    __atomic_store_n(&e->epoch, ++epoch, __ATOMIC_SEQ_CST);
+  }
+
+  while (e->head < e->len && e->retired[e->head].epoch + 2 <= epoch) {
+    e->retired[e->head].fn(e->retired[e->head].ptr);
+    e->head++;
+  }
+  if (e->head == e->len) {
+    e->head = e->len = 0;
+  }
+  return e->len - e->head;
+}
+
+void SIEpoch_Free(SIEpoch *e) {
+  for (int i = 0; i < SI_EPOCH_MAX_READERS; i++) {
+    while (__atomic_load_n(&e->slots[i].inUse, __ATOMIC_ACQUIRE)) {
+      sched_yield();
+    }
+  }
+  for (size_t i = e->head; i < e->len; i++) {
+    e->retired[i].fn(e->retired[i].ptr);
+  }
+  free(e->retired);
+  free(e);
+}
@@ -0,0 +1,42 @@
+#ifndef __SI_EPOCH_H__
+#define __SI_EPOCH_H__
+
+#include <stdlib.h>
+
+/* Epoch based reclamation of memory unlinked from a structure that is read by
+ * other threads without locks.
+ *
+ * Readers enter the domain for as long as they may hold pointers into the
+ * structure, announcing the epoch they started in. The single writer retires
+ * what it unlinks instead of freeing it, tagged with the current epoch. The
+ * epoch only moves on once all the readers inside have seen it, so memory
+ * retired two epochs ago can't be reached by any reader, and is freed */
+typedef struct siEpoch SIEpoch;
+
+typedef void (*SIEpochFreeFunc)(void *ptr);
+
+// the number of readers that can be inside a domain at once. Readers beyond it
+// wait for a slot
+#define SI_EPOCH_MAX_READERS 128
+
+SIEpoch *SI_NewEpoch();
+
+/* Enter the domain, returning the reader's slot to exit with. Can be called
+ * from any thread */
+int SIEpoch_Enter(SIEpoch *e);
+
+void SIEpoch_Exit(SIEpoch *e, int slot);
+
+/* Free ptr with fn once no reader can still reach it. Writer only */
+void SIEpoch_Retire(SIEpoch *e, void *ptr, SIEpochFreeFunc fn);
+
+/* Move the epoch on if all the readers have seen it, and free what no reader
+ * can reach anymore. Returns the number of pointers still retired. Writer
+ * only */
+size_t SIEpoch_Collect(SIEpoch *e);
+
+/* Wait for all the readers to exit, and free the domain along with everything
+ * retired in it */
+void SIEpoch_Free(SIEpoch *e);
+
+#endif
@@ -0,0 +1,201 @@
+#include <time.h>
+#include "hash_build.h"
+#include "hash_index.h"
+#include "hash_tracking.h"
+#include "rmutil/alloc.h"
+
+static long long __nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void hashBuild_Free(HashBuild *b) {
+  if (b->idx) {
+    b->idx->build = NULL;
+    // indexes without a prefix only track keys while building
+    if (!b->idx->prefix) {
+      HashTracking_Unregister(b->idx);
+    }
+  }
+  free(b);
+}
+
+/* Replace the index's contents with the built index */
+void hashBuild_Finish(RedisModuleCtx *ctx, HashBuild *b) {
+  RedisIndex_Replace(b->idx, b->shadow);
+  // the built index was not changed through the cache
+  if (b->idx->results) {
+    SIResultCache_Clear(b->idx->results);
+  }
+
+  RedisModule_Log(ctx, "notice",
+                  "index build done: %zd keys scanned, %zd indexed in %lldms",
+                  b->scanned, b->indexed, __nowMs() - b->startMs);
+  hashBuild_Free(b);
+}
+
+/* Index the hash keys of a single SCAN reply. Returns 0 if the scan is done */
+int hashBuild_ScanStep(RedisModuleCtx *ctx, HashBuild *b) {
+  RedisModuleCallReply *r = RedisModule_Call(ctx, "SCAN", "ccl", b->cursor,
+                                             "COUNT", SI_BUILD_SCAN_COUNT);
+  if (RedisModule_CallReplyType(r) != REDISMODULE_REPLY_ARRAY ||
+      RedisModule_CallReplyLength(r) != 2) {
+    RedisModule_Log(ctx, "warning", "index build: unexpected SCAN reply");
+    RedisModule_FreeCallReply(r);
+    return 0;
+  }
+
+  size_t len;
+  const char *cursor = RedisModule_CallReplyStringPtr(
+      RedisModule_CallReplyArrayElement(r, 0), &len);
+  snprintf(b->cursor, sizeof(b->cursor), "%.*s", (int)len, cursor);
+
+  RedisModuleCallReply *keys = RedisModule_CallReplyArrayElement(r, 1);
+  size_t num = RedisModule_CallReplyLength(keys);
+  SIChangeSet cs = SI_NewChangeSet(num);
+  for (size_t i = 0; i < num; i++) {
+    RedisModuleString *kstr = RedisModule_CreateStringFromCallReply(
+        RedisModule_CallReplyArrayElement(keys, i));
+    const char *key = RedisModule_StringPtrLen(kstr, &len);
+    b->scanned++;
+
+    if (HashTracking_KeyMatches(b->idx, b->db, key, len)) {
+      RedisModuleKey *k = RedisModule_OpenKey(ctx, kstr, REDISMODULE_READ);
+      SIChange ch;
+      if (RedisModule_KeyType(k) == REDISMODULE_KEYTYPE_HASH) {
+        SIId id = (SIId)strdup(key);
+        if (HashIndex_ReadChange(ctx, b->idx, k, id, &ch) == REDISMODULE_OK) {
+          SIChangeSet_AddCahnge(&cs, ch);
+        } else {
+          free(id);
+        }
+      }
+      if (k) {
+        RedisModule_CloseKey(k);
+      }
+    }
+    RedisModule_FreeString(ctx, kstr);
+  }
+
+  for (size_t i = 0; i < cs.numChanges; i++) {
+    SIChangeSet one = {.changes = &cs.changes[i], .numChanges = 1, .cap = 1};
+    if (b->shadow.Apply(b->shadow.ctx, one) == SI_INDEX_OK) {
+      b->indexed++;
+    } else {
+      RedisModule_Log(ctx, "warning", "index build: could not index id %s",
+                      cs.changes[i].id);
+    }
+    SIValueVector_Free(&cs.changes[i].v);
+  }
+  SIChangeSet_Free(&cs);
+  RedisModule_FreeCallReply(r);
+
+  return strcmp(b->cursor, "0") != 0;
+}
+
+/* Timer callback running a single build slice */
+void hashBuild_Slice(RedisModuleCtx *ctx, void *data) {
+  HashBuild *b = data;
+  // the index was deleted since the last slice
+  if (!b->idx) {
+    hashBuild_Free(b);
+    return;
+  }
+
+  int db = RedisModule_GetSelectedDb(ctx);
+  RedisModule_SelectDb(ctx, b->db);
+
+  long long start = __nowMs();
+  int more;
+  do {
+    more = hashBuild_ScanStep(ctx, b);
+  } while (more && __nowMs() - start < SI_BUILD_SLICE_MS);
+
+  if (more) {
+    // yield to the clients until the next event loop iteration
+    RedisModule_CreateTimer(ctx, 0, hashBuild_Slice, b);
+  } else {
+    hashBuild_Finish(ctx, b);
+  }
+  RedisModule_SelectDb(ctx, db);
+}
+
+int HashBuild_Start(RedisModuleCtx *ctx, RedisIndex *idx) {
+  if (idx->build || !HashTracking_Supported()) {
+    return REDISMODULE_ERR;
+  }
+
+  HashBuild *b = malloc(sizeof(HashBuild));
+  b->idx = idx;
+  b->shadow = SI_NewIndex(idx->spec);
+  b->db = idx->db = RedisModule_GetSelectedDb(ctx);
+  strcpy(b->cursor, "0");
+  b->scanned = 0;
+  b->indexed = 0;
+  b->startMs = __nowMs();
+
+  RedisModuleCallReply *r = RedisModule_Call(ctx, "DBSIZE", "");
+  b->total = RedisModule_CallReplyType(r) == REDISMODULE_REPLY_INTEGER
+                 ? RedisModule_CallReplyInteger(r)
+                 : 0;
+  RedisModule_FreeCallReply(r);
+
+  idx->build = b;
+  // track the keys written during the build. Indexes with a prefix are
+  // already tracked
+  if (!idx->prefix) {
+    HashTracking_Register(idx);
+  }
+  RedisModule_CreateTimer(ctx, 0, hashBuild_Slice, b);
+  return REDISMODULE_OK;
+}
+
+void HashBuild_Cancel(RedisIndex *idx) {
+  HashBuild *b = idx->build;
+  // the pending slice frees the build
+  b->shadow.Free(b->shadow.ctx);
+  b->idx = NULL;
+  idx->build = NULL;
+}
+
+void HashBuild_ApplyChanges(RedisModuleCtx *ctx, RedisIndex *idx,
+                            SIChangeSet *cs) {
+  HashBuild *b = idx->build;
+  for (size_t i = 0; i < cs->numChanges; i++) {
+    // the built index owns its own copies of the ids
+    SIChange ch = cs->changes[i];
+    if (ch.type == SI_CHADD) {
+      ch.id = (SIId)strdup(ch.id);
+    }
+    SIChangeSet one = {.changes = &ch, .numChanges = 1, .cap = 1};
+    if (b->shadow.Apply(b->shadow.ctx, one) != SI_INDEX_OK) {
+      RedisModule_Log(ctx, "warning", "index build: could not index id %s",
+                      ch.id);
+    }
+  }
+}
+
+int HashBuild_ReplyProgress(RedisModuleCtx *ctx, HashBuild *b) {
+  long long elapsed = __nowMs() - b->startMs;
+  // keys per second, and the remaining time at this rate
+  long long rate = elapsed ? b->scanned * 1000 / elapsed : 0;
+  long long eta = -1;
+  if (rate) {
+    eta = b->total > b->scanned ? (b->total - b->scanned) * 1000 / rate : 0;
+  }
+
+  RedisModule_ReplyWithSimpleString(ctx, "keys_scanned");
+  RedisModule_ReplyWithLongLong(ctx, b->scanned);
+  RedisModule_ReplyWithSimpleString(ctx, "keys_indexed");
+  RedisModule_ReplyWithLongLong(ctx, b->indexed);
+  RedisModule_ReplyWithSimpleString(ctx, "keys_total");
+  RedisModule_ReplyWithLongLong(ctx, b->total);
+  RedisModule_ReplyWithSimpleString(ctx, "elapsed_ms");
+  RedisModule_ReplyWithLongLong(ctx, elapsed);
+  RedisModule_ReplyWithSimpleString(ctx, "keys_per_sec");
+  RedisModule_ReplyWithLongLong(ctx, rate);
+  RedisModule_ReplyWithSimpleString(ctx, "eta_ms");
+  RedisModule_ReplyWithLongLong(ctx, eta);
+  return 12;
+}
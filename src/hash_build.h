@@ -0,0 +1,60 @@
+#ifndef __SI_HASH_BUILD_H__
+#define __SI_HASH_BUILD_H__
+
+#include "redismodule.h"
+#include "index_type.h"
+
+/*
+* Incremental building of hash indexes over an existing keyspace.
+*
+* The keyspace is scanned with SCAN in time bounded slices on the main thread,
+* yielding to clients between slices. The hash keys matching the index are
+* read into a new index, which replaces the index's contents once the scan is
+* done, so queries never see a partially built index.
+*
+* While building, the index tracks the written keys like a PREFIX index does,
+* and their changes are applied to the new index as well. Keys modified
+* during the build are therefore indexed with their latest values, whether
+* the scan has reached them or not.
+*/
+
+// the time budget of a single build slice
+#define SI_BUILD_SLICE_MS 2
+// the COUNT hint of each SCAN call
+#define SI_BUILD_SCAN_COUNT 100
+
+typedef struct hashBuild {
+  // the index we're building for, NULL if it was deleted during the build
+  RedisIndex *idx;
+  // the index being built, replacing the index's contents when done
+  SIIndex shadow;
+
+  int db;
+  char cursor[32];
+
+  // progress counters
+  size_t scanned;
+  size_t indexed;
+  // the number of keys in the database when the build started
+  size_t total;
+  long long startMs;
+} HashBuild;
+
+/* Start building an index from the keys of the currently selected database.
+ * Returns REDISMODULE_ERR if the index is already being built or the server
+ * does not support building in the background */
+int HashBuild_Start(RedisModuleCtx *ctx, RedisIndex *idx);
+
+/* Stop the build of an index that is being freed */
+void HashBuild_Cancel(RedisIndex *idx);
+
+/* Apply a change set of the index to the index being built as well. The
+ * change set itself is not modified */
+void HashBuild_ApplyChanges(RedisModuleCtx *ctx, RedisIndex *idx,
+                            SIChangeSet *cs);
+
+/* Reply with the build progress as name/value pairs, and return the number of
+ * reply elements */
+int HashBuild_ReplyProgress(RedisModuleCtx *ctx, HashBuild *b);
+
+#endif
@@ -1,4 +1,6 @@
 #include "hash_index.h"
+#include "hash_build.h"
+#include "index_pool.h"
 #include "rmutil/strings.h"
 #include "rmutil/alloc.h"
 
@@ -29,28 +31,152 @@ RedisModuleCallReply *__callParametricCommand(RedisModuleCtx *ctx, SIId id,
   return r;
 }
 
+/* A read command served directly through the key API, instead of going
+ * through RedisModule_Call. A handler returns REDISMODULE_ERR without replying
+ * if it can't serve a key, and the generic path is used instead */
+typedef int (*DirectReadHandler)(RedisModuleCtx *ctx, RedisModuleKey *k,
+                                 RedisModuleString **argv, int argc);
+
+/* reply with a hash field's value, or null if it does not exist */
+void __replyWithHashField(RedisModuleCtx *ctx, RedisModuleKey *k,
+                          RedisModuleString *field) {
+  RedisModuleString *val = NULL;
+  if (RedisModule_KeyType(k) == REDISMODULE_KEYTYPE_HASH) {
+    RedisModule_HashGet(k, REDISMODULE_HASH_NONE, field, &val, NULL);
+  }
+  if (val) {
+    RedisModule_ReplyWithString(ctx, val);
+    RedisModule_FreeString(ctx, val);
+  } else {
+    RedisModule_ReplyWithNull(ctx);
+  }
+}
+
+/* hash reads of keys of other types are left to the generic path, which
+ * replies with the proper error */
+static inline int __isHashOrEmpty(RedisModuleKey *k) {
+  int type = RedisModule_KeyType(k);
+  return type == REDISMODULE_KEYTYPE_HASH || type == REDISMODULE_KEYTYPE_EMPTY;
+}
+
+int directHGet(RedisModuleCtx *ctx, RedisModuleKey *k, RedisModuleString **argv,
+               int argc) {
+  if (!__isHashOrEmpty(k)) {
+    return REDISMODULE_ERR;
+  }
+  __replyWithHashField(ctx, k, argv[2]);
+  return REDISMODULE_OK;
+}
+
+int directHMGet(RedisModuleCtx *ctx, RedisModuleKey *k,
+                RedisModuleString **argv, int argc) {
+  if (!__isHashOrEmpty(k)) {
+    return REDISMODULE_ERR;
+  }
+  RedisModule_ReplyWithArray(ctx, argc - 2);
+  for (int i = 2; i < argc; i++) {
+    __replyWithHashField(ctx, k, argv[i]);
+  }
+  return REDISMODULE_OK;
+}
+
+int directExists(RedisModuleCtx *ctx, RedisModuleKey *k,
+                 RedisModuleString **argv, int argc) {
+  return RedisModule_ReplyWithLongLong(
+      ctx, RedisModule_KeyType(k) != REDISMODULE_KEYTYPE_EMPTY);
+}
+
+int directType(RedisModuleCtx *ctx, RedisModuleKey *k, RedisModuleString **argv,
+               int argc) {
+  static const char *typeNames[] = {
+      [REDISMODULE_KEYTYPE_EMPTY] = "none",
+      [REDISMODULE_KEYTYPE_STRING] = "string",
+      [REDISMODULE_KEYTYPE_LIST] = "list",
+      [REDISMODULE_KEYTYPE_HASH] = "hash",
+      [REDISMODULE_KEYTYPE_SET] = "set",
+      [REDISMODULE_KEYTYPE_ZSET] = "zset",
+  };
+  // module types are named by their module, only the generic path knows them
+  int type = RedisModule_KeyType(k);
+  if (type < 0 || type > REDISMODULE_KEYTYPE_ZSET) {
+    return REDISMODULE_ERR;
+  }
+  return RedisModule_ReplyWithSimpleString(ctx, typeNames[type]);
+}
+
+typedef struct {
+  const char *name;
+  DirectReadHandler handler;
+  // the allowed argument count, including the command name. -1 means variadic
+  int minArgs;
+  int maxArgs;
+} directReadDesc;
+
+static const directReadDesc directReadCommands[] = {
+    {"HGET", directHGet, 3, 3},
+    {"HMGET", directHMGet, 3, -1},
+    {"EXISTS", directExists, 2, 2},
+    {"TYPE", directType, 2, 2},
+    {NULL}};
+
+/* Get the direct handler of a read command, or NULL if it must go through
+ * RedisModule_Call. The key must be the command's first argument */
+DirectReadHandler __getDirectReadHandler(RedisModuleString **argv, int argc) {
+  if (argc < 2 || !RMUtil_StringEqualsC(argv[1], ID_SUB_TOKEN)) {
+    return NULL;
+  }
+  const char *cmd = RedisModule_StringPtrLen(argv[0], NULL);
+  for (int i = 0; directReadCommands[i].name != NULL; i++) {
+    const directReadDesc *d = &directReadCommands[i];
+    if (!strcasecmp(cmd, d->name) && argc >= d->minArgs &&
+        (d->maxArgs < 0 || argc <= d->maxArgs)) {
+      return d->handler;
+    }
+  }
+  return NULL;
+}
+
 int HashIndex_ExecuteReadCommand(RedisModuleCtx *ctx, RedisIndex *idx,
                                  SIQuery *query, RedisModuleString **argv,
                                  int argc) {
   SICursor *c = idx->idx.Find(idx->idx.ctx, query);
+  IndexPool_Watch(ctx);
   if (c->error != QE_OK) {
     // TODO: proper error reporting in cursor
     return RedisModule_ReplyWithError(ctx, "Error executing query");
   }
 
+  // common hash reads are served straight from the keys, saving the command
+  // lookup and the reply copy of RedisModule_Call for each id
+  DirectReadHandler direct = __getDirectReadHandler(argv, argc);
+
   RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
   int num = 0;
   SIId id;
   while (NULL != (id = c->Next(c->ctx))) {
     RedisModule_ReplyWithSimpleString(ctx, id);
+    num += 2;
+
+    if (direct) {
+      RedisModuleString *kstr = RedisModule_CreateString(ctx, id, strlen(id));
+      RedisModuleKey *k = RedisModule_OpenKey(ctx, kstr, REDISMODULE_READ);
+      int rc = direct(ctx, k, argv, argc);
+      if (k) {
+        RedisModule_CloseKey(k);
+      }
+      RedisModule_FreeString(ctx, kstr);
+      if (rc == REDISMODULE_OK) {
+        continue;
+      }
+    }
 
     RedisModuleCallReply *rep = __callParametricCommand(ctx, id, argv, argc);
     if (rep) {
       RedisModule_ReplyWithCallReply(ctx, rep);
+      RedisModule_FreeCallReply(rep);
     } else {
       RedisModule_ReplyWithError(ctx, "Could not execute command");
     }
-    num += 2;
   }
 
   SICursor_Free(c);
@@ -144,20 +270,11 @@ IdSource HashIndex_GetIdsForCommand(RedisModuleString **argv, int argc,
   return NULL;
 }
 
-/* Post command handler that reindexes a HASH object in redis by reading its
- * current values */
-int reindexHashHandler(RedisModuleCtx *ctx, RedisIndex *idx,
-                       RedisModuleString *hkey) {
-  RedisModuleKey *k = RedisModule_OpenKey(ctx, hkey, REDISMODULE_READ);
-
-  if (k == NULL || RedisModule_KeyType(k) != REDISMODULE_KEYTYPE_HASH ||
-      RedisModule_KeyType(k) == REDISMODULE_KEYTYPE_EMPTY) {
-    return REDISMODULE_ERR;
-  }
-
-  SIId id = (SIId)strdup(RedisModule_StringPtrLen(hkey, NULL));
-  SIChangeSet cs = SI_NewChangeSet(1);
-  SIChange ch = SI_NewEmptyAddChange(id, idx->spec.numProps);
+/* Compose the add change of a hash key from its current values. Returns
+ * REDISMODULE_ERR if a value could not be parsed */
+int HashIndex_ReadChange(RedisModuleCtx *ctx, RedisIndex *idx,
+                         RedisModuleKey *k, SIId id, SIChange *ch) {
+  *ch = SI_NewEmptyAddChange(id, idx->spec.numProps);
 
   for (int i = 0; i < idx->spec.numProps; i++) {
     RedisModuleString *vstr;
@@ -174,33 +291,56 @@ int reindexHashHandler(RedisModuleCtx *ctx, RedisIndex *idx,
     // if the hash element did not exist, we put a NULL value
     if (val) {
       v = (SIValue){.type = idx->spec.properties[i].type};
-      if (!SI_ParseValue(&v, val, vlen)) {
+      int ok = SI_ParseValue(&v, val, vlen);
+      if (!ok) {
         RedisModule_Log(ctx, "error", "could not parse value from hash %s\n",
                         val);
+      }
+      RedisModule_FreeString(ctx, vstr);
+      if (!ok) {
         goto error;
       }
     }
-    SIValueVector_Append(&ch.v, v);
+    SIValueVector_Append(&ch->v, v);
+  }
+  return REDISMODULE_OK;
+
+error:
+  SIValueVector_Free(&ch->v);
+  return REDISMODULE_ERR;
+}
+
+/* Post command handler that reindexes a HASH object in redis by reading its
+ * current values */
+int reindexHashHandler(RedisModuleCtx *ctx, RedisIndex *idx,
+                       RedisModuleString *hkey) {
+  RedisModuleKey *k = RedisModule_OpenKey(ctx, hkey, REDISMODULE_READ);
+
+  if (k == NULL || RedisModule_KeyType(k) != REDISMODULE_KEYTYPE_HASH ||
+      RedisModule_KeyType(k) == REDISMODULE_KEYTYPE_EMPTY) {
+    return REDISMODULE_ERR;
   }
 
+  SIId id = (SIId)strdup(RedisModule_StringPtrLen(hkey, NULL));
+  SIChange ch;
+  if (HashIndex_ReadChange(ctx, idx, k, id, &ch) != REDISMODULE_OK) {
+    RedisModule_CloseKey(k);
+    free(id);
+    return REDISMODULE_ERR;
+  }
+
+  SIChangeSet cs = SI_NewChangeSet(1);
   SIChangeSet_AddCahnge(&cs, ch);
 
   if (idx->idx.Apply(idx->idx.ctx, cs) != SI_INDEX_OK) {
     RedisModule_Log(ctx, "error", "Could not index id %s\n", id);
   }
+  RedisIndex_ScheduleFlush(ctx, idx);
 
   RedisModule_CloseKey(k);
   SIValueVector_Free(&ch.v);
   SIChangeSet_Free(&cs);
   return REDISMODULE_OK;
-
-error:
-  if (k)
-    RedisModule_CloseKey(k);
-
-  SIValueVector_Free(&ch.v);
-  SIChangeSet_Free(&cs);
-  return REDISMODULE_ERR;
 }
 
 /* post command handler that deletes an entry from the index following a key
@@ -215,6 +355,7 @@ int deleteHandler(RedisModuleCtx *ctx, RedisIndex *idx,
     RedisModule_Log(ctx, "error", "Could not delete id %s\n", id);
     return REDISMODULE_ERR;
   }
+  RedisIndex_ScheduleFlush(ctx, idx);
   SIChangeSet_Free(&cs);
   return REDISMODULE_OK;
 }
@@ -250,7 +391,12 @@ IndexedTransaction CreateIndexedTransaction(RedisModuleCtx *ctx,
       return ret;
     }
   } else {
+    // each id is reindexed while the cursor is still open, so the cursor reads
+    // the index as it was before the command, and never returns a moved id
+    // twice
+    q->snapshot = 1;
     ret.ids = HashIndex_GetIdsFromQuery(idx, q, &ret.ctx);
+    IndexPool_Watch(ctx);
     if (!ret.ctx || !ret.ids) {
       ret.err = "Error executing WHERE clause";
       return ret;
@@ -259,3 +405,244 @@ IndexedTransaction CreateIndexedTransaction(RedisModuleCtx *ctx,
 
   return ret;
 }
+
+/* A hash write command IDX.INTO executes through the key API. Knowing which
+ * fields the command writes lets us take the new values straight from its
+ * arguments, and skip reindexing keys whose indexed fields it does not touch */
+typedef struct {
+  const char *name;
+  // the allowed argument count, including the command name. -1 means variadic
+  int minArgs;
+  int maxArgs;
+  // the arguments are field/value pairs rather than field names to delete
+  int pairs;
+  // only set the field if it does not exist
+  int nx;
+} directWriteDesc;
+
+static const directWriteDesc directWriteCommands[] = {
+    {"HSET", 4, -1, 1, 0},
+    {"HMSET", 4, -1, 1, 0},
+    {"HSETNX", 4, 4, 1, 1},
+    {"HDEL", 3, -1, 0, 0},
+    {NULL}};
+
+/* Get the descriptor of a write command we can execute directly, or NULL if it
+ * must go through RedisModule_Call */
+const directWriteDesc *__getDirectWriteDesc(RedisIndex *idx,
+                                            RedisModuleString **argv, int argc,
+                                            int parametric) {
+  // we match the written fields to the properties by name
+  if (idx->kind != SI_HashIndex || !(idx->spec.flags & SI_INDEX_NAMED)) {
+    return NULL;
+  }
+  if (argc < 2 ||
+      (parametric && !RMUtil_StringEqualsC(argv[1], ID_SUB_TOKEN))) {
+    return NULL;
+  }
+  const char *cmd = RedisModule_StringPtrLen(argv[0], NULL);
+  for (int i = 0; directWriteCommands[i].name != NULL; i++) {
+    const directWriteDesc *d = &directWriteCommands[i];
+    if (!strcasecmp(cmd, d->name) && argc >= d->minArgs &&
+        (d->maxArgs < 0 || argc <= d->maxArgs) &&
+        (!d->pairs || argc % 2 == 0)) {
+      return d;
+    }
+  }
+  return NULL;
+}
+
+/* Return the position of the last argument writing a property, or -1 if the
+ * command does not touch it */
+int __propertyArgPos(SIIndexProperty *prop, const directWriteDesc *d,
+                     RedisModuleString **argv, int argc) {
+  size_t plen = strlen(prop->name);
+  int pos = -1;
+  for (int i = 2; i < argc; i += d->pairs ? 2 : 1) {
+    size_t len;
+    const char *field = RedisModule_StringPtrLen(argv[i], &len);
+    if (len == plen && !memcmp(field, prop->name, len)) {
+      pos = i;
+    }
+  }
+  return pos;
+}
+
+/* Execute a write command on a single hash key, and add the resulting index
+ * change to the change set, if any. Keys that are not hashes are skipped.
+ * Returns REDISMODULE_ERR if the key was written but its new values could not
+ * be parsed */
+int __writeHashKey(RedisModuleCtx *ctx, RedisIndex *idx,
+                   const directWriteDesc *d, RedisModuleString *hkey,
+                   RedisModuleString **argv, int argc, SIChangeSet *cs,
+                   int *num) {
+  RedisModuleKey *k =
+      RedisModule_OpenKey(ctx, hkey, REDISMODULE_READ | REDISMODULE_WRITE);
+  int type = RedisModule_KeyType(k);
+  if (type != REDISMODULE_KEYTYPE_HASH && type != REDISMODULE_KEYTYPE_EMPTY) {
+    RedisModule_CloseKey(k);
+    return REDISMODULE_OK;
+  }
+  (*num)++;
+
+  int isNew = type == REDISMODULE_KEYTYPE_EMPTY;
+  int exists = 0;
+  if (d->nx && !isNew) {
+    RedisModule_HashGet(k, REDISMODULE_HASH_EXISTS, argv[2], &exists, NULL);
+  }
+  // deleting from a missing key or setting an existing field with NX are no-ops
+  if ((isNew && !d->pairs) || exists) {
+    RedisModule_CloseKey(k);
+    return REDISMODULE_OK;
+  }
+
+  int changed = 0;
+  for (int i = 2; i < argc; i += d->pairs ? 2 : 1) {
+    changed += RedisModule_HashSet(
+        k, REDISMODULE_HASH_NONE, argv[i],
+        d->pairs ? argv[i + 1] : REDISMODULE_HASH_DELETE, NULL);
+  }
+  // notify like the native commands would, so that indexes tracking the key by
+  // prefix see the write
+  if (RedisModule_NotifyKeyspaceEvent && (d->pairs || changed)) {
+    RedisModule_NotifyKeyspaceEvent(ctx, REDISMODULE_NOTIFY_HASH,
+                                    d->pairs ? "hset" : "hdel", hkey);
+    if (RedisModule_KeyType(k) == REDISMODULE_KEYTYPE_EMPTY) {
+      RedisModule_NotifyKeyspaceEvent(ctx, REDISMODULE_NOTIFY_GENERIC, "del",
+                                      hkey);
+    }
+  }
+
+  SISpec *spec = &idx->spec;
+  int argPos[spec->numProps];
+  int touched = 0;
+  for (int i = 0; i < spec->numProps; i++) {
+    argPos[i] = __propertyArgPos(&spec->properties[i], d, argv, argc);
+    touched |= argPos[i] >= 0;
+  }
+  // the indexed values of existing keys did not change
+  if (!touched && !isNew) {
+    RedisModule_CloseKey(k);
+    return REDISMODULE_OK;
+  }
+
+  SIId id = (SIId)strdup(RedisModule_StringPtrLen(hkey, NULL));
+  // deleting the last field deletes the key, and its index entry
+  if (RedisModule_KeyType(k) == REDISMODULE_KEYTYPE_EMPTY) {
+    SIChangeSet_AddCahnge(cs, SI_NewDelChange(id));
+    RedisModule_CloseKey(k);
+    return REDISMODULE_OK;
+  }
+
+  SIChange ch = SI_NewEmptyAddChange(id, spec->numProps);
+  for (int i = 0; i < spec->numProps; i++) {
+    // written values are taken from the arguments, and only the untouched
+    // fields of existing keys are read from the hash
+    RedisModuleString *vstr = NULL;
+    int read = 0;
+    if (argPos[i] >= 0) {
+      vstr = d->pairs ? argv[argPos[i] + 1] : NULL;
+    } else if (!isNew) {
+      RedisModule_HashGet(k, REDISMODULE_HASH_CFIELDS, spec->properties[i].name,
+                          &vstr, NULL);
+      read = 1;
+    }
+
+    SIValue v = SI_NullVal();
+    if (vstr) {
+      size_t vlen;
+      const char *val = RedisModule_StringPtrLen(vstr, &vlen);
+      v = (SIValue){.type = spec->properties[i].type};
+      int ok = SI_ParseValue(&v, (char *)val, vlen);
+      if (!ok) {
+        RedisModule_Log(ctx, "error", "could not parse value from hash %s\n",
+                        val);
+      }
+      if (read) {
+        RedisModule_FreeString(ctx, vstr);
+      }
+      if (!ok) {
+        SIValueVector_Free(&ch.v);
+        free(id);
+        RedisModule_CloseKey(k);
+        return REDISMODULE_ERR;
+      }
+    }
+    SIValueVector_Append(&ch.v, v);
+  }
+  RedisModule_CloseKey(k);
+
+  SIChangeSet_AddCahnge(cs, ch);
+  return REDISMODULE_OK;
+}
+
+void hashIndex_logRejected(SIId id, void *key, void *ctx) {
+  RedisModule_Log(ctx, "error", "Could not index id %s\n", id);
+}
+
+void HashIndex_ApplyChanges(RedisModuleCtx *ctx, RedisIndex *idx,
+                            SIChangeSet *cs) {
+  if (idx->build) {
+    HashBuild_ApplyChanges(ctx, idx, cs);
+  }
+  if (cs->numChanges) {
+    SIIndex_ApplyEach(idx->idx, *cs, hashIndex_logRejected, ctx);
+  }
+
+  RedisIndex_ScheduleFlush(ctx, idx);
+
+  for (size_t i = 0; i < cs->numChanges; i++) {
+    // the index takes ownership of added ids, but not of deleted ones
+    if (cs->changes[i].type == SI_CHDEL) {
+      free(cs->changes[i].id);
+    } else {
+      SIValueVector_Free(&cs->changes[i].v);
+    }
+  }
+  SIChangeSet_Free(cs);
+}
+
+int HashIndex_ExecuteWriteCommand(RedisModuleCtx *ctx, RedisIndex *idx,
+                                  SIQuery *q, RedisModuleString **argv,
+                                  int argc) {
+  const directWriteDesc *d = __getDirectWriteDesc(idx, argv, argc, q != NULL);
+  if (!d) {
+    return REDISMODULE_ERR;
+  }
+
+  int num = 0;
+  int rc = REDISMODULE_OK;
+  SIChangeSet cs = SI_NewChangeSet(1);
+  if (!q) {
+    rc = __writeHashKey(ctx, idx, d, argv[1], argv, argc, &cs, &num);
+  } else {
+    SICursor *c = idx->idx.Find(idx->idx.ctx, q);
+    IndexPool_Watch(ctx);
+    if (c->error != QE_OK) {
+      SICursor_Free(c);
+      SIChangeSet_Free(&cs);
+      RedisModule_ReplyWithError(ctx, "Error executing WHERE clause");
+      return REDISMODULE_OK;
+    }
+
+    // the changes are collected while the cursor is open, and applied in one
+    // batch once we're done iterating the index
+    SIId id;
+    while (rc == REDISMODULE_OK && NULL != (id = c->Next(c->ctx))) {
+      RedisModuleString *kstr = RedisModule_CreateString(ctx, id, strlen(id));
+      rc = __writeHashKey(ctx, idx, d, kstr, argv, argc, &cs, &num);
+      RedisModule_FreeString(ctx, kstr);
+    }
+    SICursor_Free(c);
+  }
+
+  HashIndex_ApplyChanges(ctx, idx, &cs);
+
+  if (rc != REDISMODULE_OK) {
+    RedisModule_ReplyWithError(ctx,
+                               "Command performed but updating index failed");
+  } else {
+    RedisModule_ReplyWithLongLong(ctx, num);
+  }
+  return REDISMODULE_OK;
+}
@@ -16,6 +16,24 @@ int HashIndex_ExecuteReadCommand(RedisModuleCtx *ctx, RedisIndex *idx,
                                  SIQuery *query, RedisModuleString **argv,
                                  int argc);
 
+/* Execute a hash write command (HSET, HMSET, HSETNX, HDEL) through the key
+ * API, updating the index from the written values. If a query is given, it is
+ * executed on the ids matching it, with $ as the command's key. Returns
+ * REDISMODULE_ERR without replying if the command is not supported natively */
+int HashIndex_ExecuteWriteCommand(RedisModuleCtx *ctx, RedisIndex *idx,
+                                  SIQuery *q, RedisModuleString **argv,
+                                  int argc);
+
+/* Compose the add change of a hash key from its current values. Returns
+ * REDISMODULE_ERR if a value could not be parsed */
+int HashIndex_ReadChange(RedisModuleCtx *ctx, RedisIndex *idx,
+                         RedisModuleKey *k, SIId id, SIChange *ch);
+
+/* Apply a change set to the index and free it. Deleted ids are freed, while
+ * added ids are owned by the index */
+void HashIndex_ApplyChanges(RedisModuleCtx *ctx, RedisIndex *idx,
+                            SIChangeSet *cs);
+
 /* And indexed command proxy is a generic callback that based on the command at
  * hand, executes it and operates on the index accordingly */
 typedef int (*IndexedCommandProxy)(RedisModuleCtx *ctx, RedisIndex *idx,
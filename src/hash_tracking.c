@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash_tracking.h"
+#include "hash_index.h"
+#include "util/khash.h"
+#include "rmutil/alloc.h"
+
+/* A key written since the last flush, as "{db}:{key}". Key names may hold
+ * any bytes, so entries are compared by their length rather than up to their
+ * null terminator */
+typedef struct {
+  const char *str;
+  size_t len;
+} siPendingKey;
+
+static inline khint_t __siPendingKey_hash(siPendingKey k) {
+  khint_t h = 0;
+  for (size_t i = 0; i < k.len; i++) {
+    h = (h << 5) - h + (khint_t)(unsigned char)k.str[i];
+  }
+  return h;
+}
+
+static inline int __siPendingKey_equals(siPendingKey a, siPendingKey b) {
+  return a.len == b.len && !memcmp(a.str, b.str, a.len);
+}
+
+KHASH_INIT(siPendingKeys, siPendingKey, char, 0, __siPendingKey_hash,
+           __siPendingKey_equals);
+
+static khash_t(siPendingKeys) *pendingKeys = NULL;
+static int flushScheduled = 0;
+static int supported = 0;
+
+// the indexes that track keys by prefix
+static RedisIndex **trackedIndexes = NULL;
+static size_t numTracked = 0;
+static size_t capTracked = 0;
+
+// a property of a tracked index reading a hash field
+typedef struct {
+  // the position of the index in trackedIndexes
+  size_t index;
+  // the position of the property in the index's schema
+  int prop;
+} fieldUse;
+
+typedef struct {
+  fieldUse *uses;
+  size_t numUses;
+} trackedField;
+
+// the registry of the hash fields used by the tracked indexes, by name. The
+// names are owned by the indexes' specs
+KHASH_MAP_INIT_STR(siTrackedFields, trackedField *);
+
+static khash_t(siTrackedFields) *trackedFields = NULL;
+
+// the most distinct types a single hash field can be parsed to
+#define SI_TRACKING_MAX_TYPES 8
+
+/* Rebuild the field registry from the tracked indexes. Indexes are only
+ * registered and unregistered on creation and deletion, so it is simpler to
+ * rebuild the whole registry than to patch it */
+void hashTracking_BuildRegistry() {
+  if (!trackedFields) {
+    trackedFields = kh_init(siTrackedFields);
+  }
+  for (khiter_t it = kh_begin(trackedFields); it != kh_end(trackedFields);
+       ++it) {
+    if (kh_exist(trackedFields, it)) {
+      trackedField *f = kh_value(trackedFields, it);
+      free(f->uses);
+      free(f);
+    }
+  }
+  kh_clear(siTrackedFields, trackedFields);
+
+  for (size_t i = 0; i < numTracked; i++) {
+    SISpec *spec = &trackedIndexes[i]->spec;
+    for (int p = 0; p < spec->numProps; p++) {
+      int rc;
+      khiter_t it =
+          kh_put(siTrackedFields, trackedFields, spec->properties[p].name, &rc);
+      if (rc != 0) {
+        kh_value(trackedFields, it) = calloc(1, sizeof(trackedField));
+      }
+      trackedField *f = kh_value(trackedFields, it);
+      f->uses = realloc(f->uses, (f->numUses + 1) * sizeof(fieldUse));
+      f->uses[f->numUses++] = (fieldUse){.index = i, .prop = p};
+    }
+  }
+}
+
+/* Compose the changes of a written key for all the tracked indexes matching
+ * it. The key is read once: each field used by any of the indexes is fetched
+ * once, and parsed once per type it is indexed as */
+void hashTracking_ReadKey(RedisModuleCtx *ctx, RedisModuleKey *k, int db,
+                          const char *key, size_t len, SIChangeSet *sets) {
+  int matches[numTracked];
+  size_t numMatches = 0;
+  for (size_t i = 0; i < numTracked; i++) {
+    matches[i] = HashTracking_KeyMatches(trackedIndexes[i], db, key, len);
+    numMatches += matches[i];
+  }
+  if (!numMatches) {
+    return;
+  }
+
+  if (RedisModule_KeyType(k) != REDISMODULE_KEYTYPE_HASH) {
+    // deleted, expired, evicted, renamed or overwritten by another type
+    for (size_t i = 0; i < numTracked; i++) {
+      if (matches[i]) {
+        SIChangeSet_AddCahnge(&sets[i], SI_NewDelChange((SIId)strdup(key)));
+      }
+    }
+    return;
+  }
+
+  // the values of each matching index, NULL for missing fields
+  SIValue *vals[numTracked];
+  int failed[numTracked];
+  for (size_t i = 0; i < numTracked; i++) {
+    vals[i] = matches[i] ? calloc(trackedIndexes[i]->spec.numProps,
+                                  sizeof(SIValue))
+                         : NULL;
+    for (int p = 0; matches[i] && p < trackedIndexes[i]->spec.numProps; p++) {
+      vals[i][p] = SI_NullVal();
+    }
+    failed[i] = 0;
+  }
+
+  for (khiter_t it = kh_begin(trackedFields); it != kh_end(trackedFields);
+       ++it) {
+    if (!kh_exist(trackedFields, it)) {
+      continue;
+    }
+    trackedField *f = kh_value(trackedFields, it);
+    int used = 0;
+    for (size_t u = 0; u < f->numUses && !used; u++) {
+      used = matches[f->uses[u].index] && !failed[f->uses[u].index];
+    }
+    // no matching index needs this field
+    if (!used) {
+      continue;
+    }
+
+    RedisModuleString *vstr = NULL;
+    if (RedisModule_HashGet(k, REDISMODULE_HASH_CFIELDS,
+                            kh_key(trackedFields, it), &vstr,
+                            NULL) == REDISMODULE_ERR) {
+      for (size_t u = 0; u < f->numUses; u++) {
+        failed[f->uses[u].index] = 1;
+      }
+      continue;
+    }
+    // the field does not exist, the values are already NULL
+    if (!vstr) {
+      continue;
+    }
+
+    size_t vlen;
+    char *val = (char *)RedisModule_StringPtrLen(vstr, &vlen);
+    SIValue parsed[SI_TRACKING_MAX_TYPES];
+    int parsedOk[SI_TRACKING_MAX_TYPES];
+    int numParsed = 0;
+    for (size_t u = 0; u < f->numUses; u++) {
+      fieldUse use = f->uses[u];
+      if (!matches[use.index] || failed[use.index]) {
+        continue;
+      }
+
+      SIType t = trackedIndexes[use.index]->spec.properties[use.prop].type;
+      int j = 0;
+      while (j < numParsed && parsed[j].type != t) {
+        j++;
+      }
+      if (j == numParsed) {
+        parsed[j] = (SIValue){.type = t};
+        parsedOk[j] = SI_ParseValue(&parsed[j], val, vlen);
+        if (!parsedOk[j]) {
+          RedisModule_Log(ctx, "error", "could not parse value from hash %s\n",
+                          val);
+        }
+        numParsed++;
+      }
+
+      if (parsedOk[j]) {
+        vals[use.index][use.prop] = SIValue_Copy(parsed[j]);
+      } else {
+        failed[use.index] = 1;
+      }
+    }
+    for (int j = 0; j < numParsed; j++) {
+      if (parsedOk[j]) {
+        SIValue_Free(&parsed[j]);
+      }
+    }
+    RedisModule_FreeString(ctx, vstr);
+  }
+
+  for (size_t i = 0; i < numTracked; i++) {
+    if (!matches[i]) {
+      continue;
+    }
+    int numProps = trackedIndexes[i]->spec.numProps;
+    if (failed[i]) {
+      for (int p = 0; p < numProps; p++) {
+        SIValue_Free(&vals[i][p]);
+      }
+    } else {
+      SIChange ch = SI_NewEmptyAddChange((SIId)strdup(key), numProps);
+      for (int p = 0; p < numProps; p++) {
+        SIValueVector_Append(&ch.v, vals[i][p]);
+      }
+      SIChangeSet_AddCahnge(&sets[i], ch);
+    }
+    free(vals[i]);
+  }
+}
+
+int HashTracking_KeyMatches(RedisIndex *idx, int db, const char *key,
+                            size_t len) {
+  if (idx->db != db) {
+    return 0;
+  }
+  // indexes without a prefix are only tracked while they are built
+  if (!idx->prefix) {
+    return 1;
+  }
+  size_t plen = strlen(idx->prefix);
+  return len >= plen && !memcmp(key, idx->prefix, plen);
+}
+
+/* Reindex all the keys written since the last flush. Each key is opened once
+ * for all the indexes, and each index gets a single change set with all of
+ * its keys */
+void hashTracking_Flush(RedisModuleCtx *ctx, void *data) {
+  flushScheduled = 0;
+  if (!numTracked) {
+    goto done;
+  }
+
+  SIChangeSet *sets = calloc(numTracked, sizeof(SIChangeSet));
+  for (size_t i = 0; i < numTracked; i++) {
+    sets[i] = SI_NewChangeSet(0);
+  }
+
+  int db = RedisModule_GetSelectedDb(ctx);
+  for (khiter_t it = kh_begin(pendingKeys); it != kh_end(pendingKeys); ++it) {
+    if (!kh_exist(pendingKeys, it)) {
+      continue;
+    }
+    siPendingKey entry = kh_key(pendingKeys, it);
+    const char *key = (char *)memchr(entry.str, ':', entry.len) + 1;
+    size_t len = entry.len - (key - entry.str);
+
+    int keyDb = atoi(entry.str);
+    RedisModule_SelectDb(ctx, keyDb);
+    RedisModuleString *kstr = RedisModule_CreateString(ctx, key, len);
+    RedisModuleKey *k = RedisModule_OpenKey(ctx, kstr, REDISMODULE_READ);
+    hashTracking_ReadKey(ctx, k, keyDb, key, len, sets);
+
+    if (k) {
+      RedisModule_CloseKey(k);
+    }
+    RedisModule_FreeString(ctx, kstr);
+  }
+  RedisModule_SelectDb(ctx, db);
+
+  for (size_t i = 0; i < numTracked; i++) {
+    HashIndex_ApplyChanges(ctx, trackedIndexes[i], &sets[i]);
+  }
+  free(sets);
+
+done:
+  for (khiter_t it = kh_begin(pendingKeys); it != kh_end(pendingKeys); ++it) {
+    if (kh_exist(pendingKeys, it)) {
+      free((char *)kh_key(pendingKeys, it).str);
+    }
+  }
+  kh_clear(siPendingKeys, pendingKeys);
+}
+
+/* Keyspace event handler. We only record the key here, since the event may be
+ * fired in the middle of a command or a transaction */
+int hashTracking_Notify(RedisModuleCtx *ctx, int type, const char *event,
+                        RedisModuleString *key) {
+  size_t len;
+  const char *kstr = RedisModule_StringPtrLen(key, &len);
+  int db = RedisModule_GetSelectedDb(ctx);
+
+  int matches = 0;
+  for (size_t i = 0; i < numTracked && !matches; i++) {
+    matches = HashTracking_KeyMatches(trackedIndexes[i], db, kstr, len);
+  }
+  if (!matches) {
+    return REDISMODULE_OK;
+  }
+
+  // the db number takes at most 11 characters. The entry is null terminated
+  // too, since ids are
+  size_t cap = len + 14;
+  char *entry = malloc(cap);
+  int n = snprintf(entry, cap, "%d:", db);
+  memcpy(entry + n, kstr, len);
+  entry[n + len] = '\0';
+  int rc;
+  kh_put(siPendingKeys, pendingKeys, ((siPendingKey){entry, n + len}), &rc);
+  // the key is already pending
+  if (rc == 0) {
+    free(entry);
+  }
+
+  if (!flushScheduled) {
+    RedisModule_CreateTimer(ctx, 0, hashTracking_Flush, NULL);
+    flushScheduled = 1;
+  }
+  return REDISMODULE_OK;
+}
+
+int HashTracking_Init(RedisModuleCtx *ctx) {
+  if (!RedisModule_SubscribeToKeyspaceEvents || !RedisModule_CreateTimer) {
+    RedisModule_Log(ctx, "warning", "Keyspace notifications are not supported "
+                                    "by this server, indexes cannot track "
+                                    "keys by PREFIX");
+    return REDISMODULE_ERR;
+  }
+
+  pendingKeys = kh_init(siPendingKeys);
+  if (RedisModule_SubscribeToKeyspaceEvents(ctx, REDISMODULE_NOTIFY_ALL,
+                                            hashTracking_Notify) ==
+      REDISMODULE_ERR) {
+    return REDISMODULE_ERR;
+  }
+  supported = 1;
+  return REDISMODULE_OK;
+}
+
+int HashTracking_Supported() { return supported; }
+
+void HashTracking_Register(RedisIndex *idx) {
+  if (numTracked == capTracked) {
+    capTracked = capTracked ? capTracked * 2 : 4;
+    trackedIndexes = realloc(trackedIndexes, capTracked * sizeof(RedisIndex *));
+  }
+  trackedIndexes[numTracked++] = idx;
+  hashTracking_BuildRegistry();
+}
+
+void HashTracking_Unregister(RedisIndex *idx) {
+  for (size_t i = 0; i < numTracked; i++) {
+    if (trackedIndexes[i] == idx) {
+      trackedIndexes[i] = trackedIndexes[--numTracked];
+      hashTracking_BuildRegistry();
+      return;
+    }
+  }
+}
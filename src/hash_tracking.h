@@ -0,0 +1,43 @@
+#ifndef __SI_HASH_TRACKING_H__
+#define __SI_HASH_TRACKING_H__
+
+#include "redismodule.h"
+#include "index_type.h"
+
+/*
+* Automatic indexing of hash keys by prefix.
+*
+* Hash indexes created with a PREFIX are kept up to date with keyspace
+* notifications, so plain HSET, DEL, RENAME, expiration or eviction of a
+* matching key updates the index, without going through IDX.INTO.
+*
+* Notifications only record the keys that changed. The keys are reindexed once
+* per event loop iteration from their current state, so a MULTI writing the
+* same key ten times reindexes it once. A key that is no longer a hash (or no
+* longer exists) is removed from the index.
+*
+* The fields read by the tracked indexes are kept in a registry, so a key
+* matching several indexes is opened once, each field any of them uses is read
+* once and parsed once per type, and the changes are dispatched to all of the
+* indexes together.
+*/
+
+/* Subscribe to keyspace events. Returns REDISMODULE_ERR if the server does not
+ * support keyspace notifications for modules, in which case tracking indexes
+ * cannot be created */
+int HashTracking_Init(RedisModuleCtx *ctx);
+
+/* Return 1 if tracking indexes are supported by the server */
+int HashTracking_Supported();
+
+/* Start tracking the keys matching the index's prefix */
+void HashTracking_Register(RedisIndex *idx);
+
+/* Stop tracking keys for an index */
+void HashTracking_Unregister(RedisIndex *idx);
+
+/* Return 1 if a key of a database belongs to a tracked index */
+int HashTracking_KeyMatches(RedisIndex *idx, int db, const char *key,
+                            size_t len);
+
+#endif
@@ -3,32 +3,204 @@
 #include "skiplist/skiplist.h"
 #include "reverse_index.h"
 #include "query_plan.h"
+#include "top_k.h"
+#include "epoch.h"
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/param.h>
 #include "rmutil/alloc.h"
 
+int _cmpIds(void *p1, void *p2) {
+  SIId id1 = p1, id2 = p2;
+  return strcmp(id1, id2);
+}
+
+/* A partition of the index, holding the keys of a single time bucket. Indexes
+ * that are not time partitioned have a single partition */
+typedef struct {
+  // the first time of the partition's bucket
+  int64_t start;
+  skiplist *sl;
+  SIReverseIndex *ri;
+} ciPartition;
+
 typedef struct {
   SISpec spec;
   SIKeyCmpFunc *cmpFuncs;
   u_int8_t numFuncs;
+  SICmpFuncVector *cmpCtx;
 
-  skiplist *sl;
+  // the partitions, sorted by their start time
+  ciPartition *parts;
+  size_t numParts;
 
   size_t length;
-  SIReverseIndex *ri;
+
+  // the reclamation domain of concurrent indexes, whose readers don't lock.
+  // NULL otherwise
+  SIEpoch *epoch;
+
+  // the commit counter of the partitions, moved on by each write. What the
+  // open snapshots may still read is kept in retired, and the deleted values
+  // stay in the skiplists, until the first write after they are all closed
+  skiplistVersions versions;
+  struct {
+    void *ptr;
+    SIEpochFreeFunc fn;
+  } * retired;
+  size_t numRetired;
+  size_t capRetired;
+  // set once the last snapshot is closed
+  int stale;
 } compoundIndex;
 
+static void ciFreeNode(void *node) { skiplistFreeNode(node); }
+
+static void ciRetireNode(skiplistNode *node, void *ctx) {
+  SIEpoch_Retire(ctx, node, ciFreeNode);
+}
+
+/* Free memory removed from the index with fn, once neither the open snapshots
+ * nor the readers of a concurrent index can reach it */
+static void compoundIndex_retire(compoundIndex *idx, void *ptr,
+                                 SIEpochFreeFunc fn) {
+  if (idx->versions.snapshots) {
+    if (idx->numRetired == idx->capRetired) {
+      idx->capRetired = idx->capRetired ? idx->capRetired * 2 : 16;
+      idx->retired =
+          realloc(idx->retired, idx->capRetired * sizeof(*idx->retired));
+    }
+    idx->retired[idx->numRetired].ptr = ptr;
+    idx->retired[idx->numRetired++].fn = fn;
+  } else if (idx->epoch) {
+    SIEpoch_Retire(idx->epoch, ptr, fn);
+  } else {
+    fn(ptr);
+  }
+}
+
+/* Free a key no longer in the index, once readers can't hold it */
+static void compoundIndex_freeKey(compoundIndex *idx, SIMultiKey *key) {
+  compoundIndex_retire(idx, key, free);
+}
+
+/* Get the partition a value of the first property belongs to. NULL values
+ * sort last, so they have a partition of their own after all the others */
+int64_t compoundIndex_partitionKey(compoundIndex *idx, SIValue *v) {
+  if (!(idx->spec.flags & SI_INDEX_PARTITIONED)) {
+    return 0;
+  }
+  switch (v->type) {
+  case T_NULL:
+    return INT64_MAX;
+  case T_NEGINF:
+    return INT64_MIN;
+  case T_INF:
+    return INT64_MAX - 1;
+  case T_TIME: {
+    int64_t size = idx->spec.partitionSize, t = v->timeval;
+    // round down, negative times included
+    return (t / size - (t % size < 0)) * size;
+  }
+  default:
+    return 0;
+  }
+}
+
+/* Find the position of the first partition starting at or after start */
+size_t compoundIndex_partitionPos(compoundIndex *idx, int64_t start) {
+  size_t lo = 0, hi = idx->numParts;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (idx->parts[mid].start < start) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Get the partition of a key, creating it if needed */
+ciPartition *compoundIndex_getPartition(compoundIndex *idx, SIMultiKey *key) {
+  int64_t start = compoundIndex_partitionKey(idx, &key->keys[0]);
+  size_t pos = compoundIndex_partitionPos(idx, start);
+  if (pos < idx->numParts && idx->parts[pos].start == start) {
+    return &idx->parts[pos];
+  }
+
+  idx->parts = realloc(idx->parts, (idx->numParts + 1) * sizeof(ciPartition));
+  memmove(&idx->parts[pos + 1], &idx->parts[pos],
+          (idx->numParts - pos) * sizeof(ciPartition));
+  idx->numParts++;
+  idx->parts[pos] = (ciPartition){
+      .start = start,
+      .sl = skiplistCreate(SICmpMultiKey, idx->cmpCtx, _cmpIds),
+      .ri = SI_NewReverseIndex()};
+  skiplistSetVersions(idx->parts[pos].sl, &idx->versions);
+  return &idx->parts[pos];
+}
+
+/* Find the partition holding an id, and the id's key. Returns NULL if the id
+ * is not in the index. Recent partitions are the likeliest to be written, so
+ * they are searched first */
+ciPartition *compoundIndex_findId(compoundIndex *idx, SIId id,
+                                  SIMultiKey **key) {
+  for (size_t i = idx->numParts; i > 0; i--) {
+    if (SIReverseIndex_Exists(idx->parts[i - 1].ri, id, key)) {
+      return &idx->parts[i - 1];
+    }
+  }
+  return NULL;
+}
+
+/* Remove a partition that no longer holds any ids. Snapshots may still read
+ * the partition, in which case it's removed once they are closed */
+void compoundIndex_dropIfEmpty(compoundIndex *idx, ciPartition *p) {
+  if (kh_size(p->ri) || !(idx->spec.flags & SI_INDEX_PARTITIONED) ||
+      idx->versions.snapshots) {
+    return;
+  }
+  skiplistFree(p->sl);
+  SIReverseIndex_Free(p->ri);
+  size_t pos = p - idx->parts;
+  memmove(p, p + 1, (idx->numParts - pos - 1) * sizeof(ciPartition));
+  idx->numParts--;
+}
+
+/* Remove an id from its skiplist node. A node's key is the key of one of its
+ * ids, so if that id is removed, the node takes the key of another one before
+ * the removed key is freed */
+void compoundIndex_unlinkId(ciPartition *p, SIMultiKey *key, SIId id) {
+  skiplistNode *n = skiplistFind(p->sl, key);
+  if (n && n->numVals > 1 && n->obj == key) {
+    for (u_int i = 0; i < n->numVals; i++) {
+      SIMultiKey *other;
+      // ids deleted while a snapshot was open are still in the node
+      if (skiplistValVisible(n, i, SKIPLIST_LATEST) && strcmp(n->vals[i], id) &&
+          SIReverseIndex_Exists(p->ri, n->vals[i], &other)) {
+        skiplistSetObj(p->sl, n, other);
+        break;
+      }
+    }
+  }
+  skiplistDelete(p->sl, key, id);
+}
+
 /* Delete an id from the index. return 1 if it was in the index, 0 otherwise */
 int compoundIndex_applyDel(compoundIndex *idx, SIChange ch) {
   SIMultiKey *oldkey = NULL;
   // TODO: Hanlde cases where no reverse entry exists but the id is in index.
   // TODO: What happens if an id exists mutiple times? e.g. indexing sets/lists
-  int exists = SIReverseIndex_Exists(idx->ri, ch.id, &oldkey);
+  ciPartition *p = compoundIndex_findId(idx, ch.id, &oldkey);
 
-  if (exists) {
-    skiplistDelete(idx->sl, oldkey, ch.id);
-    free(oldkey);
-    SIReverseIndex_Delete(idx->ri, ch.id);
+  if (p) {
+    compoundIndex_unlinkId(p, oldkey, ch.id);
+    compoundIndex_freeKey(idx, oldkey);
+    SIReverseIndex_Delete(p->ri, ch.id);
     --idx->length;
+    compoundIndex_dropIfEmpty(idx, p);
     return SI_INDEX_OK;
   }
 
@@ -38,23 +210,29 @@ int compoundIndex_applyDel(compoundIndex *idx, SIChange ch) {
 int compoundIndex_applyAdd(compoundIndex *idx, SIChange ch) {
   SIValueVector vec;
   // if the id is already in the index, we need to delete the old index entry
-  // and replace with a new one.
-  //
-  // TODO: Optimize this to make sure we don't delete and insert if the records
-  // are the same
+  // and replace with a new one, unless the values are the same
 
-  SIMultiKey *key = NULL;
+  SIMultiKey *key = SI_NewMultiKey(ch.v.vals, ch.v.len);
   // check for duplicate if needed
   if (idx->spec.flags & SI_INDEX_UNIQUE) {
-    key = SI_NewMultiKey(ch.v.vals, ch.v.len);
-    skiplistNode *n = skiplistFind(idx->sl, key);
-    if (n != NULL) {
+    ciPartition *p = compoundIndex_getPartition(idx, key);
+    skiplistNode *n = skiplistFind(p->sl, key);
+    SIId existing = NULL;
+    for (u_int i = 0; n && !existing && i < n->numVals; i++) {
+      if (skiplistValVisible(n, i, SKIPLIST_LATEST)) {
+        existing = n->vals[i];
+      }
+    }
+    if (existing != NULL) {
       // if we have an existing value, make sure it belongs to the same id!
 
-      // there can only be 1 val per node in unique idx
-      if (!strcmp(n->vals[0], ch.id)) {
+      // there can only be 1 live val per node in unique idx
+      if (!strcmp(existing, ch.id)) {
         // the same id and key are already in the index, no need to do anything
         SIMultiKey_Free(key);
+        if (existing != ch.id) {
+          free(ch.id);
+        }
         return SI_INDEX_OK;
       }
 
@@ -65,27 +243,60 @@ int compoundIndex_applyAdd(compoundIndex *idx, SIChange ch) {
   }
 
   SIMultiKey *oldkey = NULL;
-  int exists = SIReverseIndex_Exists(idx->ri, ch.id, &oldkey);
-  if (exists) {
+  ciPartition *old = compoundIndex_findId(idx, ch.id, &oldkey);
+  if (old) {
+    if (SIMultiKey_Identical(oldkey, key)) {
+      SIMultiKey_Free(key);
+      // the index keeps the id it already holds
+      SIId oldid = (SIId)kh_key(old->ri, kh_get(khSIId, old->ri, ch.id));
+      if (oldid != ch.id) {
+        free(ch.id);
+      }
+      return SI_INDEX_OK;
+    }
     // // compose the old key and delete it from the skiplist
-    skiplistDelete(idx->sl, oldkey, ch.id);
+    compoundIndex_unlinkId(old, oldkey, ch.id);
+    SIReverseIndex_Delete(old->ri, ch.id);
     --idx->length;
-    free(oldkey);
+    compoundIndex_freeKey(idx, oldkey);
+    compoundIndex_dropIfEmpty(idx, old);
   }
   // insert the id and values to the reverse index
   // TODO: check memory management of all this stuff
-  if (!key) {
-    key = SI_NewMultiKey(ch.v.vals, ch.v.len);
-  }
-  SIReverseIndex_Insert(idx->ri, ch.id, key);
+  ciPartition *p = compoundIndex_getPartition(idx, key);
+  SIReverseIndex_Insert(p->ri, ch.id, key);
 
-  skiplistInsert(idx->sl, key, ch.id);
+  skiplistInsert(p->sl, key, ch.id);
   ++idx->length;
   return SI_INDEX_OK;
 }
 
+/* Drop what the snapshots left behind once they are all closed: the deleted
+ * ids still in the skiplists, the partitions left empty, and the retired
+ * memory */
+static void compoundIndex_collect(compoundIndex *idx) {
+  for (size_t p = idx->numParts; p > 0; p--) {
+    skiplistCollect(idx->parts[p - 1].sl);
+    compoundIndex_dropIfEmpty(idx, &idx->parts[p - 1]);
+  }
+  for (size_t i = 0; i < idx->numRetired; i++) {
+    compoundIndex_retire(idx, idx->retired[i].ptr, idx->retired[i].fn);
+  }
+  idx->numRetired = 0;
+  idx->stale = 0;
+}
+
+/* Start a write, moving the commit counter on */
+static void compoundIndex_beginWrite(compoundIndex *idx) {
+  if (idx->stale && !idx->versions.snapshots) {
+    compoundIndex_collect(idx);
+  }
+  idx->versions.current++;
+}
+
 int compoundIndex_Apply(void *ctx, SIChangeSet cs) {
   compoundIndex *idx = ctx;
+  compoundIndex_beginWrite(idx);
 
   for (size_t i = 0; i < cs.numChanges; i++) {
     // printf("applying change %d for key %s\n", cs.changes[i].type,
@@ -106,6 +317,9 @@ int compoundIndex_Apply(void *ctx, SIChangeSet cs) {
     }
   }
 
+  if (idx->epoch) {
+    SIEpoch_Collect(idx->epoch);
+  }
   return SI_INDEX_OK;
 }
 
@@ -114,273 +328,1109 @@ size_t compoundIndex_Len(void *ctx) {
   return ((compoundIndex *)ctx)->length;
 }
 
+size_t compoundIndex_Estimate(void *ctx, SIQueryPlan *plan);
 SICursor *compoundIndex_Find(void *ctx, SIQuery *q);
+int compoundIndex_DeleteWhere(void *ctx, SIQuery *q, IndexVisitor cb,
+                              void *visitCtx, size_t *num, SIGarbage **garbage);
 void compoundIndex_Free(void *ctx);
 void compoundIndex_Traverse(void *ctx, IndexVisitor cb, void *visitCtx);
 
-int _cmpIds(void *p1, void *p2) {
-  SIId id1 = p1, id2 = p2;
-  return strcmp(id1, id2);
-}
-
 SIIndex SI_NewCompoundIndex(SISpec spec) {
   compoundIndex *idx = malloc(sizeof(compoundIndex));
   idx->spec = spec;
   idx->cmpFuncs = calloc(spec.numProps, sizeof(SIKeyCmpFunc));
   idx->numFuncs = spec.numProps;
-  idx->ri = SI_NewReverseIndex();
+  idx->parts = NULL;
+  idx->numParts = 0;
   idx->length = 0;
+  idx->epoch = NULL;
+  idx->versions = (skiplistVersions){0, 0};
+  idx->retired = NULL;
+  idx->numRetired = idx->capRetired = 0;
+  idx->stale = 0;
 
   for (u_int8_t i = 0; i < spec.numProps; i++) {
-    switch (spec.properties[i].type) {
-    case T_STRING:
-      idx->cmpFuncs[i] = si_cmp_string;
-      break;
-    case T_INT32:
-      idx->cmpFuncs[i] = si_cmp_int;
-      break;
-    case T_INT64:
-      idx->cmpFuncs[i] = si_cmp_long;
-      break;
-    case T_FLOAT:
-      idx->cmpFuncs[i] = si_cmp_float;
-      break;
-    case T_DOUBLE:
-      idx->cmpFuncs[i] = si_cmp_double;
-      break;
-    case T_BOOL:
-      idx->cmpFuncs[i] = si_cmp_int;
-      break;
-    case T_TIME:
-      idx->cmpFuncs[i] = si_cmp_time;
-      break;
-    case T_UINT:
-      idx->cmpFuncs[i] = si_cmp_uint;
-      break;
-
-    default: // TODO - implement all other types here
-
+    idx->cmpFuncs[i] = SI_KeyCmpFunc(spec.properties[i].type);
+    // TODO - implement all other types here
+    if (!idx->cmpFuncs[i]) {
       printf("unimplemented type %d! PANIC!\n", spec.properties[i].type);
       exit(-1);
     }
   }
 
-  SICmpFuncVector *sctx = malloc(sizeof(SICmpFuncVector));
-  sctx->cmpFuncs = idx->cmpFuncs;
-  sctx->numFuncs = idx->numFuncs;
+  idx->cmpCtx = malloc(sizeof(SICmpFuncVector));
+  idx->cmpCtx->cmpFuncs = idx->cmpFuncs;
+  idx->cmpCtx->numFuncs = idx->numFuncs;
 
-  idx->sl = skiplistCreate(SICmpMultiKey, sctx, _cmpIds);
+  // readers of concurrent indexes walk the partition without locking, so it
+  // is created up front and never dropped
+  if (spec.flags & SI_INDEX_CONCURRENT) {
+    idx->epoch = SI_NewEpoch();
+    idx->parts = calloc(1, sizeof(ciPartition));
+    idx->numParts = 1;
+    idx->parts[0] = (ciPartition){
+        .sl = skiplistCreateConcurrent(SICmpMultiKey, idx->cmpCtx, _cmpIds,
+                                       ciRetireNode, idx->epoch),
+        .ri = SI_NewReverseIndex()};
+    skiplistSetVersions(idx->parts[0].sl, &idx->versions);
+  }
 
   SIIndex ret;
   ret.ctx = idx;
   ret.Find = compoundIndex_Find;
   ret.Apply = compoundIndex_Apply;
   ret.Len = compoundIndex_Len;
+  ret.Estimate = compoundIndex_Estimate;
   ret.Traverse = compoundIndex_Traverse;
+  ret.DeleteWhere = compoundIndex_DeleteWhere;
   ret.Free = compoundIndex_Free;
   return ret;
 }
 
+SIIndex SI_NewIndex(SISpec spec) {
+  if (spec.flags & SI_INDEX_LSM) {
+    return SI_NewLSMIndex(spec);
+  }
+  return SI_NewCompoundIndex(spec);
+}
+
+int SIIndex_ApplyEach(SIIndex idx, SIChangeSet cs, IndexVisitor rejected,
+                      void *ctx) {
+  int rc = idx.Apply(idx.ctx, cs);
+  if (rc == SI_INDEX_OK) {
+    return rc;
+  }
+  // the change set stops at the first failing change. Applying the changes
+  // one by one is safe, since the ones already applied are no-ops now
+  for (size_t i = 0; i < cs.numChanges; i++) {
+    SIChangeSet one = {.changes = &cs.changes[i], .numChanges = 1, .cap = 1};
+    if (idx.Apply(idx.ctx, one) == SI_INDEX_OK) {
+      continue;
+    }
+    if (rejected) {
+      rejected(cs.changes[i].id, NULL, ctx);
+    }
+    // the index only takes ownership of the ids it added
+    if (cs.changes[i].type == SI_CHADD) {
+      free(cs.changes[i].id);
+    }
+  }
+  return rc;
+}
+
 typedef struct {
   SIQueryPlan *plan;
   compoundIndex *idx;
-  // the current scan range we are scanning. we need to scan them all!
-  int currentScanRange;
+  // the scan ranges are expanded lazily from the plan. we need to scan them all!
+  siPlanRangeIterator ranges;
+  // the current scan range we are scanning, NULL if we're done
+  siPlanRange *currentRange;
 
+  // the partitions the current range spans, as positions [firstPart, endPart),
+  // and the next one to scan
+  size_t firstPart;
+  size_t endPart;
+  size_t nextPart;
   skiplistIterator it;
+
+  // the number of matching ids we still need to skip, and the number of ids we
+  // can still return
+  size_t skip;
+  size_t left;
+
+  // the key of the last id we returned
+  SIMultiKey *lastKey;
+  // the version the scan reads, SKIPLIST_LATEST unless it's a snapshot
+  unsigned long snapshot;
 } ciScanCtx;
 
-siPlanRange *scanCtx_CurrentRange(ciScanCtx *c) {
-  if (c->currentScanRange < c->plan->numRanges) {
-    siPlanRange *ret;
-    if (Vector_Get(c->plan->ranges, c->currentScanRange, &ret)) {
-      return ret;
-    }
-  }
-  return NULL;
+/* Check if a range key value can be mapped to a partition */
+static int isPartitionValue(SIValue *v) {
+  return v->type == T_TIME || v->type == T_NULL || v->type == T_INF ||
+         v->type == T_NEGINF;
 }
 
-/* Eval a predicate query node against a given key. Returns 1 if the key
- * staisfies the predicate */
-int evalPredicate(SIPredicate *pred, SIMultiKey *mk, SICmpFuncVector *fv) {
-  if (pred->propId < 0 || pred->propId >= mk->size) {
-    return 0;
+/* Find the partitions a scan range spans, as positions [first, end). Only
+ * partitions whose bucket overlaps the range of the first property are
+ * scanned */
+void compoundIndex_rangePartitions(compoundIndex *idx, siPlanRange *r,
+                                   size_t *first, size_t *end) {
+  *first = 0;
+  *end = idx->numParts;
+  if (!(idx->spec.flags & SI_INDEX_PARTITIONED)) {
+    return;
   }
-  SIKeyCmpFunc cmp = fv->cmpFuncs[pred->propId];
-
-  switch (pred->t) {
-  // compare equals
-  case PRED_EQ:
-    return 0 == cmp(&mk->keys[pred->propId], &pred->eq.v, NULL);
-
-  // compare IN
-  case PRED_IN:
-    for (int i = 0; i < pred->in.numvals; i++) {
-      if (cmp(&mk->keys[pred->propId], &pred->in.vals[i], NULL) != 0) {
-        return 0;
-      }
+  if (r->min && isPartitionValue(&r->min->keys[0])) {
+    *first = compoundIndex_partitionPos(
+        idx, compoundIndex_partitionKey(idx, &r->min->keys[0]));
+  }
+  if (r->max && isPartitionValue(&r->max->keys[0])) {
+    int64_t last = compoundIndex_partitionKey(idx, &r->max->keys[0]);
+    if (last < INT64_MAX) {
+      *end = compoundIndex_partitionPos(idx, last + 1);
     }
-    // we only return true if the IN actually had values in it
-    return pred->in.numvals > 0;
-    break;
+  }
+}
 
-  // compare !=
-  case PRED_NE:
-    return cmp(&mk->keys[pred->propId], &pred->eq.v, NULL) != 0;
+/* Count the keys of each range in each of its partitions by their ranks. Keys
+ * holding several ids count once */
+size_t compoundIndex_Estimate(void *ctx, SIQueryPlan *plan) {
+  compoundIndex *idx = ctx;
+  size_t total = 0;
+  siPlanRangeIterator it = SIQueryPlan_IterateRanges(plan);
+  siPlanRange *r;
+  while (NULL != (r = siPlanRangeIterator_Next(&it))) {
+    size_t first, end;
+    compoundIndex_rangePartitions(idx, r, &first, &end);
+    for (size_t i = first; i < end; i++) {
+      skiplist *sl = idx->parts[i].sl;
+      unsigned long lo = r->min ? skiplistRankAtLeast(sl, r->min, r->minExclusive)
+                                : 0;
+      unsigned long hi = r->max
+                             ? skiplistRankAtLeast(sl, r->max, !r->maxExclusive)
+                             : skiplistLength(sl);
+      total += hi > lo ? hi - lo : 0;
+    }
+  }
+  siPlanRangeIterator_Free(&it);
+  return total;
+}
 
-  // compare range
-  case PRED_RNG: {
-    int minc = cmp(&mk->keys[pred->propId], &pred->rng.min, NULL);
-    if (minc < 0 || (minc == 0 && pred->rng.minExclusive)) {
+/* Open the scan of the current range on its next partition. Partitions are
+ * disjoint ranges of the first property, so scanning them in turn keeps the
+ * range in index order. Returns 0 if all the range's partitions were
+ * scanned */
+int scanCtx_NextPartition(ciScanCtx *c) {
+  siPlanRange *cr = c->currentRange;
+  skiplist *sl;
+  if (c->plan->reverse) {
+    if (c->nextPart <= c->firstPart) {
       return 0;
     }
-    int maxc = cmp(&mk->keys[pred->propId], &pred->rng.max, NULL);
-    if (maxc > 0 || (maxc == 0 && pred->rng.maxExclusive)) {
+    sl = c->idx->parts[--c->nextPart].sl;
+    c->it = skiplistIterateRangeReverse(sl, cr->min, cr->max, cr->minExclusive,
+                                        cr->maxExclusive);
+    c->it.snapshot = c->snapshot;
+  } else {
+    if (c->nextPart >= c->endPart) {
       return 0;
     }
-    return 1;
-  }
-  default:
-    printf("Unssupported filter predicate %d\n", pred->t);
+    sl = c->idx->parts[c->nextPart++].sl;
+    c->it = skiplistIterateRange(sl, cr->min, cr->max, cr->minExclusive,
+                                 cr->maxExclusive);
+    c->it.snapshot = c->snapshot;
   }
-  return 0;
+  return 1;
 }
 
-/* Eval a key against a query node, whether a logical or predicate node. If the
- * node is a logical operator, its children are evaluated recursivel */
-int evalKey(SIQueryNode *n, SIMultiKey *mk, SICmpFuncVector *fv) {
-  // passthrough nodes always return 1
-  if (n->type & QN_PASSTHRU) {
-    return 1;
-  }
-  // predicate nodes are evaluated one by one
-  if (n->type == QN_PRED) {
-    return evalPredicate(&n->pred, mk, fv);
-  } else if (n->type != QN_LOGIC) {
-    // WTF?
-    return 0;
-  }
+/* Move the scan to the plan's next range. Returns 0 if there are no more
+ * ranges to scan */
+int scanCtx_NextRange(ciScanCtx *c) {
+  do {
+    siPlanRange *cr = siPlanRangeIterator_Next(&c->ranges);
+    c->currentRange = cr;
+    if (!cr) {
+      return 0;
+    }
+    compoundIndex_rangePartitions(c->idx, cr, &c->firstPart, &c->endPart);
+    c->nextPart = c->plan->reverse ? c->endPart : c->firstPart;
+  } while (!scanCtx_NextPartition(c));
+  return 1;
+}
 
-  // a logic node always has left and right that are either ORed or ANDed
-  int leftEval = evalKey(n->op.left, mk, fv);
-  // we will not evluate the RHS unless there's a need to
-  if (n->op.op == OP_OR) {
-    return leftEval || evalKey(n->op.right, mk, fv);
-  }
-  return leftEval && evalKey(n->op.right, mk, fv);
+/* Move the scan on once the current partition is done, to the range's next
+ * partition or to the next range */
+int scanCtx_Advance(ciScanCtx *c) {
+  return scanCtx_NextPartition(c) || scanCtx_NextRange(c);
 }
 
 SIId scan_next(void *ctx) {
   ciScanCtx *sc = ctx;
   skiplistNode *n;
-  SIId ret = NULL;
-  SICmpFuncVector fv = {.cmpFuncs = sc->idx->cmpFuncs,
-                        .numFuncs = sc->idx->numFuncs};
 
-  while (sc->currentScanRange < sc->plan->numRanges) {
+  // once the limit is reached there is no need to keep scanning
+  if (sc->left == 0) {
+    return NULL;
+  }
+
+  while (sc->currentRange) {
     while (NULL != (n = skiplistIteratorCurrent(&sc->it))) {
       // if we have filters beyond the min/max range, we need to explicitly
       // filter each of them
       SIMultiKey *mk = n->obj;
 
       int ok = 1;
-      if (sc->plan->filterTree) {
-        ok = evalKey(sc->plan->filterTree, mk, &fv);
+      if (sc->plan->filter) {
+        ok = SIFilter_Eval(sc->plan->filter, mk);
       }
 
       // advance the iterator by one - but only return the value if the filter
       // eval was successful
       void *nextval = skiplistIterator_Next(&sc->it);
       if (ok) {
+        if (sc->skip > 0) {
+          sc->skip--;
+          continue;
+        }
+        sc->left--;
+        sc->lastKey = mk;
         return nextval;
       }
       // otherwise we just continue to the next node
     }
 
     // If we are here - the current range iteration is over. let's see if we can
-    // find a new range
-    sc->currentScanRange++;
-    siPlanRange *cr = scanCtx_CurrentRange(sc);
-    // start iterating the new range
-    if (cr) {
-      sc->it = skiplistIterateRange(sc->idx->sl, cr->min, cr->max,
-                                    cr->minExclusive, cr->maxExclusive);
-    }
+    // find a new range and start iterating it
+    scanCtx_Advance(sc);
   }
 
   return NULL;
 }
 
+void *scan_currentKey(void *ctx) { return ((ciScanCtx *)ctx)->lastKey; }
+
 void ciScanCtx_free(void *ctx) {
   ciScanCtx *sctx = ctx;
+  siPlanRangeIterator_Free(&sctx->ranges);
   SIQueryPlan_Free(sctx->plan);
   free(sctx);
 }
 
-SICursor *compoundIndex_Find(void *ctx, SIQuery *q) {
-  compoundIndex *idx = ctx;
+/* A cursor over the sorted ids of a query the index order can't satisfy */
+typedef struct {
+  SIId *ids;
+  SIMultiKey **keys;
+  size_t num;
+  size_t pos;
+} ciSortedCtx;
+
+SIId sorted_next(void *ctx) {
+  ciSortedCtx *sc = ctx;
+  return sc->pos < sc->num ? sc->ids[sc->pos++] : NULL;
+}
+
+void *sorted_currentKey(void *ctx) {
+  ciSortedCtx *sc = ctx;
+  return sc->pos > 0 ? sc->keys[sc->pos - 1] : NULL;
+}
+
+void ciSortedCtx_free(void *ctx) {
+  ciSortedCtx *sc = ctx;
+  free(sc->ids);
+  free(sc->keys);
+  free(sc);
+}
+
+/* Run the scan to its end, keeping only the first offset+num ids in the
+ * query's order. If each range is scanned in order, we skip to the next range
+ * as soon as a scanned id can no longer make it into the results */
+ciSortedCtx *scanCtx_Sort(ciScanCtx *sc, SIQuery *q) {
+  SITopK *tk = SI_NewTopK(q->num ? q->offset + q->num : 0, q->orderBy,
+                          q->numOrderBy, sc->idx->cmpFuncs, q->orderDesc);
+  int rangeOrdered = sc->plan->order == PLAN_ORDER_RANGE;
+  skiplistNode *n;
+
+  while (sc->currentRange) {
+    int rangeDone = 0;
+    while (NULL != (n = skiplistIteratorCurrent(&sc->it))) {
+      SIMultiKey *mk = n->obj;
+      if (sc->plan->filter && !SIFilter_Eval(sc->plan->filter, mk)) {
+        skiplistIterator_Next(&sc->it);
+        continue;
+      }
+      if (!SITopK_Push(tk, mk, skiplistIterator_Next(&sc->it)) &&
+          rangeOrdered) {
+        rangeDone = 1;
+        break;
+      }
+    }
+    if (rangeDone) {
+      scanCtx_NextRange(sc);
+    } else {
+      scanCtx_Advance(sc);
+    }
+  }
+
+  ciSortedCtx *ret = malloc(sizeof(ciSortedCtx));
+  ret->ids = SITopK_Drain(tk, &ret->num, &ret->keys);
+  ret->pos = MIN(q->offset, ret->num);
+  SITopK_Free(tk);
+  return ret;
+}
+
+static SIThreadPool *scanPool = NULL;
+static size_t scanMinRows = 0;
+
+void SI_SetScanThreadPool(SIThreadPool *pool, size_t minRows) {
+  scanPool = pool;
+  scanMinRows = minRows;
+}
+
+/* A part of a scan range within a single partition, scanned by one thread */
+typedef struct {
+  // the node the part starts from in scan order, and its number of nodes
+  skiplistNode *start;
+  unsigned long len;
+
+  // the matching nodes and the number of ids they hold, or the first ids in
+  // ORDER BY order for sorted scans
+  skiplistNode **nodes;
+  size_t numNodes;
+  size_t capNodes;
+  size_t numIds;
+  SITopK *tk;
+  int done;
+} ciScanPart;
+
+/* A scan split into parts of about the same number of keys, found by rank.
+ * The calling thread and helper tasks on the pool claim the parts in scan
+ * order, until they run out or the parts done so far hold all the ids the
+ * query needs */
+typedef struct {
+  SIQueryPlan *plan;
+  int reverse;
+  // set if the parts collect top-k ids rather than matching nodes
+  int sorted;
+  int rangeOrdered;
+  // the number of ids a part needs at most, SIZE_MAX without a LIMIT
+  size_t need;
+
+  ciScanPart *parts;
+  size_t numParts;
+
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  size_t nextPart;
+  // the number of parts being scanned
+  size_t active;
+  // the parts before donePrefix are all done, and hold prefixIds ids
+  size_t donePrefix;
+  size_t prefixIds;
+  int stop;
+  // the calling thread and the helper tasks each hold a reference
+  int refs;
+} ciParallelScan;
+
+/* A cursor over the matching nodes of a parallel scan's parts */
+typedef struct {
+  ciScanPart *parts;
+  size_t numParts;
+  size_t part;
+  size_t node;
+  unsigned int val;
+  size_t skip;
+  size_t left;
+  SIMultiKey *lastKey;
+} ciPartsCtx;
+
+SIId parts_next(void *ctx) {
+  ciPartsCtx *pc = ctx;
+  while (pc->left && pc->part < pc->numParts) {
+    ciScanPart *p = &pc->parts[pc->part];
+    if (pc->node == p->numNodes) {
+      pc->part++;
+      pc->node = 0;
+      continue;
+    }
+    skiplistNode *n = p->nodes[pc->node];
+    if (pc->val == n->numVals) {
+      pc->node++;
+      pc->val = 0;
+      continue;
+    }
+    if (!skiplistValVisible(n, pc->val, SKIPLIST_LATEST)) {
+      pc->val++;
+      continue;
+    }
+    SIId id = n->vals[pc->val++];
+    if (pc->skip > 0) {
+      pc->skip--;
+      continue;
+    }
+    pc->left--;
+    pc->lastKey = n->obj;
+    return id;
+  }
+  return NULL;
+}
+
+void *parts_currentKey(void *ctx) { return ((ciPartsCtx *)ctx)->lastKey; }
+
+void ciPartsCtx_free(void *ctx) {
+  ciPartsCtx *pc = ctx;
+  for (size_t i = 0; i < pc->numParts; i++) {
+    free(pc->parts[i].nodes);
+  }
+  free(pc->parts);
+  free(pc);
+}
+
+/* Add the parts of a range in a partition, by splitting its nodes between
+ * ranks [lo, hi) */
+static void parallelScan_addParts(ciParallelScan *ps, skiplist *sl,
+                                  unsigned long lo, unsigned long hi,
+                                  unsigned long partLen, size_t *cap) {
+  for (unsigned long i = 0; lo + i < hi; i += partLen) {
+    if (ps->numParts == *cap) {
+      *cap = *cap ? *cap * 2 : 16;
+      ps->parts = realloc(ps->parts, *cap * sizeof(ciScanPart));
+    }
+    unsigned long len = MIN(partLen, hi - lo - i);
+    // reverse scans walk back from the last node of each part
+    unsigned long first = ps->reverse ? hi - i - len : lo + i;
+    ps->parts[ps->numParts++] = (ciScanPart){
+        .start = skiplistNodeAtRank(sl, ps->reverse ? first + len - 1 : first),
+        .len = len,
+    };
+  }
+}
+
+/* Split a plan's scan into parts if it is worth it, i.e. if it spans enough
+ * keys and does more than walk them. Returns NULL otherwise */
+ciParallelScan *compoundIndex_splitScan(compoundIndex *idx, SIQueryPlan *plan,
+                                        SIQuery *q) {
+  int sorted = plan->order == PLAN_ORDER_RANGE || plan->order == PLAN_ORDER_SORT;
+  // parts are found by rank, which only the writer of a concurrent index can
+  // read. Snapshots are read between writes, which helpers would race with
+  if (!scanPool || idx->epoch || q->snapshot || (!plan->filter && !sorted) ||
+      idx->length < scanMinRows) {
+    return NULL;
+  }
+
+  // the rank bounds of each range in each of its partitions, in scan order
+  size_t numBounds = 0, capBounds = 0, total = 0;
+  struct {
+    skiplist *sl;
+    unsigned long lo, hi;
+  } *bounds = NULL;
+
+  siPlanRangeIterator it = SIQueryPlan_IterateRanges(plan);
+  siPlanRange *r;
+  while (NULL != (r = siPlanRangeIterator_Next(&it))) {
+    size_t first, end;
+    compoundIndex_rangePartitions(idx, r, &first, &end);
+    for (size_t i = first; i < end; i++) {
+      skiplist *sl = idx->parts[plan->reverse ? end - 1 - i + first : i].sl;
+      unsigned long lo = r->min ? skiplistRankAtLeast(sl, r->min, r->minExclusive)
+                                : 0;
+      unsigned long hi = r->max
+                             ? skiplistRankAtLeast(sl, r->max, !r->maxExclusive)
+                             : skiplistLength(sl);
+      if (hi <= lo) {
+        continue;
+      }
+      if (numBounds == capBounds) {
+        capBounds = capBounds ? capBounds * 2 : 16;
+        bounds = realloc(bounds, capBounds * sizeof(*bounds));
+      }
+      bounds[numBounds].sl = sl;
+      bounds[numBounds].lo = lo;
+      bounds[numBounds++].hi = hi;
+      total += hi - lo;
+    }
+  }
+  siPlanRangeIterator_Free(&it);
+
+  if (!total || total < scanMinRows) {
+    free(bounds);
+    return NULL;
+  }
+
+  ciParallelScan *ps = calloc(1, sizeof(ciParallelScan));
+  ps->plan = plan;
+  ps->reverse = plan->reverse;
+  ps->sorted = sorted;
+  ps->rangeOrdered = plan->order == PLAN_ORDER_RANGE;
+  ps->need = q->num ? q->offset + q->num : SIZE_MAX;
+  pthread_mutex_init(&ps->lock, NULL);
+  pthread_cond_init(&ps->idle, NULL);
+
+  // a few parts per thread, so threads whose parts filter faster take more
+  size_t numThreads = SIThreadPool_NumThreads(scanPool);
+  unsigned long partLen = MAX(total / (numThreads * 4), SI_PARALLEL_SCAN_MIN_PART);
+  size_t cap = 0;
+  for (size_t i = 0; i < numBounds; i++) {
+    parallelScan_addParts(ps, bounds[i].sl, bounds[i].lo, bounds[i].hi, partLen,
+                          &cap);
+  }
+  free(bounds);
+
+  if (sorted) {
+    for (size_t i = 0; i < ps->numParts; i++) {
+      ps->parts[i].tk = SI_NewTopK(q->num ? q->offset + q->num : 0, q->orderBy,
+                                   q->numOrderBy, idx->cmpFuncs, q->orderDesc);
+    }
+  }
+  return ps;
+}
+
+/* Scan a part with a filter of its own, so threads don't share the filter's
+ * counters */
+static void parallelScan_scanPart(ciParallelScan *ps, ciScanPart *p,
+                                  SIFilter *f) {
+  skiplistNode *n = p->start;
+  for (unsigned long i = 0; i < p->len;
+       i++, n = ps->reverse ? n->backward : n->level[0].forward) {
+    SIMultiKey *mk = n->obj;
+    if (f && !SIFilter_Eval(f, mk)) {
+      continue;
+    }
+
+    if (ps->sorted) {
+      for (unsigned int v = 0; v < n->numVals; v++) {
+        // the rest of the part's range can't make it into the results
+        if (skiplistValVisible(n, v, SKIPLIST_LATEST) &&
+            !SITopK_Push(p->tk, mk, n->vals[v]) && ps->rangeOrdered) {
+          return;
+        }
+      }
+      continue;
+    }
+
+    unsigned int live = 0;
+    for (unsigned int v = 0; v < n->numVals; v++) {
+      live += skiplistValVisible(n, v, SKIPLIST_LATEST);
+    }
+    if (!live) {
+      continue;
+    }
+
+    if (p->numNodes == p->capNodes) {
+      p->capNodes = p->capNodes ? p->capNodes * 2 : 64;
+      p->nodes = realloc(p->nodes, p->capNodes * sizeof(skiplistNode *));
+    }
+    p->nodes[p->numNodes++] = n;
+    p->numIds += live;
+    // the ids of the following parts come after these
+    if (p->numIds >= ps->need) {
+      return;
+    }
+  }
+}
+
+/* Claim and scan parts until there are none left. The plan is only touched
+ * while a part is claimed, since the calling thread frees it once all the
+ * claimed parts are done */
+static void parallelScan_Work(ciParallelScan *ps) {
+  SIFilter local, *f = NULL;
+
+  pthread_mutex_lock(&ps->lock);
+  while (!ps->stop && ps->nextPart < ps->numParts) {
+    ciScanPart *p = &ps->parts[ps->nextPart++];
+    ps->active++;
+    if (ps->plan->filter && !f) {
+      local = *ps->plan->filter;
+      f = &local;
+    }
+    local.numEvals = local.numSteps = 0;
+    pthread_mutex_unlock(&ps->lock);
+
+    parallelScan_scanPart(ps, p, f);
+
+    pthread_mutex_lock(&ps->lock);
+    if (f) {
+      ps->plan->filter->numEvals += f->numEvals;
+      ps->plan->filter->numSteps += f->numSteps;
+    }
+    p->done = 1;
+    while (ps->donePrefix < ps->numParts && ps->parts[ps->donePrefix].done) {
+      ps->prefixIds += ps->parts[ps->donePrefix++].numIds;
+    }
+    if (!ps->sorted && ps->prefixIds >= ps->need) {
+      ps->stop = 1;
+    }
+    if (--ps->active == 0) {
+      pthread_cond_broadcast(&ps->idle);
+    }
+  }
+  pthread_mutex_unlock(&ps->lock);
+}
+
+static void parallelScan_Release(ciParallelScan *ps) {
+  pthread_mutex_lock(&ps->lock);
+  int refs = --ps->refs;
+  pthread_mutex_unlock(&ps->lock);
+  if (refs == 0) {
+    pthread_mutex_destroy(&ps->lock);
+    pthread_cond_destroy(&ps->idle);
+    free(ps);
+  }
+}
+
+/* Helpers may only start once the scan is over, in which case they find no
+ * part left and just drop their reference */
+void parallelScan_helperRun(SITask *t, void *arg) {
+  parallelScan_Work(arg);
+  parallelScan_Release(arg);
+}
+
+void parallelScan_helperDone(void *arg, int cancelled) {
+  if (cancelled) {
+    parallelScan_Release(arg);
+  }
+}
+
+/* Run a split scan on the calling thread and the pool, and open a cursor
+ * over its results. The cursor owns the plan */
+SICursor *compoundIndex_parallelCursor(compoundIndex *idx, ciParallelScan *ps,
+                                       SIQuery *q) {
+  size_t numHelpers = MIN(SIThreadPool_NumThreads(scanPool), ps->numParts - 1);
+  ps->refs = numHelpers + 1;
+  for (size_t i = 0; i < numHelpers; i++) {
+    SIThreadPool_Submit(scanPool, SI_TASK_HIGH, parallelScan_helperRun,
+                        parallelScan_helperDone, ps);
+  }
+
+  // the calling thread scans too, so the scan never waits for busy workers,
+  // only for the parts they have already started
+  parallelScan_Work(ps);
+  pthread_mutex_lock(&ps->lock);
+  ps->stop = 1;
+  while (ps->active) {
+    pthread_cond_wait(&ps->idle, &ps->lock);
+  }
+  pthread_mutex_unlock(&ps->lock);
+
   SICursor *c = SI_NewCursor(NULL);
-  if (q->numPredicates == 0) {
-    goto error;
+  if (ps->sorted) {
+    // merge the parts' top ids
+    SITopK *tk = SI_NewTopK(q->num ? q->offset + q->num : 0, q->orderBy,
+                            q->numOrderBy, idx->cmpFuncs, q->orderDesc);
+    for (size_t i = 0; i < ps->numParts; i++) {
+      size_t num;
+      SIMultiKey **keys;
+      SIId *ids = SITopK_Drain(ps->parts[i].tk, &num, &keys);
+      for (size_t j = 0; j < num; j++) {
+        SITopK_Push(tk, keys[j], ids[j]);
+      }
+      free(ids);
+      free(keys);
+      SITopK_Free(ps->parts[i].tk);
+    }
+    free(ps->parts);
+
+    ciSortedCtx *sc = malloc(sizeof(ciSortedCtx));
+    sc->ids = SITopK_Drain(tk, &sc->num, &sc->keys);
+    sc->pos = MIN(q->offset, sc->num);
+    SITopK_Free(tk);
+    c->ctx = sc;
+    c->Next = sorted_next;
+    c->CurrentKey = sorted_currentKey;
+    c->Release = ciSortedCtx_free;
+  } else {
+    ciPartsCtx *pc = calloc(1, sizeof(ciPartsCtx));
+    pc->parts = ps->parts;
+    pc->numParts = ps->numParts;
+    pc->skip = q->offset;
+    pc->left = q->num ? q->num : SIZE_MAX;
+    c->ctx = pc;
+    c->Next = parts_next;
+    c->CurrentKey = parts_currentKey;
+    c->Release = ciPartsCtx_free;
   }
 
-  SIQueryPlan *plan = SI_BuildQueryPlan(q, &idx->spec);
-  if (!plan) {
-    goto error;
+  SIQueryPlan_Free(ps->plan);
+  parallelScan_Release(ps);
+  return c;
+}
+
+/* Open a cursor executing a query plan. The cursor owns the plan */
+SICursor *compoundIndex_planCursor(compoundIndex *idx, SIQueryPlan *plan,
+                                   SIQuery *q) {
+  ciParallelScan *ps = compoundIndex_splitScan(idx, plan, q);
+  if (ps) {
+    return compoundIndex_parallelCursor(idx, ps, q);
   }
 
+  SICursor *c = SI_NewCursor(NULL);
   ciScanCtx *sctx = malloc(sizeof(ciScanCtx));
-  sctx->currentScanRange = 0;
   sctx->plan = plan;
   sctx->idx = idx;
-  siPlanRange *cr = scanCtx_CurrentRange(sctx);
-  if (cr) {
-    sctx->it = skiplistIterateRange(sctx->idx->sl, cr->min, cr->max,
-                                    cr->minExclusive, cr->maxExclusive);
+  sctx->skip = q->offset;
+  sctx->left = q->num ? q->num : SIZE_MAX;
+  sctx->lastKey = NULL;
+  sctx->snapshot = q->snapshot ? idx->versions.current : SKIPLIST_LATEST;
+  sctx->ranges = SIQueryPlan_IterateRanges(plan);
+  scanCtx_NextRange(sctx);
+
+  // orderings the scan does not yield are sorted in advance
+  if (plan->order == PLAN_ORDER_RANGE || plan->order == PLAN_ORDER_SORT) {
+    c->ctx = scanCtx_Sort(sctx, q);
+    c->Next = sorted_next;
+    c->CurrentKey = sorted_currentKey;
+    c->Release = ciSortedCtx_free;
+    ciScanCtx_free(sctx);
+    return c;
   }
+
   c->ctx = sctx;
   c->Next = scan_next;
+  c->CurrentKey = scan_currentKey;
   c->Release = ciScanCtx_free;
   return c;
+}
 
-error:
-  c->error = SI_CURSOR_ERROR;
-  return c;
+/* A cursor of a concurrent index, inside the index's reclamation domain for
+ * as long as it's open, so the nodes, keys and ids it returns stay valid. The
+ * cursors of snapshots hold the snapshot open the same way */
+typedef struct {
+  SICursor *inner;
+  compoundIndex *idx;
+  // the reader's slot in the domain of a concurrent index, -1 otherwise
+  int slot;
+  int snapshot;
+} ciGuardCtx;
+
+SIId guard_next(void *ctx) {
+  SICursor *c = ((ciGuardCtx *)ctx)->inner;
+  return c->Next(c->ctx);
 }
 
-void compoundIndex_Traverse(void *ctx, IndexVisitor cb, void *visitCtx) {
+void *guard_currentKey(void *ctx) {
+  SICursor *c = ((ciGuardCtx *)ctx)->inner;
+  return c->CurrentKey(c->ctx);
+}
+
+void ciGuardCtx_free(void *ctx) {
+  ciGuardCtx *gc = ctx;
+  SICursor_Free(gc->inner);
+  if (gc->snapshot && --gc->idx->versions.snapshots == 0) {
+    gc->idx->stale = 1;
+  }
+  if (gc->slot >= 0) {
+    SIEpoch_Exit(gc->idx->epoch, gc->slot);
+  }
+  free(gc);
+}
+
+SICursor *compoundIndex_Find(void *ctx, SIQuery *q) {
   compoundIndex *idx = ctx;
+  SIQueryPlan *plan = NULL;
+  if (q->numPredicates == 0 ||
+      NULL == (plan = SI_BuildQueryPlan(q, &idx->spec))) {
+    SICursor *c = SI_NewCursor(NULL);
+    c->error = SI_CURSOR_ERROR;
+    return c;
+  }
+  if (!idx->epoch && !q->snapshot) {
+    return compoundIndex_planCursor(idx, plan, q);
+  }
 
-  skiplistIterator it = skiplistIterateAll(idx->sl);
-  skiplistNode *n;
+  ciGuardCtx *gc = malloc(sizeof(ciGuardCtx));
+  gc->idx = idx;
+  gc->slot = idx->epoch ? SIEpoch_Enter(idx->epoch) : -1;
+  gc->snapshot = q->snapshot;
+  if (q->snapshot) {
+    idx->versions.snapshots++;
+  }
+  gc->inner = compoundIndex_planCursor(idx, plan, q);
+  SICursor *c = SI_NewCursor(gc);
+  c->Next = guard_next;
+  c->CurrentKey = guard_currentKey;
+  c->Release = ciGuardCtx_free;
+  return c;
+}
+
+struct siGarbage {
+  // unlinked skiplist nodes, linked by their level 0 forward pointers. Their
+  // ids are freed along with them
+  skiplistNode *nodes;
+  // the keys of all the deleted ids
+  SIMultiKey **keys;
+  size_t numKeys;
+  size_t capKeys;
+  // ids deleted one by one, that are no longer in any node
+  SIId *ids;
+  size_t numIds;
+  size_t capIds;
+  // the reverse indexes of dropped partitions, with the keys of their ids,
+  // and the position of the next key to free in the last one
+  SIReverseIndex **ris;
+  size_t numRis;
+  khiter_t riPos;
+};
+
+SIGarbage *SI_NewGarbage() { return calloc(1, sizeof(SIGarbage)); }
+
+void SIGarbage_AddKey(SIGarbage *g, SIMultiKey *k) {
+  if (g->numKeys == g->capKeys) {
+    g->capKeys = g->capKeys ? g->capKeys * 2 : 16;
+    g->keys = realloc(g->keys, g->capKeys * sizeof(SIMultiKey *));
+  }
+  g->keys[g->numKeys++] = k;
+}
+
+void SIGarbage_AddId(SIGarbage *g, SIId id) {
+  if (g->numIds == g->capIds) {
+    g->capIds = g->capIds ? g->capIds * 2 : 16;
+    g->ids = realloc(g->ids, g->capIds * sizeof(SIId));
+  }
+  g->ids[g->numIds++] = id;
+}
+
+int SIGarbage_Release(SIGarbage *g, size_t max) {
+  size_t n = 0;
+  while (g->nodes && n < max) {
+    skiplistNode *next = g->nodes->level[0].forward;
+    for (u_int i = 0; i < g->nodes->numVals; i++) {
+      free(g->nodes->vals[i]);
+    }
+    n += g->nodes->numVals + 1;
+    skiplistFreeNode(g->nodes);
+    g->nodes = next;
+  }
+  while (g->numKeys && n++ < max) {
+    SIMultiKey_Free(g->keys[--g->numKeys]);
+  }
+  while (g->numIds && n++ < max) {
+    free(g->ids[--g->numIds]);
+  }
+  while (g->numRis && n < max) {
+    SIReverseIndex *ri = g->ris[g->numRis - 1];
+    for (; g->riPos != kh_end(ri) && n < max; ++g->riPos) {
+      if (kh_exist(ri, g->riPos)) {
+        SIMultiKey_Free(kh_value(ri, g->riPos));
+        n++;
+      }
+    }
+    if (g->riPos == kh_end(ri)) {
+      SIReverseIndex_Free(ri);
+      g->numRis--;
+      g->riPos = 0;
+    }
+  }
+  if (g->nodes || g->numKeys || g->numIds || g->numRis) {
+    return 0;
+  }
 
-  while (NULL != (n = skiplistIteratorCurrent(&it))) {
+  free(g->keys);
+  free(g->ids);
+  free(g->ris);
+  free(g);
+  return 1;
+}
+
+/* Remove the ids of nodes unlinked from a partition from its reverse index,
+ * and hand the nodes over to the garbage list */
+size_t compoundIndex_dropNodes(ciPartition *p, skiplistNode *first,
+                               IndexVisitor cb, void *visitCtx,
+                               SIGarbage *g) {
+  size_t num = 0;
+  skiplistNode *n = first, *last = NULL;
+  for (; n != NULL; last = n, n = n->level[0].forward) {
     for (u_int i = 0; i < n->numVals; i++) {
-      cb(n->vals[i], n->obj, visitCtx);
+      if (cb) {
+        cb(n->vals[i], n->obj, visitCtx);
+      }
+      SIMultiKey *key = NULL;
+      if (SIReverseIndex_Exists(p->ri, n->vals[i], &key)) {
+        SIReverseIndex_Delete(p->ri, n->vals[i]);
+        SIGarbage_AddKey(g, key);
+      }
+      num++;
     }
+  }
+  if (last) {
+    last->level[0].forward = g->nodes;
+    g->nodes = first;
+  }
+  return num;
+}
 
-    skiplistIterator_Next(&it);
+/* Check if all the keys of a partition are within a scan range, comparing
+ * just its first and last keys */
+int compoundIndex_partitionWithin(ciPartition *p, siPlanRange *r) {
+  skiplist *sl = p->sl;
+  skiplistNode *first = sl->header->level[0].forward;
+  if (!first) {
+    return 0;
   }
+  int rc;
+  if (r->min) {
+    rc = sl->compare(first->obj, r->min, sl->cmpCtx);
+    if (rc < 0 || (rc == 0 && r->minExclusive)) {
+      return 0;
+    }
+  }
+  if (r->max) {
+    rc = sl->compare(sl->tail->obj, r->max, sl->cmpCtx);
+    if (rc > 0 || (rc == 0 && r->maxExclusive)) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
-void compoundIndex_Free(void *ctx) {
+/* Detach a whole partition from the index in O(1), handing its nodes and
+ * reverse index over to the garbage list */
+size_t compoundIndex_dropPartition(compoundIndex *idx, size_t pos,
+                                   IndexVisitor cb, void *visitCtx,
+                                   SIGarbage *g) {
+  ciPartition *p = &idx->parts[pos];
+  size_t num = kh_size(p->ri);
+  skiplistNode *first = p->sl->header->level[0].forward;
+  for (skiplistNode *n = first; cb && n != NULL; n = n->level[0].forward) {
+    for (u_int i = 0; i < n->numVals; i++) {
+      cb(n->vals[i], n->obj, visitCtx);
+    }
+  }
+  if (first) {
+    p->sl->tail->level[0].forward = g->nodes;
+    g->nodes = first;
+  }
+  // what's left of the skiplist is its header
+  for (int i = 0; i < SKIPLIST_MAXLEVEL; i++) {
+    p->sl->header->level[i].forward = NULL;
+  }
+  skiplistFree(p->sl);
+
+  g->ris = realloc(g->ris, (g->numRis + 1) * sizeof(SIReverseIndex *));
+  g->ris[g->numRis++] = p->ri;
+
+  memmove(p, p + 1, (idx->numParts - pos - 1) * sizeof(ciPartition));
+  idx->numParts--;
+  return num;
+}
+
+static void compoundIndex_releaseGarbage(void *g) {
+  SIGarbage_Release(g, SIZE_MAX);
+}
+
+int compoundIndex_DeleteWhere(void *ctx, SIQuery *q, IndexVisitor cb,
+                              void *visitCtx, size_t *num,
+                              SIGarbage **garbage) {
   compoundIndex *idx = ctx;
+  *num = 0;
+  *garbage = NULL;
+  if (q->numPredicates == 0) {
+    return SI_INDEX_ERROR;
+  }
 
-  SIReverseIndex_Free(idx->ri);
+  SIQueryPlan *plan = SI_BuildQueryPlan(q, &idx->spec);
+  if (!plan) {
+    return SI_INDEX_ERROR;
+  }
+  compoundIndex_beginWrite(idx);
+  SIGarbage *g = SI_NewGarbage();
 
-  // free up all keys in the skiplist
-  skiplistIterator it = skiplistIterateAll(idx->sl);
-  skiplistNode *n;
+  // concurrent readers may stand on any node, and snapshots may read the
+  // deleted ids, so their skiplists are not cut in bulk
+  if (!plan->filter && !q->num && !q->offset && !idx->epoch &&
+      !idx->versions.snapshots) {
+    // the ranges hold exactly the matching ids, so each of them is unlinked
+    // whole, without descending the skiplist per id. Partitions entirely
+    // within a range are dropped altogether
+    siPlanRangeIterator ranges = SIQueryPlan_IterateRanges(plan);
+    siPlanRange *r;
+    while (NULL != (r = siPlanRangeIterator_Next(&ranges))) {
+      size_t i, end;
+      compoundIndex_rangePartitions(idx, r, &i, &end);
+      while (i < end) {
+        ciPartition *p = &idx->parts[i];
+        if (compoundIndex_partitionWithin(p, r)) {
+          *num += compoundIndex_dropPartition(idx, i, cb, visitCtx, g);
+          end--;
+          continue;
+        }
 
-  while (NULL != (n = skiplistIteratorCurrent(&it))) {
-    for (u_int i = 0; i < n->numVals; i++) {
-      free(n->vals[i]);
+        skiplistNode *first;
+        if (skiplistDeleteRange(p->sl, r->min, r->max, r->minExclusive,
+                                r->maxExclusive, &first)) {
+          *num += compoundIndex_dropNodes(p, first, cb, visitCtx, g);
+        }
+        if (!kh_size(p->ri) && (idx->spec.flags & SI_INDEX_PARTITIONED)) {
+          compoundIndex_dropIfEmpty(idx, p);
+          end--;
+          continue;
+        }
+        i++;
+      }
+    }
+    siPlanRangeIterator_Free(&ranges);
+    SIQueryPlan_Free(plan);
+  } else {
+    // residual filters must be evaluated per id. The matching ids are
+    // collected first, since the scan can't run over a changing skiplist
+    SICursor *c = compoundIndex_planCursor(idx, plan, q);
+    SIId id;
+    while (c->error == SI_CURSOR_OK && NULL != (id = c->Next(c->ctx))) {
+      SIGarbage_AddId(g, id);
     }
-    if (n->obj)
-      SIMultiKey_Free(n->obj);
+    SICursor_Free(c);
 
-    skiplistIterator_Next(&it);
+    for (size_t i = 0; i < g->numIds; i++) {
+      SIMultiKey *key = NULL;
+      ciPartition *p = compoundIndex_findId(idx, g->ids[i], &key);
+      if (cb) {
+        cb(g->ids[i], key, visitCtx);
+      }
+      compoundIndex_unlinkId(p, key, g->ids[i]);
+      SIReverseIndex_Delete(p->ri, g->ids[i]);
+      SIGarbage_AddKey(g, key);
+      compoundIndex_dropIfEmpty(idx, p);
+    }
+    *num = g->numIds;
+  }
+
+  idx->length -= *num;
+  // readers of concurrent indexes and snapshots may still hold the deleted
+  // entries, so they are released once none can, and the caller gets an
+  // empty list
+  if (idx->epoch || idx->versions.snapshots) {
+    compoundIndex_retire(idx, g, compoundIndex_releaseGarbage);
+    if (idx->epoch) {
+      SIEpoch_Collect(idx->epoch);
+    }
+    g = SI_NewGarbage();
   }
-  skiplistFree(idx->sl);
+  *garbage = g;
+  return SI_INDEX_OK;
+}
+
+void compoundIndex_Traverse(void *ctx, IndexVisitor cb, void *visitCtx) {
+  compoundIndex *idx = ctx;
+
+  // nodes are visited directly rather than with an iterator, which yields
+  // each node once per id
+  for (size_t p = 0; p < idx->numParts; p++) {
+    skiplist *sl = idx->parts[p].sl;
+    for (skiplistNode *n = sl->header->level[0].forward; n != NULL;
+         n = n->level[0].forward) {
+      for (u_int i = 0; i < n->numVals; i++) {
+        if (skiplistValVisible(n, i, SKIPLIST_LATEST)) {
+          cb(n->vals[i], n->obj, visitCtx);
+        }
+      }
+    }
+  }
+}
+
+void compoundIndex_Free(void *ctx) {
+  compoundIndex *idx = ctx;
+  // the cursors of the index must be closed by now
+  idx->versions.snapshots = 0;
+  compoundIndex_collect(idx);
+  free(idx->retired);
+  if (idx->epoch) {
+    SIEpoch_Free(idx->epoch);
+  }
+
+  for (size_t p = 0; p < idx->numParts; p++) {
+    SIReverseIndex_Free(idx->parts[p].ri);
+
+    // free up all keys in the skiplist
+    skiplist *sl = idx->parts[p].sl;
+    for (skiplistNode *n = sl->header->level[0].forward; n != NULL;
+         n = n->level[0].forward) {
+      for (u_int i = 0; i < n->numVals; i++) {
+        free(n->vals[i]);
+      }
+      if (n->obj)
+        SIMultiKey_Free(n->obj);
+    }
+    skiplistFree(idx->parts[p].sl);
+  }
+  free(idx->parts);
+  free(idx->cmpCtx);
   free(idx);
-}
\ No newline at end of file
+}
@@ -2,11 +2,14 @@
 #define __SECONDARY_H__
 
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "query.h"
 #include "value.h"
 #include "changeset.h"
 #include "spec.h"
+#include "key.h"
+#include "thread_pool.h"
 
 #define SI_INDEX_OK 0
 #define SI_INDEX_ERROR -1
@@ -22,6 +25,8 @@ typedef struct {
   int error;
   void *ctx;
   SIId (*Next)(void *ctx);
+  // the index key of the id Next returned last. NULL if not supported
+  void *(*CurrentKey)(void *ctx);
   void (*Release)(void *vtx);
 } SICursor;
 
@@ -30,16 +35,133 @@ SICursor *SI_NewCursor(void *ctx);
 
 typedef void (*IndexVisitor)(SIId id, void *key, void *ctx);
 
+/* The entries removed from an index by a bulk delete. They are no longer
+ * reachable from the index, so they can be freed at any later time */
+typedef struct siGarbage SIGarbage;
+
+/* Free up to max entries of a garbage list. Returns 1 once all of them are
+ * freed, in which case the list itself is freed too */
+int SIGarbage_Release(SIGarbage *g, size_t max);
+
+/* Create an empty garbage list, for indexes collecting their own entries */
+SIGarbage *SI_NewGarbage();
+
+/* Add a deleted key to a garbage list */
+void SIGarbage_AddKey(SIGarbage *g, SIMultiKey *k);
+
+/* Add a deleted id to a garbage list */
+void SIGarbage_AddId(SIGarbage *g, SIId id);
+
 typedef struct {
   void *ctx;
 
   int (*Apply)(void *ctx, SIChangeSet cs);
   SICursor *(*Find)(void *ctx, SIQuery *q);
   void (*Traverse)(void *ctx, IndexVisitor cb, void *visitCtx);
+  /* Delete all the ids matching a query, calling cb on each of them before it
+   * is removed. The number of deleted ids is put in num, and the removed
+   * entries in garbage, to be released by the caller */
+  int (*DeleteWhere)(void *ctx, SIQuery *q, IndexVisitor cb, void *visitCtx,
+                     size_t *num, SIGarbage **garbage);
   size_t (*Len)(void *ctx);
+  /* Estimate the number of ids within a plan's ranges from the index
+   * structure, without scanning them. The plan's filter is not considered */
+  size_t (*Estimate)(void *ctx, struct SIQueryPlan *plan);
   void (*Free)(void *ctx);
 } SIIndex;
 
+/* Create a compound index. With SI_INDEX_CONCURRENT, the index can be read
+ * from other threads without a lock while a single thread writes it: its
+ * cursors are epoch guards, and the nodes, keys and deleted entries they could
+ * reach are freed once all the cursors opened before their removal are freed.
+ * Concurrent indexes can't be partitioned */
 SIIndex SI_NewCompoundIndex(SISpec spec);
 
+/* Create the index engine a spec asks for: an LSM index if SI_INDEX_LSM is
+ * set, a compound index otherwise */
+SIIndex SI_NewIndex(SISpec spec);
+
+/* Apply a change set, and if it fails, retry its changes one at a time so
+ * that a single rejected change does not drop the rest. The ids of the
+ * additions the index still rejects are passed to rejected, if given, and
+ * freed. Returns the error of the first attempt */
+int SIIndex_ApplyEach(SIIndex idx, SIChangeSet cs, IndexVisitor rejected,
+                      void *ctx);
+
+/* The number of keys from which the module splits compound index scans with
+ * filters or sorting over its thread pool */
+#define SI_PARALLEL_SCAN_MIN_ROWS 100000
+
+/* The least number of keys a part of a parallel scan is given */
+#define SI_PARALLEL_SCAN_MIN_PART 1024
+
+/* Set the thread pool compound index scans are split over, once they span at
+ * least minRows keys. Without a pool, the default, scans run on the calling
+ * thread */
+void SI_SetScanThreadPool(SIThreadPool *pool, size_t minRows);
+
+/* The number of ids an LSM index's memtable holds before it is frozen to an
+ * immutable segment */
+#define SI_LSM_MEMTABLE_SIZE 4096
+
+/* The number of segment entries compaction merges per written id */
+#define SI_LSM_COMPACT_STEP 32
+
+/* Create an LSM index. Writes go to a skiplist memtable, which is frozen to an
+ * immutable sorted segment once full. Segments are compacted incrementally on
+ * writes, and read through a merging iterator. The index owns the ids of
+ * additions */
+SIIndex SI_NewLSMIndex(SISpec spec);
+
+/* Freeze the memtable of an LSM index to a segment */
+void SILSMIndex_Freeze(void *ctx);
+
+/* Run up to steps entries of the pending compaction of an LSM index. Returns 1
+ * if no compaction is pending anymore */
+int SILSMIndex_Compact(void *ctx, size_t steps);
+
+/* Return the number of segments of an LSM index */
+size_t SILSMIndex_NumSegments(void *ctx);
+
+/* The number of keys of a static index block. The first key of each block is
+ * kept in a fence array, searched before the block itself */
+#define SI_STATIC_BLOCK_SIZE 64
+
+/* Create a read only copy of an index, with each distinct key stored once and
+ * the ids packed in a contiguous array. The first write thaws it back into a
+ * mutable index. The source index is not modified */
+SIIndex SI_NewStaticIndex(SIIndex src, SISpec spec);
+
+/* Wrap an index so that changes are buffered rather than applied right away.
+ * Only the last change of each id is kept, and the buffered changes are
+ * applied to the wrapped index in a single batch, sorted by key, when the
+ * index is flushed or read. The wrapped index is owned by the new one */
+SIIndex SI_NewDeferredIndex(SIIndex inner, SISpec *spec);
+
+/* Apply the buffered changes of a deferred index */
+int SIDeferredIndex_Flush(void *ctx);
+
+/* Return the number of buffered changes of a deferred index */
+size_t SIDeferredIndex_Pending(void *ctx);
+
+/* Return the index wrapped by a deferred index */
+SIIndex SIDeferredIndex_Inner(void *ctx);
+
+/* Wrap an index so that it can be read from other threads. Writes and freeing
+ * the index take the write lock. Writes made while other threads hold the read
+ * lock are buffered rather than waiting for them, except in unique indexes,
+ * and applied by the next write or read that gets the lock. Reads do not take
+ * the lock, since they are meant to be called from the writing thread. Other
+ * threads read the wrapped index, holding the read lock for as long as they
+ * use it or its cursors. The wrapped index is owned by the new one, the lock
+ * is not */
+SIIndex SI_NewLockedIndex(SIIndex inner, SISpec *spec, pthread_rwlock_t *lock);
+
+/* Apply the buffered changes of a locked index, waiting for the readers on
+ * other threads if there are any */
+void SILockedIndex_Sync(void *ctx);
+
+/* Return the index wrapped by a locked index, for other threads to read */
+SIIndex SILockedIndex_Inner(void *ctx);
+
 #endif // !__SECONDARY_H__
\ No newline at end of file
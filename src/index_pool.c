@@ -0,0 +1,68 @@
+#include <stdint.h>
+#include "index_pool.h"
+#include "index.h"
+#include "rmutil/util.h"
+#include "rmutil/alloc.h"
+
+static SIThreadPool *pool = NULL;
+static int drainScheduled = 0;
+
+/* Timer callback running the completions of finished tasks. It keeps itself
+ * armed as long as there are tasks in flight */
+void indexPool_Drain(RedisModuleCtx *ctx, void *data) {
+  drainScheduled = 0;
+  if (SIThreadPool_Drain(pool, SIZE_MAX) && !drainScheduled) {
+    RedisModule_CreateTimer(ctx, SI_POOL_DRAIN_MS, indexPool_Drain, NULL);
+    drainScheduled = 1;
+  }
+}
+
+int IndexPool_Init(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  long long threads = SI_DEFAULT_THREADS;
+  if (RMUtil_ArgExists("THREADS", argv, argc, 0) &&
+      (RMUtil_ParseArgsAfter("THREADS", argv, argc, "l", &threads) ==
+           REDISMODULE_ERR ||
+       threads < 0)) {
+    RedisModule_Log(ctx, "warning", "Invalid THREADS argument");
+    return REDISMODULE_ERR;
+  }
+
+  if (threads == 0) {
+    return REDISMODULE_OK;
+  }
+  if (!RedisModule_CreateTimer) {
+    RedisModule_Log(ctx, "warning", "Timers are not supported by this server, "
+                                    "all the work is done on the main thread");
+    return REDISMODULE_OK;
+  }
+  pool = SI_NewThreadPool(threads);
+  if (!pool) {
+    RedisModule_Log(ctx, "warning", "Could not start %lld threads", threads);
+    return REDISMODULE_ERR;
+  }
+  SI_SetScanThreadPool(pool, SI_PARALLEL_SCAN_MIN_ROWS);
+  return REDISMODULE_OK;
+}
+
+int IndexPool_Enabled() { return pool != NULL; }
+
+SIThreadPool *IndexPool_Get() { return pool; }
+
+SITask *IndexPool_Submit(RedisModuleCtx *ctx, SITaskPriority prio,
+                         SITaskFunc run, SITaskDoneFunc done, void *arg) {
+  if (!pool) {
+    return NULL;
+  }
+  SITask *t = SIThreadPool_Submit(pool, prio, run, done, arg);
+  if (ctx) {
+    IndexPool_Watch(ctx);
+  }
+  return t;
+}
+
+void IndexPool_Watch(RedisModuleCtx *ctx) {
+  if (pool && !drainScheduled && SIThreadPool_Pending(pool)) {
+    RedisModule_CreateTimer(ctx, SI_POOL_DRAIN_MS, indexPool_Drain, NULL);
+    drainScheduled = 1;
+  }
+}
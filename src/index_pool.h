@@ -0,0 +1,42 @@
+#ifndef __SI_INDEX_POOL_H__
+#define __SI_INDEX_POOL_H__
+
+#include "redismodule.h"
+#include "thread_pool.h"
+
+/*
+* The module's thread pool, shared by all the indexes.
+*
+* The number of workers is set with the THREADS module load argument, and 0
+* disables the pool, in which case all the work is done on the main thread.
+* The completions of the pool's tasks are run on the main thread by a timer,
+* which is only armed while there are tasks in flight.
+*/
+
+// the number of workers, unless given at load time
+#define SI_DEFAULT_THREADS 4
+
+// the period of the timer running the completions of finished tasks
+#define SI_POOL_DRAIN_MS 1
+
+/* Start the pool with the THREADS load argument, if any. The pool is not
+ * started on servers without timers */
+int IndexPool_Init(RedisModuleCtx *ctx, RedisModuleString **argv, int argc);
+
+/* Return 1 if the module has a thread pool */
+int IndexPool_Enabled();
+
+/* Submit a task from the main thread. Returns NULL if there is no pool, in
+ * which case the caller should do the work itself. Without a context, the
+ * task's completion waits for the next task submitted with one. Tasks spawning
+ * more tasks submit them with SIThreadPool_Submit on IndexPool_Get() */
+SITask *IndexPool_Submit(RedisModuleCtx *ctx, SITaskPriority prio,
+                         SITaskFunc run, SITaskDoneFunc done, void *arg);
+
+SIThreadPool *IndexPool_Get();
+
+/* Arm the completions timer if there are tasks in flight. Called after reading
+ * an index from the main thread, since large scans spawn tasks of their own */
+void IndexPool_Watch(RedisModuleCtx *ctx);
+
+#endif
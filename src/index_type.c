@@ -1,7 +1,11 @@
+#include <stdint.h>
 #include "redismodule.h"
 #include "index.h"
 #include "key.h"
 #include "index_type.h"
+#include "hash_tracking.h"
+#include "hash_build.h"
+#include "index_pool.h"
 #include "rmutil/util.h"
 #include "rmutil/vector.h"
 #include "rmutil/alloc.h"
@@ -28,6 +32,12 @@ void __redisIndex_SaveSpec(RedisIndex *idx, RedisModuleIO *io) {
     RedisModule_SaveSigned(io, (int)idx->spec.properties[i].type);
     RedisModule_SaveSigned(io, (int)idx->spec.properties[i].flags);
   }
+  if (idx->spec.flags & SI_INDEX_PARTITIONED) {
+    RedisModule_SaveSigned(io, idx->spec.partitionSize);
+  }
+  if (idx->spec.flags & SI_INDEX_CACHED) {
+    RedisModule_SaveUnsigned(io, idx->spec.cacheSize);
+  }
 }
 
 /* Load the index spec from an rdb/replication buffer */
@@ -47,6 +57,11 @@ void __redisIndex_LoadSpec(RedisIndex *idx, RedisModuleIO *io) {
     // printf("loaded prop type %d flags %x\n", idx->spec.properties[i].type,
     //        idx->spec.properties[i].flags);
   }
+  idx->spec.partitionSize = idx->spec.flags & SI_INDEX_PARTITIONED
+                                ? RedisModule_LoadSigned(io)
+                                : 0;
+  idx->spec.cacheSize =
+      idx->spec.flags & SI_INDEX_CACHED ? RedisModule_LoadUnsigned(io) : 0;
 }
 
 /* Read a single SIValue from a redis io buffer. Returns NULL value if the value
@@ -167,7 +182,7 @@ void __redisIndex_SaveIndex(RedisIndex *idx, RedisModuleIO *w) {
 int __redisIndex_LoadIndex(RedisIndex *idx, RedisModuleIO *rdb) {
   // 1. create an index
   // TODO: Check idx kind for multiple kind support
-  idx->idx = SI_NewCompoundIndex(idx->spec);
+  idx->idx = SI_NewIndex(idx->spec);
 
   // read the total number of elements in the index
   u_int64_t elements = RedisModule_LoadUnsigned(rdb);
@@ -195,11 +210,14 @@ int __redisIndex_LoadIndex(RedisIndex *idx, RedisModuleIO *rdb) {
   }
 
   SIChangeSet_Free(&cs);
+  // the loaded records are applied directly, and only later changes deferred
+  idx->idx = RedisIndex_WrapIndex(idx, idx->idx);
 
   return REDISMODULE_OK;
 }
 
-/* IDX.CREATE {name} [TYPE [HASH|STRING]] [UNIQUE] SCHEMA [{t}... ]|[{p1} {t1}]
+/* IDX.CREATE {name} [TYPE [HASH|STRING]] [UNIQUE] [DEFERRED] [LSM]
+  [PARTITION {secs}] [CACHE {bytes}] SCHEMA [{t}... ]|[{p1} {t1}]
   Create an index according to its spec string
 */
 int SI_ParseSpec(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
@@ -234,8 +252,42 @@ int SI_ParseSpec(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
     return REDISMODULE_ERR;
   }
 
-  spec->flags =
-      0 | (unique ? SI_INDEX_UNIQUE : 0) | (named ? SI_INDEX_NAMED : 0);
+  int deferred = RMUtil_ArgExists("DEFERRED", argv, schemaPos, 2);
+
+  // time partitioned indexes split their keys to buckets of a fixed span of
+  // their leading TIME property
+  long long partitionSize = 0;
+  int partitioned = RMUtil_ArgExists("PARTITION", argv, schemaPos, 2);
+  if (partitioned &&
+      (RMUtil_ParseArgsAfter("PARTITION", argv, schemaPos, "l",
+                             &partitionSize) == REDISMODULE_ERR ||
+       partitionSize <= 0)) {
+    RedisModule_Log(ctx, "warning", "Invalid partition size");
+    return REDISMODULE_ERR;
+  }
+
+  // the results of recent queries are kept within a memory budget
+  long long cacheSize = 0;
+  int cached = RMUtil_ArgExists("CACHE", argv, schemaPos, 2);
+  if (cached && (RMUtil_ParseArgsAfter("CACHE", argv, schemaPos, "l",
+                                       &cacheSize) == REDISMODULE_ERR ||
+                 cacheSize <= 0)) {
+    RedisModule_Log(ctx, "warning", "Invalid cache size");
+    return REDISMODULE_ERR;
+  }
+
+  int lsm = RMUtil_ArgExists("LSM", argv, schemaPos, 2);
+  int concurrent = RMUtil_ArgExists("CONCURRENT", argv, schemaPos, 2);
+
+  spec->flags = 0 | (unique ? SI_INDEX_UNIQUE : 0) |
+                (named ? SI_INDEX_NAMED : 0) |
+                (deferred ? SI_INDEX_DEFERRED : 0) |
+                (partitioned ? SI_INDEX_PARTITIONED : 0) |
+                (lsm ? SI_INDEX_LSM : 0) |
+                (concurrent ? SI_INDEX_CONCURRENT : 0) |
+                (cached ? SI_INDEX_CACHED : 0);
+  spec->partitionSize = partitionSize;
+  spec->cacheSize = cacheSize;
   printf("flags: %x\n", spec->flags);
   spec->numProps =
       named ? (argc - (schemaPos + 1)) / 2 : argc - (schemaPos + 1);
@@ -269,6 +321,13 @@ int SI_ParseSpec(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
     p++;
   }
 
+  if (partitioned && spec->properties[0].type != T_TIME) {
+    RedisModule_Log(ctx, "warning",
+                    "Partitioned indexes must have a leading TIME property");
+    SISpec_Free(spec);
+    return REDISMODULE_ERR;
+  }
+
   return REDISMODULE_OK;
 }
 
@@ -278,26 +337,213 @@ void *NewRedisIndex(SIIndexKind kind, u_int32_t flags, SISpec spec) {
   idx->kind = kind;
   idx->flags = flags;
   idx->spec = spec;
-  idx->idx = SI_NewCompoundIndex(idx->spec);
+  pthread_rwlock_init(&idx->lock, NULL);
+  idx->pins = 0;
+  idx->dropped = 0;
+  idx->retired = NULL;
+  idx->numRetired = 0;
+  idx->results = spec.flags & SI_INDEX_CACHED
+                     ? SI_NewResultCache(spec.cacheSize)
+                     : NULL;
+  idx->idx = RedisIndex_WrapIndex(idx, SI_NewIndex(idx->spec));
+  idx->prefix = NULL;
+  idx->db = 0;
+  idx->build = NULL;
+  idx->dirty = 0;
+  idx->queries = SI_NewQueryCache(SI_QUERY_CACHE_SIZE);
+  idx->statements = kh_init(siStatements);
 
   return idx;
 }
 
+SIIndex RedisIndex_WrapIndex(RedisIndex *idx, SIIndex inner) {
+  // buffered changes only take the lock once they are flushed. Concurrent
+  // indexes are read without it
+  idx->locked = NULL;
+  if (!(idx->spec.flags & SI_INDEX_CONCURRENT)) {
+    inner = SI_NewLockedIndex(inner, &idx->spec, &idx->lock);
+    idx->locked = inner.ctx;
+  }
+  if (idx->results) {
+    inner = SI_NewCachedIndex(inner, idx->results, &idx->spec);
+  }
+  if (idx->spec.flags & SI_INDEX_DEFERRED) {
+    return SI_NewDeferredIndex(inner, &idx->spec);
+  }
+  return inner;
+}
+
+// the deferred indexes with buffered changes
+static RedisIndex **dirtyIndexes = NULL;
+static size_t numDirty = 0;
+static size_t capDirty = 0;
+
+/* Timer callback applying the buffered changes of all deferred indexes */
+void redisIndex_FlushDirty(RedisModuleCtx *ctx, void *data) {
+  for (size_t i = 0; i < numDirty; i++) {
+    dirtyIndexes[i]->dirty = 0;
+    if (SIDeferredIndex_Flush(dirtyIndexes[i]->idx.ctx) != SI_INDEX_OK) {
+      RedisModule_Log(ctx, "warning",
+                      "deferred index flush: some changes were rejected");
+    }
+  }
+  numDirty = 0;
+}
+
+void RedisIndex_ScheduleFlush(RedisModuleCtx *ctx, RedisIndex *idx) {
+  // without timers, the changes are applied when the index is read
+  if (!(idx->spec.flags & SI_INDEX_DEFERRED) || idx->dirty ||
+      !RedisModule_CreateTimer) {
+    return;
+  }
+
+  if (numDirty == capDirty) {
+    capDirty = capDirty ? capDirty * 2 : 4;
+    dirtyIndexes = realloc(dirtyIndexes, capDirty * sizeof(RedisIndex *));
+  }
+  if (numDirty == 0) {
+    RedisModule_CreateTimer(ctx, 0, redisIndex_FlushDirty, NULL);
+  }
+  dirtyIndexes[numDirty++] = idx;
+  idx->dirty = 1;
+}
+
+/* Timer callback freeing a slice of the entries removed by a bulk delete */
+void redisIndex_ReleaseGarbage(RedisModuleCtx *ctx, void *data) {
+  if (!SIGarbage_Release(data, SI_GARBAGE_RELEASE_COUNT)) {
+    RedisModule_CreateTimer(ctx, 0, redisIndex_ReleaseGarbage, data);
+  }
+}
+
+void redisIndex_GarbageTask(SITask *t, void *data) {
+  SIGarbage_Release(data, SIZE_MAX);
+}
+
+void RedisIndex_ReleaseGarbage(RedisModuleCtx *ctx, SIGarbage *g) {
+  // the entries are unreachable, so they can be freed on any thread
+  if (IndexPool_Submit(ctx, SI_TASK_LOW, redisIndex_GarbageTask, NULL, g)) {
+    return;
+  }
+  if (!RedisModule_CreateTimer) {
+    SIGarbage_Release(g, SIZE_MAX);
+    return;
+  }
+  RedisModule_CreateTimer(ctx, 0, redisIndex_ReleaseGarbage, g);
+}
+
+RedisStatement *redisStatement_New(int numArgs) {
+  RedisStatement *rs = malloc(sizeof(RedisStatement));
+  rs->args = calloc(numArgs + 1, sizeof(char *));
+  rs->argLens = calloc(numArgs + 1, sizeof(size_t));
+  rs->numArgs = numArgs;
+  rs->st = NULL;
+  return rs;
+}
+
+void redisStatement_Free(RedisStatement *rs) {
+  for (int i = 0; i < rs->numArgs; i++) {
+    free(rs->args[i]);
+  }
+  free(rs->args);
+  free(rs->argLens);
+  if (rs->st) {
+    SIStatement_Free(rs->st);
+  }
+  free(rs);
+}
+
+/* Save the prepared queries by the arguments they were prepared from */
+void __redisIndex_SaveStatements(RedisIndex *idx, RedisModuleIO *rdb) {
+  RedisModule_SaveUnsigned(rdb, kh_size(idx->statements));
+  for (khiter_t k = kh_begin(idx->statements); k != kh_end(idx->statements);
+       ++k) {
+    if (!kh_exist(idx->statements, k)) {
+      continue;
+    }
+    const char *name = kh_key(idx->statements, k);
+    RedisStatement *rs = kh_value(idx->statements, k);
+    RedisModule_SaveStringBuffer(rdb, name, strlen(name));
+    RedisModule_SaveUnsigned(rdb, rs->numArgs);
+    for (int i = 0; i < rs->numArgs; i++) {
+      RedisModule_SaveStringBuffer(rdb, rs->args[i], rs->argLens[i]);
+    }
+  }
+}
+
+/* Store a statement under a name, taking ownership of it */
+void redisIndex_PutStatement(RedisIndex *idx, const char *name,
+                             RedisStatement *rs) {
+  int rc;
+  khiter_t k = kh_put(siStatements, idx->statements, name, &rc);
+  if (rc == 0) {
+    redisStatement_Free(kh_value(idx->statements, k));
+  } else {
+    kh_key(idx->statements, k) = strdup(name);
+  }
+  kh_value(idx->statements, k) = rs;
+}
+
+/* Load the prepared queries, which are prepared again when first executed */
+void __redisIndex_LoadStatements(RedisIndex *idx, RedisModuleIO *rdb) {
+  size_t num = RedisModule_LoadUnsigned(rdb);
+  for (size_t n = 0; n < num; n++) {
+    size_t len;
+    char *buf = RedisModule_LoadStringBuffer(rdb, &len);
+    char *name = strndup(buf, len);
+    free(buf);
+
+    RedisStatement *rs = redisStatement_New(RedisModule_LoadUnsigned(rdb));
+    for (int i = 0; i < rs->numArgs; i++) {
+      rs->args[i] = RedisModule_LoadStringBuffer(rdb, &rs->argLens[i]);
+    }
+    redisIndex_PutStatement(idx, name, rs);
+    free(name);
+  }
+}
+
 /* Load the index's spec and data from rdb */
 void *RedisIndex_RdbLoad(RedisModuleIO *rdb, int encver) {
-  if (encver != 0) {
+  if (encver > SI_INDEX_ENCVER) {
     return NULL;
   }
 
   RedisIndex *idx = malloc(sizeof(RedisIndex));
   idx->kind = RedisModule_LoadUnsigned(rdb);
   idx->flags = RedisModule_LoadUnsigned(rdb);
+  idx->prefix = NULL;
+  // the index is loaded into the database it was saved from
+  idx->db = RedisModule_GetDbIdFromIO ? RedisModule_GetDbIdFromIO(rdb) : 0;
+  // builds are not persisted, an index saved while building is loaded with
+  // its previous contents
+  idx->build = NULL;
+  idx->dirty = 0;
+  idx->queries = SI_NewQueryCache(SI_QUERY_CACHE_SIZE);
+  idx->statements = kh_init(siStatements);
+  pthread_rwlock_init(&idx->lock, NULL);
+  idx->pins = 0;
+  idx->dropped = 0;
+  idx->retired = NULL;
+  idx->numRetired = 0;
+  if (encver >= 1 && RedisModule_LoadUnsigned(rdb)) {
+    // loaded buffers are not null terminated
+    size_t len;
+    char *buf = RedisModule_LoadStringBuffer(rdb, &len);
+    idx->prefix = strndup(buf, len);
+    free(buf);
+    HashTracking_Register(idx);
+  }
 
   // read the spec
   __redisIndex_LoadSpec(idx, rdb);
+  idx->results = idx->spec.flags & SI_INDEX_CACHED
+                     ? SI_NewResultCache(idx->spec.cacheSize)
+                     : NULL;
 
   // create and populat the index
   __redisIndex_LoadIndex(idx, rdb);
+  if (encver >= 3) {
+    __redisIndex_LoadStatements(idx, rdb);
+  }
 
   return idx;
 }
@@ -307,12 +553,17 @@ void RedisIndex_RdbSave(RedisModuleIO *rdb, void *value) {
   RedisIndex *idx = value;
   RedisModule_SaveUnsigned(rdb, idx->kind);
   RedisModule_SaveUnsigned(rdb, idx->flags);
+  RedisModule_SaveUnsigned(rdb, idx->prefix != NULL);
+  if (idx->prefix) {
+    RedisModule_SaveStringBuffer(rdb, idx->prefix, strlen(idx->prefix));
+  }
 
   // save the spec
   __redisIndex_SaveSpec(idx, rdb);
 
   // save the index data
   __redisIndex_SaveIndex(idx, rdb);
+  __redisIndex_SaveStatements(idx, rdb);
 }
 
 #define __vpushStr(v, ctx, str) \
@@ -359,6 +610,29 @@ void RedisIndex_AofRewrite(RedisModuleIO *aof, RedisModuleString *key,
     __vpushStr(args, ctx, "TYPE");
     __vpushStr(args, ctx, "HASH");
   }
+  if (idx->spec.flags & SI_INDEX_DEFERRED) {
+    __vpushStr(args, ctx, "DEFERRED");
+  }
+  if (idx->spec.flags & SI_INDEX_LSM) {
+    __vpushStr(args, ctx, "LSM");
+  }
+  if (idx->spec.flags & SI_INDEX_CONCURRENT) {
+    __vpushStr(args, ctx, "CONCURRENT");
+  }
+  if (idx->spec.flags & SI_INDEX_PARTITIONED) {
+    __vpushStr(args, ctx, "PARTITION");
+    Vector_Push(args,
+                RedisModule_CreateStringFromLongLong(ctx, idx->spec.partitionSize));
+  }
+  if (idx->spec.flags & SI_INDEX_CACHED) {
+    __vpushStr(args, ctx, "CACHE");
+    Vector_Push(args, RedisModule_CreateStringFromLongLong(
+                          ctx, (long long)idx->spec.cacheSize));
+  }
+  if (idx->prefix) {
+    __vpushStr(args, ctx, "PREFIX");
+    __vpushStr(args, ctx, idx->prefix);
+  }
 
   __vpushStr(args, ctx, "SCHEMA");
   for (int i = 0; i < idx->spec.numProps; i++) {
@@ -376,20 +650,135 @@ void RedisIndex_AofRewrite(RedisModuleIO *aof, RedisModuleString *key,
   __redisIndexVisitorCtx vx = {.w = aof, .idx = idx, .num = 0, .indexKey = key};
 
   idx->idx.Traverse(idx->idx.ctx, __redisIndex_AofVisitor, &vx);
+
+  for (khiter_t k = kh_begin(idx->statements); k != kh_end(idx->statements);
+       ++k) {
+    if (!kh_exist(idx->statements, k)) {
+      continue;
+    }
+    RedisStatement *rs = kh_value(idx->statements, k);
+    args = NewVector(RedisModuleString *, rs->numArgs + 1);
+    __vpushStr(args, ctx, kh_key(idx->statements, k));
+    for (int i = 0; i < rs->numArgs; i++) {
+      Vector_Push(args,
+                  RedisModule_CreateString(ctx, rs->args[i], rs->argLens[i]));
+    }
+    RedisModule_EmitAOF(aof, "IDX.PREPARE", "sv", key,
+                        (RedisModuleString *)args->data, Vector_Size(args));
+    Vector_Free(args);
+  }
 }
 
 void RedisIndex_Digest(RedisModuleDigest *digest, void *value) {}
 
-void RedisIndex_Free(void *value) {
-  RedisIndex *idx = value;
+/* Free the index's contents. Freeing waits for the queries still reading the
+ * index on other threads, through its lock */
+void redisIndex_FreeTask(SITask *t, void *data) {
+  RedisIndex *idx = data;
   idx->idx.Free(idx->idx.ctx);
+  pthread_rwlock_destroy(&idx->lock);
   free(idx);
 }
 
+/* Free the index structure on the thread pool */
+void redisIndex_Release(RedisIndex *idx) {
+  // the cached and prepared queries share their values with the queries of
+  // the main thread, so they are freed here
+  SIQueryCache_Free(idx->queries);
+  if (idx->results) {
+    SIResultCache_Free(idx->results);
+  }
+  for (khiter_t k = kh_begin(idx->statements); k != kh_end(idx->statements);
+       ++k) {
+    if (kh_exist(idx->statements, k)) {
+      free((char *)kh_key(idx->statements, k));
+      redisStatement_Free(kh_value(idx->statements, k));
+    }
+  }
+  kh_destroy(siStatements, idx->statements);
+  // the free callback has no context to arm the completions timer with, but
+  // there's nothing to complete anyway
+  if (!IndexPool_Submit(NULL, SI_TASK_LOW, redisIndex_FreeTask, NULL, idx)) {
+    redisIndex_FreeTask(NULL, idx);
+  }
+}
+
+void RedisIndex_Free(void *value) {
+  RedisIndex *idx = value;
+  if (idx->build) {
+    HashBuild_Cancel(idx);
+  }
+  HashTracking_Unregister(idx);
+  if (idx->dirty) {
+    for (size_t i = 0; i < numDirty; i++) {
+      if (dirtyIndexes[i] == idx) {
+        dirtyIndexes[i] = dirtyIndexes[--numDirty];
+        break;
+      }
+    }
+  }
+  if (idx->prefix) {
+    free(idx->prefix);
+  }
+  // queries still running on other threads free the index once they're done
+  if (idx->pins) {
+    idx->dropped = 1;
+    return;
+  }
+  redisIndex_Release(idx);
+}
+
+void RedisIndex_SetStatement(RedisIndex *idx, const char *name,
+                             SIStatement *st, RedisModuleString **args,
+                             int numArgs) {
+  RedisStatement *rs = redisStatement_New(numArgs);
+  for (int i = 0; i < numArgs; i++) {
+    const char *arg = RedisModule_StringPtrLen(args[i], &rs->argLens[i]);
+    rs->args[i] = malloc(rs->argLens[i]);
+    memcpy(rs->args[i], arg, rs->argLens[i]);
+  }
+  rs->st = st;
+  redisIndex_PutStatement(idx, name, rs);
+}
+
+RedisStatement *RedisIndex_GetStatement(RedisIndex *idx, const char *name) {
+  khiter_t k = kh_get(siStatements, idx->statements, name);
+  return k == kh_end(idx->statements) ? NULL : kh_value(idx->statements, k);
+}
+
+void RedisIndex_Unpin(RedisIndex *idx) {
+  if (--idx->pins) {
+    return;
+  }
+  for (size_t i = 0; i < idx->numRetired; i++) {
+    idx->retired[i].Free(idx->retired[i].ctx);
+  }
+  free(idx->retired);
+  idx->retired = NULL;
+  idx->numRetired = 0;
+  if (idx->dropped) {
+    redisIndex_Release(idx);
+  }
+}
+
+void RedisIndex_Replace(RedisIndex *idx, SIIndex inner) {
+  SIIndex old = idx->idx;
+  idx->idx = RedisIndex_WrapIndex(idx, inner);
+  if (!idx->pins) {
+    old.Free(old.ctx);
+    return;
+  }
+  // the running queries read the old structure, which nothing changes anymore
+  idx->retired =
+      realloc(idx->retired, (idx->numRetired + 1) * sizeof(SIIndex));
+  idx->retired[idx->numRetired++] = old;
+}
+
 int RedisIndex_Register(RedisModuleCtx *ctx) {
   IndexType = RedisModule_CreateDataType(
-      ctx, "indextype", 0, RedisIndex_RdbLoad, RedisIndex_RdbSave,
-      RedisIndex_AofRewrite, RedisIndex_Digest, RedisIndex_Free);
+      ctx, "indextype", SI_INDEX_ENCVER, RedisIndex_RdbLoad,
+      RedisIndex_RdbSave, RedisIndex_AofRewrite, RedisIndex_Digest,
+      RedisIndex_Free);
   if (IndexType == NULL) {
     return REDISMODULE_ERR;
   }
@@ -2,15 +2,70 @@
 #define __SI_INDEX_TYPE_H
 #include "redismodule.h"
 #include "index.h"
+#include "query_cache.h"
+#include "statement.h"
+#include "result_cache.h"
+#include "util/khash.h"
+#include <pthread.h>
 
 extern RedisModuleType *IndexType;
 typedef enum { SI_AbstractIndex, SI_HashIndex } SIIndexKind;
 
+/* A prepared query of an index, with the IDX.PREPARE arguments following its
+ * name, from which it is saved, rewritten to the AOF, and prepared again once
+ * loaded */
+typedef struct {
+  char **args;
+  size_t *argLens;
+  int numArgs;
+  // NULL for a query loaded from rdb, until it is first executed
+  SIStatement *st;
+} RedisStatement;
+
+/* The prepared queries of an index, by name */
+KHASH_MAP_INIT_STR(siStatements, RedisStatement *);
+
+// the rdb encoding version. Version 1 added the tracked key prefix, version 2
+// the partition size of time partitioned indexes, version 3 the prepared
+// queries, version 4 the result cache budget
+#define SI_INDEX_ENCVER 4
+
 typedef struct {
   SIIndexKind kind;
   u_int32_t flags;
   SISpec spec;
   SIIndex idx;
+  // hash keys starting with this prefix are indexed automatically. NULL if the
+  // index is only updated explicitly
+  char *prefix;
+  // the database of the index key. Only its hash keys are tracked and built
+  int db;
+  // the background build of the index, NULL if it is not being built
+  struct hashBuild *build;
+  // deferred indexes with changes waiting for the end of the event loop
+  // iteration
+  int dirty;
+  // the recently parsed and planned WHERE clauses of the index's queries
+  SIQueryCache *queries;
+  khash_t(siStatements) *statements;
+  // the results of recent queries, NULL unless the index was created with
+  // CACHE
+  SIResultCache *results;
+  // held for reading by queries running on other threads, and for writing by
+  // changes to the index. CONCURRENT indexes don't use it
+  pthread_rwlock_t lock;
+  // the locked wrapper of the index structure, which buffers the changes
+  // written while queries on other threads hold the lock. NULL for CONCURRENT
+  // indexes
+  void *locked;
+  // the number of queries running on other threads. An index deleted while
+  // they run is only freed once they are done
+  int pins;
+  int dropped;
+  // the index structures replaced while queries on other threads could still
+  // read them, freed once they are done
+  SIIndex *retired;
+  size_t numRetired;
 } RedisIndex;
 
 void *RedisIndex_RdbLoad(RedisModuleIO *rdb, int encver);
@@ -21,9 +76,43 @@ void RedisIndex_AofRewrite(RedisModuleIO *aof, RedisModuleString *key,
 void RedisIndex_Digest(RedisModuleDigest *digest, void *value);
 void RedisIndex_Free(void *value);
 
+/* Store a prepared query under a name, with the arguments it was prepared
+ * from, replacing the one already there. The arguments are copied */
+void RedisIndex_SetStatement(RedisIndex *idx, const char *name,
+                             SIStatement *st, RedisModuleString **args,
+                             int numArgs);
+
+/* Get a prepared query by name, or NULL if there is none */
+RedisStatement *RedisIndex_GetStatement(RedisIndex *idx, const char *name);
+
+/* Release a query's hold on an index, freeing the index if it was deleted */
+void RedisIndex_Unpin(RedisIndex *idx);
+
+/* Replace the index structure with a new one, wrapped according to the
+ * index's spec. The old structure is freed once no query running on another
+ * thread can read it, so replacing it never waits for them */
+void RedisIndex_Replace(RedisIndex *idx, SIIndex inner);
+
 int SI_ParseSpec(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
                  SISpec *spec, SIIndexKind *kind);
 
 void *NewRedisIndex(SIIndexKind kind, u_int32_t flags, SISpec spec);
+
+/* Wrap a new index structure according to the index's spec. The index is
+ * locked against readers on other threads for changes, its changes invalidate
+ * its cached results, and indexes with the DEFERRED flag buffer their
+ * changes */
+SIIndex RedisIndex_WrapIndex(RedisIndex *idx, SIIndex inner);
+
+/* Schedule the buffered changes of a deferred index to be applied at the end
+ * of the event loop iteration. Does nothing for other indexes */
+void RedisIndex_ScheduleFlush(RedisModuleCtx *ctx, RedisIndex *idx);
+
+// the number of deleted entries freed per event loop iteration
+#define SI_GARBAGE_RELEASE_COUNT 10000
+
+/* Free the entries removed from an index by a bulk delete in the background,
+ * a slice per event loop iteration */
+void RedisIndex_ReleaseGarbage(RedisModuleCtx *ctx, SIGarbage *g);
 int RedisIndex_Register(RedisModuleCtx *ctx);
 #endif  // !__SI_INDEX_TYPE_
\ No newline at end of file
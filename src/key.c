@@ -42,6 +42,28 @@ int si_cmp_string(void *p1, void *p2, void *ctx) {
   return cmp;
 }
 
+SIKeyCmpFunc SI_KeyCmpFunc(SIType t) {
+  switch (t) {
+  case T_STRING:
+    return si_cmp_string;
+  case T_INT32:
+  case T_BOOL:
+    return si_cmp_int;
+  case T_INT64:
+    return si_cmp_long;
+  case T_FLOAT:
+    return si_cmp_float;
+  case T_DOUBLE:
+    return si_cmp_double;
+  case T_TIME:
+    return si_cmp_time;
+  case T_UINT:
+    return si_cmp_uint;
+  default:
+    return NULL;
+  }
+}
+
 SIMultiKey *SI_NewMultiKey(SIValue *vals, u_int8_t numvals) {
   SIMultiKey *k = malloc(sizeof(SIMultiKey) + numvals * sizeof(SIValue));
   k->size = numvals;
@@ -75,6 +97,41 @@ int SICmpMultiKey(void *p1, void *p2, void *ctx) {
   return 0;
 }
 
+int SIMultiKey_Identical(SIMultiKey *k1, SIMultiKey *k2) {
+  if (k1->size != k2->size) {
+    return 0;
+  }
+  for (u_int8_t i = 0; i < k1->size; i++) {
+    SIValue *v1 = &k1->keys[i], *v2 = &k2->keys[i];
+    if (v1->type != v2->type) {
+      return 0;
+    }
+    switch (v1->type) {
+    case T_STRING:
+      if (v1->stringval.len != v2->stringval.len ||
+          memcmp(v1->stringval.str, v2->stringval.str, v1->stringval.len)) {
+        return 0;
+      }
+      break;
+    case T_INT32:
+      if (v1->intval != v2->intval) return 0;
+      break;
+    case T_BOOL:
+      if (v1->boolval != v2->boolval) return 0;
+      break;
+    case T_FLOAT:
+      if (v1->floatval != v2->floatval) return 0;
+      break;
+    case T_NULL:
+      break;
+    // all other types use the full 64 bits of the value
+    default:
+      if (v1->longval != v2->longval) return 0;
+    }
+  }
+  return 1;
+}
+
 void SIMultiKey_Free(SIMultiKey *k) {
   for (int i = 0; i < k->size; i++) {
     SIValue_Free(&k->keys[i]);
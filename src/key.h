@@ -31,6 +31,10 @@ GENERIC_CMP_FUNC_DECL(si_cmp_double);
 GENERIC_CMP_FUNC_DECL(si_cmp_uint);
 GENERIC_CMP_FUNC_DECL(si_cmp_time);
 
+/* Get the key comparator of a property type. Returns NULL if the type cannot
+ * be indexed */
+SIKeyCmpFunc SI_KeyCmpFunc(SIType t);
+
 typedef struct {
   SIKeyCmpFunc cmpFunc;
   void *ctx;
@@ -54,4 +58,8 @@ void SIMultiKey_Free(SIMultiKey *k);
 
 int SICmpMultiKey(void *p1, void *p2, void *ctx);
 
+/* Return 1 if two keys hold exactly the same values. Unlike the comparators,
+ * strings that differ only in case are not identical */
+int SIMultiKey_Identical(SIMultiKey *k1, SIMultiKey *k2);
+
 #endif
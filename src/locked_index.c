@@ -0,0 +1,137 @@
+#include <unistd.h>
+#include "index.h"
+#include "rmutil/alloc.h"
+
+typedef struct {
+  SIIndex inner;
+  pthread_rwlock_t *lock;
+  // the changes written while readers on other threads held the lock, in a
+  // deferred index wrapping inner. Unique indexes have none, since their
+  // violations must be reported to the writer
+  SIIndex pending;
+  // the process the index was created in. Children forked to save the
+  // dataset have none of the reader threads, but inherit the lock as they held
+  // it
+  pid_t pid;
+} lockedIndex;
+
+/* Take the write lock, unless we are in a forked child */
+static void lockedIndex_wrlock(lockedIndex *idx) {
+  if (getpid() == idx->pid) {
+    pthread_rwlock_wrlock(idx->lock);
+  }
+}
+
+static void lockedIndex_unlock(lockedIndex *idx) {
+  if (getpid() == idx->pid) {
+    pthread_rwlock_unlock(idx->lock);
+  }
+}
+
+/* Apply the buffered changes before a read on the writing thread. This waits
+ * for the readers on other threads, but only if changes were written while
+ * they ran */
+static void lockedIndex_sync(lockedIndex *idx) {
+  if (!idx->pending.ctx || !SIDeferredIndex_Pending(idx->pending.ctx)) {
+    return;
+  }
+  lockedIndex_wrlock(idx);
+  SIDeferredIndex_Flush(idx->pending.ctx);
+  lockedIndex_unlock(idx);
+}
+
+/* Readers on other threads hold the lock for as long as their scan runs.
+ * Rather than waiting for them, the changes are buffered, and applied by the
+ * next write or read that gets the lock */
+int lockedIndex_Apply(void *ctx, SIChangeSet cs) {
+  lockedIndex *idx = ctx;
+  if (!idx->pending.ctx || getpid() != idx->pid) {
+    lockedIndex_wrlock(idx);
+  } else if (pthread_rwlock_trywrlock(idx->lock)) {
+    return idx->pending.Apply(idx->pending.ctx, cs);
+  }
+
+  // the buffered changes come first. Their writers were already answered, and
+  // the flush frees the ids it rejects, so only the errors of cs are returned
+  if (idx->pending.ctx) {
+    SIDeferredIndex_Flush(idx->pending.ctx);
+  }
+  int rc = idx->inner.Apply(idx->inner.ctx, cs);
+  lockedIndex_unlock(idx);
+  return rc;
+}
+
+/* Reads on the writing thread never run alongside a write, so only readers
+ * on other threads need to take the lock */
+SICursor *lockedIndex_Find(void *ctx, SIQuery *q) {
+  lockedIndex *idx = ctx;
+  lockedIndex_sync(idx);
+  return idx->inner.Find(idx->inner.ctx, q);
+}
+
+void lockedIndex_Traverse(void *ctx, IndexVisitor cb, void *visitCtx) {
+  lockedIndex *idx = ctx;
+  lockedIndex_sync(idx);
+  idx->inner.Traverse(idx->inner.ctx, cb, visitCtx);
+}
+
+int lockedIndex_DeleteWhere(void *ctx, SIQuery *q, IndexVisitor cb,
+                            void *visitCtx, size_t *num, SIGarbage **garbage) {
+  lockedIndex *idx = ctx;
+  lockedIndex_wrlock(idx);
+  if (idx->pending.ctx) {
+    SIDeferredIndex_Flush(idx->pending.ctx);
+  }
+  int rc = idx->inner.DeleteWhere(idx->inner.ctx, q, cb, visitCtx, num, garbage);
+  lockedIndex_unlock(idx);
+  return rc;
+}
+
+size_t lockedIndex_Len(void *ctx) {
+  lockedIndex *idx = ctx;
+  lockedIndex_sync(idx);
+  return idx->inner.Len(idx->inner.ctx);
+}
+
+size_t lockedIndex_Estimate(void *ctx, struct SIQueryPlan *plan) {
+  lockedIndex *idx = ctx;
+  lockedIndex_sync(idx);
+  return idx->inner.Estimate(idx->inner.ctx, plan);
+}
+
+/* Freeing waits for the readers still scanning the index */
+void lockedIndex_Free(void *ctx) {
+  lockedIndex *idx = ctx;
+  lockedIndex_wrlock(idx);
+  // the deferred index owns the inner one
+  if (idx->pending.ctx) {
+    idx->pending.Free(idx->pending.ctx);
+  } else {
+    idx->inner.Free(idx->inner.ctx);
+  }
+  lockedIndex_unlock(idx);
+  free(idx);
+}
+
+void SILockedIndex_Sync(void *ctx) { lockedIndex_sync(ctx); }
+
+SIIndex SILockedIndex_Inner(void *ctx) { return ((lockedIndex *)ctx)->inner; }
+
+SIIndex SI_NewLockedIndex(SIIndex inner, SISpec *spec, pthread_rwlock_t *lock) {
+  lockedIndex *idx = malloc(sizeof(lockedIndex));
+  idx->inner = inner;
+  idx->lock = lock;
+  idx->pid = getpid();
+  idx->pending = spec->flags & SI_INDEX_UNIQUE
+                     ? (SIIndex){.ctx = NULL}
+                     : SI_NewDeferredIndex(inner, spec);
+
+  return (SIIndex){.ctx = idx,
+                   .Apply = lockedIndex_Apply,
+                   .Find = lockedIndex_Find,
+                   .Traverse = lockedIndex_Traverse,
+                   .DeleteWhere = lockedIndex_DeleteWhere,
+                   .Len = lockedIndex_Len,
+                   .Estimate = lockedIndex_Estimate,
+                   .Free = lockedIndex_Free};
+}
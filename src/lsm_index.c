@@ -0,0 +1,846 @@
+#include "index.h"
+#include "key.h"
+#include "skiplist/skiplist.h"
+#include "reverse_index.h"
+#include "query_plan.h"
+#include "top_k.h"
+#include <stdint.h>
+#include <sys/param.h>
+#include "rmutil/alloc.h"
+
+/* A memtable entry. Unlike the compound index, the memtable is ordered by key
+ * and id, so each node holds a single id */
+typedef struct {
+  SIMultiKey *key;
+  SIId id;
+} lsmEntry;
+
+/* An immutable run of entries sorted by key and id, packed in contiguous
+ * arrays. Deleted entries are not removed, but marked as dead until the
+ * segment is compacted. The segment owns the keys and ids of its entries */
+typedef struct {
+  SIMultiKey **keys;
+  SIId *ids;
+  // a bit per entry, set for deleted entries
+  u_int8_t *dead;
+  size_t len;
+  size_t cap;
+  size_t numDead;
+} lsmSegment;
+
+/* A compaction in progress, merging one or two adjacent segments into a new
+ * one without their dead entries. The source segments are still read until the
+ * merge is done */
+typedef struct {
+  lsmSegment *src[2];
+  size_t numSrc;
+  // the position of the next entry to merge in each source
+  size_t pos[2];
+  lsmSegment *out;
+  // the dead entries the merge skipped, freed once it is done
+  lsmSegment *dropped;
+} lsmMerge;
+
+typedef struct {
+  SISpec spec;
+  SIKeyCmpFunc *cmpFuncs;
+  u_int8_t numFuncs;
+  SICmpFuncVector cmpCtx;
+
+  skiplist *mem;
+  // the segments, from the oldest to the newest
+  lsmSegment **segs;
+  size_t numSegs;
+  lsmMerge *merge;
+
+  // the live key of each id
+  SIReverseIndex *ri;
+  size_t length;
+} lsmIndex;
+
+/* Compare two entries by key and then by id. A NULL id compares equal to all
+ * the ids, so a range bound matches all the ids of its key */
+static int lsm_cmp(lsmIndex *idx, SIMultiKey *k1, SIId id1, SIMultiKey *k2,
+                   SIId id2) {
+  int rc = SICmpMultiKey(k1, k2, &idx->cmpCtx);
+  if (rc != 0 || !id1 || !id2) {
+    return rc;
+  }
+  return strcmp(id1, id2);
+}
+
+int lsmEntry_cmp(void *p1, void *p2, void *ctx) {
+  lsmEntry *e1 = p1, *e2 = p2;
+  return lsm_cmp(ctx, e1->key, e1->id, e2->key, e2->id);
+}
+
+int lsm_cmpIds(void *p1, void *p2) { return strcmp(p1, p2); }
+
+/* Iterate all the memtable entries. The skiplist's own iterator starts at
+ * the header node, which holds no entry */
+skiplistIterator lsmIndex_iterateMem(lsmIndex *idx) {
+  skiplistIterator it = skiplistIterateAll(idx->mem);
+  it.current = idx->mem->header->level[0].forward;
+  return it;
+}
+
+lsmSegment *lsmSegment_New(size_t cap) {
+  lsmSegment *s = malloc(sizeof(lsmSegment));
+  s->keys = calloc(cap ? cap : 1, sizeof(SIMultiKey *));
+  s->ids = calloc(cap ? cap : 1, sizeof(SIId));
+  s->dead = calloc(cap / 8 + 1, 1);
+  s->len = 0;
+  s->cap = cap;
+  s->numDead = 0;
+  return s;
+}
+
+/* Free a segment's arrays, but not its entries */
+void lsmSegment_Free(lsmSegment *s) {
+  free(s->keys);
+  free(s->ids);
+  free(s->dead);
+  free(s);
+}
+
+/* Free the keys and ids of a segment's entries */
+void lsmSegment_FreeEntries(lsmSegment *s) {
+  for (size_t i = 0; i < s->len; i++) {
+    SIMultiKey_Free(s->keys[i]);
+    free(s->ids[i]);
+  }
+}
+
+void lsmSegment_Push(lsmSegment *s, SIMultiKey *key, SIId id) {
+  if (s->len == s->cap) {
+    size_t oldBytes = s->cap / 8 + 1;
+    s->cap = s->cap ? s->cap * 2 : 16;
+    s->keys = realloc(s->keys, s->cap * sizeof(SIMultiKey *));
+    s->ids = realloc(s->ids, s->cap * sizeof(SIId));
+    s->dead = realloc(s->dead, s->cap / 8 + 1);
+    memset(s->dead + oldBytes, 0, s->cap / 8 + 1 - oldBytes);
+  }
+  s->keys[s->len] = key;
+  s->ids[s->len++] = id;
+}
+
+static inline int lsmSegment_IsDead(lsmSegment *s, size_t i) {
+  return s->dead[i / 8] & (1 << (i % 8));
+}
+
+static inline void lsmSegment_MarkDead(lsmSegment *s, size_t i) {
+  s->dead[i / 8] |= 1 << (i % 8);
+  s->numDead++;
+}
+
+static inline size_t lsmSegment_Live(lsmSegment *s) {
+  return s->len - s->numDead;
+}
+
+/* Find the first entry of a segment not below a key and id, or above them if
+ * upper is set. The loop runs a fixed log2(len) iterations, and the comparison
+ * result moves the base arithmetically rather than through a branch */
+size_t lsmSegment_Bound(lsmIndex *idx, lsmSegment *s, SIMultiKey *key, SIId id,
+                        int upper) {
+  if (s->len == 0) {
+    return 0;
+  }
+  size_t base = 0, n = s->len;
+  while (n > 1) {
+    size_t half = n / 2;
+    int c = lsm_cmp(idx, s->keys[base + half], s->ids[base + half], key, id);
+    base += (upper ? c <= 0 : c < 0) * half;
+    n -= half;
+  }
+  int c = lsm_cmp(idx, s->keys[base], s->ids[base], key, id);
+  return base + (upper ? c <= 0 : c < 0);
+}
+
+/* Find the live entry of an id in a segment. Returns 0 if it is not there */
+int lsmSegment_Find(lsmIndex *idx, lsmSegment *s, SIMultiKey *key, SIId id,
+                    size_t *pos) {
+  for (size_t i = lsmSegment_Bound(idx, s, key, id, 0);
+       i < s->len && !lsm_cmp(idx, s->keys[i], s->ids[i], key, id); i++) {
+    if (!lsmSegment_IsDead(s, i)) {
+      *pos = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Start merging the newest pair of adjacent segments of similar sizes, or else
+ * rewriting a segment that is mostly dead. Merging only segments whose sizes
+ * are within a factor of 2 keeps the number of segments logarithmic */
+void lsmIndex_planMerge(lsmIndex *idx) {
+  lsmSegment *a = NULL, *b = NULL;
+  for (size_t i = idx->numSegs; i > 1; i--) {
+    if (lsmSegment_Live(idx->segs[i - 2]) <=
+        2 * lsmSegment_Live(idx->segs[i - 1])) {
+      a = idx->segs[i - 2];
+      b = idx->segs[i - 1];
+      break;
+    }
+  }
+  for (size_t i = 0; !a && i < idx->numSegs; i++) {
+    if (idx->segs[i]->numDead * 2 > idx->segs[i]->len) {
+      a = idx->segs[i];
+    }
+  }
+  if (!a) {
+    return;
+  }
+
+  lsmMerge *m = malloc(sizeof(lsmMerge));
+  m->src[0] = a;
+  m->src[1] = b;
+  m->numSrc = b ? 2 : 1;
+  m->pos[0] = m->pos[1] = 0;
+  m->out = lsmSegment_New(lsmSegment_Live(a) + (b ? lsmSegment_Live(b) : 0));
+  m->dropped = lsmSegment_New(0);
+  idx->merge = m;
+}
+
+/* Replace the merged segments with the merge output, unless nothing is left
+ * of them */
+void lsmIndex_finishMerge(lsmIndex *idx) {
+  lsmMerge *m = idx->merge;
+  for (size_t i = 0; i < idx->numSegs; i++) {
+    if (idx->segs[i] == m->src[0] && m->out->len) {
+      idx->segs[i] = m->out;
+    } else if (idx->segs[i] == m->src[0] || idx->segs[i] == m->src[1]) {
+      memmove(&idx->segs[i], &idx->segs[i + 1],
+              (idx->numSegs - i - 1) * sizeof(lsmSegment *));
+      idx->numSegs--;
+      i--;
+    }
+  }
+  for (size_t i = 0; i < m->numSrc; i++) {
+    lsmSegment_Free(m->src[i]);
+  }
+  if (!m->out->len) {
+    lsmSegment_Free(m->out);
+  }
+  lsmSegment_FreeEntries(m->dropped);
+  lsmSegment_Free(m->dropped);
+  free(m);
+  idx->merge = NULL;
+}
+
+int SILSMIndex_Compact(void *ctx, size_t steps) {
+  lsmIndex *idx = ctx;
+  while (idx->merge && steps > 0) {
+    lsmMerge *m = idx->merge;
+    int pick = -1;
+    for (size_t s = 0; s < m->numSrc; s++) {
+      lsmSegment *src = m->src[s];
+      while (m->pos[s] < src->len && lsmSegment_IsDead(src, m->pos[s])) {
+        lsmSegment_Push(m->dropped, src->keys[m->pos[s]], src->ids[m->pos[s]]);
+        m->pos[s]++;
+      }
+      if (m->pos[s] < src->len &&
+          (pick < 0 ||
+           lsm_cmp(idx, src->keys[m->pos[s]], src->ids[m->pos[s]],
+                   m->src[pick]->keys[m->pos[pick]],
+                   m->src[pick]->ids[m->pos[pick]]) < 0)) {
+        pick = s;
+      }
+    }
+
+    if (pick < 0) {
+      lsmIndex_finishMerge(idx);
+      lsmIndex_planMerge(idx);
+      continue;
+    }
+    lsmSegment *src = m->src[pick];
+    m->out->keys[m->out->len] = src->keys[m->pos[pick]];
+    m->out->ids[m->out->len++] = src->ids[m->pos[pick]];
+    m->pos[pick]++;
+    steps--;
+  }
+  return idx->merge == NULL;
+}
+
+void SILSMIndex_Freeze(void *ctx) {
+  lsmIndex *idx = ctx;
+  if (!skiplistLength(idx->mem)) {
+    return;
+  }
+
+  lsmSegment *s = lsmSegment_New(skiplistLength(idx->mem));
+  skiplistIterator it = lsmIndex_iterateMem(idx);
+  skiplistNode *n;
+  while (NULL != (n = skiplistIteratorCurrent(&it))) {
+    lsmEntry *e = n->obj;
+    s->keys[s->len] = e->key;
+    s->ids[s->len++] = e->id;
+    free(e);
+    skiplistIterator_Next(&it);
+  }
+  skiplistFree(idx->mem);
+  idx->mem = skiplistCreate(lsmEntry_cmp, idx, lsm_cmpIds);
+
+  idx->segs = realloc(idx->segs, (idx->numSegs + 1) * sizeof(lsmSegment *));
+  idx->segs[idx->numSegs++] = s;
+  if (!idx->merge) {
+    lsmIndex_planMerge(idx);
+  }
+}
+
+size_t SILSMIndex_NumSegments(void *ctx) { return ((lsmIndex *)ctx)->numSegs; }
+
+/* Remove the live entry of an id, whose reverse index record was already
+ * deleted. Memtable entries are freed, or put in the garbage list if there is
+ * one, while segment entries are just marked as dead */
+void lsmIndex_unlink(lsmIndex *idx, SIMultiKey *key, SIId id, SIGarbage *g) {
+  lsmEntry probe = {.key = key, .id = id};
+  skiplistNode *n = skiplistFind(idx->mem, &probe);
+  if (n) {
+    lsmEntry *e = n->obj;
+    skiplistDelete(idx->mem, e, e->id);
+    if (g) {
+      SIGarbage_AddKey(g, e->key);
+      SIGarbage_AddId(g, e->id);
+    } else {
+      SIMultiKey_Free(e->key);
+      free(e->id);
+    }
+    free(e);
+    return;
+  }
+
+  // the newest segments are the likeliest to hold recently written ids
+  for (size_t i = idx->numSegs; i > 0; i--) {
+    lsmSegment *s = idx->segs[i - 1];
+    size_t pos;
+    if (!lsmSegment_Find(idx, s, key, id, &pos)) {
+      continue;
+    }
+    lsmSegment_MarkDead(s, pos);
+
+    // the entry may already be merged, in which case the copy is dead too
+    lsmMerge *m = idx->merge;
+    for (size_t j = 0; m && j < m->numSrc; j++) {
+      if (m->src[j] == s && pos < m->pos[j] &&
+          lsmSegment_Find(idx, m->out, key, id, &pos)) {
+        lsmSegment_MarkDead(m->out, pos);
+      }
+    }
+    return;
+  }
+}
+
+int lsmIndex_applyDel(lsmIndex *idx, SIChange ch) {
+  khiter_t k = kh_get(khSIId, idx->ri, ch.id);
+  if (k == kh_end(idx->ri)) {
+    return SI_INDEX_NOTFOUND;
+  }
+  SIMultiKey *key = kh_value(idx->ri, k);
+  SIId id = (SIId)kh_key(idx->ri, k);
+  kh_del(khSIId, idx->ri, k);
+  lsmIndex_unlink(idx, key, id, NULL);
+  --idx->length;
+  return SI_INDEX_OK;
+}
+
+int lsmIndex_applyAdd(lsmIndex *idx, SIChange ch) {
+  SIMultiKey *key = SI_NewMultiKey(ch.v.vals, ch.v.len);
+
+  khiter_t k = kh_get(khSIId, idx->ri, ch.id);
+  if (k != kh_end(idx->ri)) {
+    SIMultiKey *oldkey = kh_value(idx->ri, k);
+    SIId oldid = (SIId)kh_key(idx->ri, k);
+    if (SIMultiKey_Identical(oldkey, key)) {
+      SIMultiKey_Free(key);
+      if (oldid != ch.id) {
+        free(ch.id);
+      }
+      return SI_INDEX_OK;
+    }
+    kh_del(khSIId, idx->ri, k);
+    lsmIndex_unlink(idx, oldkey, oldid, NULL);
+    --idx->length;
+  }
+
+  lsmEntry *e = malloc(sizeof(lsmEntry));
+  e->key = key;
+  e->id = ch.id;
+  skiplistInsert(idx->mem, e, ch.id);
+  SIReverseIndex_Insert(idx->ri, ch.id, key);
+  ++idx->length;
+
+  if (skiplistLength(idx->mem) >= SI_LSM_MEMTABLE_SIZE) {
+    SILSMIndex_Freeze(idx);
+  }
+  return SI_INDEX_OK;
+}
+
+int lsmIndex_Apply(void *ctx, SIChangeSet cs) {
+  lsmIndex *idx = ctx;
+
+  for (size_t i = 0; i < cs.numChanges; i++) {
+    int rc = SI_INDEX_ERROR;
+    if (cs.changes[i].type == SI_CHADD) {
+      if (cs.changes[i].v.len != idx->numFuncs) {
+        return SI_INDEX_ERROR;
+      }
+      rc = lsmIndex_applyAdd(idx, cs.changes[i]);
+    } else if (cs.changes[i].type == SI_CHDEL) {
+      rc = lsmIndex_applyDel(idx, cs.changes[i]);
+    }
+    if (rc != SI_INDEX_OK && rc != SI_INDEX_NOTFOUND) {
+      return rc;
+    }
+  }
+
+  // compaction keeps up with the writes, a few entries per written id
+  SILSMIndex_Compact(idx, cs.numChanges * SI_LSM_COMPACT_STEP);
+  return SI_INDEX_OK;
+}
+
+size_t lsmIndex_Len(void *ctx) { return ((lsmIndex *)ctx)->length; }
+
+/* Count the entries of each range in the memtable and the segments. The dead
+ * entries of the segments are counted too */
+size_t lsmIndex_Estimate(void *ctx, SIQueryPlan *plan) {
+  lsmIndex *idx = ctx;
+  size_t total = 0;
+  siPlanRangeIterator it = SIQueryPlan_IterateRanges(plan);
+  siPlanRange *r;
+  while (NULL != (r = siPlanRangeIterator_Next(&it))) {
+    lsmEntry min = {.key = r->min, .id = NULL};
+    lsmEntry max = {.key = r->max, .id = NULL};
+    unsigned long lo = skiplistRankAtLeast(idx->mem, &min, r->minExclusive);
+    unsigned long hi = skiplistRankAtLeast(idx->mem, &max, !r->maxExclusive);
+    total += hi > lo ? hi - lo : 0;
+    for (size_t i = 0; i < idx->numSegs; i++) {
+      lsmSegment *s = idx->segs[i];
+      size_t pos = lsmSegment_Bound(idx, s, r->min, NULL, r->minExclusive);
+      size_t end = lsmSegment_Bound(idx, s, r->max, NULL, !r->maxExclusive);
+      total += end > pos ? end - pos : 0;
+    }
+  }
+  siPlanRangeIterator_Free(&it);
+  return total;
+}
+
+/* A merging scan over the memtable and the segments */
+typedef struct {
+  SIQueryPlan *plan;
+  lsmIndex *idx;
+  siPlanRangeIterator ranges;
+  // the current scan range, NULL if we're done
+  siPlanRange *currentRange;
+  int reverse;
+
+  // the range bounds, as memtable entries
+  lsmEntry min;
+  lsmEntry max;
+  skiplistIterator it;
+  // the range of each segment, as positions [pos, end). Reverse scans move
+  // end down rather than pos up
+  size_t *pos;
+  size_t *end;
+  // the source of the current entry, -1 for the memtable
+  int src;
+
+  size_t skip;
+  size_t left;
+
+  SIMultiKey *lastKey;
+} lsmScanCtx;
+
+/* Position each source on a range. A NULL range scans everything */
+void lsmScan_Open(lsmScanCtx *sc, siPlanRange *r) {
+  lsmIndex *idx = sc->idx;
+  if (!r) {
+    sc->it = lsmIndex_iterateMem(idx);
+    for (size_t i = 0; i < idx->numSegs; i++) {
+      sc->pos[i] = 0;
+      sc->end[i] = idx->segs[i]->len;
+    }
+    return;
+  }
+
+  sc->min = (lsmEntry){.key = r->min, .id = NULL};
+  sc->max = (lsmEntry){.key = r->max, .id = NULL};
+  sc->it = sc->reverse
+               ? skiplistIterateRangeReverse(idx->mem, &sc->min, &sc->max,
+                                             r->minExclusive, r->maxExclusive)
+               : skiplistIterateRange(idx->mem, &sc->min, &sc->max,
+                                      r->minExclusive, r->maxExclusive);
+  for (size_t i = 0; i < idx->numSegs; i++) {
+    lsmSegment *s = idx->segs[i];
+    sc->pos[i] = lsmSegment_Bound(idx, s, r->min, NULL, r->minExclusive);
+    sc->end[i] = lsmSegment_Bound(idx, s, r->max, NULL, !r->maxExclusive);
+  }
+}
+
+/* Move the scan to the plan's next range. Returns 0 if there are no more
+ * ranges to scan */
+int lsmScan_NextRange(lsmScanCtx *sc) {
+  sc->currentRange = siPlanRangeIterator_Next(&sc->ranges);
+  if (!sc->currentRange) {
+    return 0;
+  }
+  lsmScan_Open(sc, sc->currentRange);
+  return 1;
+}
+
+/* Get the next entry of the current range in scan order, without consuming
+ * it. Returns NULL once the range is done */
+SIId lsmScan_Peek(lsmScanCtx *sc, SIMultiKey **key) {
+  lsmIndex *idx = sc->idx;
+  SIMultiKey *bestKey = NULL;
+  SIId best = NULL;
+  sc->src = -2;
+
+  skiplistNode *n = skiplistIteratorCurrent(&sc->it);
+  if (n) {
+    lsmEntry *e = n->obj;
+    bestKey = e->key;
+    best = e->id;
+    sc->src = -1;
+  }
+
+  for (size_t i = 0; i < idx->numSegs; i++) {
+    lsmSegment *s = idx->segs[i];
+    size_t p;
+    if (sc->reverse) {
+      while (sc->end[i] > sc->pos[i] && lsmSegment_IsDead(s, sc->end[i] - 1)) {
+        sc->end[i]--;
+      }
+      if (sc->end[i] == sc->pos[i]) {
+        continue;
+      }
+      p = sc->end[i] - 1;
+    } else {
+      while (sc->pos[i] < sc->end[i] && lsmSegment_IsDead(s, sc->pos[i])) {
+        sc->pos[i]++;
+      }
+      if (sc->pos[i] == sc->end[i]) {
+        continue;
+      }
+      p = sc->pos[i];
+    }
+
+    int c = best ? lsm_cmp(idx, s->keys[p], s->ids[p], bestKey, best) : 0;
+    if (!best || (sc->reverse ? c > 0 : c < 0)) {
+      bestKey = s->keys[p];
+      best = s->ids[p];
+      sc->src = i;
+    }
+  }
+
+  *key = bestKey;
+  return best;
+}
+
+/* Consume the entry the last peek returned */
+void lsmScan_Advance(lsmScanCtx *sc) {
+  if (sc->src == -1) {
+    skiplistIterator_Next(&sc->it);
+  } else if (sc->src >= 0) {
+    if (sc->reverse) {
+      sc->end[sc->src]--;
+    } else {
+      sc->pos[sc->src]++;
+    }
+  }
+}
+
+lsmScanCtx *lsmScan_New(lsmIndex *idx, SIQueryPlan *plan) {
+  lsmScanCtx *sc = calloc(1, sizeof(lsmScanCtx));
+  sc->idx = idx;
+  sc->plan = plan;
+  sc->reverse = plan ? plan->reverse : 0;
+  sc->pos = calloc(idx->numSegs + 1, sizeof(size_t));
+  sc->end = calloc(idx->numSegs + 1, sizeof(size_t));
+  sc->left = SIZE_MAX;
+  return sc;
+}
+
+SIId lsmScan_next(void *ctx) {
+  lsmScanCtx *sc = ctx;
+  if (sc->left == 0) {
+    return NULL;
+  }
+
+  while (sc->currentRange) {
+    SIMultiKey *mk;
+    SIId id;
+    while (NULL != (id = lsmScan_Peek(sc, &mk))) {
+      lsmScan_Advance(sc);
+      if (sc->plan->filter && !SIFilter_Eval(sc->plan->filter, mk)) {
+        continue;
+      }
+      if (sc->skip > 0) {
+        sc->skip--;
+        continue;
+      }
+      sc->left--;
+      sc->lastKey = mk;
+      return id;
+    }
+    lsmScan_NextRange(sc);
+  }
+  return NULL;
+}
+
+void *lsmScan_currentKey(void *ctx) { return ((lsmScanCtx *)ctx)->lastKey; }
+
+void lsmScan_free(void *ctx) {
+  lsmScanCtx *sc = ctx;
+  if (sc->plan) {
+    siPlanRangeIterator_Free(&sc->ranges);
+    SIQueryPlan_Free(sc->plan);
+  }
+  free(sc->pos);
+  free(sc->end);
+  free(sc);
+}
+
+/* A cursor over the sorted ids of a query the index order can't satisfy */
+typedef struct {
+  SIId *ids;
+  SIMultiKey **keys;
+  size_t num;
+  size_t pos;
+  // set if the cursor owns copies of the ids and keys
+  int owned;
+} lsmSortedCtx;
+
+SIId lsmSorted_next(void *ctx) {
+  lsmSortedCtx *sc = ctx;
+  return sc->pos < sc->num ? sc->ids[sc->pos++] : NULL;
+}
+
+void *lsmSorted_currentKey(void *ctx) {
+  lsmSortedCtx *sc = ctx;
+  return sc->pos > 0 ? sc->keys[sc->pos - 1] : NULL;
+}
+
+void lsmSorted_free(void *ctx) {
+  lsmSortedCtx *sc = ctx;
+  for (size_t i = 0; sc->owned && i < sc->num; i++) {
+    free(sc->ids[i]);
+    SIMultiKey_Free(sc->keys[i]);
+  }
+  free(sc->ids);
+  free(sc->keys);
+  free(sc);
+}
+
+/* Run the scan to its end, keeping only the first offset+num ids in the
+ * query's order. If each range is scanned in order, we skip to the next range
+ * as soon as a scanned id can no longer make it into the results */
+lsmSortedCtx *lsmScan_Sort(lsmScanCtx *sc, SIQuery *q) {
+  SITopK *tk = SI_NewTopK(q->num ? q->offset + q->num : 0, q->orderBy,
+                          q->numOrderBy, sc->idx->cmpFuncs, q->orderDesc);
+  int rangeOrdered = sc->plan->order == PLAN_ORDER_RANGE;
+
+  while (sc->currentRange) {
+    SIMultiKey *mk;
+    SIId id;
+    while (NULL != (id = lsmScan_Peek(sc, &mk))) {
+      lsmScan_Advance(sc);
+      if (sc->plan->filter && !SIFilter_Eval(sc->plan->filter, mk)) {
+        continue;
+      }
+      if (!SITopK_Push(tk, mk, id) && rangeOrdered) {
+        break;
+      }
+    }
+    lsmScan_NextRange(sc);
+  }
+
+  lsmSortedCtx *ret = malloc(sizeof(lsmSortedCtx));
+  ret->ids = SITopK_Drain(tk, &ret->num, &ret->keys);
+  ret->pos = MIN(q->offset, ret->num);
+  ret->owned = 0;
+  SITopK_Free(tk);
+  return ret;
+}
+
+/* Open a cursor executing a query plan. The cursor owns the plan */
+SICursor *lsmIndex_planCursor(lsmIndex *idx, SIQueryPlan *plan, SIQuery *q) {
+  SICursor *c = SI_NewCursor(NULL);
+  lsmScanCtx *sc = lsmScan_New(idx, plan);
+  sc->skip = q->offset;
+  sc->left = q->num ? q->num : SIZE_MAX;
+  sc->ranges = SIQueryPlan_IterateRanges(plan);
+  lsmScan_NextRange(sc);
+
+  if (plan->order == PLAN_ORDER_RANGE || plan->order == PLAN_ORDER_SORT) {
+    c->ctx = lsmScan_Sort(sc, q);
+    c->Next = lsmSorted_next;
+    c->CurrentKey = lsmSorted_currentKey;
+    c->Release = lsmSorted_free;
+    lsmScan_free(sc);
+    return c;
+  }
+
+  c->ctx = sc;
+  c->Next = lsmScan_next;
+  c->CurrentKey = lsmScan_currentKey;
+  c->Release = lsmScan_free;
+  return c;
+}
+
+/* Drain a cursor into copies of its ids and keys. Writes move entries between
+ * the memtable and the segments, so snapshots of the index are copied out
+ * rather than versioned */
+SICursor *lsmIndex_snapshot(SICursor *c) {
+  lsmSortedCtx *sc = calloc(1, sizeof(lsmSortedCtx));
+  sc->owned = 1;
+  size_t cap = 0;
+  SIId id;
+  while (NULL != (id = c->Next(c->ctx))) {
+    if (sc->num == cap) {
+      cap = cap ? cap * 2 : 16;
+      sc->ids = realloc(sc->ids, cap * sizeof(SIId));
+      sc->keys = realloc(sc->keys, cap * sizeof(SIMultiKey *));
+    }
+    SIMultiKey *mk = c->CurrentKey(c->ctx);
+    sc->ids[sc->num] = strdup(id);
+    sc->keys[sc->num++] = SI_NewMultiKey(mk->keys, mk->size);
+  }
+  SICursor_Free(c);
+
+  SICursor *ret = SI_NewCursor(sc);
+  ret->Next = lsmSorted_next;
+  ret->CurrentKey = lsmSorted_currentKey;
+  ret->Release = lsmSorted_free;
+  return ret;
+}
+
+SICursor *lsmIndex_Find(void *ctx, SIQuery *q) {
+  lsmIndex *idx = ctx;
+  SIQueryPlan *plan = NULL;
+  if (q->numPredicates == 0 ||
+      NULL == (plan = SI_BuildQueryPlan(q, &idx->spec))) {
+    SICursor *c = SI_NewCursor(NULL);
+    c->error = SI_CURSOR_ERROR;
+    return c;
+  }
+  SICursor *c = lsmIndex_planCursor(idx, plan, q);
+  return q->snapshot ? lsmIndex_snapshot(c) : c;
+}
+
+/* Deleted segment entries stay in place as dead entries, so only the deleted
+ * memtable entries end up in the garbage list */
+int lsmIndex_DeleteWhere(void *ctx, SIQuery *q, IndexVisitor cb,
+                         void *visitCtx, size_t *num, SIGarbage **garbage) {
+  lsmIndex *idx = ctx;
+  *num = 0;
+  *garbage = NULL;
+  SIQueryPlan *plan = NULL;
+  if (q->numPredicates == 0 ||
+      NULL == (plan = SI_BuildQueryPlan(q, &idx->spec))) {
+    return SI_INDEX_ERROR;
+  }
+
+  // the matching ids are collected first, since the scan can't run over
+  // changing segments
+  SIId *ids = NULL;
+  size_t cap = 0;
+  SICursor *c = lsmIndex_planCursor(idx, plan, q);
+  SIId id;
+  while (c->error == SI_CURSOR_OK && NULL != (id = c->Next(c->ctx))) {
+    if (*num == cap) {
+      cap = cap ? cap * 2 : 16;
+      ids = realloc(ids, cap * sizeof(SIId));
+    }
+    ids[(*num)++] = id;
+  }
+  SICursor_Free(c);
+
+  SIGarbage *g = SI_NewGarbage();
+  for (size_t i = 0; i < *num; i++) {
+    khiter_t k = kh_get(khSIId, idx->ri, ids[i]);
+    SIMultiKey *key = kh_value(idx->ri, k);
+    if (cb) {
+      cb(ids[i], key, visitCtx);
+    }
+    kh_del(khSIId, idx->ri, k);
+    lsmIndex_unlink(idx, key, ids[i], g);
+  }
+  free(ids);
+  idx->length -= *num;
+
+  SILSMIndex_Compact(idx, *num * SI_LSM_COMPACT_STEP);
+  *garbage = g;
+  return SI_INDEX_OK;
+}
+
+void lsmIndex_Traverse(void *ctx, IndexVisitor cb, void *visitCtx) {
+  lsmIndex *idx = ctx;
+  lsmScanCtx *sc = lsmScan_New(idx, NULL);
+  lsmScan_Open(sc, NULL);
+
+  SIMultiKey *mk;
+  SIId id;
+  while (NULL != (id = lsmScan_Peek(sc, &mk))) {
+    lsmScan_Advance(sc);
+    cb(id, mk, visitCtx);
+  }
+  lsmScan_free(sc);
+}
+
+void lsmIndex_Free(void *ctx) {
+  lsmIndex *idx = ctx;
+
+  skiplistIterator it = lsmIndex_iterateMem(idx);
+  skiplistNode *n;
+  while (NULL != (n = skiplistIteratorCurrent(&it))) {
+    lsmEntry *e = n->obj;
+    SIMultiKey_Free(e->key);
+    free(e->id);
+    free(e);
+    skiplistIterator_Next(&it);
+  }
+  skiplistFree(idx->mem);
+
+  // each entry, live or dead, is owned by exactly one segment. The merge
+  // output and dropped list only refer to entries of the merged segments
+  for (size_t i = 0; i < idx->numSegs; i++) {
+    lsmSegment_FreeEntries(idx->segs[i]);
+    lsmSegment_Free(idx->segs[i]);
+  }
+  if (idx->merge) {
+    lsmSegment_Free(idx->merge->out);
+    lsmSegment_Free(idx->merge->dropped);
+    free(idx->merge);
+  }
+  free(idx->segs);
+  SIReverseIndex_Free(idx->ri);
+  free(idx->cmpFuncs);
+  free(idx);
+}
+
+SIIndex SI_NewLSMIndex(SISpec spec) {
+  lsmIndex *idx = malloc(sizeof(lsmIndex));
+  idx->spec = spec;
+  idx->numFuncs = spec.numProps;
+  idx->cmpFuncs = calloc(spec.numProps, sizeof(SIKeyCmpFunc));
+  for (u_int8_t i = 0; i < spec.numProps; i++) {
+    idx->cmpFuncs[i] = SI_KeyCmpFunc(spec.properties[i].type);
+  }
+  idx->cmpCtx = (SICmpFuncVector){.cmpFuncs = idx->cmpFuncs,
+                                  .numFuncs = idx->numFuncs};
+  idx->mem = skiplistCreate(lsmEntry_cmp, idx, lsm_cmpIds);
+  idx->segs = NULL;
+  idx->numSegs = 0;
+  idx->merge = NULL;
+  idx->ri = SI_NewReverseIndex();
+  idx->length = 0;
+
+  return (SIIndex){.ctx = idx,
+                   .Apply = lsmIndex_Apply,
+                   .Find = lsmIndex_Find,
+                   .Traverse = lsmIndex_Traverse,
+                   .DeleteWhere = lsmIndex_DeleteWhere,
+                   .Len = lsmIndex_Len,
+                   .Estimate = lsmIndex_Estimate,
+                   .Free = lsmIndex_Free};
+}
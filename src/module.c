@@ -1,8 +1,17 @@
+#include <strings.h>
+#include <sys/param.h>
 #include "index_type.h"
 #include "redismodule.h"
 #include "rmutil/util.h"
-#include "rmutil/alloc.h"
 #include "hash_index.h"
+#include "hash_tracking.h"
+#include "hash_build.h"
+#include "select_thread.h"
+#include "index_pool.h"
+#include "key.h"
+#include "query_plan.h"
+#include "parser/lexer.h"
+#include "rmutil/alloc.h"
 /*
 * IDX.CREATE <index_name> {options} SCHEMA
 * [[STRING|INT32|INT64|UINT|BOOL|FLOAT|DOUBLE|TIME] ...]
@@ -20,6 +29,44 @@ int CreateIndexCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
     return RedisModule_ReplyWithError(ctx, "Invalid schema");
   }
 
+  // options must come before the schema, which may have properties named like
+  // them
+  int schemaPos = RMUtil_ArgExists("SCHEMA", argv, argc, 2);
+  RedisModuleString *prefix = NULL;
+  RMUtil_ParseArgsAfter("PREFIX", argv, schemaPos, "s", &prefix);
+  int build = RMUtil_ArgExists("BUILD", argv, schemaPos, 2);
+  // unique violations are only found when the changes are flushed, too late
+  // to fail the write
+  if ((spec.flags & SI_INDEX_DEFERRED) && (spec.flags & SI_INDEX_UNIQUE)) {
+    SISpec_Free(&spec);
+    return RedisModule_ReplyWithError(
+        ctx, "DEFERRED cannot be used with UNIQUE indexes");
+  }
+  if ((spec.flags & SI_INDEX_LSM) &&
+      (spec.flags & (SI_INDEX_UNIQUE | SI_INDEX_PARTITIONED))) {
+    SISpec_Free(&spec);
+    return RedisModule_ReplyWithError(
+        ctx, "LSM cannot be used with UNIQUE or PARTITION indexes");
+  }
+  if ((spec.flags & SI_INDEX_CONCURRENT) &&
+      (spec.flags & (SI_INDEX_LSM | SI_INDEX_PARTITIONED))) {
+    SISpec_Free(&spec);
+    return RedisModule_ReplyWithError(
+        ctx, "CONCURRENT cannot be used with LSM or PARTITION indexes");
+  }
+  if (prefix || build) {
+    const char *err = NULL;
+    if (kind != SI_HashIndex) {
+      err = "PREFIX and BUILD are only supported for hash indexes";
+    } else if (!HashTracking_Supported()) {
+      err = "PREFIX and BUILD are not supported by this server";
+    }
+    if (err) {
+      SISpec_Free(&spec);
+      return RedisModule_ReplyWithError(ctx, err);
+    }
+  }
+
   // Open the index key
   RedisModuleKey *key =
       RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
@@ -29,7 +76,15 @@ int CreateIndexCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
   }
 
   RedisIndex *idx = NewRedisIndex(kind, 0, spec);
+  idx->db = RedisModule_GetSelectedDb(ctx);
+  if (prefix) {
+    idx->prefix = strdup(RedisModule_StringPtrLen(prefix, NULL));
+    HashTracking_Register(idx);
+  }
   RedisModule_ModuleTypeSetValue(key, IndexType, idx);
+  if (build) {
+    HashBuild_Start(ctx, idx);
+  }
 
   return RedisModule_ReplyWithSimpleString(ctx, "OK");
 }
@@ -83,6 +138,7 @@ int IndexAddCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     SIValueVector_Free(&vals);
     return RedisModule_ReplyWithError(ctx, "Could not apply change to index");
   }
+  RedisIndex_ScheduleFlush(ctx, idx);
 
   SIValueVector_Free(&vals);
   return RedisModule_ReplyWithSimpleString(ctx, "OK");
@@ -116,6 +172,7 @@ int IndexDelCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     SIChangeSet_Free(&cs);
     return RedisModule_ReplyWithError(ctx, "Could not apply change to index");
   }
+  RedisIndex_ScheduleFlush(ctx, idx);
 
   SIChangeSet_Free(&cs);
   return RedisModule_ReplyWithSimpleString(ctx, "OK");
@@ -146,7 +203,348 @@ int IndexCardinalityCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
   return RedisModule_ReplyWithLongLong(ctx, idx->idx.Len(idx->idx.ctx));
 }
 
+/* IDX.REBUILD <index_name>
+ * Rebuild a hash index from the keys of the database in the background */
+int IndexRebuildCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                        int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 2)
+    return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+      RedisModule_ModuleTypeGetType(key) != IndexType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  RedisIndex *idx = RedisModule_ModuleTypeGetValue(key);
+  if (idx->kind != SI_HashIndex) {
+    return RedisModule_ReplyWithError(
+        ctx, "Only hash indexes can be rebuilt from the database");
+  }
+  if (idx->build) {
+    return RedisModule_ReplyWithError(ctx, "Index is already being built");
+  }
+  if (HashBuild_Start(ctx, idx) != REDISMODULE_OK) {
+    return RedisModule_ReplyWithError(
+        ctx, "Index builds are not supported by this server");
+  }
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
+/* IDX.INFO <index_name>
+ * Reply with the index's properties and the progress of its build */
+int IndexInfoCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 2)
+    return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+      RedisModule_ModuleTypeGetType(key) != IndexType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+
+  RedisIndex *idx = RedisModule_ModuleTypeGetValue(key);
+  RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+  int num = 8;
+
+  RedisModule_ReplyWithSimpleString(ctx, "type");
+  RedisModule_ReplyWithSimpleString(
+      ctx, idx->kind == SI_HashIndex ? "hash" : "raw");
+  RedisModule_ReplyWithSimpleString(ctx, "prefix");
+  if (idx->prefix) {
+    RedisModule_ReplyWithStringBuffer(ctx, idx->prefix, strlen(idx->prefix));
+  } else {
+    RedisModule_ReplyWithNull(ctx);
+  }
+  RedisModule_ReplyWithSimpleString(ctx, "cardinality");
+  RedisModule_ReplyWithLongLong(ctx, idx->idx.Len(idx->idx.ctx));
+  RedisModule_ReplyWithSimpleString(ctx, "building");
+  RedisModule_ReplyWithLongLong(ctx, idx->build != NULL);
+  if (idx->build) {
+    num += HashBuild_ReplyProgress(ctx, idx->build);
+  }
+  if (idx->results) {
+    RedisModule_ReplyWithSimpleString(ctx, "cached_results");
+    RedisModule_ReplyWithLongLong(ctx, SIResultCache_Len(idx->results));
+    RedisModule_ReplyWithSimpleString(ctx, "cached_results_memory");
+    RedisModule_ReplyWithLongLong(ctx, SIResultCache_Memory(idx->results));
+    num += 4;
+  }
+
+  RedisModule_ReplySetArrayLength(ctx, num);
+  return REDISMODULE_OK;
+}
+
 /* IDX.SELECT <index_name> WHERE <predicates> [LIMIT offset num] */
+/* Return the position of the query option clause that follows pos, or argc if
+ * it's the last clause */
+int nextQueryClause(RedisModuleString **argv, int argc, int pos) {
+  static const char *clauses[] = {"ORDER", "LIMIT", "RETURN", NULL};
+  int next = argc;
+  for (int i = 0; clauses[i]; i++) {
+    int p = RMUtil_ArgExists(clauses[i], argv, argc, pos + 1);
+    if (p && p < next) {
+      next = p;
+    }
+  }
+  return next;
+}
+
+/* Parse the ORDER BY and LIMIT options that follow the WHERE clause of a
+ * query, starting at argv[offset]. Returns an error message if they are
+ * invalid, or NULL if they were parsed */
+const char *parseQueryOptions(RedisModuleString **argv, int argc, int offset,
+                              SIQuery *q, SISpec *spec) {
+  int limitPos = RMUtil_ArgExists("LIMIT", argv, argc, offset);
+  int orderPos = RMUtil_ArgExists("ORDER", argv, argc, offset);
+
+  if (orderPos) {
+    int end = nextQueryClause(argv, argc, orderPos);
+    if (orderPos + 1 >= end ||
+        strcasecmp(RedisModule_StringPtrLen(argv[orderPos + 1], NULL), "BY")) {
+      return "Invalid ORDER BY clause";
+    }
+    for (int i = orderPos + 2; i < end; i++) {
+      const char *arg = RedisModule_StringPtrLen(argv[i], NULL);
+      if (!strcasecmp(arg, "ASC") || !strcasecmp(arg, "DESC")) {
+        // the direction must be the last token of the clause
+        if (i != end - 1) {
+          return "Invalid ORDER BY clause";
+        }
+        q->orderDesc = !strcasecmp(arg, "DESC");
+        break;
+      }
+      if (!SIQuery_AddOrderBy(q, arg, spec)) {
+        return "Invalid ORDER BY property";
+      }
+    }
+    if (!q->numOrderBy) {
+      return "Invalid ORDER BY clause";
+    }
+  }
+
+  if (limitPos) {
+    long long offset = 0, num = 0;
+    if (nextQueryClause(argv, argc, limitPos) != limitPos + 3 ||
+        RMUtil_ParseArgs(argv, argc, limitPos + 1, "ll", &offset, &num) ==
+            REDISMODULE_ERR ||
+        offset < 0 || num <= 0) {
+      return "Invalid LIMIT";
+    }
+    q->offset = offset;
+    q->num = num;
+  }
+  return NULL;
+}
+
+/* Parse the RETURN clause of IDX.SELECT into the list of property ids to
+ * return. Returns the number of properties, 0 if there is no RETURN clause, or
+ * -1 if it's invalid */
+int parseReturnClause(RedisModuleString **argv, int argc, int offset,
+                      SISpec *spec, int *props) {
+  int pos = RMUtil_ArgExists("RETURN", argv, argc, offset);
+  if (!pos) {
+    return 0;
+  }
+  int end = nextQueryClause(argv, argc, pos);
+  if (end == pos + 2 &&
+      !strcasecmp(RedisModule_StringPtrLen(argv[pos + 1], NULL), "ALL")) {
+    for (int i = 0; i < spec->numProps; i++) {
+      props[i] = i;
+    }
+    return spec->numProps;
+  }
+
+  int n = 0;
+  for (int i = pos + 1; i < end; i++) {
+    if ((props[n++] = SISpec_PropertyId(
+             spec, RedisModule_StringPtrLen(argv[i], NULL))) < 0) {
+      return -1;
+    }
+  }
+  return n ? n : -1;
+}
+
+/* Reply with an index key value the way a hash field would hold it */
+void replyWithValue(RedisModuleCtx *ctx, SIValue *v) {
+  char buf[SI_VALUE_FORMAT_MAX];
+  switch (v->type) {
+  case T_STRING:
+    RedisModule_ReplyWithStringBuffer(ctx, v->stringval.str, v->stringval.len);
+    break;
+  case T_NULL:
+    RedisModule_ReplyWithNull(ctx);
+    break;
+  default:
+    RedisModule_ReplyWithStringBuffer(ctx, buf, SIValue_Format(v, buf));
+  }
+}
+
+/* Reply to an IDX.SELECT that ran on a thread, with the ids and keys it
+ * copied */
+int selectThreadReply(RedisModuleCtx *ctx, RedisModuleString **argv,
+                      int argc) {
+  SelectJob *j = RedisModule_GetBlockedClientPrivateData(ctx);
+  if (j->error) {
+    return RedisModule_ReplyWithError(ctx, "Error performing query");
+  }
+  // the results are only cached if the index didn't change while the query
+  // ran
+  if (j->cacheKey && !j->owner->dropped) {
+    SIResultCache_Put(j->owner->results, j->cacheKey, j->cacheKeyLen,
+                      j->q.plan, j->ids, j->num, j->version);
+  }
+
+  RedisModule_ReplyWithArray(ctx, j->num);
+  for (size_t i = 0; i < j->num; i++) {
+    if (!j->numRet) {
+      RedisModule_ReplyWithStringBuffer(ctx, j->ids[i], strlen(j->ids[i]));
+      continue;
+    }
+    RedisModule_ReplyWithArray(ctx, j->numRet + 1);
+    RedisModule_ReplyWithStringBuffer(ctx, j->ids[i], strlen(j->ids[i]));
+    for (int n = 0; n < j->numRet; n++) {
+      if (j->keys[i]) {
+        replyWithValue(ctx, &j->keys[i]->keys[j->retProps[n]]);
+      } else {
+        RedisModule_ReplyWithNull(ctx);
+      }
+    }
+  }
+  return REDISMODULE_OK;
+}
+
+/* Build the key a query's results are cached by from the command's arguments,
+ * starting with the predicates. The predicates are keyed by their tokens, so
+ * that spacing and the case of keywords don't matter, and each token's text
+ * and each of the options are prefixed by their length so that no two queries
+ * share a key */
+char *resultCacheKey(RedisModuleString **argv, int argc, int offset,
+                     size_t *len) {
+  size_t cap = 0;
+  for (int i = offset; i < argc; i++) {
+    size_t n;
+    RedisModule_StringPtrLen(argv[i], &n);
+    cap += n + 22;
+  }
+  size_t qlen;
+  const char *qstr = RedisModule_StringPtrLen(argv[offset], &qlen);
+  // each token takes at least a character of the predicates
+  char *key = malloc(cap + qlen * 22 + 1);
+  *len = 0;
+
+  SILexer lx = SI_NewLexer(qstr, qlen);
+  SIToken tok;
+  while ((tok = SILexer_Next(&lx)).type != SI_TOK_EOF) {
+    *len += sprintf(key + *len, "%d", tok.type);
+    if (tok.type <= SI_TOK_PARAM) {
+      continue;
+    }
+    *len += sprintf(key + *len, ":%zu:", tok.len);
+    memcpy(key + *len, tok.text, tok.len);
+    *len += tok.len;
+  }
+  key[(*len)++] = ';';
+
+  for (int i = offset + 1; i < argc; i++) {
+    size_t n;
+    const char *s = RedisModule_StringPtrLen(argv[i], &n);
+    *len += sprintf(key + *len, "%zu:", n);
+    memcpy(key + *len, s, n);
+    *len += n;
+  }
+  return key;
+}
+
+/* Reply with the cached results of a query. Returns 0 if they aren't
+ * cached */
+int replyWithCachedResults(RedisModuleCtx *ctx, RedisIndex *idx,
+                           const char *key, size_t len) {
+  // the buffered changes may invalidate the results
+  if (idx->spec.flags & SI_INDEX_DEFERRED) {
+    SIDeferredIndex_Flush(idx->idx.ctx);
+  }
+  size_t num;
+  SIId *ids = SIResultCache_Get(idx->results, key, len, &num);
+  if (!ids) {
+    return 0;
+  }
+  RedisModule_ReplyWithArray(ctx, num);
+  for (size_t i = 0; i < num; i++) {
+    RedisModule_ReplyWithStringBuffer(ctx, ids[i], strlen(ids[i]));
+  }
+  return 1;
+}
+
+/* Execute a query and reply with its ids, and their RETURN properties. The
+ * query is freed, or handed over to the thread pool. If a cache key is given,
+ * the ids are cached by it, and the key is freed */
+int executeSelect(RedisModuleCtx *ctx, RedisIndex *idx, SIQuery *q,
+                  int *retProps, int numRet, char *cacheKey, size_t keyLen) {
+  if (SelectThread_ShouldRun(ctx, idx, q)) {
+    SelectThread_Start(ctx, idx, q, retProps, numRet, cacheKey, keyLen,
+                       selectThreadReply);
+    return REDISMODULE_OK;
+  }
+
+  SICursor *c = idx->idx.Find(idx->idx.ctx, q);
+  IndexPool_Watch(ctx);
+  // read after the scan applied the buffered changes of deferred indexes
+  unsigned long version = cacheKey ? SIResultCache_Version(idx->results) : 0;
+  SIId *ids = NULL;
+  int cap = 0;
+  if (c->error == SI_CURSOR_OK) {
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    SIId id;
+    int i = 0;
+    while (NULL != (id = c->Next(c->ctx))) {
+      if (cacheKey) {
+        if (i == cap) {
+          cap = cap ? cap * 2 : 64;
+          ids = realloc(ids, cap * sizeof(SIId));
+        }
+        ids[i] = id;
+      }
+      i++;
+      if (!numRet) {
+        RedisModule_ReplyWithStringBuffer(ctx, id, strlen(id));
+        continue;
+      }
+
+      // return the values straight from the index key, without touching the
+      // indexed records
+      SIMultiKey *mk = c->CurrentKey ? c->CurrentKey(c->ctx) : NULL;
+      RedisModule_ReplyWithArray(ctx, numRet + 1);
+      RedisModule_ReplyWithStringBuffer(ctx, id, strlen(id));
+      for (int n = 0; n < numRet; n++) {
+        if (mk) {
+          replyWithValue(ctx, &mk->keys[retProps[n]]);
+        } else {
+          RedisModule_ReplyWithNull(ctx);
+        }
+      }
+    }
+    RedisModule_ReplySetArrayLength(ctx, i);
+    if (cacheKey) {
+      SIResultCache_Put(idx->results, cacheKey, keyLen, q->plan, ids, i,
+                        version);
+    }
+  } else {
+    RedisModule_ReplyWithError(ctx, "Error performing query");
+  }
+
+  free(ids);
+  free(cacheKey);
+  SIQuery_Free(q);
+  SICursor_Free(c);
+
+  return REDISMODULE_OK;
+}
+
 int IndexSelectCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
                        int argc) {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
@@ -167,7 +565,11 @@ int IndexSelectCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
   char *qstr = (char *)RedisModule_StringPtrLen(argv[3], &len);
   char *parseError = NULL;
   SIQuery q = SI_NewQuery();
-  if (!SI_ParseQuery(&q, qstr, len, &idx->spec, &parseError)) {
+  // the cached plans depend on the ORDER BY, so the options come first
+  const char *optErr = parseQueryOptions(argv, argc, 4, &q, &idx->spec);
+  if (!optErr && !SIQueryCache_Parse(idx->queries, &q, qstr, len, &idx->spec,
+                                     &parseError)) {
+    SIQuery_Free(&q);
     RedisModule_ReplyWithError(ctx, parseError ? parseError
                                                : "Error parsing query string");
     if (parseError) {
@@ -176,26 +578,434 @@ int IndexSelectCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
     return REDISMODULE_OK;
   }
 
+  // the returned properties may repeat, but can't outnumber the arguments
+  int retProps[MAX(argc, idx->spec.numProps)];
+  int numRet = parseReturnClause(argv, argc, 4, &idx->spec, retProps);
+  if (optErr || numRet < 0) {
+    SIQuery_Free(&q);
+    return RedisModule_ReplyWithError(ctx,
+                                      optErr ? optErr : "Invalid RETURN clause");
+  }
+
+  // the results of queries are cached by the query's arguments, with the plan
+  // they were found with. Their offset depends on the ids before it, which
+  // aren't kept, and NOW and TODAY change with time
+  char *cacheKey = NULL;
+  size_t keyLen = 0;
+  if (idx->results && !numRet && !q.offset && !q.timeDependent &&
+      SIQuery_Plan(&q, &idx->spec)) {
+    cacheKey = resultCacheKey(argv, argc, 3, &keyLen);
+    if (replyWithCachedResults(ctx, idx, cacheKey, keyLen)) {
+      free(cacheKey);
+      SIQuery_Free(&q);
+      return REDISMODULE_OK;
+    }
+  }
+
+  return executeSelect(ctx, idx, &q, retProps, numRet, cacheKey, keyLen);
+}
+
+/* IDX.MSELECT <index_name> WHERE <predicates> [WHERE <predicates> ...]
+ * Run several queries with a single scan of the union of their ranges,
+ * matching each scanned key against each of the queries. Replies with an array
+ * of ids per query */
+int IndexMSelectCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                        int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc < 4 || argc % 2)
+    return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+      RedisModule_ModuleTypeGetType(key) != IndexType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  RedisIndex *idx = RedisModule_ModuleTypeGetValue(key);
+
+  int num = (argc - 2) / 2;
+  SIQueryPlan *plans[num];
+  SIQuery q = SI_NewQuery();
+  const char *err = NULL;
+  char *parseError = NULL;
+  int n;
+  for (n = 0; n < num && !err; n++) {
+    if (strcasecmp(RedisModule_StringPtrLen(argv[2 + 2 * n], NULL), "WHERE")) {
+      err = "Expected WHERE";
+      break;
+    }
+    size_t len;
+    const char *qstr = RedisModule_StringPtrLen(argv[3 + 2 * n], &len);
+    SIQuery pq = SI_NewQuery();
+    if (!SIQueryCache_Parse(idx->queries, &pq, qstr, len, &idx->spec,
+                            &parseError)) {
+      err = parseError ? parseError : "Error parsing query string";
+      break;
+    }
+    plans[n] = pq.numPredicates ? SI_BuildQueryPlan(&pq, &idx->spec) : NULL;
+    if (plans[n]) {
+      // the tree is freed with the query, the compiled filter is all we need
+      plans[n]->filterTree = NULL;
+      q.numPredicates += pq.numPredicates;
+    } else {
+      err = "Error performing query";
+    }
+    SIQuery_Free(&pq);
+  }
+  if (err) {
+    RedisModule_ReplyWithError(ctx, err);
+    free(parseError);
+    while (n-- > 0) {
+      if (plans[n]) {
+        SIQueryPlan_Free(plans[n]);
+      }
+    }
+    return REDISMODULE_OK;
+  }
+
+  q.plan = SI_NewUnionPlan(plans, num, &idx->spec);
   SICursor *c = idx->idx.Find(idx->idx.ctx, &q);
+  IndexPool_Watch(ctx);
+
+  SIId *ids[num];
+  size_t lens[num], caps[num];
+  memset(ids, 0, sizeof(ids));
+  memset(lens, 0, sizeof(lens));
+  memset(caps, 0, sizeof(caps));
+  SIId id;
+  while (c->error == SI_CURSOR_OK && NULL != (id = c->Next(c->ctx))) {
+    SIMultiKey *mk = c->CurrentKey ? c->CurrentKey(c->ctx) : NULL;
+    if (!mk) {
+      c->error = SI_CURSOR_ERROR;
+      break;
+    }
+    for (int i = 0; i < num; i++) {
+      if (!SIQueryPlan_Match(plans[i], mk, &idx->spec)) {
+        continue;
+      }
+      if (lens[i] == caps[i]) {
+        caps[i] = caps[i] ? caps[i] * 2 : 16;
+        ids[i] = realloc(ids[i], caps[i] * sizeof(SIId));
+      }
+      ids[i][lens[i]++] = id;
+    }
+  }
+
   if (c->error == SI_CURSOR_OK) {
-    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
-    SIId id;
-    int i = 0;
-    while (NULL != (id = c->Next(c->ctx))) {
-      i++;
-      RedisModule_ReplyWithStringBuffer(ctx, id, strlen(id));
+    RedisModule_ReplyWithArray(ctx, num);
+    for (int i = 0; i < num; i++) {
+      RedisModule_ReplyWithArray(ctx, lens[i]);
+      for (size_t j = 0; j < lens[i]; j++) {
+        RedisModule_ReplyWithStringBuffer(ctx, ids[i][j], strlen(ids[i][j]));
+      }
     }
-    RedisModule_ReplySetArrayLength(ctx, i);
   } else {
     RedisModule_ReplyWithError(ctx, "Error performing query");
   }
 
+  for (int i = 0; i < num; i++) {
+    free(ids[i]);
+    SIQueryPlan_Free(plans[i]);
+  }
   SIQuery_Free(&q);
   SICursor_Free(c);
+  return REDISMODULE_OK;
+}
+
+/* Prepare a query from the arguments of IDX.PREPARE that follow its name: the
+ * predicates and the query's options. Replies with the error and returns NULL
+ * if the query can't be prepared */
+SIStatement *prepareStatement(RedisModuleCtx *ctx, RedisIndex *idx,
+                              RedisModuleString **args, int numArgs) {
+  SIQuery q = SI_NewQuery();
+  const char *optErr = parseQueryOptions(args, numArgs, 1, &q, &idx->spec);
+  int retProps[MAX(numArgs, idx->spec.numProps)];
+  int numRet = parseReturnClause(args, numArgs, 1, &idx->spec, retProps);
+  if (optErr || numRet < 0) {
+    SIQuery_Free(&q);
+    RedisModule_ReplyWithError(ctx, optErr ? optErr : "Invalid RETURN clause");
+    return NULL;
+  }
+
+  size_t len;
+  char *qstr = (char *)RedisModule_StringPtrLen(args[0], &len);
+  char *parseError = NULL;
+  if (!SI_ParseQuery(&q, qstr, len, &idx->spec, &parseError)) {
+    SIQuery_Free(&q);
+    RedisModule_ReplyWithError(ctx, parseError ? parseError
+                                               : "Error parsing query string");
+    if (parseError) {
+      free(parseError);
+    }
+    return NULL;
+  }
+  // the time would be frozen at the time of preparing
+  if (q.timeDependent) {
+    SIQuery_Free(&q);
+    RedisModule_ReplyWithError(
+        ctx, "NOW and TODAY can't be prepared, use a parameter instead");
+    return NULL;
+  }
+
+  const char *err = NULL;
+  SIStatement *st = SI_NewStatement(&q, &idx->spec, &err);
+  if (!st) {
+    RedisModule_ReplyWithError(ctx, err);
+    return NULL;
+  }
+  st->returnProps = calloc(numRet + 1, sizeof(int));
+  memcpy(st->returnProps, retProps, numRet * sizeof(int));
+  st->numReturn = numRet;
+  return st;
+}
+
+/* IDX.PREPARE <index_name> <name> <predicates> [ORDER BY ...] [LIMIT ...]
+ *   [RETURN ...]
+ * Parse and plan a query with ? parameters in place of its values, and store
+ * it in the index under a name, replacing the query already prepared with that
+ * name. Replies with the number of parameters. Prepared queries are part of
+ * the index: they are replicated, and saved with it */
+int IndexPrepareCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                        int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc < 4)
+    return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+      RedisModule_ModuleTypeGetType(key) != IndexType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  RedisIndex *idx = RedisModule_ModuleTypeGetValue(key);
+
+  SIStatement *st = prepareStatement(ctx, idx, argv + 3, argc - 3);
+  if (!st) {
+    return REDISMODULE_OK;
+  }
+  RedisIndex_SetStatement(idx, RedisModule_StringPtrLen(argv[2], NULL), st,
+                          argv + 3, argc - 3);
+  RedisModule_ReplicateVerbatim(ctx);
+
+  return RedisModule_ReplyWithLongLong(ctx, st->numParams);
+}
+
+/* IDX.EXECUTE <index_name> <name> [<value> ...]
+ * Execute a prepared query with a value for each of its parameters, replying
+ * like IDX.SELECT */
+int IndexExecuteCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                        int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc < 3)
+    return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+      RedisModule_ModuleTypeGetType(key) != IndexType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  RedisIndex *idx = RedisModule_ModuleTypeGetValue(key);
+
+  RedisStatement *rs =
+      RedisIndex_GetStatement(idx, RedisModule_StringPtrLen(argv[2], NULL));
+  if (!rs) {
+    return RedisModule_ReplyWithError(ctx, "No such prepared query");
+  }
+  // queries loaded from rdb are prepared on their first execution
+  if (!rs->st) {
+    RedisModuleString *args[rs->numArgs];
+    for (int i = 0; i < rs->numArgs; i++) {
+      args[i] = RedisModule_CreateString(ctx, rs->args[i], rs->argLens[i]);
+    }
+    if (!(rs->st = prepareStatement(ctx, idx, args, rs->numArgs))) {
+      return REDISMODULE_OK;
+    }
+  }
+  SIStatement *st = rs->st;
+  if (argc - 3 != st->numParams) {
+    return RedisModule_ReplyWithError(ctx, "Wrong number of parameters");
+  }
+
+  // the values are parsed straight into the types of their properties
+  SIValue params[st->numParams + 1];
+  for (int i = 0; i < st->numParams; i++) {
+    size_t len;
+    char *str = (char *)RedisModule_StringPtrLen(argv[3 + i], &len);
+    params[i] = (SIValue){.type = st->paramTypes[i]};
+    if (!SI_ParseValue(&params[i], str, len)) {
+      while (i--) {
+        SIValue_Free(&params[i]);
+      }
+      return RedisModule_ReplyWithError(ctx, "Invalid parameter value");
+    }
+  }
+
+  SIQuery q = SIStatement_Bind(st, params, &idx->spec);
+  for (int i = 0; i < st->numParams; i++) {
+    SIValue_Free(&params[i]);
+  }
+  return executeSelect(ctx, idx, &q, st->returnProps, st->numReturn, NULL, 0);
+}
+
+typedef struct {
+  RedisModuleCtx *ctx;
+  // the deleted ids reply array is only opened once there are ids to delete,
+  // so a failed query can still reply with an error
+  int replying;
+} delWhereCtx;
+
+void delWhereVisitor(SIId id, void *key, void *ctx) {
+  delWhereCtx *dc = ctx;
+  if (!dc->replying) {
+    RedisModule_ReplyWithArray(dc->ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    dc->replying = 1;
+  }
+  RedisModule_ReplyWithStringBuffer(dc->ctx, id, strlen(id));
+}
+
+/* IDX.DELWHERE <index_name> WHERE <predicates> [WITHIDS]
+ * Delete all the ids matching the query from the index, replying with their
+ * number, or with the ids themselves if WITHIDS is given */
+int IndexDelWhereCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                         int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
 
+  if (argc < 4 || argc > 5)
+    return RedisModule_WrongArity(ctx);
+
+  int withIds = RMUtil_ArgExists("WITHIDS", argv, argc, 4);
+  if (argc == 5 && !withIds) {
+    return RedisModule_ReplyWithError(ctx, "Invalid DELWHERE option");
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+      RedisModule_ModuleTypeGetType(key) != IndexType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  RedisIndex *idx = RedisModule_ModuleTypeGetValue(key);
+
+  size_t len;
+  char *qstr = (char *)RedisModule_StringPtrLen(argv[3], &len);
+  char *parseError = NULL;
+  SIQuery q = SI_NewQuery();
+  if (!SIQueryCache_Parse(idx->queries, &q, qstr, len, &idx->spec,
+                          &parseError)) {
+    RedisModule_ReplyWithError(ctx, parseError ? parseError
+                                               : "Error parsing query string");
+    if (parseError) {
+      free(parseError);
+    }
+    return REDISMODULE_OK;
+  }
+
+  delWhereCtx dc = {.ctx = ctx, .replying = 0};
+  size_t num = 0;
+  SIGarbage *g = NULL;
+  int rc = idx->idx.DeleteWhere(idx->idx.ctx, &q, withIds ? delWhereVisitor
+                                                          : NULL,
+                                &dc, &num, &g);
+  SIQuery_Free(&q);
+  if (rc != SI_INDEX_OK) {
+    return RedisModule_ReplyWithError(ctx, "Error performing query");
+  }
+  // the deleted entries are no longer reachable, there's no need to free them
+  // before replying
+  RedisIndex_ReleaseGarbage(ctx, g);
+
+  if (!withIds) {
+    return RedisModule_ReplyWithLongLong(ctx, num);
+  }
+  if (!dc.replying) {
+    return RedisModule_ReplyWithArray(ctx, 0);
+  }
+  RedisModule_ReplySetArrayLength(ctx, num);
   return REDISMODULE_OK;
 }
 
+/* IDX.TRIM <index_name> BEFORE <timestamp>
+ * Delete all the ids whose leading TIME property is before the timestamp.
+ * Partitioned indexes drop the partitions entirely before the timestamp at
+ * once */
+int IndexTrimCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                     int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 4)
+    return RedisModule_WrongArity(ctx);
+
+  long long ts;
+  if (strcasecmp(RedisModule_StringPtrLen(argv[2], NULL), "BEFORE") ||
+      RedisModule_StringToLongLong(argv[3], &ts) == REDISMODULE_ERR) {
+    return RedisModule_ReplyWithError(ctx, "Invalid TRIM timestamp");
+  }
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+      RedisModule_ModuleTypeGetType(key) != IndexType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  RedisIndex *idx = RedisModule_ModuleTypeGetValue(key);
+  if (idx->spec.properties[0].type != T_TIME) {
+    return RedisModule_ReplyWithError(
+        ctx, "TRIM requires an index with a leading TIME property");
+  }
+
+  // $1 < ts
+  SIQuery q = SI_NewQuery();
+  SIQueryNode *n = SI_PredBetween(SI_NegativeInfVal(), SI_TimeVal(ts), 0, 1);
+  n->pred.propId = 0;
+  SIQuery_SetRoot(&q, n);
+  q.numPredicates = 1;
+
+  size_t num = 0;
+  SIGarbage *g = NULL;
+  int rc = idx->idx.DeleteWhere(idx->idx.ctx, &q, NULL, NULL, &num, &g);
+  SIQuery_Free(&q);
+  if (rc != SI_INDEX_OK) {
+    return RedisModule_ReplyWithError(ctx, "Error trimming index");
+  }
+  RedisIndex_ReleaseGarbage(ctx, g);
+
+  return RedisModule_ReplyWithLongLong(ctx, num);
+}
+
+/* IDX.COMPACT {index_name}
+ *  Freeze an index into a read only static layout. The first write thaws it */
+int IndexCompactCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+                        int argc) {
+  RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
+
+  if (argc != 2)
+    return RedisModule_WrongArity(ctx);
+
+  RedisModuleKey *key =
+      RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+  if (RedisModule_KeyType(key) == REDISMODULE_KEYTYPE_EMPTY ||
+      RedisModule_ModuleTypeGetType(key) != IndexType) {
+    return RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+  }
+  RedisIndex *idx = RedisModule_ModuleTypeGetValue(key);
+  if (idx->build) {
+    return RedisModule_ReplyWithError(ctx, "Index is being built");
+  }
+  // static indexes thaw in place on the next write, which lock free readers
+  // can't follow
+  if (idx->spec.flags & SI_INDEX_CONCURRENT) {
+    return RedisModule_ReplyWithError(ctx,
+                                      "CONCURRENT indexes cannot be compacted");
+  }
+
+  // traversing a deferred index applies its buffered changes first
+  RedisIndex_Replace(idx, SI_NewStaticIndex(idx->idx, idx->spec));
+
+  return RedisModule_ReplyWithSimpleString(ctx, "OK");
+}
+
 /* IDX.FROM {index_name} WHERE {predicates} ANY REDIS READ COMMAND */
 int IndexFromCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
   RedisModule_AutoMemory(ctx); /* Use automatic memory management. */
@@ -223,7 +1033,8 @@ int IndexFromCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
   char *parseError = NULL;
 
   SIQuery q = SI_NewQuery();
-  if (!SI_ParseQuery(&q, qstr, len, &idx->spec, &parseError)) {
+  if (!SIQueryCache_Parse(idx->queries, &q, qstr, len, &idx->spec,
+                          &parseError)) {
     RedisModule_ReplyWithError(
         ctx, parseError ? parseError : "Error parsing WHERE query string");
     if (parseError) {
@@ -262,7 +1073,8 @@ int IndexIntoCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     char *parseError = NULL;
 
     q = SI_NewQuery();
-    if (!SI_ParseQuery(&q, qstr, len, &idx->spec, &parseError)) {
+    if (!SIQueryCache_Parse(idx->queries, &q, qstr, len, &idx->spec,
+                            &parseError)) {
       RedisModule_ReplyWithError(
           ctx, parseError ? parseError : "Error parsing WHERE query string");
       if (parseError) {
@@ -275,11 +1087,23 @@ int IndexIntoCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
   // TODO: dynamic cmdPos if WHERE exists
   int cmdPos = wherePos ? wherePos + 2 : 2;
 
+  // common hash writes are executed directly on the keys, other commands go
+  // through RedisModule_Call and reindex the keys they wrote
+  if (HashIndex_ExecuteWriteCommand(ctx, idx, wherePos ? &q : NULL,
+                                    &argv[cmdPos],
+                                    argc - cmdPos) == REDISMODULE_OK) {
+    if (wherePos) {
+      SIQuery_Free(&q);
+    }
+    return REDISMODULE_OK;
+  }
+
   IndexedTransaction tx = CreateIndexedTransaction(
       ctx, idx, wherePos ? &q : NULL, &argv[cmdPos], argc - cmdPos);
 
   if (tx.err != NULL) {
-    return RedisModule_ReplyWithError(ctx, tx.err);
+    RedisModule_ReplyWithError(ctx, tx.err);
+    goto cleanup;
   }
 
   int num = 0;
@@ -306,21 +1130,40 @@ int IndexIntoCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
   RedisModule_ReplyWithLongLong(ctx, num);
 
 cleanup:
-  if (tx.ctx)
-    free(tx.ctx);
+  // closing a snapshot cursor lets the next write collect what it kept alive
+  if (tx.ctx) {
+    if (wherePos) {
+      SICursor_Free(tx.ctx);
+    } else {
+      free(tx.ctx);
+    }
+  }
+  if (wherePos) {
+    SIQuery_Free(&q);
+  }
 
   return REDISMODULE_OK;
 }
 
-int RedisModule_OnLoad(RedisModuleCtx *ctx) {
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
+                       int argc) {
   // LOGGING_INIT(0xFFFFFFFF);
   if (RedisModule_Init(ctx, "idx", 1, REDISMODULE_APIVER_1) == REDISMODULE_ERR)
     return REDISMODULE_ERR;
 
+  // THREADS {n}: the size of the thread pool, 0 to do everything on the main
+  // thread
+  if (IndexPool_Init(ctx, argv, argc) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
   // register index type
   if (RedisIndex_Register(ctx) == REDISMODULE_ERR)
     return REDISMODULE_ERR;
 
+  // indexes tracking keys by prefix are not available on older servers, but
+  // everything else is
+  HashTracking_Init(ctx);
+
   if (RedisModule_CreateCommand(ctx, "idx.create", CreateIndexCommand,
                                 "write deny-oom no-cluster", 1, 1,
                                 1) == REDISMODULE_ERR)
@@ -336,11 +1179,41 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx) {
                                 1) == REDISMODULE_ERR)
     return REDISMODULE_ERR;
 
+  if (RedisModule_CreateCommand(ctx, "idx.delwhere", IndexDelWhereCommand,
+                                "write no-cluster", 1, 1,
+                                1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "idx.trim", IndexTrimCommand,
+                                "write no-cluster", 1, 1,
+                                1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "idx.compact", IndexCompactCommand,
+                                "write no-cluster", 1, 1,
+                                1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
   if (RedisModule_CreateCommand(ctx, "idx.select", IndexSelectCommand,
                                 "readonly no-cluster", 1, 1,
                                 1) == REDISMODULE_ERR)
     return REDISMODULE_ERR;
 
+  if (RedisModule_CreateCommand(ctx, "idx.mselect", IndexMSelectCommand,
+                                "readonly no-cluster", 1, 1,
+                                1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "idx.prepare", IndexPrepareCommand,
+                                "write deny-oom no-cluster", 1, 1,
+                                1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "idx.execute", IndexExecuteCommand,
+                                "readonly no-cluster", 1, 1,
+                                1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
   if (RedisModule_CreateCommand(ctx, "idx.from", IndexFromCommand,
                                 "readonly no-cluster", 1, 1,
                                 1) == REDISMODULE_ERR)
@@ -357,5 +1230,15 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx) {
                                 1) == REDISMODULE_ERR)
     return REDISMODULE_ERR;
 
+  if (RedisModule_CreateCommand(ctx, "idx.rebuild", IndexRebuildCommand,
+                                "write no-cluster", 1, 1,
+                                1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
+  if (RedisModule_CreateCommand(ctx, "idx.info", IndexInfoCommand,
+                                "readonly no-cluster", 1, 1,
+                                1) == REDISMODULE_ERR)
+    return REDISMODULE_ERR;
+
   return REDISMODULE_OK;
 }
\ No newline at end of file
@@ -0,0 +1,182 @@
+#include <string.h>
+#include <strings.h>
+#include "lexer.h"
+#include "../rmutil/alloc.h"
+
+static const struct {
+  const char *word;
+  SITokenType type;
+} siKeywords[] = {
+    {"AND", SI_TOK_AND},
+    {"OR", SI_TOK_OR},
+    {"IN", SI_TOK_IN},
+    {"IS", SI_TOK_IS},
+    {"NULL", SI_TOK_NULL},
+    {"LIKE", SI_TOK_LIKE},
+    {"TRUE", SI_TOK_TRUE},
+    {"FALSE", SI_TOK_FALSE},
+    {"NOW", SI_TOK_NOW},
+    {"TODAY", SI_TOK_TODAY},
+    {"UNIX", SI_TOK_UNIX},
+    {"TIME_ADD", SI_TOK_TIME_ADD},
+    {"TIME_SUB", SI_TOK_TIME_SUB},
+    {"DAYS", SI_TOK_DAYS},
+    {"HOURS", SI_TOK_HOURS},
+    {"MINUTES", SI_TOK_MINUTES},
+    {"SECONDS", SI_TOK_SECONDS},
+    {NULL},
+};
+
+#define isDigit(c) ((c) >= '0' && (c) <= '9')
+#define isIdentStart(c) \
+  (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || (c) == '_')
+#define isIdentChar(c) (isIdentStart(c) || isDigit(c))
+
+SILexer SI_NewLexer(const char *s, size_t len) {
+  return (SILexer){.pos = s, .end = s + len, .line = 1};
+}
+
+/* Match a number at p: an optional sign, and either digits or a fraction.
+ * Returns the end of the number, or p if there is none */
+static const char *lexer_number(SILexer *lx, const char *p, int *isFloat) {
+  const char *s = p;
+  if (s < lx->end && (*s == '-' || *s == '+')) {
+    s++;
+  }
+  const char *digits = s;
+  while (s < lx->end && isDigit(*s)) {
+    s++;
+  }
+  *isFloat = 0;
+  if (s + 1 < lx->end && *s == '.' && isDigit(s[1])) {
+    *isFloat = 1;
+    for (s++; s < lx->end && isDigit(*s);) {
+      s++;
+    }
+    return s;
+  }
+  return s > digits ? s : p;
+}
+
+/* Match a quoted string at p, returning its closing quote, or NULL if it is
+ * not terminated. A quote preceded by a backslash may be escaped, so the
+ * string runs to the first quote that isn't, or to the last one that is */
+static const char *lexer_string(SILexer *lx, const char *p) {
+  const char *last = NULL;
+  for (const char *s = p + 1; s < lx->end; s++) {
+    if (*s == *p) {
+      if (s[-1] != '\\') {
+        return s;
+      }
+      last = s;
+    }
+  }
+  return last;
+}
+
+SIToken SILexer_Next(SILexer *lx) {
+  while (lx->pos < lx->end) {
+    const char *p = lx->pos;
+    SIToken t = {.text = p, .len = 1, .line = lx->line};
+
+    switch (*p) {
+    case '\n':
+      lx->line++;
+    // fallthrough
+    case ' ':
+    case '\t':
+      lx->pos++;
+      continue;
+
+    case '=':
+      t.type = SI_TOK_EQ;
+      break;
+    case '(':
+      t.type = SI_TOK_LP;
+      break;
+    case ')':
+      t.type = SI_TOK_RP;
+      break;
+    case ',':
+      t.type = SI_TOK_COMMA;
+      break;
+    case '?':
+      t.type = SI_TOK_PARAM;
+      break;
+    case '!':
+    case '>':
+    case '<':
+      if (p + 1 < lx->end && p[1] == '=') {
+        t.type = *p == '!' ? SI_TOK_NE : *p == '>' ? SI_TOK_GE : SI_TOK_LE;
+        t.len = 2;
+      } else if (*p != '!') {
+        t.type = *p == '>' ? SI_TOK_GT : SI_TOK_LT;
+      } else {
+        lx->pos++;
+        continue;
+      }
+      break;
+
+    case '$':
+      if (p + 1 < lx->end && isDigit(p[1])) {
+        t.type = SI_TOK_ENUMERATOR;
+        t.len = 2;
+        break;
+      }
+      lx->pos++;
+      continue;
+
+    case '"':
+    case '\'': {
+      const char *close = lexer_string(lx, p);
+      if (!close) {
+        lx->pos++;
+        continue;
+      }
+      for (const char *s = p; s < close; s++) {
+        lx->line += *s == '\n';
+      }
+      t.type = SI_TOK_STRING;
+      t.text = p + 1;
+      t.len = close - p - 1;
+      lx->pos = close + 1;
+      return t;
+    }
+
+    default:
+      if (isIdentStart(*p)) {
+        const char *s = p + 1;
+        while (s < lx->end && isIdentChar(*s)) {
+          s++;
+        }
+        t.type = SI_TOK_IDENT;
+        t.len = s - p;
+        for (int i = 0; siKeywords[i].word; i++) {
+          if (strlen(siKeywords[i].word) == t.len &&
+              !strncasecmp(siKeywords[i].word, p, t.len)) {
+            t.type = siKeywords[i].type;
+            break;
+          }
+        }
+        break;
+      }
+
+      int isFloat;
+      const char *s = lexer_number(lx, p, &isFloat);
+      if (s == p) {
+        // not the start of any token
+        lx->pos++;
+        continue;
+      }
+      t.type = isFloat ? SI_TOK_FLOAT : SI_TOK_INTEGER;
+      t.len = s - p;
+      break;
+    }
+
+    lx->pos += t.len;
+    return t;
+  }
+
+  return (SIToken){.type = SI_TOK_EOF, .text = lx->end, .len = 0,
+                   .line = lx->line};
+}
@@ -0,0 +1,71 @@
+#ifndef __SI_LEXER_H__
+#define __SI_LEXER_H__
+
+#include <stdlib.h>
+
+/* The tokens of WHERE expressions. Keywords are case insensitive */
+typedef enum {
+  SI_TOK_EOF = 0,
+  SI_TOK_AND,
+  SI_TOK_OR,
+  SI_TOK_IN,
+  SI_TOK_IS,
+  SI_TOK_NULL,
+  SI_TOK_LIKE,
+  SI_TOK_TRUE,
+  SI_TOK_FALSE,
+  SI_TOK_NOW,
+  SI_TOK_TODAY,
+  SI_TOK_UNIX,
+  SI_TOK_TIME_ADD,
+  SI_TOK_TIME_SUB,
+  SI_TOK_DAYS,
+  SI_TOK_HOURS,
+  SI_TOK_MINUTES,
+  SI_TOK_SECONDS,
+
+  SI_TOK_EQ,
+  SI_TOK_NE,
+  SI_TOK_GT,
+  SI_TOK_GE,
+  SI_TOK_LT,
+  SI_TOK_LE,
+  SI_TOK_LP,
+  SI_TOK_RP,
+  SI_TOK_COMMA,
+  // a parameter of a prepared query
+  SI_TOK_PARAM,
+
+  // $1 to $9
+  SI_TOK_ENUMERATOR,
+  SI_TOK_IDENT,
+  SI_TOK_INTEGER,
+  SI_TOK_FLOAT,
+  // the text of a string is its contents, without the quotes. Escape sequences
+  // are left as they are
+  SI_TOK_STRING,
+} SITokenType;
+
+/* A token, pointing into the lexed text */
+typedef struct {
+  SITokenType type;
+  const char *text;
+  size_t len;
+  int line;
+} SIToken;
+
+/* The lexer's state. The lexer does not allocate, and any number of lexers can
+ * run at once */
+typedef struct {
+  const char *pos;
+  const char *end;
+  int line;
+} SILexer;
+
+SILexer SI_NewLexer(const char *s, size_t len);
+
+/* Read the next token. Characters that don't start a token are skipped.
+ * Returns an SI_TOK_EOF token at the end of the text */
+SIToken SILexer_Next(SILexer *lx);
+
+#endif
@@ -1,32 +0,0 @@
-#define AND                              1
-#define OR                               2
-#define EQ                               3
-#define NE                               4
-#define GT                               5
-#define GE                               6
-#define LT                               7
-#define LE                               8
-#define IN                               9
-#define IS                              10
-#define NOW                             11
-#define LIKE                            12
-#define STRING                          13
-#define TK_NULL                         14
-#define LP                              15
-#define RP                              16
-#define INTEGER                         17
-#define FLOAT                           18
-#define TRUE                            19
-#define FALSE                           20
-#define COMMA                           21
-#define ENUMERATOR                      22
-#define IDENT                           23
-#define TODAY                           24
-#define TIME                            25
-#define UNIXTIME                        26
-#define TIME_ADD                        27
-#define TIME_SUB                        28
-#define DAYS                            29
-#define HOURS                           30
-#define MINUTES                         31
-#define SECONDS                         32
@@ -1,4 +1,5 @@
 #include "query.h"
+#include "query_plan.h"
 #include "rmutil/alloc.h"
 
 SIQueryNode *__newQueryNode(SIQueryNodeType t) {
@@ -12,6 +13,12 @@ SIQueryNode *SI_PredEquals(SIValue v) {
   return ret;
 }
 
+SIQueryNode *SI_PredNotEquals(SIValue v) {
+  SIQueryNode *ret = __newQueryNode(QN_PRED);
+  ret->pred = (SIPredicate){.ne = (SINotEquals){SIValue_Copy(v)}, .t = PRED_NE};
+  return ret;
+}
+
 SIQueryNode *SI_PredBetween(SIValue min, SIValue max, int minExclusive,
                             int maxExclusive) {
   SIQueryNode *ret = __newQueryNode(QN_PRED);
@@ -46,7 +53,17 @@ SIQueryNode *SI_PredIsNull() {
 }
 
 SIQuery SI_NewQuery() {
-  return (SIQuery){.root = NULL, .offset = 0, .num = 0, .numPredicates = 0};
+  return (SIQuery){.root = NULL,
+                   .offset = 0,
+                   .num = 0,
+                   .numPredicates = 0,
+                   .numParams = 0,
+                   .orderBy = NULL,
+                   .numOrderBy = 0,
+                   .orderDesc = 0,
+                   .snapshot = 0,
+                   .timeDependent = 0,
+                   .plan = NULL};
 }
 
 SIQueryNode *SIQuery_NewLogicNode(SIQueryNode *left, SILogicOperator op,
@@ -64,6 +81,17 @@ SIQueryNode *SIQuery_SetRoot(SIQuery *q, SIQueryNode *n) {
   return n;
 }
 
+int SIQuery_AddOrderBy(SIQuery *q, const char *prop, SISpec *spec) {
+  int id = SISpec_PropertyId(spec, prop);
+  if (id < 0) {
+    return 0;
+  }
+
+  q->orderBy = realloc(q->orderBy, (q->numOrderBy + 1) * sizeof(int));
+  q->orderBy[q->numOrderBy++] = id;
+  return 1;
+}
+
 void __freePredicate(SIPredicate *p) {
   switch (p->t) {
     case PRED_EQ:
@@ -106,9 +134,105 @@ void SIQueryNode_Free(SIQueryNode *n) {
   free(n);
 }
 
+/* Take a reference to a copied value, or to the parameter value it stands
+ * for */
+void __cloneValue(SIValue *v, SIValue *params) {
+  if (params && v->type == T_PARAM) {
+    *v = SIValue_Copy(params[v->intval]);
+  } else {
+    SIValue_IncRef(v);
+  }
+}
+
+SIQueryNode *__cloneNode(SIQueryNode *n, SIValue *params) {
+  if (!n) return NULL;
+
+  SIQueryNode *ret = __newQueryNode(n->type);
+  *ret = *n;
+  switch (n->type & ~QN_PASSTHRU) {
+    case QN_LOGIC:
+      ret->op.left = __cloneNode(n->op.left, params);
+      ret->op.right = __cloneNode(n->op.right, params);
+      break;
+    case QN_PRED: {
+      SIPredicate *p = &ret->pred;
+      switch (p->t) {
+        case PRED_EQ:
+          __cloneValue(&p->eq.v, params);
+          break;
+        case PRED_NE:
+          __cloneValue(&p->ne.v, params);
+          break;
+        case PRED_RNG:
+          __cloneValue(&p->rng.min, params);
+          __cloneValue(&p->rng.max, params);
+          break;
+        case PRED_IN:
+          p->in.vals = calloc(p->in.numvals, sizeof(SIValue));
+          memcpy(p->in.vals, n->pred.in.vals, p->in.numvals * sizeof(SIValue));
+          for (int i = 0; i < p->in.numvals; i++) {
+            __cloneValue(&p->in.vals[i], params);
+          }
+          break;
+        case PRED_ISNULL:
+        default:
+          break;
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return ret;
+}
+
+SIQueryNode *SIQueryNode_Clone(SIQueryNode *n) { return __cloneNode(n, NULL); }
+
+SIQueryNode *SIQueryNode_Bind(SIQueryNode *n, SIValue *params) {
+  return __cloneNode(n, params);
+}
+
+int SIQueryNode_HasParams(SIQueryNode *n) {
+  if (!n) return 0;
+
+  switch (n->type & ~QN_PASSTHRU) {
+    case QN_LOGIC:
+      return SIQueryNode_HasParams(n->op.left) ||
+             SIQueryNode_HasParams(n->op.right);
+    case QN_PRED:
+      switch (n->pred.t) {
+        case PRED_EQ:
+          return n->pred.eq.v.type == T_PARAM;
+        case PRED_NE:
+          return n->pred.ne.v.type == T_PARAM;
+        case PRED_RNG:
+          return n->pred.rng.min.type == T_PARAM ||
+                 n->pred.rng.max.type == T_PARAM;
+        case PRED_IN:
+          for (int i = 0; i < n->pred.in.numvals; i++) {
+            if (n->pred.in.vals[i].type == T_PARAM) {
+              return 1;
+            }
+          }
+          return 0;
+        default:
+          return 0;
+      }
+    default:
+      return 0;
+  }
+}
+
 void SIQuery_Free(SIQuery *q) {
   if (q->root) {
     SIQueryNode_Free(q->root);
     q->root = NULL;
   }
+  if (q->plan) {
+    SIQueryPlan_Free(q->plan);
+    q->plan = NULL;
+  }
+  free(q->orderBy);
+  q->orderBy = NULL;
+  q->numOrderBy = 0;
 }
\ No newline at end of file
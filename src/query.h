@@ -30,6 +30,7 @@ typedef enum {
 } SIQueryNodeType;
 
 struct queryNode;
+struct SIQueryPlan;
 
 /* Equals to predicate */
 typedef struct {
@@ -91,6 +92,7 @@ typedef struct queryNode {
 
 SIQueryNode *SI_PredIsNull();
 SIQueryNode *SI_PredEquals(SIValue v);
+SIQueryNode *SI_PredNotEquals(SIValue v);
 SIQueryNode *SI_PredBetween(SIValue min, SIValue max, int minExclusive,
                             int maxExclusive);
 
@@ -100,11 +102,31 @@ SIQueryNode *SI_PredIn(SIValueVector v);
 typedef struct {
   SIQueryNode *root;
   size_t numPredicates;
+  // the number of ? parameters in the tree, only allowed in prepared queries
+  int numParams;
 
   size_t offset;
+  // the maximal number of results, 0 means no limit
   size_t num;
 
-  // TODO - ordering and other options
+  // the property ids the results are ordered by. If empty, the results are in
+  // the order the index yields them
+  int *orderBy;
+  int numOrderBy;
+  // order the results in descending order
+  int orderDesc;
+
+  // read the index as it was when the cursor was opened, regardless of the
+  // changes applied while it is open. Snapshot cursors must be read and freed
+  // by the thread writing the index
+  int snapshot;
+
+  // the query uses NOW or TODAY, so its values depend on when it was parsed
+  int timeDependent;
+  // the cached plan to execute the query with, instead of planning its tree
+  struct SIQueryPlan *plan;
+
+  // TODO - other options
 } SIQuery;
 
 /* internal - free the values of a predicate node */
@@ -115,15 +137,33 @@ SIQuery SI_NewQuery();
 void SIQuery_Free(SIQuery *q);
 SIQueryNode *SIQuery_SetRoot(SIQuery *q, SIQueryNode *n);
 
+/* Add a property to the query's ORDER BY clause. The property is either a
+ * 1-based enumerator like $1, or a property name. Returns 0 if no such
+ * property exists */
+int SIQuery_AddOrderBy(SIQuery *q, const char *prop, SISpec *spec);
+
 SIQueryNode *SIQuery_NewLogicNode(SIQueryNode *left, SILogicOperator op,
                                   SIQueryNode *right);
 
 SIQueryError SIQuery_Normalize(SIQuery *q, SISpec *spec);
 
+/* Convert a predicate value to the given property type. Returns 1 on success,
+ * 0 if the value cannot be converted */
+int castPredicateValue(SIValue *v, SIType t);
+
 int SI_ParseQuery(SIQuery *query, const char *q, size_t len, SISpec *spec,
                   char **err);
 void SIQueryNode_Print(SIQueryNode *n, int depth);
 
 void SIQueryNode_Free(SIQueryNode *n);
 
+/* Copy a query tree. The values are shared with the original tree */
+SIQueryNode *SIQueryNode_Clone(SIQueryNode *n);
+
+/* Copy a query tree, replacing its parameters with the given values */
+SIQueryNode *SIQueryNode_Bind(SIQueryNode *n, SIValue *params);
+
+/* Return 1 if a query tree has parameters */
+int SIQueryNode_HasParams(SIQueryNode *n);
+
 #endif  // !__SECONDARY_QUERY_H__
\ No newline at end of file
@@ -0,0 +1,220 @@
+#include <string.h>
+#include "query_cache.h"
+#include "query_plan.h"
+#include "util/khash.h"
+#include "rmutil/alloc.h"
+
+/* The text of a WHERE clause, which isn't necessarily null terminated */
+typedef struct {
+  const char *str;
+  size_t len;
+} siQueryText;
+
+static inline khint_t __siQueryText_hash(siQueryText t) {
+  khint_t h = 0;
+  for (size_t i = 0; i < t.len; i++) {
+    h = (h << 5) - h + (khint_t)(unsigned char)t.str[i];
+  }
+  return h;
+}
+
+static inline int __siQueryText_equals(siQueryText a, siQueryText b) {
+  return a.len == b.len && !memcmp(a.str, b.str, a.len);
+}
+
+typedef struct siCachedQuery {
+  // a copy of the text the entry is keyed by
+  siQueryText text;
+  // the normalized tree, never planned itself
+  SIQueryNode *root;
+  size_t numPredicates;
+
+  // the plan last built from the tree, for the ORDER BY below. NULL if the
+  // tree could not be planned
+  SIQueryPlan *plan;
+  int planned;
+  int *orderBy;
+  int numOrderBy;
+  int orderDesc;
+
+  // the list of entries, from the most to the least recently used
+  struct siCachedQuery *prev;
+  struct siCachedQuery *next;
+} siCachedQuery;
+
+KHASH_INIT(siQueryCache, siQueryText, siCachedQuery *, 1, __siQueryText_hash,
+           __siQueryText_equals);
+
+struct siQueryCache {
+  khash_t(siQueryCache) * h;
+  siCachedQuery *head;
+  siCachedQuery *tail;
+  size_t cap;
+};
+
+SIQueryCache *SI_NewQueryCache(size_t cap) {
+  SIQueryCache *c = malloc(sizeof(SIQueryCache));
+  c->h = kh_init(siQueryCache);
+  c->head = c->tail = NULL;
+  c->cap = cap;
+  return c;
+}
+
+/* Create an entry for a parsed query, taking over its tree */
+siCachedQuery *cachedQuery_New(const char *str, size_t len, SIQuery *q) {
+  siCachedQuery *e = calloc(1, sizeof(siCachedQuery));
+  char *text = malloc(len + 1);
+  memcpy(text, str, len);
+  text[len] = '\0';
+  e->text = (siQueryText){text, len};
+  e->root = q->root;
+  e->numPredicates = q->numPredicates;
+  q->root = NULL;
+  return e;
+}
+
+void cachedQuery_Free(siCachedQuery *e) {
+  // the plan's values may share their strings with the tree, and queries
+  // still executing the plan may release it last, so the tree goes first
+  SIQueryNode_Free(e->root);
+  if (e->plan) {
+    SIQueryPlan_Free(e->plan);
+  }
+  free(e->orderBy);
+  free((char *)e->text.str);
+  free(e);
+}
+
+/* Return 1 if the entry's plan was built for the query's ORDER BY */
+int cachedQuery_SameOrder(siCachedQuery *e, SIQuery *q) {
+  if (e->numOrderBy != q->numOrderBy) {
+    return 0;
+  }
+  // the direction doesn't matter for unordered queries
+  return !q->numOrderBy ||
+         (e->orderDesc == q->orderDesc &&
+          !memcmp(e->orderBy, q->orderBy, q->numOrderBy * sizeof(int)));
+}
+
+/* Replace the entry's plan with one built for the query's ORDER BY */
+void cachedQuery_Plan(siCachedQuery *e, SIQuery *q, SISpec *spec) {
+  if (e->plan) {
+    SIQueryPlan_Free(e->plan);
+  }
+
+  // the planner consumes the predicates it scans by, so it plans a copy of the
+  // tree
+  SIQuery pq = *q;
+  pq.root = SIQueryNode_Clone(e->root);
+  pq.plan = NULL;
+  e->plan = SI_BuildQueryPlan(&pq, spec);
+  SIQueryNode_Free(pq.root);
+  if (e->plan) {
+    e->plan->filterTree = NULL;
+  }
+
+  free(e->orderBy);
+  e->orderBy = NULL;
+  if (q->numOrderBy) {
+    e->orderBy = malloc(q->numOrderBy * sizeof(int));
+    memcpy(e->orderBy, q->orderBy, q->numOrderBy * sizeof(int));
+  }
+  e->numOrderBy = q->numOrderBy;
+  e->orderDesc = q->orderDesc;
+  e->planned = 1;
+}
+
+void queryCache_Unlink(SIQueryCache *c, siCachedQuery *e) {
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    c->head = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    c->tail = e->prev;
+  }
+  e->prev = e->next = NULL;
+}
+
+void queryCache_PushFront(SIQueryCache *c, siCachedQuery *e) {
+  e->next = c->head;
+  if (c->head) {
+    c->head->prev = e;
+  } else {
+    c->tail = e;
+  }
+  c->head = e;
+}
+
+/* Drop the least recently used entry */
+void queryCache_Evict(SIQueryCache *c) {
+  siCachedQuery *e = c->tail;
+  queryCache_Unlink(c, e);
+  kh_del(siQueryCache, c->h, kh_get(siQueryCache, c->h, e->text));
+  cachedQuery_Free(e);
+}
+
+int SIQueryCache_Parse(SIQueryCache *c, SIQuery *q, const char *str,
+                       size_t len, SISpec *spec, char **err) {
+  siCachedQuery *e;
+  khiter_t k = kh_get(siQueryCache, c->h, ((siQueryText){str, len}));
+  if (k != kh_end(c->h)) {
+    e = kh_value(c->h, k);
+    queryCache_Unlink(c, e);
+    if (err) {
+      *err = NULL;
+    }
+  } else {
+    if (!SI_ParseQuery(q, str, len, spec, err)) {
+      return 0;
+    }
+    if (q->numParams) {
+      SIQueryNode_Free(q->root);
+      q->root = NULL;
+      q->numPredicates = 0;
+      if (err) {
+        *err = strdup("Parameters can only be used in prepared queries");
+      }
+      return 0;
+    }
+    if (q->timeDependent || !c->cap) {
+      return 1;
+    }
+
+    if (kh_size(c->h) >= c->cap) {
+      queryCache_Evict(c);
+    }
+    e = cachedQuery_New(str, len, q);
+    int rc;
+    k = kh_put(siQueryCache, c->h, e->text, &rc);
+    kh_value(c->h, k) = e;
+  }
+  queryCache_PushFront(c, e);
+
+  if (!e->planned || !cachedQuery_SameOrder(e, q)) {
+    cachedQuery_Plan(e, q, spec);
+  }
+  q->numPredicates = e->numPredicates;
+  if (e->plan) {
+    q->plan = SIQueryPlan_Copy(e->plan);
+  } else {
+    // the tree can't be planned, the engine fails the query as usual
+    q->root = SIQueryNode_Clone(e->root);
+  }
+  return 1;
+}
+
+size_t SIQueryCache_Len(SIQueryCache *c) { return kh_size(c->h); }
+
+void SIQueryCache_Free(SIQueryCache *c) {
+  siCachedQuery *e = c->head;
+  while (e) {
+    siCachedQuery *next = e->next;
+    cachedQuery_Free(e);
+    e = next;
+  }
+  kh_destroy(siQueryCache, c->h);
+  free(c);
+}
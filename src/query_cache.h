@@ -0,0 +1,46 @@
+#ifndef __SI_QUERY_CACHE_H__
+#define __SI_QUERY_CACHE_H__
+
+#include "query.h"
+#include "spec.h"
+
+/*
+* A cache of parsed and planned queries, by the exact text of their WHERE
+* clause.
+*
+* Applications send the same few query shapes over and over, and lexing,
+* parsing, normalizing and planning them is a visible part of the latency of
+* small lookups. Each index keeps its most recently used queries: the
+* normalized query tree, and the plan last built from it. Plans depend on the
+* query's ORDER BY, so a query ordered differently than the cached plan gets
+* a new plan, built from the cached tree.
+*
+* Queries executing a cached plan work on their own copy of it, which leaves
+* the cached plan unchanged. Queries using NOW or TODAY depend on the time
+* they are parsed, and are never cached.
+*
+* The cache belongs to its index, and is dropped with it. It is only used by
+* the thread writing the index.
+*/
+
+// the number of queries cached per index
+#define SI_QUERY_CACHE_SIZE 1024
+
+typedef struct siQueryCache SIQueryCache;
+
+SIQueryCache *SI_NewQueryCache(size_t cap);
+
+/* Parse a WHERE clause into a query like SI_ParseQuery does, taking its tree
+ * and plan from the cache if it was parsed before. The query's ORDER BY must
+ * already be set. A query with a cached plan carries a copy of the plan rather
+ * than a tree. Returns 0 on a parsing error, which is not cached, or if the
+ * clause has parameters */
+int SIQueryCache_Parse(SIQueryCache *c, SIQuery *q, const char *str,
+                       size_t len, SISpec *spec, char **err);
+
+/* Return the number of cached queries */
+size_t SIQueryCache_Len(SIQueryCache *c);
+
+void SIQueryCache_Free(SIQueryCache *c);
+
+#endif
@@ -0,0 +1,295 @@
+#include <strings.h>
+#include <sys/param.h>
+#include "query_filter.h"
+#include "rmutil/alloc.h"
+
+// not null - used for ranges that are unbounded on both sides
+#define FI_NOTNULL (FI_ISNULL + 1)
+
+#define FI_KIND_BITS 3
+#define FI_CODE(op, kind) ((op) << FI_KIND_BITS | (kind))
+#define FI_OP(code) ((code) >> FI_KIND_BITS)
+
+/* Get the filter value kind of a property type */
+SIFilterKind filterKind(SIType t) {
+  switch (t) {
+  case T_STRING:
+    return FK_STRING;
+  case T_INT64:
+    return FK_INT64;
+  case T_UINT:
+    return FK_UINT;
+  case T_FLOAT:
+    return FK_FLOAT;
+  case T_DOUBLE:
+    return FK_DOUBLE;
+  case T_TIME:
+    return FK_TIME;
+  // bools are stored and compared as ints
+  case T_BOOL:
+  case T_INT32:
+  default:
+    return FK_INT32;
+  }
+}
+
+/* Cast a predicate value to the property type and store it in dst, which then
+ * owns the value. Returns 0 if the value cannot be cast */
+int filterOperand(SIValue *dst, SIValue src, SIType t) {
+  SIValue v = src;
+  if (v.type != t && !castPredicateValue(&v, t)) {
+    return 0;
+  }
+  // casting a number to a string allocates a new string, otherwise we need a
+  // reference of our own
+  if (v.type == T_STRING && src.type == T_STRING) {
+    SIValue_IncRef(&v);
+  }
+  *dst = v;
+  return 1;
+}
+
+/* Build a value set for an IN predicate, with its values cast to the property
+ * type. Values that cannot be cast can never match, and are skipped */
+SIValueSet *filterInSet(SIPredicate *pred, SIType t) {
+  SIValue *vals = calloc(pred->in.numvals, sizeof(SIValue));
+  size_t num = 0;
+  for (size_t i = 0; i < pred->in.numvals; i++) {
+    if (filterOperand(&vals[num], pred->in.vals[i], t)) {
+      num++;
+    }
+  }
+
+  SIValueSet *set = SI_NewValueSet(vals, num);
+  // the set keeps its own references
+  for (size_t i = 0; i < num; i++) {
+    SIValue_Free(&vals[i]);
+  }
+  free(vals);
+  return set;
+}
+
+/* Compile a single predicate into an instruction */
+void compilePredicate(SIFilterInstr *in, SIPredicate *pred, SISpec *spec) {
+  in->code = FI_CODE(FI_FALSE, 0);
+  if (pred->propId < 0 || pred->propId >= spec->numProps) {
+    return;
+  }
+  in->propId = pred->propId;
+
+  SIType t = spec->properties[pred->propId].type;
+  SIFilterKind k = filterKind(t);
+
+  switch (pred->t) {
+  case PRED_EQ:
+    if (filterOperand(&in->a, pred->eq.v, t)) {
+      in->code = FI_CODE(FI_EQ, k);
+    }
+    break;
+
+  case PRED_NE:
+    // a value of the wrong type is different from any key
+    in->code = filterOperand(&in->a, pred->ne.v, t) ? FI_CODE(FI_NE, k)
+                                                     : FI_CODE(FI_TRUE, 0);
+    break;
+
+  case PRED_RNG: {
+    int minInf = SIValue_IsNegativeInf(&pred->rng.min);
+    int maxInf = SIValue_IsInf(&pred->rng.max);
+    if (SIValue_IsInf(&pred->rng.min) || SIValue_IsNegativeInf(&pred->rng.max)) {
+      // empty range
+      break;
+    }
+    in->minExclusive = pred->rng.minExclusive;
+    in->maxExclusive = pred->rng.maxExclusive;
+
+    if (minInf && maxInf) {
+      in->code = FI_CODE(FI_NOTNULL, 0);
+    } else if (minInf) {
+      if (filterOperand(&in->a, pred->rng.max, t)) {
+        in->code = FI_CODE(in->maxExclusive ? FI_LT : FI_LE, k);
+      }
+    } else if (maxInf) {
+      if (filterOperand(&in->a, pred->rng.min, t)) {
+        in->code = FI_CODE(in->minExclusive ? FI_GT : FI_GE, k);
+      }
+    } else if (filterOperand(&in->a, pred->rng.min, t)) {
+      if (filterOperand(&in->b, pred->rng.max, t)) {
+        in->code = FI_CODE(FI_BETWEEN, k);
+      }
+    }
+    break;
+  }
+
+  case PRED_IN:
+    in->set = filterInSet(pred, t);
+    in->code = FI_CODE(FI_IN, 0);
+    break;
+
+  case PRED_ISNULL:
+    in->code = FI_CODE(FI_ISNULL, 0);
+    break;
+  }
+}
+
+/* Return the number of instructions a node compiles into */
+int filterNodeSize(SIQueryNode *n) {
+  if (n->type == QN_LOGIC) {
+    return filterNodeSize(n->op.left) + filterNodeSize(n->op.right);
+  }
+  return 1;
+}
+
+/* Compile a node into the program at pos, jumping to onTrue or onFalse
+ * according to its result */
+void compileNode(SIFilter *f, SIQueryNode *n, int pos, int onTrue, int onFalse,
+                 SISpec *spec) {
+  // passthrough nodes always evaluate to true
+  if (n->type & QN_PASSTHRU) {
+    f->instrs[pos].code = FI_CODE(FI_TRUE, 0);
+  } else if (n->type == QN_PRED) {
+    compilePredicate(&f->instrs[pos], &n->pred, spec);
+  } else {
+    // the right node's code follows the left node's code. For AND we only
+    // continue to the right node if the left is true, for OR if it's false
+    int rpos = pos + filterNodeSize(n->op.left);
+    if (n->op.op == OP_OR) {
+      compileNode(f, n->op.left, pos, onTrue, rpos, spec);
+    } else {
+      compileNode(f, n->op.left, pos, rpos, onFalse, spec);
+    }
+    compileNode(f, n->op.right, rpos, onTrue, onFalse, spec);
+    return;
+  }
+
+  f->instrs[pos].onTrue = onTrue;
+  f->instrs[pos].onFalse = onFalse;
+}
+
+SIFilter *SI_CompileFilter(SIQueryNode *root, SISpec *spec) {
+  if (!root || root->type & QN_PASSTHRU) {
+    return NULL;
+  }
+
+  SIFilter *f = malloc(sizeof(SIFilter));
+  f->numInstrs = filterNodeSize(root);
+  f->instrs = calloc(f->numInstrs, sizeof(SIFilterInstr));
+  f->numEvals = 0;
+  f->numSteps = 0;
+  for (int i = 0; i < f->numInstrs; i++) {
+    f->instrs[i].a = SI_NullVal();
+    f->instrs[i].b = SI_NullVal();
+  }
+
+  compileNode(f, root, 0, SI_FILTER_ACCEPT, SI_FILTER_REJECT, spec);
+  return f;
+}
+
+/* Compare strings the same way the index comparator does */
+static inline int __filterStrCmp(SIString *s1, SIString *s2) {
+  int cmp = strncasecmp(s1->str, s2->str, MIN(s1->len, s2->len));
+  if (cmp == 0 && s1->len != s2->len) {
+    return s1->len > s2->len ? 1 : -1;
+  }
+  return cmp;
+}
+
+#define __NUMERIC_INSTR_CASES(K, memb)                                        \
+  case FI_CODE(FI_EQ, K):                                                     \
+    return k->memb == in->a.memb;                                             \
+  case FI_CODE(FI_NE, K):                                                     \
+    return k->memb != in->a.memb;                                             \
+  case FI_CODE(FI_GT, K):                                                     \
+    return k->memb > in->a.memb;                                              \
+  case FI_CODE(FI_GE, K):                                                     \
+    return k->memb >= in->a.memb;                                             \
+  case FI_CODE(FI_LT, K):                                                     \
+    return k->memb < in->a.memb;                                              \
+  case FI_CODE(FI_LE, K):                                                     \
+    return k->memb <= in->a.memb;                                             \
+  case FI_CODE(FI_BETWEEN, K):                                                \
+    return (in->minExclusive ? k->memb > in->a.memb : k->memb >= in->a.memb) && \
+           (in->maxExclusive ? k->memb < in->b.memb : k->memb <= in->b.memb);
+
+static inline int evalInstr(SIFilterInstr *in, SIValue *k) {
+  // NULL keys only pass NULL checks and inequality
+  if (k->type == T_NULL) {
+    switch (FI_OP(in->code)) {
+    case FI_TRUE:
+    case FI_NE:
+    case FI_ISNULL:
+      return 1;
+    default:
+      return 0;
+    }
+  }
+
+  switch (in->code) {
+  case FI_CODE(FI_TRUE, 0):
+  case FI_CODE(FI_NOTNULL, 0):
+    return 1;
+  case FI_CODE(FI_FALSE, 0):
+  case FI_CODE(FI_ISNULL, 0):
+    return 0;
+  case FI_CODE(FI_IN, 0):
+    return SIValueSet_Contains(in->set, k);
+
+    __NUMERIC_INSTR_CASES(FK_INT32, intval);
+    __NUMERIC_INSTR_CASES(FK_INT64, longval);
+    __NUMERIC_INSTR_CASES(FK_UINT, uintval);
+    __NUMERIC_INSTR_CASES(FK_FLOAT, floatval);
+    __NUMERIC_INSTR_CASES(FK_DOUBLE, doubleval);
+    __NUMERIC_INSTR_CASES(FK_TIME, timeval);
+
+  case FI_CODE(FI_EQ, FK_STRING):
+    return k->stringval.len == in->a.stringval.len &&
+           !strncasecmp(k->stringval.str, in->a.stringval.str,
+                        k->stringval.len);
+  case FI_CODE(FI_NE, FK_STRING):
+    return k->stringval.len != in->a.stringval.len ||
+           strncasecmp(k->stringval.str, in->a.stringval.str,
+                       k->stringval.len);
+  case FI_CODE(FI_GT, FK_STRING):
+    return __filterStrCmp(&k->stringval, &in->a.stringval) > 0;
+  case FI_CODE(FI_GE, FK_STRING):
+    return __filterStrCmp(&k->stringval, &in->a.stringval) >= 0;
+  case FI_CODE(FI_LT, FK_STRING):
+    return __filterStrCmp(&k->stringval, &in->a.stringval) < 0;
+  case FI_CODE(FI_LE, FK_STRING):
+    return __filterStrCmp(&k->stringval, &in->a.stringval) <= 0;
+  case FI_CODE(FI_BETWEEN, FK_STRING): {
+    int minc = __filterStrCmp(&k->stringval, &in->a.stringval);
+    if (minc < 0 || (minc == 0 && in->minExclusive)) {
+      return 0;
+    }
+    int maxc = __filterStrCmp(&k->stringval, &in->b.stringval);
+    return maxc < 0 || (maxc == 0 && !in->maxExclusive);
+  }
+  default:
+    return 0;
+  }
+}
+
+int SIFilter_Eval(SIFilter *f, SIMultiKey *mk) {
+  f->numEvals++;
+  int pc = 0;
+  // jumps are always forward, so this always ends
+  while (pc >= 0) {
+    SIFilterInstr *in = &f->instrs[pc];
+    f->numSteps++;
+    pc = evalInstr(in, &mk->keys[in->propId]) ? in->onTrue : in->onFalse;
+  }
+  return pc == SI_FILTER_ACCEPT;
+}
+
+void SIFilter_Free(SIFilter *f) {
+  for (int i = 0; i < f->numInstrs; i++) {
+    SIValue_Free(&f->instrs[i].a);
+    SIValue_Free(&f->instrs[i].b);
+    if (f->instrs[i].set) {
+      SIValueSet_Free(f->instrs[i].set);
+    }
+  }
+  free(f->instrs);
+  free(f);
+}
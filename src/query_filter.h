@@ -0,0 +1,84 @@
+#ifndef __SI_QUERY_FILTER_H__
+#define __SI_QUERY_FILTER_H__
+
+#include "key.h"
+#include "query.h"
+#include "spec.h"
+#include "value_set.h"
+
+/*
+* A filter tree compiled into a flat program of predicate instructions.
+*
+* Each instruction tests a single property of the scanned key, and jumps to
+* another instruction (always forward) depending on the result, or ends the
+* evaluation with an accept/reject decision. AND/OR nodes are expressed as
+* short-circuit jumps, so no recursion is needed to evaluate the program.
+*
+* Instructions are specialized by the property type at compile time, and
+* their values are cast to that type, so evaluation does not need comparator
+* function pointers.
+*/
+
+/* Jump targets that end the evaluation */
+#define SI_FILTER_ACCEPT -1
+#define SI_FILTER_REJECT -2
+
+typedef enum {
+  FI_TRUE,
+  FI_FALSE,
+  FI_EQ,
+  FI_NE,
+  FI_GT,
+  FI_GE,
+  FI_LT,
+  FI_LE,
+  FI_BETWEEN,
+  FI_IN,
+  FI_ISNULL,
+} SIFilterOp;
+
+/* The value representation the instruction compares */
+typedef enum {
+  FK_INT32,
+  FK_INT64,
+  FK_UINT,
+  FK_FLOAT,
+  FK_DOUBLE,
+  FK_TIME,
+  FK_STRING,
+} SIFilterKind;
+
+typedef struct {
+  // the instruction code, combining the op and the kind
+  u_int16_t code;
+  u_int8_t propId;
+  u_int8_t minExclusive : 1;
+  u_int8_t maxExclusive : 1;
+  int onTrue;
+  int onFalse;
+  // the operand for comparisons, or the min of a range
+  SIValue a;
+  // the max of a range
+  SIValue b;
+  SIValueSet *set;
+} SIFilterInstr;
+
+typedef struct {
+  SIFilterInstr *instrs;
+  int numInstrs;
+
+  // evaluation counters, making the filter's cost measurable
+  size_t numEvals;
+  size_t numSteps;
+} SIFilter;
+
+/* Compile a (cleaned) filter tree into a filter program. Returns NULL if there
+ * is nothing to filter */
+SIFilter *SI_CompileFilter(SIQueryNode *root, SISpec *spec);
+
+/* Evaluate a key against the filter. Returns 1 if it passes, 0 otherwise */
+int SIFilter_Eval(SIFilter *f, SIMultiKey *mk);
+
+void SIFilter_Free(SIFilter *f);
+
+#endif
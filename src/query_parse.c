@@ -1,91 +1,406 @@
+#include <string.h>
+#include <strings.h>
+#include <time.h>
 #include "query.h"
-#include "parser/parser_common.h"
+#include "parser/lexer.h"
 #include "rmutil/alloc.h"
 
-SIQueryNode *toQueryNode(PredicateNode *n) {
-  switch (n->op) {
-    case EQ:
+/* WHERE expressions are parsed by recursive descent, building the query tree
+ * straight from the tokens. All the parser's state is in its context, so any
+ * number of queries can be parsed at once, on any thread.
+ *
+ * OR binds tighter than AND, so a AND b OR c is a AND (b OR c) */
 
-      return SI_PredEquals(n->val);
+// the maximal nesting of parentheses
+#define SI_PARSE_MAX_DEPTH 100
 
-    case GT:
-    case GE:
-      // > --> betweetn val and inf (NULL value), exclusive min
-      return SI_PredBetween(n->val, SI_InfVal(), n->op == GT, 0);
+typedef struct {
+  SILexer lx;
+  // the lookahead token
+  SIToken tok;
+  SIQuery *q;
+  SISpec *spec;
+  int depth;
+  char *errorMsg;
+} parseCtx;
 
-    case LT:
-    case LE:
-      return SI_PredBetween(SI_NegativeInfVal(), n->val, 0, n->op == LT);
+void parser_advance(parseCtx *ctx) { ctx->tok = SILexer_Next(&ctx->lx); }
 
-    case IN:
-      return SI_PredIn(n->lst);
+/* Fail on the lookahead token. Always returns 0 */
+int parser_error(parseCtx *ctx) {
+  if (!ctx->errorMsg) {
+    SIToken t = ctx->tok;
+    // strings are quoted back
+    if (t.type == SI_TOK_STRING) {
+      t.text--;
+      t.len += 2;
+    }
+    const char *fmt = "Syntax error in WHERE line %d near '%.*s'";
+    int len = snprintf(NULL, 0, fmt, t.line, (int)t.len, t.text);
+    ctx->errorMsg = malloc(len + 1);
+    snprintf(ctx->errorMsg, len + 1, fmt, t.line, (int)t.len, t.text);
+  }
+  return 0;
+}
 
-    case LIKE:
-      // support LIKE 'fff%' wildcard
-      if (n->val.stringval.len > 0 &&
-          n->val.stringval.str[n->val.stringval.len - 1] == '%') {
-        SIString min = n->val.stringval, max = n->val.stringval;
-        // disregard the first character.
-        min.len--;
+int parser_expect(parseCtx *ctx, SITokenType type) {
+  if (ctx->tok.type != type) {
+    return parser_error(ctx);
+  }
+  parser_advance(ctx);
+  return 1;
+}
 
-        max.str[max.len - 1] = '\xff';
-        return SI_PredBetween(SI_StringVal(min), SI_StringVal(max), 0, 0);
-      } else {
-        return SI_PredEquals(n->val);
-      }
+/* Copy a numeric token to a NUL terminated buffer, for strtoll and strtod */
+int parser_number(parseCtx *ctx, SITokenType type, char *buf, size_t size) {
+  if (ctx->tok.type != type || ctx->tok.len >= size) {
+    return parser_error(ctx);
+  }
+  memcpy(buf, ctx->tok.text, ctx->tok.len);
+  buf[ctx->tok.len] = 0;
+  parser_advance(ctx);
+  return 1;
+}
 
-    case IS:
+int parser_integer(parseCtx *ctx, int64_t *v) {
+  char buf[32];
+  if (!parser_number(ctx, SI_TOK_INTEGER, buf, sizeof(buf))) {
+    return 0;
+  }
+  *v = strtoll(buf, NULL, 10);
+  return 1;
+}
 
-      if (SIValue_IsNull(n->val)) {
-        return SI_PredIsNull();
-      }
+/* UNIT(n), e.g. DAYS(2), in seconds */
+int parser_duration(parseCtx *ctx, int64_t *d) {
+  int64_t unit;
+  switch (ctx->tok.type) {
+  case SI_TOK_DAYS:
+    unit = 86400;
+    break;
+  case SI_TOK_HOURS:
+    unit = 3600;
+    break;
+  case SI_TOK_MINUTES:
+    unit = 60;
+    break;
+  case SI_TOK_SECONDS:
+    unit = 1;
+    break;
+  default:
+    return parser_error(ctx);
+  }
+  parser_advance(ctx);
 
-    default:
-      printf("Operator %d not supported!", n->op);
-      return NULL;
+  int64_t n;
+  if (!parser_expect(ctx, SI_TOK_LP) || !parser_integer(ctx, &n) ||
+      !parser_expect(ctx, SI_TOK_RP)) {
+    return 0;
   }
+  *d = n * unit;
+  return 1;
 }
 
-SIQueryNode *traverseNode(SIQuery *q, ParseNode *n, SISpec *spec) {
-  if (!n) return NULL;
+/* NOW, TODAY, UNIX(ts), or TIME_ADD / TIME_SUB of a timestamp and a
+ * duration */
+int parser_timestamp(parseCtx *ctx, time_t *ts) {
+  SITokenType type = ctx->tok.type;
+  switch (type) {
+  case SI_TOK_NOW:
+    parser_advance(ctx);
+    ctx->q->timeDependent = 1;
+    *ts = time(NULL);
+    return 1;
 
-  if (n->t == N_COND) {
-    return SIQuery_NewLogicNode(traverseNode(q, n->cn.left, spec),
-                                n->cn.op == OR ? OP_OR : OP_AND,
-                                traverseNode(q, n->cn.right, spec));
-  } else {
-    SIQueryNode *ret = toQueryNode(&n->pn);
+  case SI_TOK_TODAY:
+    parser_advance(ctx);
+    ctx->q->timeDependent = 1;
+    *ts = time(NULL);
+    *ts -= *ts % 86400;
+    return 1;
+
+  case SI_TOK_UNIX: {
+    int64_t n;
+    parser_advance(ctx);
+    if (!parser_expect(ctx, SI_TOK_LP) || !parser_integer(ctx, &n) ||
+        !parser_expect(ctx, SI_TOK_RP)) {
+      return 0;
+    }
+    *ts = (time_t)n;
+    return 1;
+  }
+
+  case SI_TOK_TIME_ADD:
+  case SI_TOK_TIME_SUB: {
+    int64_t d;
+    parser_advance(ctx);
+    if (!parser_expect(ctx, SI_TOK_LP) || !parser_timestamp(ctx, ts) ||
+        !parser_expect(ctx, SI_TOK_COMMA) || !parser_duration(ctx, &d) ||
+        !parser_expect(ctx, SI_TOK_RP)) {
+      return 0;
+    }
+    *ts += type == SI_TOK_TIME_ADD ? d : -d;
+    return 1;
+  }
+
+  default:
+    return parser_error(ctx);
+  }
+}
+
+/* A literal value. Strings are copied once, into the value */
+int parser_value(parseCtx *ctx, SIValue *v) {
+  switch (ctx->tok.type) {
+  case SI_TOK_INTEGER: {
+    int64_t n;
+    if (!parser_integer(ctx, &n)) {
+      return 0;
+    }
+    *v = SI_LongVal(n);
+    return 1;
+  }
+
+  case SI_TOK_FLOAT: {
+    char buf[64];
+    if (!parser_number(ctx, SI_TOK_FLOAT, buf, sizeof(buf))) {
+      return 0;
+    }
+    *v = SI_DoubleVal(strtod(buf, NULL));
+    return 1;
+  }
+
+  case SI_TOK_STRING:
+    *v = SI_StringVal(SIString_Copy(
+        (SIString){.str = (char *)ctx->tok.text, .len = ctx->tok.len}));
+    parser_advance(ctx);
+    return 1;
+
+  case SI_TOK_TRUE:
+  case SI_TOK_FALSE:
+    *v = SI_BoolVal(ctx->tok.type == SI_TOK_TRUE);
+    parser_advance(ctx);
+    return 1;
+
+  // parameters are numbered in the order they appear
+  case SI_TOK_PARAM:
+    *v = SI_ParamVal(ctx->q->numParams++);
+    parser_advance(ctx);
+    return 1;
+
+  default: {
+    time_t ts;
+    if (!parser_timestamp(ctx, &ts)) {
+      return 0;
+    }
+    *v = SI_TimeVal(ts);
+    return 1;
+  }
+  }
+}
+
+/* The id of a property, either an enumerator or a name. Names not in the spec
+ * get -1, which makes query validation fail */
+int parser_property(parseCtx *ctx) {
+  if (ctx->tok.type == SI_TOK_ENUMERATOR) {
     // prop ids start at index 1, here we convert them to zero-index
-    if (n->pn.prop.name && spec != NULL) {
-      SIIndexProperty *ip =
-          SISpec_PropertyByName(spec, n->pn.prop.name, &ret->pred.propId);
-      // if we couldn't find the property name, we set the id to -1, which will
-      // make query validation fail
-      if (!ip) {
-        ret->pred.propId = -1;
-      }
+    return ctx->tok.text[1] - '0' - 1;
+  }
+  for (int i = 0; ctx->spec && i < ctx->spec->numProps; i++) {
+    const char *name = ctx->spec->properties[i].name;
+    if (name && strlen(name) == ctx->tok.len &&
+        !strncasecmp(name, ctx->tok.text, ctx->tok.len)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* (v1, v2, ...), with at least two values */
+SIQueryNode *parser_in(parseCtx *ctx) {
+  if (!parser_expect(ctx, SI_TOK_LP)) {
+    return NULL;
+  }
+
+  SIValueVector vals = SI_NewValueVector(2);
+  SIQueryNode *n = NULL;
+  for (;;) {
+    SIValue v;
+    if (!parser_value(ctx, &v)) {
+      goto end;
+    }
+    SIValueVector_Append(&vals, v);
+    if (vals.len > 1 && ctx->tok.type != SI_TOK_COMMA) {
+      break;
+    }
+    if (!parser_expect(ctx, SI_TOK_COMMA)) {
+      goto end;
+    }
+  }
+  if (parser_expect(ctx, SI_TOK_RP)) {
+    n = SI_PredIn(vals);
+  }
+
+end:
+  SIValueVector_Free(&vals);
+  return n;
+}
+
+/* A single predicate on a property */
+SIQueryNode *parser_predicate(parseCtx *ctx) {
+  if (ctx->tok.type != SI_TOK_ENUMERATOR && ctx->tok.type != SI_TOK_IDENT) {
+    parser_error(ctx);
+    return NULL;
+  }
+  int propId = parser_property(ctx);
+  parser_advance(ctx);
+
+  SIQueryNode *n = NULL;
+  SITokenType op = ctx->tok.type;
+  SIValue v;
+  switch (op) {
+  case SI_TOK_EQ:
+  case SI_TOK_NE:
+  case SI_TOK_GT:
+  case SI_TOK_GE:
+  case SI_TOK_LT:
+  case SI_TOK_LE:
+    parser_advance(ctx);
+    if (!parser_value(ctx, &v)) {
+      return NULL;
+    }
+    if (op == SI_TOK_EQ) {
+      n = SI_PredEquals(v);
+    } else if (op == SI_TOK_NE) {
+      n = SI_PredNotEquals(v);
+    } else if (op == SI_TOK_GT || op == SI_TOK_GE) {
+      // > --> between val and inf, exclusive min
+      n = SI_PredBetween(v, SI_InfVal(), op == SI_TOK_GT, 0);
+    } else {
+      n = SI_PredBetween(SI_NegativeInfVal(), v, 0, op == SI_TOK_LT);
+    }
+    SIValue_Free(&v);
+    break;
+
+  case SI_TOK_LIKE:
+    // LIKE only applies to strings
+    parser_advance(ctx);
+    if (ctx->tok.type != SI_TOK_STRING) {
+      parser_error(ctx);
+      return NULL;
+    }
+    parser_value(ctx, &v);
+
+    // support LIKE 'fff%' wildcard
+    SIString s = v.stringval;
+    if (s.len > 0 && s.str[s.len - 1] == '%') {
+      SIString min = s, max = s;
+      // disregard the last character
+      min.len--;
+      max.str[max.len - 1] = '\xff';
+      n = SI_PredBetween(SI_StringVal(min), SI_StringVal(max), 0, 0);
     } else {
-      ret->pred.propId = n->pn.prop.id - 1;
+      n = SI_PredEquals(v);
+    }
+    SIValue_Free(&v);
+    break;
+
+  case SI_TOK_IS:
+    parser_advance(ctx);
+    if (!parser_expect(ctx, SI_TOK_NULL)) {
+      return NULL;
     }
+    n = SI_PredIsNull();
+    break;
 
-    q->numPredicates++;
-    return ret;
+  case SI_TOK_IN:
+    parser_advance(ctx);
+    if (NULL == (n = parser_in(ctx))) {
+      return NULL;
+    }
+    break;
+
+  default:
+    parser_error(ctx);
+    return NULL;
+  }
+
+  n->pred.propId = propId;
+  ctx->q->numPredicates++;
+  return n;
+}
+
+SIQueryNode *parser_and(parseCtx *ctx);
+
+/* A predicate, or a condition in parentheses */
+SIQueryNode *parser_primary(parseCtx *ctx) {
+  if (ctx->tok.type != SI_TOK_LP) {
+    return parser_predicate(ctx);
+  }
+  if (ctx->depth == SI_PARSE_MAX_DEPTH) {
+    parser_error(ctx);
+    return NULL;
+  }
+  parser_advance(ctx);
+  ctx->depth++;
+  SIQueryNode *n = parser_and(ctx);
+  ctx->depth--;
+  if (n && !parser_expect(ctx, SI_TOK_RP)) {
+    SIQueryNode_Free(n);
+    return NULL;
+  }
+  return n;
+}
+
+/* A chain of operands joined by op, associating to the left */
+SIQueryNode *parser_chain(parseCtx *ctx, SITokenType op,
+                          SIQueryNode *(*operand)(parseCtx *)) {
+  SIQueryNode *n = operand(ctx);
+  while (n && ctx->tok.type == op) {
+    parser_advance(ctx);
+    SIQueryNode *right = operand(ctx);
+    if (!right) {
+      SIQueryNode_Free(n);
+      return NULL;
+    }
+    n = SIQuery_NewLogicNode(n, op == SI_TOK_OR ? OP_OR : OP_AND, right);
   }
+  return n;
+}
+
+SIQueryNode *parser_or(parseCtx *ctx) {
+  return parser_chain(ctx, SI_TOK_OR, parser_primary);
+}
+
+SIQueryNode *parser_and(parseCtx *ctx) {
+  return parser_chain(ctx, SI_TOK_AND, parser_or);
 }
 
 int SI_ParseQuery(SIQuery *query, const char *q, size_t len, SISpec *spec,
                   char **errorMsg) {
   // TODO: Query validation!
   query->numPredicates = 0;
+  query->numParams = 0;
+
+  parseCtx ctx = {.lx = SI_NewLexer(q, len), .q = query, .spec = spec};
+  parser_advance(&ctx);
+  SIQueryNode *root = parser_and(&ctx);
+  if (root && ctx.tok.type != SI_TOK_EOF) {
+    parser_error(&ctx);
+    SIQueryNode_Free(root);
+    root = NULL;
+  }
 
-  ParseNode *root = ParseQuery(q, len, errorMsg);
+  if (errorMsg) {
+    *errorMsg = ctx.errorMsg;
+  } else {
+    free(ctx.errorMsg);
+  }
   if (!root) {
+    query->numPredicates = 0;
+    query->numParams = 0;
     return 0;
   }
-  ParseNode_print(root, 0);
-
-  query->root = traverseNode(query, root, spec);
-  ParseNode_Free(root);
+  query->root = root;
   return 1;
 }
 
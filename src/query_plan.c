@@ -1,11 +1,12 @@
 #include "query_plan.h"
-#include "rmutil/vector.h"
+#include "query_filter.h"
 #include <stdio.h>
+#include <sys/param.h>
 #include "rmutil/alloc.h"
 
-/* Get the most relevant predicate for the current leftmost property id. Returns
- * NULL if no such predicate exists */
-SIPredicate *getPredicate(SIQueryNode *node, int propId) {
+/* Get the most relevant predicate node for the current leftmost property id.
+ * Returns NULL if no such predicate exists */
+SIQueryNode *getPredicateNode(SIQueryNode *node, int propId) {
   if (!node || node->type & QN_PASSTHRU) {
     return NULL;
   }
@@ -15,18 +16,18 @@ SIPredicate *getPredicate(SIQueryNode *node, int propId) {
     // filter tree
     if (node->pred.propId == propId) {
       node->type |= QN_PASSTHRU;
-      return &node->pred;
+      return node;
     }
     break;
   case QN_LOGIC:
     // we only use AND nodes in building scan ranges
     if (node->op.op == OP_AND) {
-      SIPredicate *p = getPredicate(node->op.left, propId);
+      SIQueryNode *p = getPredicateNode(node->op.left, propId);
 
       // no predicate from the left node means it's probably a passthru
       // so let's try the right now
       if (!p) {
-        p = getPredicate(node->op.right, propId);
+        p = getPredicateNode(node->op.right, propId);
       }
       return p;
     }
@@ -38,9 +39,23 @@ SIPredicate *getPredicate(SIQueryNode *node, int propId) {
   return NULL;
 }
 
+/* Copy a predicate value into a scan key, cast to the property type so it
+ * compares correctly with the index keys. If the value cannot be cast, it is
+ * copied as is */
+SIValue planKeyValue(SIValue v, SIType t) {
+  SIValue ret = SIValue_Copy(v);
+  if (ret.type != t && castPredicateValue(&ret, t) && v.type == T_STRING &&
+      ret.type != T_STRING) {
+    // the cast replaced our string reference with a number
+    SIValue_Free(&v);
+  }
+  return ret;
+}
+
 /* Convert a single predicate to a list of scan ranges of (min,max, exclusive or
- * not). Returns an allocated list that must be freed later */
-siPlanRangeKey *predicateToRanges(SIPredicate *pred, size_t *numRanges,
+ * not). Returns an allocated list that must be freed later. The values are
+ * copied, so the list does not depend on the predicate's lifetime */
+siPlanRangeKey *predicateToRanges(SIPredicate *pred, SIType t, size_t *numRanges,
                                   int *isLast) {
   siPlanRangeKey *ret = NULL;
   *numRanges = 0;
@@ -49,7 +64,8 @@ siPlanRangeKey *predicateToRanges(SIPredicate *pred, size_t *numRanges,
   case PRED_EQ: {
     ret = malloc(sizeof(siPlanRangeKey));
     *numRanges = 1;
-    ret->min = ret->max = &(pred->eq.v);
+    ret->min = planKeyValue(pred->eq.v, t);
+    ret->max = planKeyValue(pred->eq.v, t);
     ret->minExclusive = 0;
     ret->maxExclusive = 0;
     break;
@@ -57,8 +73,8 @@ siPlanRangeKey *predicateToRanges(SIPredicate *pred, size_t *numRanges,
   case PRED_RNG: {
     ret = malloc(sizeof(siPlanRangeKey));
     *numRanges = 1;
-    ret->min = &(pred->rng.min);
-    ret->max = &(pred->rng.max);
+    ret->min = planKeyValue(pred->rng.min, t);
+    ret->max = planKeyValue(pred->rng.max, t);
     ret->minExclusive = pred->rng.minExclusive;
     ret->maxExclusive = pred->rng.maxExclusive;
     *isLast = 1;
@@ -68,8 +84,8 @@ siPlanRangeKey *predicateToRanges(SIPredicate *pred, size_t *numRanges,
   case PRED_ISNULL: {
     ret = malloc(sizeof(siPlanRangeKey));
     *numRanges = 1;
-    ret->min = &(pred->eq.v);
-    ret->max = &(pred->eq.v);
+    ret->min = planKeyValue(pred->eq.v, t);
+    ret->max = planKeyValue(pred->eq.v, t);
     ret->minExclusive = 0;
     ret->maxExclusive = 0;
     break;
@@ -80,8 +96,8 @@ siPlanRangeKey *predicateToRanges(SIPredicate *pred, size_t *numRanges,
     *numRanges = pred->in.numvals;
 
     for (int i = 0; i < pred->in.numvals; i++) {
-      ret[i].min = &pred->in.vals[i];
-      ret[i].max = &pred->in.vals[i];
+      ret[i].min = planKeyValue(pred->in.vals[i], t);
+      ret[i].max = planKeyValue(pred->in.vals[i], t);
       ret[i].minExclusive = 0;
       ret[i].maxExclusive = 0;
     }
@@ -93,31 +109,75 @@ siPlanRangeKey *predicateToRanges(SIPredicate *pred, size_t *numRanges,
   return ret;
 }
 
-void buildKey(siPlanRangeKey **keys, size_t *keyNums, size_t *stack,
-              int numKeys, int keyIdx, Vector *result) {
-  // if possible - recursive reentry into the next level
-  if (keyIdx < numKeys) {
-    for (int i = 0; i < keyNums[keyIdx]; i++) {
-      stack[keyIdx] = i;
-      buildKey(keys, keyNums, stack, numKeys, keyIdx + 1, result);
-    }
+int planColumn_HasParams(siPlanColumn *col);
+
+void planColumn_Free(siPlanColumn *col) {
+  for (size_t i = 0; i < col->numKeys; i++) {
+    SIValue_Free(&col->keys[i].min);
+    SIValue_Free(&col->keys[i].max);
+  }
+  free(col->keys);
+}
+
+/* Sort a column's keys in index order, using a merge sort since qsort cannot
+ * pass the comparator along. Duplicate keys are removed, so the ranges we scan
+ * never overlap */
+void planColumn_Sort(siPlanColumn *col, SIKeyCmpFunc cmp) {
+  size_t n = col->numKeys;
+  if (n < 2) {
     return;
   }
+  siPlanRangeKey *keys = col->keys;
+  siPlanRangeKey *tmp = malloc(n * sizeof(siPlanRangeKey));
 
-  // if not - we're at the end, let's build the scan range up until here
-  siPlanRange *rng = malloc(sizeof(siPlanRange));
-  rng->min = malloc(sizeof(SIMultiKey) + numKeys * sizeof(SIValue));
-  rng->min->size = numKeys;
-  rng->max = malloc(sizeof(SIMultiKey) + numKeys * sizeof(SIValue));
-  rng->max->size = numKeys;
-  for (int i = 0; i < numKeys; i++) {
-    rng->min->keys[i] = SIValue_Copy(*keys[i][stack[i]].min);
-    rng->max->keys[i] = SIValue_Copy(*keys[i][stack[i]].max);
-    rng->minExclusive = keys[i][stack[i]].minExclusive;
-    rng->maxExclusive = keys[i][stack[i]].maxExclusive;
+  // bottom up merge of runs of doubling width
+  for (size_t w = 1; w < n; w *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * w) {
+      size_t mid = MIN(lo + w, n), hi = MIN(lo + 2 * w, n);
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) {
+        tmp[k++] = cmp(&keys[j].min, &keys[i].min, NULL) < 0 ? keys[j++]
+                                                             : keys[i++];
+      }
+      while (i < mid) tmp[k++] = keys[i++];
+      while (j < hi) tmp[k++] = keys[j++];
+    }
+    siPlanRangeKey *t = keys;
+    keys = tmp;
+    tmp = t;
   }
+  free(tmp);
 
-  Vector_Push(result, rng);
+  // only point keys can repeat, so comparing the mins is enough
+  size_t num = 1;
+  for (size_t i = 1; i < n; i++) {
+    if (cmp(&keys[i].min, &keys[num - 1].min, NULL) == 0) {
+      SIValue_Free(&keys[i].min);
+      SIValue_Free(&keys[i].max);
+    } else {
+      keys[num++] = keys[i];
+    }
+  }
+  col->keys = keys;
+  col->numKeys = num;
+}
+
+/* Check if scanning in index order yields the results in the query's order.
+ * This is the case if the ordered properties are consecutive index columns,
+ * and all the columns before them are fixed to a single value */
+int planIsOrdered(SIQuery *q, int *fixed, int numColumns) {
+  int first = q->orderBy[0];
+  for (int i = 0; i < first; i++) {
+    if (i >= numColumns || !fixed[i]) {
+      return 0;
+    }
+  }
+  for (int i = 1; i < q->numOrderBy; i++) {
+    if (q->orderBy[i] != first + i) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
 void cleanQueryNode(SIQueryNode **pn) {
@@ -148,25 +208,41 @@ void cleanQueryNode(SIQueryNode **pn) {
 }
 
 SIQueryPlan *SI_BuildQueryPlan(SIQuery *q, SISpec *spec) {
-  printf("spec %p\n", spec);
-  siPlanRangeKey *keys[q->numPredicates];
-  memset(keys, 0, q->numPredicates * sizeof(siPlanRangeKey *));
-  size_t keyNums[q->numPredicates];
+  if (q->plan) {
+    return SIQueryPlan_Copy(q->plan);
+  }
+
+  siPlanColumn columns[spec->numProps];
+  SIQueryNode *nodes[spec->numProps];
+  // columns fixed to a single value by an equality predicate
+  int fixed[spec->numProps];
+  // columns fixed to a single value within each range, i.e. not a range scan
+  int points[spec->numProps];
 
   // extract an array of all key ranges we need to traverse from this tree
-  int propId = 0;
-  SIPredicate *pred = NULL;
+  int numColumns = 0;
+  SIQueryNode *pn = NULL;
 
-  while (propId < spec->numProps &&
-         NULL != (pred = getPredicate(q->root, propId))) {
+  while (numColumns < spec->numProps &&
+         NULL != (pn = getPredicateNode(q->root, numColumns))) {
     int isLast = 0;
-    siPlanRangeKey *ka = predicateToRanges(pred, &(keyNums[propId]), &isLast);
-    if (!ka) {
-      keys[propId] = NULL;
+    siPlanColumn *col = &columns[numColumns];
+    SIType t = spec->properties[numColumns].type;
+    col->keys = predicateToRanges(&pn->pred, t, &col->numKeys, &isLast);
+    if (!col->keys) {
+      // we can't scan by this predicate, so it must be filtered
+      pn->type &= ~QN_PASSTHRU;
       break;
     }
 
-    keys[propId++] = ka;
+    // for ordered queries, the ranges must be scanned in index order. Keys
+    // with parameters are sorted once they're bound
+    if (q->numOrderBy && !planColumn_HasParams(col)) {
+      planColumn_Sort(col, SI_KeyCmpFunc(t));
+    }
+    fixed[numColumns] = !isLast && col->numKeys == 1;
+    points[numColumns] = !isLast;
+    nodes[numColumns++] = pn;
 
     if (isLast) {
       break;
@@ -174,55 +250,386 @@ SIQueryPlan *SI_BuildQueryPlan(SIQuery *q, SISpec *spec) {
   }
 
   // we couldn't compose a single scan range... let's disqualify the query
-  if (propId == 0) {
+  if (numColumns == 0) {
     return NULL;
   }
 
-  // convert this array into a list of ranges that is basically the cartesian
-  // product of all the possible keys
-  Vector *scanKeys = NewVector(siPlanRange *, q->numPredicates);
-  size_t stack[propId];
-  buildKey(keys, keyNums, stack, propId, 0, scanKeys);
+  // The ranges are the cartesian product of all the columns' keys, which can
+  // explode with a few large IN predicates. We only expand the longest prefix
+  // of columns that stays under the range limit, and the rest of the columns
+  // are evaluated as filters on the scanned keys instead.
+  size_t numRanges = columns[0].numKeys;
+  int expanded = 1;
+  while (expanded < numColumns) {
+    size_t n = columns[expanded].numKeys;
+    if (n > 1 && numRanges > SI_PLAN_MAX_RANGES / n) {
+      break;
+    }
+    numRanges *= n;
+    expanded++;
+  }
+  for (int i = expanded; i < numColumns; i++) {
+    nodes[i]->type &= ~QN_PASSTHRU;
+    planColumn_Free(&columns[i]);
+  }
 
   SIQueryPlan *pln = malloc(sizeof(SIQueryPlan));
   if (q->root->type & QN_PASSTHRU) {
     pln->filterTree = NULL;
   } else {
-    SIQueryNode_Print(q->root, 0);
     cleanQueryNode(&q->root);
-    pln->filterTree = q->root;
+    // all the predicates might have been consumed by the scan ranges
+    pln->filterTree = q->root->type & QN_PASSTHRU ? NULL : q->root;
   }
+  // compile the filter tree once, rather than walking it for each scanned key
+  pln->filter = SI_CompileFilter(pln->filterTree, spec);
 
-  // copy the ranges from the vector
-  pln->ranges = scanKeys;
-  pln->numRanges = Vector_Size(scanKeys);
+  pln->columns = malloc(expanded * sizeof(siPlanColumn));
+  memcpy(pln->columns, columns, expanded * sizeof(siPlanColumn));
+  pln->numColumns = expanded;
+  pln->numRanges = numRanges;
+  pln->ranges = NULL;
 
-  for (int i = 0; i < q->numPredicates; i++) {
-    if (keys[i] != NULL) {
-      free(keys[i]);
+  // if the index order can't yield the query order, the ids must be sorted. If
+  // each range is still scanned in order, a top-k sort can skip the rest of a
+  // range once it's full
+  pln->order = PLAN_ORDER_NONE;
+  if (q->numOrderBy) {
+    if (planIsOrdered(q, fixed, numColumns)) {
+      pln->order = PLAN_ORDER_SCAN;
+    } else if (planIsOrdered(q, points, expanded)) {
+      pln->order = PLAN_ORDER_RANGE;
+    } else {
+      pln->order = PLAN_ORDER_SORT;
     }
   }
+  pln->reverse = pln->order != PLAN_ORDER_NONE && q->orderDesc;
+  pln->shared = NULL;
+  pln->refcount = 1;
+  pln->bound = 0;
 
   return pln;
 }
 
-void SIQueryPlan_Free(SIQueryPlan *plan) {
-  if (plan->ranges) {
-    siPlanRange *rng = NULL;
-    for (int i = 0; i < plan->numRanges; i++) {
-      Vector_Get(plan->ranges, i, &rng);
-      if (rng->min) {
-        SIMultiKey_Free(rng->min);
+int SIQuery_Plan(SIQuery *q, SISpec *spec) {
+  if (q->plan) {
+    return 1;
+  }
+  if (!q->numPredicates) {
+    return 0;
+  }
+  // the planner consumes the predicates it scans by, so it plans a copy of the
+  // tree
+  SIQuery pq = *q;
+  pq.root = SIQueryNode_Clone(q->root);
+  q->plan = SI_BuildQueryPlan(&pq, spec);
+  SIQueryNode_Free(pq.root);
+  if (!q->plan) {
+    return 0;
+  }
+  q->plan->filterTree = NULL;
+  return 1;
+}
+
+SIQueryPlan *SIQueryPlan_Copy(SIQueryPlan *plan) {
+  // a plain copy shares the ranges of the plan it copies, so we can skip it
+  if (plan->shared && !plan->bound) {
+    plan = plan->shared;
+  }
+  // copies may be freed by other threads
+  __atomic_add_fetch(&plan->refcount, 1, __ATOMIC_RELAXED);
+
+  SIQueryPlan *cp = malloc(sizeof(SIQueryPlan));
+  *cp = *plan;
+  cp->filterTree = NULL;
+  cp->shared = plan;
+  cp->refcount = 1;
+  cp->bound = 0;
+  if (plan->filter) {
+    // the instructions are shared, but the counters are the copy's own
+    cp->filter = malloc(sizeof(SIFilter));
+    *cp->filter = *plan->filter;
+    cp->filter->numEvals = cp->filter->numSteps = 0;
+  }
+  return cp;
+}
+
+/* Return 1 if any of a column's keys is a parameter */
+int planColumn_HasParams(siPlanColumn *col) {
+  for (size_t i = 0; i < col->numKeys; i++) {
+    if (col->keys[i].min.type == T_PARAM || col->keys[i].max.type == T_PARAM) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+SIValue planBindValue(SIValue v, SIValue *params) {
+  return SIValue_Copy(v.type == T_PARAM ? params[v.intval] : v);
+}
+
+SIQueryPlan *SIQueryPlan_Bind(SIQueryPlan *plan, SIValue *params,
+                              SISpec *spec) {
+  SIQueryPlan *cp = SIQueryPlan_Copy(plan);
+
+  int bindRanges = 0;
+  for (int i = 0; i < plan->numColumns && !bindRanges; i++) {
+    bindRanges = planColumn_HasParams(&plan->columns[i]);
+  }
+  if (bindRanges) {
+    cp->columns = malloc(plan->numColumns * sizeof(siPlanColumn));
+    cp->numRanges = 1;
+    for (int i = 0; i < plan->numColumns; i++) {
+      siPlanColumn *src = &plan->columns[i], *col = &cp->columns[i];
+      col->numKeys = src->numKeys;
+      col->keys = malloc(src->numKeys * sizeof(siPlanRangeKey));
+      for (size_t k = 0; k < src->numKeys; k++) {
+        col->keys[k] = src->keys[k];
+        col->keys[k].min = planBindValue(src->keys[k].min, params);
+        col->keys[k].max = planBindValue(src->keys[k].max, params);
       }
-      if (rng->max) {
-        SIMultiKey_Free(rng->max);
+      // the template could not sort keys it did not know yet
+      if (plan->order != PLAN_ORDER_NONE && planColumn_HasParams(src)) {
+        planColumn_Sort(col, SI_KeyCmpFunc(spec->properties[i].type));
       }
-      free(rng);
-      rng = NULL;
+      cp->numRanges *= col->numKeys;
     }
+    cp->bound |= PLAN_BOUND_RANGES;
+  }
+
+  if (plan->filterTree && SIQueryNode_HasParams(plan->filterTree)) {
+    SIQueryNode *tree = SIQueryNode_Bind(plan->filterTree, params);
+    free(cp->filter);
+    cp->filter = SI_CompileFilter(tree, spec);
+    SIQueryNode_Free(tree);
+    cp->bound |= PLAN_BOUND_FILTER;
+  }
+  return cp;
+}
 
-    Vector_Free(plan->ranges);
+/* Compare two range bounds by their position among the index keys. A bound on
+ * a prefix of the columns sits before all the keys with that prefix, or after
+ * them if it's an exclusive min or an inclusive max */
+int planBound_Cmp(SIMultiKey *k1, int after1, SIMultiKey *k2, int after2,
+                  SISpec *spec) {
+  for (int i = 0; i < MIN(k1->size, k2->size); i++) {
+    int rc = SI_KeyCmpFunc(spec->properties[i].type)(&k1->keys[i],
+                                                     &k2->keys[i], NULL);
+    if (rc != 0) {
+      return rc;
+    }
+  }
+  // the longer bound is among the keys of the shorter one's prefix
+  if (k1->size != k2->size) {
+    return k1->size > k2->size ? (after2 ? -1 : 1) : (after1 ? 1 : -1);
   }
+  return after1 - after2;
+}
+
+/* Sort ranges by their min bound, with the same merge sort as the columns */
+void planRanges_Sort(siPlanRange *ranges, size_t n, SISpec *spec) {
+  siPlanRange *tmp = malloc(n * sizeof(siPlanRange));
+  siPlanRange *src = ranges;
 
+  for (size_t w = 1; w < n; w *= 2) {
+    for (size_t lo = 0; lo < n; lo += 2 * w) {
+      size_t mid = MIN(lo + w, n), hi = MIN(lo + 2 * w, n);
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) {
+        tmp[k++] = planBound_Cmp(src[j].min, src[j].minExclusive, src[i].min,
+                                 src[i].minExclusive, spec) < 0
+                       ? src[j++]
+                       : src[i++];
+      }
+      while (i < mid) tmp[k++] = src[i++];
+      while (j < hi) tmp[k++] = src[j++];
+    }
+    siPlanRange *t = src;
+    src = tmp;
+    tmp = t;
+  }
+  if (src != ranges) {
+    memcpy(ranges, src, n * sizeof(siPlanRange));
+    tmp = src;
+  }
+  free(tmp);
+}
+
+SIQueryPlan *SI_NewUnionPlan(SIQueryPlan **plans, int num, SISpec *spec) {
+  size_t n = 0;
+  for (int i = 0; i < num; i++) {
+    n += plans[i]->numRanges;
+  }
+
+  // the ranges are copied, so the union does not depend on the plans
+  siPlanRange *ranges = malloc(MAX(n, 1) * sizeof(siPlanRange));
+  n = 0;
+  for (int i = 0; i < num; i++) {
+    siPlanRangeIterator it = SIQueryPlan_IterateRanges(plans[i]);
+    siPlanRange *r;
+    while (NULL != (r = siPlanRangeIterator_Next(&it))) {
+      ranges[n] = *r;
+      ranges[n].min = SI_NewMultiKey(r->min->keys, r->min->size);
+      ranges[n++].max = SI_NewMultiKey(r->max->keys, r->max->size);
+    }
+    siPlanRangeIterator_Free(&it);
+  }
+  planRanges_Sort(ranges, n, spec);
+
+  // merge each range into the last one if they overlap or touch, so no key is
+  // scanned twice
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    siPlanRange *r = &ranges[i], *last = m ? &ranges[m - 1] : NULL;
+    if (!last || planBound_Cmp(r->min, r->minExclusive, last->max,
+                               !last->maxExclusive, spec) > 0) {
+      ranges[m++] = *r;
+      continue;
+    }
+    if (planBound_Cmp(r->max, !r->maxExclusive, last->max, !last->maxExclusive,
+                      spec) > 0) {
+      SIMultiKey *k = last->max;
+      last->max = r->max;
+      last->maxExclusive = r->maxExclusive;
+      r->max = k;
+    }
+    SIMultiKey_Free(r->min);
+    SIMultiKey_Free(r->max);
+  }
+
+  SIQueryPlan *pln = calloc(1, sizeof(SIQueryPlan));
+  pln->ranges = ranges;
+  pln->numRanges = m;
+  pln->order = PLAN_ORDER_NONE;
+  pln->refcount = 1;
+  return pln;
+}
+
+int SIQueryPlan_Match(SIQueryPlan *plan, SIMultiKey *mk, SISpec *spec) {
+  // the ranges are the product of the columns' keys, so the key must be within
+  // one of the keys of each column
+  for (int i = 0; i < plan->numColumns; i++) {
+    SIKeyCmpFunc cmp = SI_KeyCmpFunc(spec->properties[i].type);
+    siPlanColumn *col = &plan->columns[i];
+    size_t k;
+    for (k = 0; k < col->numKeys; k++) {
+      siPlanRangeKey *rk = &col->keys[k];
+      int lo = cmp(&mk->keys[i], &rk->min, NULL);
+      int hi = cmp(&mk->keys[i], &rk->max, NULL);
+      if ((lo > 0 || (lo == 0 && !rk->minExclusive)) &&
+          (hi < 0 || (hi == 0 && !rk->maxExclusive))) {
+        break;
+      }
+    }
+    if (k == col->numKeys) {
+      return 0;
+    }
+  }
+  return !plan->filter || SIFilter_Eval(plan->filter, mk);
+}
+
+int SIQueryPlan_Overlaps(SIQueryPlan *a, SIQueryPlan *b, SISpec *spec) {
+  int ret = 0;
+  siPlanRangeIterator ia = SIQueryPlan_IterateRanges(a);
+  siPlanRange *ra;
+  while (!ret && NULL != (ra = siPlanRangeIterator_Next(&ia))) {
+    siPlanRangeIterator ib = SIQueryPlan_IterateRanges(b);
+    siPlanRange *rb;
+    while (!ret && NULL != (rb = siPlanRangeIterator_Next(&ib))) {
+      // bounds at the same position have no key between them
+      ret = planBound_Cmp(ra->min, ra->minExclusive, rb->max, !rb->maxExclusive,
+                          spec) < 0 &&
+            planBound_Cmp(rb->min, rb->minExclusive, ra->max, !ra->maxExclusive,
+                          spec) < 0;
+    }
+    siPlanRangeIterator_Free(&ib);
+  }
+  siPlanRangeIterator_Free(&ia);
+  return ret;
+}
+
+void SIQueryPlan_Free(SIQueryPlan *plan) {
+  if (__atomic_sub_fetch(&plan->refcount, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+
+  // copies only own the parts bound to their parameters
+  if (!plan->shared || plan->bound & PLAN_BOUND_RANGES) {
+    for (int i = 0; i < plan->numColumns; i++) {
+      planColumn_Free(&plan->columns[i]);
+    }
+    free(plan->columns);
+    for (size_t i = 0; plan->ranges && i < plan->numRanges; i++) {
+      SIMultiKey_Free(plan->ranges[i].min);
+      SIMultiKey_Free(plan->ranges[i].max);
+    }
+    free(plan->ranges);
+  }
+  if (plan->filter) {
+    if (!plan->shared || plan->bound & PLAN_BOUND_FILTER) {
+      SIFilter_Free(plan->filter);
+    } else {
+      free(plan->filter);
+    }
+  }
+  if (plan->shared) {
+    SIQueryPlan_Free(plan->shared);
+  }
   free(plan);
-}
\ No newline at end of file
+}
+
+siPlanRangeIterator SIQueryPlan_IterateRanges(SIQueryPlan *plan) {
+  siPlanRangeIterator it = {.plan = plan, .offset = 0};
+  it.stack = calloc(plan->numColumns, sizeof(size_t));
+
+  // the range keys are allocated once and refilled on every step
+  it.range.min = malloc(sizeof(SIMultiKey) + plan->numColumns * sizeof(SIValue));
+  it.range.min->size = plan->numColumns;
+  it.range.max = malloc(sizeof(SIMultiKey) + plan->numColumns * sizeof(SIValue));
+  it.range.max->size = plan->numColumns;
+  return it;
+}
+
+siPlanRange *siPlanRangeIterator_Next(siPlanRangeIterator *it) {
+  SIQueryPlan *plan = it->plan;
+  if (it->offset >= plan->numRanges) {
+    return NULL;
+  }
+
+  // advance the column offsets like an odometer, rightmost column first
+  if (it->offset > 0) {
+    for (int i = plan->numColumns - 1; i >= 0; i--) {
+      if (++it->stack[i] < plan->columns[i].numKeys) {
+        break;
+      }
+      it->stack[i] = 0;
+    }
+  }
+  it->offset++;
+
+  // union plans list their ranges as they are
+  if (plan->ranges) {
+    return &plan->ranges[plan->reverse ? plan->numRanges - it->offset
+                                       : it->offset - 1];
+  }
+
+  // the range's values are borrowed from the plan, it owns them. reverse plans
+  // yield the keys of each column from last to first
+  for (int i = 0; i < plan->numColumns; i++) {
+    siPlanColumn *col = &plan->columns[i];
+    siPlanRangeKey *k =
+        &col->keys[plan->reverse ? col->numKeys - 1 - it->stack[i] : it->stack[i]];
+    it->range.min->keys[i] = k->min;
+    it->range.max->keys[i] = k->max;
+    it->range.minExclusive = k->minExclusive;
+    it->range.maxExclusive = k->maxExclusive;
+  }
+
+  return &it->range;
+}
+
+void siPlanRangeIterator_Free(siPlanRangeIterator *it) {
+  free(it->stack);
+  free(it->range.min);
+  free(it->range.max);
+}
@@ -1,9 +1,14 @@
 #ifndef __SI_QUERY_PLAN
+#define __SI_QUERY_PLAN
 
 #include "key.h"
 #include "query.h"
 #include "index.h"
-#include "rmutil/vector.h"
+#include "query_filter.h"
+
+/* The maximal number of scan ranges we are willing to expand from IN
+ * predicates. Beyond it, the rightmost columns are evaluated as filters */
+#define SI_PLAN_MAX_RANGES 1024
 
 typedef struct {
   SIMultiKey *min;
@@ -13,31 +18,134 @@ typedef struct {
 } siPlanRange;
 
 typedef struct {
-  SIValue *min;
-  SIValue *max;
+  SIValue min;
+  SIValue max;
   int minExclusive;
   int maxExclusive;
 } siPlanRangeKey;
 
+/* All the possible scan keys of a single index column */
+typedef struct {
+  siPlanRangeKey *keys;
+  size_t numKeys;
+} siPlanColumn;
+
+/* How the scan order relates to the query's ORDER BY */
+typedef enum {
+  // the query is not ordered
+  PLAN_ORDER_NONE,
+  // the ids are scanned in the query's order
+  PLAN_ORDER_SCAN,
+  // the ids of each range are scanned in the query's order, but the ranges
+  // are not, so the ids must be sorted
+  PLAN_ORDER_RANGE,
+  // the ids must be sorted
+  PLAN_ORDER_SORT,
+} SIPlanOrder;
+
 /*
 * The query plan object passed to the index to execute a scan.
 * It includes at least one range and 0 or more filters that are matched on each
-* iteration of the ranges
+* iteration of the ranges.
+*
+* The ranges are the cartesian product of the scan keys of each column. They
+* are not materialized, but rather expanded lazily with a range iterator.
+*
+* Plans can be shared: a copy of a plan reuses its ranges and filter program,
+* and only has its own filter counters. Shared plans are never changed, so
+* their copies can be executed by several threads at once. Plans of prepared
+* queries hold parameters in their keys, and are executed by copies with the
+* parameters bound.
+*
+* Union plans scan the ranges of several plans at once, as a list of disjoint
+* ranges rather than columns.
 */
-typedef struct {
-  Vector *ranges;
-  int numRanges;
+typedef struct SIQueryPlan {
+  siPlanColumn *columns;
+  int numColumns;
+  // the number of ranges the columns expand to
+  size_t numRanges;
+  // the ranges of a union plan, in index order. NULL for the plans of queries
+  siPlanRange *ranges;
 
   SIQueryNode *filterTree;
+  // the filter tree compiled for evaluation, NULL if there are no filters
+  SIFilter *filter;
 
+  SIPlanOrder order;
+  // scan the ranges from the last to the first, and each range from its max
+  // down to its min
+  int reverse;
+
+  // the plan this one is a copy of, owning the ranges and the filter program.
+  // NULL if the plan owns them
+  struct SIQueryPlan *shared;
+  // the number of references to the plan, including its copies
+  int refcount;
+  // the parts of a copy that it owns, with its parameters bound
+  int bound;
 } SIQueryPlan;
 
+/* The parts of a bound plan copy */
+#define PLAN_BOUND_RANGES 0x1
+#define PLAN_BOUND_FILTER 0x2
+
 /*
 * Build a query plan from a parsed/composed query tree.
-* Returns 1 if successful, 0 if an error occured
+* Returns NULL if we could not build a plan for the query. If the query
+* already carries a plan, a copy of it is returned instead
 */
 SIQueryPlan *SI_BuildQueryPlan(SIQuery *q, SISpec *spec);
 
+/* Plan a query ahead of its execution, setting the plan it is executed with.
+ * The plan is built from a copy of the query's tree, which the query keeps.
+ * Returns 0 if the query can't be planned */
+int SIQuery_Plan(SIQuery *q, SISpec *spec);
+
+/* Copy a plan for another execution, sharing its ranges and filter program.
+ * The copy's filter tree is not set */
+SIQueryPlan *SIQueryPlan_Copy(SIQueryPlan *plan);
+
+/* Copy a plan built from a query with parameters, binding the parameters to
+ * values already cast to their property types. The copy has its own ranges
+ * and filter program only if the parameters appear in them */
+SIQueryPlan *SIQueryPlan_Bind(SIQueryPlan *plan, SIValue *params,
+                              SISpec *spec);
+
+/* Build a plan scanning the union of the ranges of several plans, each index
+ * key at most once. Overlapping ranges are merged, and the ranges are scanned in
+ * index order. The plan has no filter: the keys it scans are matched against
+ * each of the plans with SIQueryPlan_Match */
+SIQueryPlan *SI_NewUnionPlan(SIQueryPlan **plans, int num, SISpec *spec);
+
+/* Return 1 if a key is within one of the ranges of a query's plan, and passes
+ * its filter */
+int SIQueryPlan_Match(SIQueryPlan *plan, SIMultiKey *mk, SISpec *spec);
+
+/* Return 1 if any range of a plan shares keys with a range of another plan.
+ * The plans' filters are not considered */
+int SIQueryPlan_Overlaps(SIQueryPlan *a, SIQueryPlan *b, SISpec *spec);
+
+/* Free a plan, or a copy of one. A plan is only freed with its last copy */
 void SIQueryPlan_Free(SIQueryPlan *plan);
 
+/* Iterates the scan ranges of a plan one by one, without expanding them all
+ * in advance */
+typedef struct {
+  SIQueryPlan *plan;
+  // the number of ranges we've yielded so far
+  size_t offset;
+  // the current offset into each column's keys
+  size_t *stack;
+  siPlanRange range;
+} siPlanRangeIterator;
+
+siPlanRangeIterator SIQueryPlan_IterateRanges(SIQueryPlan *plan);
+
+/* Get the next range of the plan, or NULL if we are done. The returned range
+ * is only valid until the next call */
+siPlanRange *siPlanRangeIterator_Next(siPlanRangeIterator *it);
+
+void siPlanRangeIterator_Free(siPlanRangeIterator *it);
+
 #endif
@@ -62,6 +62,26 @@
  * field deletion, and that is impossible to be a valid pointer. */
 #define REDISMODULE_HASH_DELETE ((RedisModuleString *)(long)1)
 
+/* Keyspace changes notification classes. Every class is associated with a
+ * character for configuration purposes. */
+#define REDISMODULE_NOTIFY_GENERIC (1 << 2) /* g */
+#define REDISMODULE_NOTIFY_STRING (1 << 3)  /* $ */
+#define REDISMODULE_NOTIFY_LIST (1 << 4)    /* l */
+#define REDISMODULE_NOTIFY_SET (1 << 5)     /* s */
+#define REDISMODULE_NOTIFY_HASH (1 << 6)    /* h */
+#define REDISMODULE_NOTIFY_ZSET (1 << 7)    /* z */
+#define REDISMODULE_NOTIFY_EXPIRED (1 << 8) /* x */
+#define REDISMODULE_NOTIFY_EVICTED (1 << 9) /* e */
+#define REDISMODULE_NOTIFY_ALL                                                \
+  (REDISMODULE_NOTIFY_GENERIC | REDISMODULE_NOTIFY_STRING |                   \
+   REDISMODULE_NOTIFY_LIST | REDISMODULE_NOTIFY_SET | REDISMODULE_NOTIFY_HASH | \
+   REDISMODULE_NOTIFY_ZSET | REDISMODULE_NOTIFY_EXPIRED |                     \
+   REDISMODULE_NOTIFY_EVICTED) /* A */
+
+/* Context flags, as returned by RedisModule_GetContextFlags() */
+#define REDISMODULE_CTX_FLAGS_LUA (1 << 0)
+#define REDISMODULE_CTX_FLAGS_MULTI (1 << 1)
+
 /* Error messages. */
 #define REDISMODULE_ERRORMSG_WRONGTYPE \
   "WRONGTYPE Operation against a key holding the wrong kind of value"
@@ -83,6 +103,7 @@ typedef struct RedisModuleCallReply RedisModuleCallReply;
 typedef struct RedisModuleIO RedisModuleIO;
 typedef struct RedisModuleType RedisModuleType;
 typedef struct RedisModuleDigest RedisModuleDigest;
+typedef struct RedisModuleBlockedClient RedisModuleBlockedClient;
 
 typedef int (*RedisModuleCmdFunc)(RedisModuleCtx *ctx, RedisModuleString **argv,
                                   int argc);
@@ -94,6 +115,11 @@ typedef void (*RedisModuleTypeRewriteFunc)(RedisModuleIO *aof,
 typedef void (*RedisModuleTypeDigestFunc)(RedisModuleDigest *digest,
                                           void *value);
 typedef void (*RedisModuleTypeFreeFunc)(void *value);
+typedef int (*RedisModuleNotificationFunc)(RedisModuleCtx *ctx, int type,
+                                           const char *event,
+                                           RedisModuleString *key);
+typedef void (*RedisModuleTimerProc)(RedisModuleCtx *ctx, void *data);
+typedef uint64_t RedisModuleTimerID;
 
 #define REDISMODULE_GET_API(name) \
   RedisModule_GetApi("RedisModule_" #name, ((void **)&RedisModule_##name))
@@ -284,6 +310,33 @@ int REDISMODULE_API_FUNC(RedisModule_StringCompare)(RedisModuleString *a,
                                                     RedisModuleString *b);
 RedisModuleCtx *REDISMODULE_API_FUNC(RedisModule_GetContextFromIO)(
     RedisModuleIO *io);
+/* Not available on older servers, in which case it stays NULL */
+int REDISMODULE_API_FUNC(RedisModule_GetDbIdFromIO)(RedisModuleIO *io);
+
+/* Keyspace notifications and timers are not available on older servers, in
+ * which case these stay NULL */
+int REDISMODULE_API_FUNC(RedisModule_SubscribeToKeyspaceEvents)(
+    RedisModuleCtx *ctx, int types, RedisModuleNotificationFunc cb);
+RedisModuleTimerID REDISMODULE_API_FUNC(RedisModule_CreateTimer)(
+    RedisModuleCtx *ctx, mstime_t period, RedisModuleTimerProc callback,
+    void *data);
+int REDISMODULE_API_FUNC(RedisModule_StopTimer)(RedisModuleCtx *ctx,
+                                                RedisModuleTimerID id,
+                                                void **data);
+int REDISMODULE_API_FUNC(RedisModule_NotifyKeyspaceEvent)(
+    RedisModuleCtx *ctx, int type, const char *event, RedisModuleString *key);
+
+/* Blocked clients and context flags are not available on older servers, in
+ * which case these stay NULL */
+RedisModuleBlockedClient *REDISMODULE_API_FUNC(RedisModule_BlockClient)(
+    RedisModuleCtx *ctx, RedisModuleCmdFunc reply_callback,
+    RedisModuleCmdFunc timeout_callback,
+    void (*free_privdata)(RedisModuleCtx *, void *), long long timeout_ms);
+int REDISMODULE_API_FUNC(RedisModule_UnblockClient)(
+    RedisModuleBlockedClient *bc, void *privdata);
+void *REDISMODULE_API_FUNC(RedisModule_GetBlockedClientPrivateData)(
+    RedisModuleCtx *ctx);
+int REDISMODULE_API_FUNC(RedisModule_GetContextFlags)(RedisModuleCtx *ctx);
 
 /* This is included inline inside each Redis module. */
 static int RedisModule_Init(RedisModuleCtx *ctx, const char *name, int ver,
@@ -388,6 +441,15 @@ static int RedisModule_Init(RedisModuleCtx *ctx, const char *name, int ver,
   REDISMODULE_GET_API(RetainString);
   REDISMODULE_GET_API(StringCompare);
   REDISMODULE_GET_API(GetContextFromIO);
+  REDISMODULE_GET_API(GetDbIdFromIO);
+  REDISMODULE_GET_API(SubscribeToKeyspaceEvents);
+  REDISMODULE_GET_API(CreateTimer);
+  REDISMODULE_GET_API(StopTimer);
+  REDISMODULE_GET_API(NotifyKeyspaceEvent);
+  REDISMODULE_GET_API(BlockClient);
+  REDISMODULE_GET_API(UnblockClient);
+  REDISMODULE_GET_API(GetBlockedClientPrivateData);
+  REDISMODULE_GET_API(GetContextFlags);
   //    REDISMODULE_GET_API(FreeIOContext);
 
   RedisModule_SetModuleAttribs(ctx, name, ver, apiver);
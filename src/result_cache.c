@@ -0,0 +1,294 @@
+#include <string.h>
+#include "result_cache.h"
+#include "util/khash.h"
+#include "rmutil/alloc.h"
+
+/* The ids of a cached result, for finding the results holding a changed id */
+KHASH_SET_INIT_STR(siResultIds);
+
+typedef struct siCachedResult {
+  char *key;
+  size_t len;
+  // the plan the result was found with, matching the keys it could hold
+  SIQueryPlan *plan;
+  // the ids, in the order the query returned them
+  SIId *ids;
+  size_t num;
+  khash_t(siResultIds) * idSet;
+  size_t memory;
+
+  // the list of results, from the most to the least recently used
+  struct siCachedResult *prev;
+  struct siCachedResult *next;
+} siCachedResult;
+
+/* The results by their key. Keys hold the query's options, so they are not
+ * null terminated strings */
+typedef struct {
+  const char *str;
+  size_t len;
+} siResultKey;
+
+static inline khint_t __siResultKey_hash(siResultKey k) {
+  khint_t h = 0;
+  for (size_t i = 0; i < k.len; i++) {
+    h = (h << 5) - h + (khint_t)(unsigned char)k.str[i];
+  }
+  return h;
+}
+
+static inline int __siResultKey_equals(siResultKey a, siResultKey b) {
+  return a.len == b.len && !memcmp(a.str, b.str, a.len);
+}
+
+KHASH_INIT(siResults, siResultKey, siCachedResult *, 1, __siResultKey_hash,
+           __siResultKey_equals);
+
+struct siResultCache {
+  khash_t(siResults) * h;
+  siCachedResult *head;
+  siCachedResult *tail;
+  size_t memory;
+  size_t budget;
+  unsigned long version;
+};
+
+SIResultCache *SI_NewResultCache(size_t budget) {
+  SIResultCache *c = calloc(1, sizeof(SIResultCache));
+  c->h = kh_init(siResults);
+  c->budget = budget;
+  return c;
+}
+
+unsigned long SIResultCache_Version(SIResultCache *c) { return c->version; }
+
+void cachedResult_Free(siCachedResult *r) {
+  for (size_t i = 0; i < r->num; i++) {
+    free(r->ids[i]);
+  }
+  free(r->ids);
+  kh_destroy(siResultIds, r->idSet);
+  SIQueryPlan_Free(r->plan);
+  free(r->key);
+  free(r);
+}
+
+void resultCache_Unlink(SIResultCache *c, siCachedResult *r) {
+  if (r->prev) {
+    r->prev->next = r->next;
+  } else {
+    c->head = r->next;
+  }
+  if (r->next) {
+    r->next->prev = r->prev;
+  } else {
+    c->tail = r->prev;
+  }
+  r->prev = r->next = NULL;
+}
+
+void resultCache_PushFront(SIResultCache *c, siCachedResult *r) {
+  r->next = c->head;
+  if (c->head) {
+    c->head->prev = r;
+  } else {
+    c->tail = r;
+  }
+  c->head = r;
+}
+
+/* Drop a result from the cache and free it */
+void resultCache_Drop(SIResultCache *c, siCachedResult *r) {
+  resultCache_Unlink(c, r);
+  kh_del(siResults, c->h,
+         kh_get(siResults, c->h, ((siResultKey){r->key, r->len})));
+  c->memory -= r->memory;
+  cachedResult_Free(r);
+}
+
+SIId *SIResultCache_Get(SIResultCache *c, const char *key, size_t len,
+                        size_t *num) {
+  khiter_t k = kh_get(siResults, c->h, ((siResultKey){key, len}));
+  if (k == kh_end(c->h)) {
+    return NULL;
+  }
+  siCachedResult *r = kh_value(c->h, k);
+  resultCache_Unlink(c, r);
+  resultCache_PushFront(c, r);
+  *num = r->num;
+  return r->ids;
+}
+
+void SIResultCache_Put(SIResultCache *c, const char *key, size_t len,
+                       SIQueryPlan *plan, SIId *ids, size_t num,
+                       unsigned long version) {
+  // the ids and their set are the bulk of a result
+  size_t memory = sizeof(siCachedResult) + len + num * 3 * sizeof(SIId);
+  for (size_t i = 0; i < num; i++) {
+    memory += strlen(ids[i]) + 1;
+  }
+  if (version != c->version || memory > c->budget) {
+    return;
+  }
+
+  khiter_t k = kh_get(siResults, c->h, ((siResultKey){key, len}));
+  if (k != kh_end(c->h)) {
+    resultCache_Drop(c, kh_value(c->h, k));
+  }
+  while (c->memory + memory > c->budget) {
+    resultCache_Drop(c, c->tail);
+  }
+
+  siCachedResult *r = calloc(1, sizeof(siCachedResult));
+  r->key = malloc(len);
+  memcpy(r->key, key, len);
+  r->len = len;
+  r->plan = SIQueryPlan_Copy(plan);
+  r->ids = malloc(num * sizeof(SIId));
+  r->num = num;
+  r->idSet = kh_init(siResultIds);
+  for (size_t i = 0; i < num; i++) {
+    int rc;
+    r->ids[i] = strdup(ids[i]);
+    kh_put(siResultIds, r->idSet, r->ids[i], &rc);
+  }
+  r->memory = memory;
+
+  int rc;
+  k = kh_put(siResults, c->h, ((siResultKey){r->key, len}), &rc);
+  kh_value(c->h, k) = r;
+  resultCache_PushFront(c, r);
+  c->memory += memory;
+}
+
+void SIResultCache_Clear(SIResultCache *c) {
+  // queries still running read the index the results were dropped for
+  c->version++;
+  while (c->head) {
+    resultCache_Drop(c, c->head);
+  }
+}
+
+size_t SIResultCache_Len(SIResultCache *c) { return kh_size(c->h); }
+
+size_t SIResultCache_Memory(SIResultCache *c) { return c->memory; }
+
+void SIResultCache_Free(SIResultCache *c) {
+  SIResultCache_Clear(c);
+  kh_destroy(siResults, c->h);
+  free(c);
+}
+
+/* Drop the results a changed id could be in. An added key also drops the
+ * results it matches, while the old key of a changed id is only known to the
+ * index, so a result it could be part of must hold the id already */
+void resultCache_Invalidate(SIResultCache *c, SIId id, SIMultiKey *key,
+                            SISpec *spec) {
+  siCachedResult *r = c->head;
+  while (r) {
+    siCachedResult *next = r->next;
+    if ((id && kh_get(siResultIds, r->idSet, id) != kh_end(r->idSet)) ||
+        (key && SIQueryPlan_Match(r->plan, key, spec))) {
+      resultCache_Drop(c, r);
+    }
+    r = next;
+  }
+}
+
+typedef struct {
+  SIIndex inner;
+  SIResultCache *cache;
+  SISpec *spec;
+} cachedIndex;
+
+/* The results are invalidated before the changes are applied, since the index
+ * takes ownership of the ids of additions */
+int cachedIndex_Apply(void *ctx, SIChangeSet cs) {
+  cachedIndex *idx = ctx;
+  SIResultCache *c = idx->cache;
+  c->version++;
+
+  SIMultiKey *key =
+      malloc(sizeof(SIMultiKey) + idx->spec->numProps * sizeof(SIValue));
+  key->size = idx->spec->numProps;
+  for (size_t i = 0; i < cs.numChanges && c->head; i++) {
+    SIChange *ch = &cs.changes[i];
+    if (ch->type == SI_CHDEL) {
+      resultCache_Invalidate(c, ch->id, NULL, idx->spec);
+    } else if (ch->v.len != idx->spec->numProps) {
+      // the index rejects the change, but its key can't be matched either
+      SIResultCache_Clear(c);
+    } else {
+      // the key borrows the change's values
+      memcpy(key->keys, ch->v.vals, ch->v.len * sizeof(SIValue));
+      resultCache_Invalidate(c, ch->id, key, idx->spec);
+    }
+  }
+  free(key);
+
+  return idx->inner.Apply(idx->inner.ctx, cs);
+}
+
+SICursor *cachedIndex_Find(void *ctx, SIQuery *q) {
+  cachedIndex *idx = ctx;
+  return idx->inner.Find(idx->inner.ctx, q);
+}
+
+void cachedIndex_Traverse(void *ctx, IndexVisitor cb, void *visitCtx) {
+  cachedIndex *idx = ctx;
+  idx->inner.Traverse(idx->inner.ctx, cb, visitCtx);
+}
+
+/* Bulk deletes drop the results whose ranges overlap the deleted ranges,
+ * rather than matching each deleted id. Deletes without a plan to compare
+ * with drop all the results */
+int cachedIndex_DeleteWhere(void *ctx, SIQuery *q, IndexVisitor cb,
+                            void *visitCtx, size_t *num, SIGarbage **garbage) {
+  cachedIndex *idx = ctx;
+  SIResultCache *c = idx->cache;
+  c->version++;
+
+  siCachedResult *r = c->head;
+  while (r) {
+    siCachedResult *next = r->next;
+    if (!q->plan || SIQueryPlan_Overlaps(r->plan, q->plan, idx->spec)) {
+      resultCache_Drop(c, r);
+    }
+    r = next;
+  }
+
+  return idx->inner.DeleteWhere(idx->inner.ctx, q, cb, visitCtx, num,
+                                garbage);
+}
+
+size_t cachedIndex_Len(void *ctx) {
+  cachedIndex *idx = ctx;
+  return idx->inner.Len(idx->inner.ctx);
+}
+
+size_t cachedIndex_Estimate(void *ctx, SIQueryPlan *plan) {
+  cachedIndex *idx = ctx;
+  return idx->inner.Estimate(idx->inner.ctx, plan);
+}
+
+void cachedIndex_Free(void *ctx) {
+  cachedIndex *idx = ctx;
+  idx->inner.Free(idx->inner.ctx);
+  free(idx);
+}
+
+SIIndex SI_NewCachedIndex(SIIndex inner, SIResultCache *c, SISpec *spec) {
+  cachedIndex *idx = malloc(sizeof(cachedIndex));
+  idx->inner = inner;
+  idx->cache = c;
+  idx->spec = spec;
+
+  return (SIIndex){.ctx = idx,
+                   .Apply = cachedIndex_Apply,
+                   .Find = cachedIndex_Find,
+                   .Traverse = cachedIndex_Traverse,
+                   .DeleteWhere = cachedIndex_DeleteWhere,
+                   .Len = cachedIndex_Len,
+                   .Estimate = cachedIndex_Estimate,
+                   .Free = cachedIndex_Free};
+}
@@ -0,0 +1,60 @@
+#ifndef __SI_RESULT_CACHE_H__
+#define __SI_RESULT_CACHE_H__
+
+#include "index.h"
+#include "query_plan.h"
+
+/*
+* A cache of query results, the ids of recently executed queries, for indexes
+* that change much less often than they are queried.
+*
+* Results are keyed by the tokens of the query and by its options, and keep
+* the plan they were found with. Changes to the index only drop the results they
+* could affect: the ones whose ranges and filter match an added key, and the
+* ones holding a changed or deleted id. Other changes leave the results as
+* they are. Bulk deletes drop the results whose ranges overlap the deleted
+* ranges.
+*
+* The cache counts the changes applied to its index, and results are only
+* cached if the index did not change since their query started, so a query
+* racing a change never caches what it read before the change.
+*
+* The cache keeps the least recently used results within a memory budget. It
+* is only used by the thread writing the index.
+*/
+typedef struct siResultCache SIResultCache;
+
+SIResultCache *SI_NewResultCache(size_t budget);
+
+/* Return the number of changes applied to the cache's index so far */
+unsigned long SIResultCache_Version(SIResultCache *c);
+
+/* Get the cached ids of a query, or NULL if they aren't cached. The ids are
+ * valid until the next change of the index */
+SIId *SIResultCache_Get(SIResultCache *c, const char *key, size_t len,
+                        size_t *num);
+
+/* Cache the ids of a query, found with the given plan on the version of the
+ * index given. The ids are copied, and results of an older version, or larger
+ * than the budget, are not cached */
+void SIResultCache_Put(SIResultCache *c, const char *key, size_t len,
+                       SIQueryPlan *plan, SIId *ids, size_t num,
+                       unsigned long version);
+
+/* Drop all the cached results, once the index is replaced. Results of queries
+ * started before are not cached either */
+void SIResultCache_Clear(SIResultCache *c);
+
+/* Return the number of cached results */
+size_t SIResultCache_Len(SIResultCache *c);
+
+/* Return the memory the cached results take, in bytes */
+size_t SIResultCache_Memory(SIResultCache *c);
+
+void SIResultCache_Free(SIResultCache *c);
+
+/* Wrap an index so that its changes invalidate the cached results they could
+ * affect. The wrapped index is owned by the new one, the cache is not */
+SIIndex SI_NewCachedIndex(SIIndex inner, SIResultCache *c, SISpec *spec);
+
+#endif
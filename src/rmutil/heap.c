@@ -15,7 +15,7 @@
         } while (--__size > 0);               \
     } while (0)
 
-inline char *__vector_GetPtr(Vector *v, size_t pos) {
+static inline char *__vector_GetPtr(Vector *v, size_t pos) {
     return v->data + (pos * v->elemSize);
 }
 
@@ -0,0 +1,121 @@
+#include <sys/param.h>
+#include "select_thread.h"
+#include "index_pool.h"
+#include "key.h"
+#include "query_plan.h"
+#include "rmutil/alloc.h"
+
+int SelectThread_ShouldRun(RedisModuleCtx *ctx, RedisIndex *idx, SIQuery *q) {
+  if (!IndexPool_Enabled() || !RedisModule_BlockClient ||
+      !RedisModule_GetContextFlags) {
+    return 0;
+  }
+  // transactions and scripts can't block
+  if (RedisModule_GetContextFlags(ctx) &
+      (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA)) {
+    return 0;
+  }
+
+  // the query is planned once here, and executed with the same plan
+  size_t rows = SIQuery_Plan(q, &idx->spec)
+                    ? idx->idx.Estimate(idx->idx.ctx, q->plan)
+                    : idx->idx.Len(idx->idx.ctx);
+  if (q->num) {
+    rows = MIN(rows, q->offset + q->num);
+  }
+  return rows >= SI_THREADED_SELECT_MIN_ROWS;
+}
+
+void selectJob_Free(RedisModuleCtx *ctx, void *data) {
+  SelectJob *j = data;
+  for (size_t i = 0; i < j->num; i++) {
+    free(j->ids[i]);
+    if (j->keys) {
+      SIMultiKey_Free(j->keys[i]);
+    }
+  }
+  free(j->ids);
+  free(j->keys);
+  free(j->retProps);
+  free(j->cacheKey);
+  SIQuery_Free(&j->q);
+  RedisIndex_Unpin(j->owner);
+  free(j);
+}
+
+/* Scan the index under its read lock. The results are copied, since the index
+ * may change as soon as the lock is released. Changes written meanwhile are
+ * buffered by the locked index, so the main thread does not wait for the
+ * scan */
+void selectJob_Run(SITask *t, void *data) {
+  SelectJob *j = data;
+  if (j->lock) {
+    pthread_rwlock_rdlock(j->lock);
+  }
+
+  SICursor *c = j->index.Find(j->index.ctx, &j->q);
+  j->error = c->error != SI_CURSOR_OK;
+  SIId id;
+  while (!j->error && NULL != (id = c->Next(c->ctx))) {
+    if (j->num == j->cap) {
+      j->cap = j->cap ? j->cap * 2 : 1024;
+      j->ids = realloc(j->ids, j->cap * sizeof(SIId));
+      if (j->numRet) {
+        j->keys = realloc(j->keys, j->cap * sizeof(SIMultiKey *));
+      }
+    }
+    if (j->numRet) {
+      SIMultiKey *mk = c->CurrentKey ? c->CurrentKey(c->ctx) : NULL;
+      j->keys[j->num] = mk ? SI_NewMultiKey(mk->keys, mk->size) : NULL;
+    }
+    j->ids[j->num++] = strdup(id);
+  }
+  SICursor_Free(c);
+
+  if (j->lock) {
+    pthread_rwlock_unlock(j->lock);
+  }
+  RedisModule_UnblockClient(j->bc, j);
+}
+
+/* A query is only cancelled if the pool is stopped before running it */
+void selectJob_Done(void *data, int cancelled) {
+  SelectJob *j = data;
+  if (cancelled) {
+    j->error = 1;
+    RedisModule_UnblockClient(j->bc, j);
+  }
+}
+
+void SelectThread_Start(RedisModuleCtx *ctx, RedisIndex *idx, SIQuery *q,
+                        int *retProps, int numRet, char *cacheKey,
+                        size_t cacheKeyLen, RedisModuleCmdFunc reply) {
+  SelectJob *j = calloc(1, sizeof(SelectJob));
+  j->q = *q;
+  j->owner = idx;
+  idx->pins++;
+  j->lock = idx->spec.flags & SI_INDEX_CONCURRENT ? NULL : &idx->lock;
+  j->numRet = numRet;
+  j->retProps = calloc(numRet + 1, sizeof(int));
+  memcpy(j->retProps, retProps, numRet * sizeof(int));
+
+  // the buffered changes are applied first, so the thread reads the index
+  // itself rather than the buffers the main thread keeps writing to
+  j->index = idx->idx;
+  if (idx->spec.flags & SI_INDEX_DEFERRED) {
+    SIDeferredIndex_Flush(idx->idx.ctx);
+    j->index = SIDeferredIndex_Inner(idx->idx.ctx);
+  }
+  if (idx->locked) {
+    SILockedIndex_Sync(idx->locked);
+    j->index = SILockedIndex_Inner(idx->locked);
+  }
+  j->cacheKey = cacheKey;
+  j->cacheKeyLen = cacheKeyLen;
+  if (idx->results) {
+    j->version = SIResultCache_Version(idx->results);
+  }
+
+  j->bc = RedisModule_BlockClient(ctx, reply, NULL, selectJob_Free, 0);
+  IndexPool_Submit(ctx, SI_TASK_HIGH, selectJob_Run, selectJob_Done, j);
+}
@@ -0,0 +1,75 @@
+#ifndef __SI_SELECT_THREAD_H__
+#define __SI_SELECT_THREAD_H__
+
+#include "redismodule.h"
+#include "index_type.h"
+
+/*
+* Running large IDX.SELECT queries off the main thread.
+*
+* Queries expected to return many ids block their client, and are executed on
+* the module's thread pool holding the index's read lock, so other clients are
+* served while they run. The matching ids, and the keys the RETURN clause
+* needs, are copied out while the lock is held, and the client is replied from
+* the main thread once the scan is done.
+*
+* Changes to the index take the write lock, so scans never see a partially
+* applied change. Changes written while scans of the index run are buffered
+* instead of waiting for them, and applied once the lock is free; reading the
+* index on the main thread before that waits for the scans to apply them.
+* Unique indexes can't buffer changes, since the violations must be replied,
+* and their changes wait for the scans. CONCURRENT indexes are scanned without
+* the lock, while they change.
+* Compacting or rebuilding the index replaces its structure without waiting
+* for the scans: they finish on the old structure, which is freed once they
+* are all done.
+*/
+
+// the expected number of ids from which a query runs on the thread pool
+#define SI_THREADED_SELECT_MIN_ROWS 100000
+
+typedef struct {
+  RedisModuleBlockedClient *bc;
+  // the pinned index, and the index to scan, without the deferred changes
+  // buffer. The structure scanned is kept while the index is pinned, even if
+  // it is replaced by a compaction or a rebuild
+  RedisIndex *owner;
+  SIIndex index;
+  // NULL for CONCURRENT indexes, whose cursors are safe to read while the
+  // index changes
+  pthread_rwlock_t *lock;
+  SIQuery q;
+
+  // the properties of the RETURN clause
+  int *retProps;
+  int numRet;
+
+  // the key the results are cached by once the query is done, NULL if they
+  // aren't cached, and the version of the index the query reads
+  char *cacheKey;
+  size_t cacheKeyLen;
+  unsigned long version;
+
+  // the copied ids, and their keys if there is a RETURN clause
+  SIId *ids;
+  SIMultiKey **keys;
+  size_t num;
+  size_t cap;
+  int error;
+} SelectJob;
+
+/* Return 1 if a query should run on the thread pool. The number of ids is
+ * estimated from the ranges of the query's plan, which is built here if the
+ * query has none yet, and from its LIMIT. Queries that can't be planned are
+ * estimated by the size of the index */
+int SelectThread_ShouldRun(RedisModuleCtx *ctx, RedisIndex *idx, SIQuery *q);
+
+/* Block the client and run a query on the thread pool. The job takes
+ * ownership of the query, and of the key to cache its results by. Once the
+ * scan is done, reply is called on the main thread, with the job as the
+ * blocked client's private data */
+void SelectThread_Start(RedisModuleCtx *ctx, RedisIndex *idx, SIQuery *q,
+                        int *retProps, int numRet, char *cacheKey,
+                        size_t cacheKeyLen, RedisModuleCmdFunc reply);
+
+#endif
@@ -50,13 +50,22 @@
 #define zmalloc malloc
 #define zfree free
 #include <stdlib.h>
+#include <string.h>
 #include "../rmutil/alloc.h"
+
+/* The links readers of concurrent skiplists follow are loaded and stored
+ * atomically. Without concurrent readers these are plain moves on most
+ * platforms, so all skiplists use them */
+#define SL_GET(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define SL_SET(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
 /* Create a skip list node with the specified number of levels, pointing to
  * the specified object. */
 skiplistNode *skiplistCreateNode(int level, void *obj, void *val) {
   skiplistNode *zn =
       zmalloc(sizeof(*zn) + level * sizeof(struct skiplistLevel));
   zn->obj = obj;
+  zn->versions = NULL;
   if (val) {
     zn->vals = calloc(1, sizeof(void *));
     zn->numVals = 1;
@@ -81,6 +90,7 @@ skiplistNode *skiplistNodeAppendValue(skiplistNode *n, void *val,
 
   n->vals = realloc(n->vals, ++n->numVals * sizeof(void *));
   n->vals[n->numVals - 1] = val;
+  return n;
 }
 
 /* Create a new skip list with the specified function used in order to
@@ -104,14 +114,181 @@ skiplist *skiplistCreate(skiplistCmpFunc cmp, void *cmpCtx,
   sl->compare = cmp;
   sl->cmpCtx = cmpCtx;
   sl->valcmp = vcmp;
+  sl->retire = NULL;
+  sl->retireCtx = NULL;
+  sl->versions = NULL;
+  sl->touched = NULL;
+  sl->numTouched = sl->capTouched = 0;
+
+  return sl;
+}
 
+skiplist *skiplistCreateConcurrent(skiplistCmpFunc cmp, void *cmpCtx,
+                                   skiplistValCmpFunc vcmp,
+                                   skiplistRetireFunc retire, void *retireCtx) {
+  skiplist *sl = skiplistCreate(cmp, cmpCtx, vcmp);
+  sl->retire = retire;
+  sl->retireCtx = retireCtx;
   return sl;
 }
 
+/* Link a copy of x holding obj and vals in its place, in concurrent skiplists
+ * whose linked nodes can't change. update holds the last node before x on
+ * each level. x keeps its links, so readers standing on it carry on */
+static skiplistNode *skiplistReplaceNode(skiplist *sl, skiplistNode *x,
+                                         skiplistNode **update, void *obj,
+                                         void **vals, unsigned int numVals,
+                                         skiplistValVersion *versions) {
+  int level = 0, i;
+  while (level < sl->level && update[level]->level[level].forward == x)
+    level++;
+
+  skiplistNode *y = zmalloc(sizeof(*y) + level * sizeof(struct skiplistLevel));
+  y->obj = obj;
+  y->vals = vals;
+  y->numVals = numVals;
+  y->versions = versions;
+  y->backward = x->backward;
+  for (i = 0; i < level; i++)
+    y->level[i] = x->level[i];
+
+  for (i = 0; i < level; i++)
+    SL_SET(update[i]->level[i].forward, y);
+  if (y->level[0].forward)
+    SL_SET(y->level[0].forward->backward, y);
+  else
+    SL_SET(sl->tail, y);
+  sl->retire(x, sl->retireCtx);
+  return y;
+}
+
+/* Find the last node before obj on each level */
+static void skiplistFindUpdate(skiplist *sl, void *obj,
+                               skiplistNode **update) {
+  skiplistNode *x = sl->header;
+  int i;
+  for (i = sl->level - 1; i >= 0; i--) {
+    while (x->level[i].forward &&
+           sl->compare(x->level[i].forward->obj, obj, sl->cmpCtx) < 0) {
+      x = x->level[i].forward;
+    }
+    update[i] = x;
+  }
+}
+
+void skiplistSetVersions(skiplist *sl, skiplistVersions *v) {
+  sl->versions = v;
+}
+
+static inline int skiplistValLive(skiplistNode *n, unsigned int i) {
+  return !n->versions || !n->versions[i].deleted;
+}
+
+int skiplistValVisible(skiplistNode *n, unsigned int i,
+                       unsigned long snapshot) {
+  if (!n->versions)
+    return 1;
+  skiplistValVersion *v = &n->versions[i];
+  return v->added <= snapshot && (!v->deleted || v->deleted > snapshot);
+}
+
+/* Check if a change to a node must keep its values where they are, because
+ * snapshots may be reading them, or some of them are already versioned */
+static int skiplistVersioned(skiplist *sl, skiplistNode *x) {
+  return x->versions || (sl->versions && sl->versions->snapshots);
+}
+
+/* Remember the object of a node whose values got versioned */
+static void skiplistTouch(skiplist *sl, void *obj) {
+  if (sl->numTouched == sl->capTouched) {
+    sl->capTouched = sl->capTouched ? sl->capTouched * 2 : 16;
+    sl->touched = realloc(sl->touched, sl->capTouched * sizeof(void *));
+  }
+  sl->touched[sl->numTouched++] = obj;
+}
+
+/* Get the versions of a node's values with room for num values. Values added
+ * before the node was versioned are visible to all the snapshots, and the
+ * node is remembered so it is compacted later. Concurrent skiplists get a
+ * copy, others grow the node's own array */
+static skiplistValVersion *skiplistNodeVersions(skiplist *sl, skiplistNode *x,
+                                                unsigned int num) {
+  skiplistValVersion *v;
+  if (sl->retire) {
+    v = zmalloc(num * sizeof(*v));
+    if (x->versions) {
+      memcpy(v, x->versions, x->numVals * sizeof(*v));
+      return v;
+    }
+  } else {
+    int first = x->versions == NULL;
+    v = x->versions = realloc(x->versions, num * sizeof(*v));
+    if (!first)
+      return v;
+  }
+  for (unsigned int i = 0; i < x->numVals; i++)
+    v[i] = (skiplistValVersion){0, 0};
+  skiplistTouch(sl, x->obj);
+  return v;
+}
+
+/* Add a value to a node snapshots may be reading, after its other values. A
+ * node whose values were all deleted takes the object of the new value, since
+ * its object belongs to a deleted one */
+static skiplistNode *skiplistAppendVersioned(skiplist *sl, skiplistNode *x,
+                                             skiplistNode **update, void *obj,
+                                             void *val) {
+  int live = 0;
+  unsigned int i, num = x->numVals + 1;
+  for (i = 0; i < x->numVals; i++) {
+    if (!skiplistValLive(x, i))
+      continue;
+    if (!sl->valcmp(x->vals[i], val))
+      return NULL;
+    live = 1;
+  }
+
+  skiplistValVersion *versions = skiplistNodeVersions(sl, x, num);
+  versions[num - 1] = (skiplistValVersion){sl->versions->current, 0};
+  if (sl->retire) {
+    void **vals = zmalloc(num * sizeof(void *));
+    memcpy(vals, x->vals, x->numVals * sizeof(void *));
+    vals[num - 1] = val;
+    return skiplistReplaceNode(sl, x, update, live ? x->obj : obj, vals, num,
+                               versions);
+  }
+  x->vals = realloc(x->vals, num * sizeof(void *));
+  x->vals[num - 1] = val;
+  x->numVals = num;
+  if (!live)
+    x->obj = obj;
+  return x;
+}
+
+skiplistNode *skiplistSetObj(skiplist *sl, skiplistNode *node, void *obj) {
+  if (!sl->retire) {
+    node->obj = obj;
+    return node;
+  }
+  skiplistNode *update[SKIPLIST_MAXLEVEL];
+  skiplistFindUpdate(sl, node->obj, update);
+  void **vals = zmalloc(node->numVals * sizeof(void *));
+  memcpy(vals, node->vals, node->numVals * sizeof(void *));
+  skiplistValVersion *versions = NULL;
+  if (node->versions) {
+    versions = zmalloc(node->numVals * sizeof(skiplistValVersion));
+    memcpy(versions, node->versions,
+           node->numVals * sizeof(skiplistValVersion));
+  }
+  return skiplistReplaceNode(sl, node, update, obj, vals, node->numVals,
+                             versions);
+}
+
 /* Free a skiplist node. We don't free the node's pointed object. */
 void skiplistFreeNode(skiplistNode *node) {
   if (node->vals)
     free(node->vals);
+  free(node->versions);
   zfree(node);
 }
 
@@ -125,6 +302,7 @@ void skiplistFree(skiplist *sl) {
     skiplistFreeNode(node);
     node = next;
   }
+  free(sl->touched);
   zfree(sl);
 }
 
@@ -161,7 +339,21 @@ skiplistNode *skiplistInsert(skiplist *sl, void *obj, void *val) {
   /* If the element is already inside, append the value to the element. */
   if (x->level[0].forward &&
       sl->compare(x->level[0].forward->obj, obj, sl->cmpCtx) == 0) {
-    return skiplistNodeAppendValue(x->level[0].forward, val, sl->valcmp);
+    x = x->level[0].forward;
+    if (skiplistVersioned(sl, x))
+      return skiplistAppendVersioned(sl, x, update, obj, val);
+    if (!sl->retire)
+      return skiplistNodeAppendValue(x, val, sl->valcmp);
+
+    for (i = 0; i < x->numVals; i++) {
+      if (!sl->valcmp(x->vals[i], val))
+        return NULL;
+    }
+    void **vals = zmalloc((x->numVals + 1) * sizeof(void *));
+    memcpy(vals, x->vals, x->numVals * sizeof(void *));
+    vals[x->numVals] = val;
+    return skiplistReplaceNode(sl, x, update, x->obj, vals, x->numVals + 1,
+                               NULL);
   }
 
   /* Add a new node with a random number of levels. */
@@ -172,12 +364,19 @@ skiplistNode *skiplistInsert(skiplist *sl, void *obj, void *val) {
       update[i] = sl->header;
       update[i]->level[i].span = sl->length;
     }
-    sl->level = level;
+    SL_SET(sl->level, level);
   }
   x = skiplistCreateNode(level, obj, val);
+  /* hide the value from the open snapshots */
+  if (sl->versions && sl->versions->snapshots) {
+    x->versions = zmalloc(sizeof(skiplistValVersion));
+    x->versions[0] = (skiplistValVersion){sl->versions->current, 0};
+    skiplistTouch(sl, obj);
+  }
+  x->backward = (update[0] == sl->header) ? NULL : update[0];
   for (i = 0; i < level; i++) {
     x->level[i].forward = update[i]->level[i].forward;
-    update[i]->level[i].forward = x;
+    SL_SET(update[i]->level[i].forward, x);
 
     /* update span covered by update[i] as x is inserted here */
     x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
@@ -189,11 +388,10 @@ skiplistNode *skiplistInsert(skiplist *sl, void *obj, void *val) {
     update[i]->level[i].span++;
   }
 
-  x->backward = (update[0] == sl->header) ? NULL : update[0];
   if (x->level[0].forward)
-    x->level[0].forward->backward = x;
+    SL_SET(x->level[0].forward->backward, x);
   else
-    sl->tail = x;
+    SL_SET(sl->tail, x);
   sl->length++;
   return x;
 }
@@ -206,18 +404,18 @@ void skiplistDeleteNode(skiplist *sl, skiplistNode *x, skiplistNode **update) {
   for (i = 0; i < sl->level; i++) {
     if (update[i]->level[i].forward == x) {
       update[i]->level[i].span += x->level[i].span - 1;
-      update[i]->level[i].forward = x->level[i].forward;
+      SL_SET(update[i]->level[i].forward, x->level[i].forward);
     } else {
       update[i]->level[i].span -= 1;
     }
   }
   if (x->level[0].forward) {
-    x->level[0].forward->backward = x->backward;
+    SL_SET(x->level[0].forward->backward, x->backward);
   } else {
-    sl->tail = x->backward;
+    SL_SET(sl->tail, x->backward);
   }
   while (sl->level > 1 && sl->header->level[sl->level - 1].forward == NULL)
-    sl->level--;
+    SL_SET(sl->level, sl->level - 1);
   sl->length--;
 }
 
@@ -238,45 +436,191 @@ int skiplistDelete(skiplist *sl, void *obj, void *val) {
   x = x->level[0].forward;
   if (x && sl->compare(x->obj, obj, sl->cmpCtx) == 0) {
 
+    /* values snapshots may read are only marked as deleted */
+    if (val && skiplistVersioned(sl, x)) {
+      for (i = 0; i < x->numVals; i++) {
+        if (skiplistValLive(x, i) && !sl->valcmp(val, x->vals[i]))
+          break;
+      }
+      if (i == x->numVals)
+        return 1;
+      skiplistValVersion *versions = skiplistNodeVersions(sl, x, x->numVals);
+      versions[i].deleted = sl->versions->current;
+      if (sl->retire) {
+        void **vals = zmalloc(x->numVals * sizeof(void *));
+        memcpy(vals, x->vals, x->numVals * sizeof(void *));
+        skiplistReplaceNode(sl, x, update, x->obj, vals, x->numVals, versions);
+      }
+      return 1;
+    }
+
     if (val) {
       // try to delete the value itself from the vallist
-      for (int i = 0; i < x->numVals; i++) {
-        // found the value - let's delete it
-        if (!sl->valcmp(val, x->vals[i])) {
-
-          // switch the found value with the top value
-          if (i < x->numVals - 1) {
-            x->vals[i] = x->vals[x->numVals - 1];
-          }
-          x->numVals--;
+      int i;
+      for (i = 0; i < x->numVals; i++) {
+        if (!sl->valcmp(val, x->vals[i]))
           break;
+      }
+      // found the value, but it's not the last one - let's delete it
+      if (i < x->numVals && x->numVals > 1) {
+        // concurrent skiplists remove it from a copy of the node
+        void **vals = x->vals;
+        if (sl->retire) {
+          vals = zmalloc(x->numVals * sizeof(void *));
+          memcpy(vals, x->vals, x->numVals * sizeof(void *));
         }
+        // switch the found value with the top value
+        vals[i] = vals[x->numVals - 1];
+        if (sl->retire)
+          skiplistReplaceNode(sl, x, update, x->obj, vals, x->numVals - 1,
+                              NULL);
+        else
+          x->numVals--;
+        return 1;
       }
+      if (i == x->numVals && x->numVals > 0)
+        return 1;
     }
 
-    if (!val || x->numVals == 0) {
-      skiplistDeleteNode(sl, x, update);
+    skiplistDeleteNode(sl, x, update);
+    if (sl->retire)
+      sl->retire(x, sl->retireCtx);
+    else
       skiplistFreeNode(x);
-    }
     return 1;
   }
   return 0; /* not found */
 }
 
+unsigned long skiplistCollect(skiplist *sl) {
+  skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+  unsigned long dropped = 0;
+
+  for (unsigned long t = 0; t < sl->numTouched; t++) {
+    skiplistFindUpdate(sl, sl->touched[t], update);
+    x = update[0]->level[0].forward;
+    if (!x || !x->versions ||
+        sl->compare(x->obj, sl->touched[t], sl->cmpCtx) != 0)
+      continue;
+
+    unsigned int i, num = 0;
+    void **vals = sl->retire ? zmalloc(x->numVals * sizeof(void *)) : x->vals;
+    for (i = 0; i < x->numVals; i++) {
+      if (!x->versions[i].deleted)
+        vals[num++] = x->vals[i];
+    }
+    dropped += x->numVals - num;
+
+    if (num == 0) {
+      if (sl->retire)
+        zfree(vals);
+      skiplistDeleteNode(sl, x, update);
+      if (sl->retire)
+        sl->retire(x, sl->retireCtx);
+      else
+        skiplistFreeNode(x);
+    } else if (sl->retire) {
+      skiplistReplaceNode(sl, x, update, x->obj, vals, num, NULL);
+    } else {
+      free(x->versions);
+      x->versions = NULL;
+      x->numVals = num;
+    }
+  }
+  sl->numTouched = 0;
+  return dropped;
+}
+
+/* Unlink all the nodes within a range from every level at once, without
+ * visiting them. A NULL min or max means the range is open on that side. The
+ * unlinked nodes are not freed, but returned in *first as a list linked by
+ * their level 0 forward pointers. Returns the number of unlinked nodes. */
+unsigned long skiplistDeleteRange(skiplist *sl, void *min, void *max,
+                                  int minExclusive, int maxExclusive,
+                                  skiplistNode **first) {
+  skiplistNode *update[SKIPLIST_MAXLEVEL], *last[SKIPLIST_MAXLEVEL], *x;
+  unsigned long rankUpdate[SKIPLIST_MAXLEVEL], rankLast[SKIPLIST_MAXLEVEL];
+  int i;
+
+  *first = NULL;
+
+  /* the last node before the range on each level */
+  x = sl->header;
+  for (i = sl->level - 1; i >= 0; i--) {
+    rankUpdate[i] = i == (sl->level - 1) ? 0 : rankUpdate[i + 1];
+    while (min && x->level[i].forward) {
+      int rc = sl->compare(x->level[i].forward->obj, min, sl->cmpCtx);
+      if (rc > 0 || (rc == 0 && !minExclusive))
+        break;
+      rankUpdate[i] += x->level[i].span;
+      x = x->level[i].forward;
+    }
+    update[i] = x;
+  }
+
+  /* the last node of the range on each level */
+  x = sl->header;
+  for (i = sl->level - 1; i >= 0; i--) {
+    rankLast[i] = i == (sl->level - 1) ? 0 : rankLast[i + 1];
+    while (x->level[i].forward) {
+      if (max) {
+        int rc = sl->compare(x->level[i].forward->obj, max, sl->cmpCtx);
+        if (rc > 0 || (rc == 0 && maxExclusive))
+          break;
+      }
+      rankLast[i] += x->level[i].span;
+      x = x->level[i].forward;
+    }
+    last[i] = x;
+  }
+
+  if (rankLast[0] <= rankUpdate[0])
+    return 0;
+  unsigned long removed = rankLast[0] - rankUpdate[0];
+
+  /* link each level over the range, which it either skipped already or
+   * entered and left at update[i] and last[i] */
+  *first = update[0]->level[0].forward;
+  skiplistNode *after = last[0]->level[0].forward;
+  for (i = 0; i < sl->level; i++) {
+    if (last[i] != update[i]) {
+      update[i]->level[i].span =
+          rankLast[i] + last[i]->level[i].span - rankUpdate[i] - removed;
+      update[i]->level[i].forward = last[i]->level[i].forward;
+    } else {
+      update[i]->level[i].span -= removed;
+    }
+  }
+  last[0]->level[0].forward = NULL;
+
+  x = update[0] == sl->header ? NULL : update[0];
+  if (after) {
+    after->backward = x;
+  } else {
+    sl->tail = x;
+  }
+  while (sl->level > 1 && sl->header->level[sl->level - 1].forward == NULL)
+    sl->level--;
+  sl->length -= removed;
+  return removed;
+}
+
 /* Search for the element in the skip list, if found the
  * node pointer is returned, otherwise NULL is returned. */
 void *skiplistFind(skiplist *sl, void *obj) {
-  skiplistNode *x;
+  skiplistNode *x, *next;
   int i;
 
+  /* readers of concurrent skiplists load each link once, so they only step
+   * to nodes they have compared */
   x = sl->header;
-  for (i = sl->level - 1; i >= 0; i--) {
-    while (x->level[i].forward &&
-           sl->compare(x->level[i].forward->obj, obj, sl->cmpCtx) < 0) {
-      x = x->level[i].forward;
+  for (i = SL_GET(sl->level) - 1; i >= 0; i--) {
+    while ((next = SL_GET(x->level[i].forward)) &&
+           sl->compare(next->obj, obj, sl->cmpCtx) < 0) {
+      x = next;
     }
   }
-  x = x->level[0].forward;
+  x = SL_GET(x->level[0].forward);
   if (x && sl->compare(x->obj, obj, sl->cmpCtx) == 0) {
     return x;
   } else {
@@ -287,25 +631,46 @@ void *skiplistFind(skiplist *sl, void *obj) {
 /* Search for the element in the skip list, if found the
  * node pointer is returned, otherwise the next pointer is returned. */
 void *skiplistFindAtLeast(skiplist *sl, void *obj, int exclusive) {
-  skiplistNode *x;
+  skiplistNode *x, *next;
   int i;
 
   x = sl->header;
-  for (i = sl->level - 1; i >= 0; i--) {
-    while (x->level[i].forward) {
-      int rc = sl->compare(x->level[i].forward->obj, obj, sl->cmpCtx);
+  for (i = SL_GET(sl->level) - 1; i >= 0; i--) {
+    while ((next = SL_GET(x->level[i].forward))) {
+      int rc = sl->compare(next->obj, obj, sl->cmpCtx);
       if (rc < 0 || (rc == 0 && exclusive)) {
-        x = x->level[i].forward;
+        x = next;
       } else {
         break;
       }
     }
   }
-  x = x->level[0].forward;
+  x = SL_GET(x->level[0].forward);
 
   return x;
 }
 
+/* Search for the last element in the skip list that is lower than obj (or
+ * equal to it if not exclusive). Returns NULL if there is no such element */
+void *skiplistFindAtMost(skiplist *sl, void *obj, int exclusive) {
+  skiplistNode *x, *next;
+  int i;
+
+  x = sl->header;
+  for (i = SL_GET(sl->level) - 1; i >= 0; i--) {
+    while ((next = SL_GET(x->level[i].forward))) {
+      int rc = sl->compare(next->obj, obj, sl->cmpCtx);
+      if (rc < 0 || (rc == 0 && !exclusive)) {
+        x = next;
+      } else {
+        break;
+      }
+    }
+  }
+
+  return x == sl->header ? NULL : x;
+}
+
 /* If the skip list is empty, NULL is returned, otherwise the element
  * at head is removed and its pointed object returned. */
 void *skiplistPopHead(skiplist *sl) {
@@ -333,6 +698,45 @@ void *skiplistPopTail(skiplist *sl) {
 
 unsigned long skiplistLength(skiplist *sl) { return sl->length; }
 
+/* Sum the spans of the nodes passed on the way to the first node at least
+ * obj, which is its 0 based rank */
+unsigned long skiplistRankAtLeast(skiplist *sl, void *obj, int exclusive) {
+  skiplistNode *x = sl->header;
+  unsigned long rank = 0;
+  int i;
+
+  for (i = sl->level - 1; i >= 0; i--) {
+    while (x->level[i].forward) {
+      int rc = sl->compare(x->level[i].forward->obj, obj, sl->cmpCtx);
+      if (rc > 0 || (rc == 0 && !exclusive))
+        break;
+      rank += x->level[i].span;
+      x = x->level[i].forward;
+    }
+  }
+  return rank;
+}
+
+skiplistNode *skiplistNodeAtRank(skiplist *sl, unsigned long rank) {
+  skiplistNode *x = sl->header;
+  unsigned long traversed = 0;
+  int i;
+
+  if (rank >= sl->length)
+    return NULL;
+  /* the header is rank 0 in span terms, so we look for rank + 1 */
+  rank++;
+  for (i = sl->level - 1; i >= 0; i--) {
+    while (x->level[i].forward && traversed + x->level[i].span <= rank) {
+      traversed += x->level[i].span;
+      x = x->level[i].forward;
+    }
+    if (traversed == rank)
+      return x;
+  }
+  return NULL;
+}
+
 skiplistIterator skiplistIterateRange(skiplist *sl, void *min, void *max,
                                       int minExclusive, int maxExclusive) {
   skiplistNode *n = skiplistFindAtLeast(sl, min, minExclusive);
@@ -346,50 +750,104 @@ skiplistIterator skiplistIterateRange(skiplist *sl, void *min, void *max,
     }
   }
   return (skiplistIterator){.current = n,
+                            .reverse = 0,
                             .rangeMin = min,
                             .minExclusive = minExclusive,
                             .rangeMax = max,
                             .maxExclusive = maxExclusive,
                             .currentValOffset = 0,
-                            .sl = sl};
+                            .sl = sl,
+                            .snapshot = SKIPLIST_LATEST};
+}
+
+skiplistIterator skiplistIterateRangeReverse(skiplist *sl, void *min,
+                                             void *max, int minExclusive,
+                                             int maxExclusive) {
+  // seek to the range max, NULL means +inf
+  skiplistNode *n =
+      max ? skiplistFindAtMost(sl, max, maxExclusive) : SL_GET(sl->tail);
+  if (n && min) {
+    // make sure the last item of the range is not already below the range start
+    int c = sl->compare(n->obj, min, sl->cmpCtx);
+    if (c < 0 || (c == 0 && minExclusive)) {
+      n = NULL;
+    }
+  }
+  return (skiplistIterator){.current = n,
+                            .reverse = 1,
+                            .rangeMin = min,
+                            .minExclusive = minExclusive,
+                            .rangeMax = max,
+                            .maxExclusive = maxExclusive,
+                            .currentValOffset = 0,
+                            .sl = sl,
+                            .snapshot = SKIPLIST_LATEST};
 }
 
 skiplistIterator skiplistIterateAll(skiplist *sl) {
 
   return (skiplistIterator){.current = sl->header,
+                            .reverse = 0,
                             .rangeMin = NULL,
                             .minExclusive = 0,
                             .rangeMax = NULL,
                             .maxExclusive = 0,
                             .sl = sl,
-                            .currentValOffset = 0};
+                            .currentValOffset = 0,
+                            .snapshot = SKIPLIST_LATEST};
+}
+
+/* Move an iterator to the next node of its range */
+static void skiplistIteratorAdvance(skiplistIterator *it) {
+  if (it->reverse) {
+    it->current = SL_GET(it->current->backward);
+    // make sure we don't pass the range min. NULL means -inf
+    if (it->current && it->rangeMin) {
+      int c = it->sl->compare(it->current->obj, it->rangeMin, it->sl->cmpCtx);
+      if (c < 0 || (c == 0 && it->minExclusive)) {
+        it->current = NULL;
+      }
+    }
+    return;
+  }
+
+  it->current = SL_GET(it->current->level[0].forward);
+
+  // make sure we don't pass the range max. NULL means +inf
+  if (it->current && it->rangeMax) {
+    int c = it->sl->compare(it->current->obj, it->rangeMax, it->sl->cmpCtx);
+    if (c > 0 || (c == 0 && it->maxExclusive)) {
+      it->current = NULL;
+    }
+  }
+}
+
+/* Skip the values the iterator's snapshot can't see, so the iterator always
+ * stands on the value it returns next */
+static void skiplistIteratorSeek(skiplistIterator *it) {
+  skiplistNode *n;
+  while (NULL != (n = it->current)) {
+    while (it->currentValOffset < n->numVals &&
+           !skiplistValVisible(n, it->currentValOffset, it->snapshot))
+      it->currentValOffset++;
+    if (it->currentValOffset < n->numVals)
+      return;
+    it->currentValOffset = 0;
+    skiplistIteratorAdvance(it);
+  }
 }
 
 skiplistNode *skiplistIteratorCurrent(skiplistIterator *it) {
+  skiplistIteratorSeek(it);
   return it->current;
 }
 
 void *skiplistIterator_Next(skiplistIterator *it) {
-
+  skiplistIteratorSeek(it);
   if (!it->current) {
     return NULL;
   }
-  void *ret = NULL;
-  if (it->currentValOffset < it->current->numVals) {
-    ret = it->current->vals[it->currentValOffset++];
-  }
-
-  if (it->currentValOffset == it->current->numVals) {
-    it->current = it->current->level[0].forward;
-    it->currentValOffset = 0;
-
-    // make sure we don't pass the range max. NULL means +inf
-    if (it->current && it->rangeMax) {
-      int c = it->sl->compare(it->current->obj, it->rangeMax, it->sl->cmpCtx);
-      if (c > 0 || (c == 0 && it->maxExclusive)) {
-        it->current = NULL;
-      }
-    }
-  }
+  void *ret = it->current->vals[it->currentValOffset++];
+  skiplistIteratorSeek(it);
   return ret;
-}
\ No newline at end of file
+}
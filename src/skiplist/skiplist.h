@@ -34,10 +34,22 @@
 #define SKIPLIST_MAXLEVEL 32 /* Should be enough for 2^32 elements */
 #define SKIPLIST_P 0.25      /* Skiplist P = 1/4 */
 
+#include <limits.h>
+
+/* The versions a value of a versioned skiplist was added and deleted in.
+ * deleted is 0 while the value is in the skiplist */
+typedef struct {
+  unsigned long added;
+  unsigned long deleted;
+} skiplistValVersion;
+
 typedef struct skiplistNode {
   void *obj;
   void **vals;
   unsigned int numVals;
+  // the versions of the values, NULL unless they changed while a snapshot was
+  // open
+  skiplistValVersion *versions;
   struct skiplistNode *backward;
   struct skiplistLevel {
     struct skiplistNode *forward;
@@ -49,6 +61,21 @@ typedef int (*skiplistCmpFunc)(void *p1, void *p2, void *ctx);
 
 typedef int (*skiplistValCmpFunc)(void *p1, void *p2);
 
+typedef void (*skiplistRetireFunc)(skiplistNode *node, void *ctx);
+
+/* The commit counter of versioned skiplists, which may be shared by several of
+ * them. While there are open snapshots, deleted values are only marked with
+ * the current version, and added ones are marked too, so snapshots of older
+ * versions don't see them. Nothing is moved, so the positions of the iterators
+ * of open snapshots stay valid */
+typedef struct {
+  unsigned long current;
+  unsigned long snapshots;
+} skiplistVersions;
+
+// the snapshot of iterators reading the values in the skiplist now
+#define SKIPLIST_LATEST ULONG_MAX
+
 typedef struct skiplist {
   struct skiplistNode *header, *tail;
   skiplistCmpFunc compare;
@@ -57,33 +84,98 @@ typedef struct skiplist {
   void *cmpCtx;
   unsigned long length;
   int level;
+
+  // set for concurrent skiplists, getting the nodes they unlink
+  skiplistRetireFunc retire;
+  void *retireCtx;
+
+  // set for versioned skiplists, along with the objects of the nodes holding
+  // versioned values
+  skiplistVersions *versions;
+  void **touched;
+  unsigned long numTouched;
+  unsigned long capTouched;
 } skiplist;
 
 skiplist *skiplistCreate(skiplistCmpFunc cmp, void *cmpCtx,
                          skiplistValCmpFunc vcmp);
 
+/* Create a skiplist that other threads can read without locking while a single
+ * thread writes it. Links are published with release stores and followed with
+ * acquire loads, and a linked node never changes: changing its object or
+ * values links a copy in its place. Unlinked nodes are passed to retire
+ * instead of being freed, and must be kept until no reader can hold them.
+ * Ranks and range deletes are for the writer only */
+skiplist *skiplistCreateConcurrent(skiplistCmpFunc cmp, void *cmpCtx,
+                                   skiplistValCmpFunc vcmp,
+                                   skiplistRetireFunc retire, void *retireCtx);
+
+/* Version the values of a skiplist with a commit counter. The counter is not
+ * owned by the skiplist */
+void skiplistSetVersions(skiplist *sl, skiplistVersions *v);
+
+/* Drop the deleted values of a versioned skiplist, and the nodes left without
+ * values. Must only be called once no snapshot is open. Returns the number of
+ * dropped values */
+unsigned long skiplistCollect(skiplist *sl);
+
+/* Return 1 if the i'th value of a node is visible to a snapshot, or is in the
+ * skiplist for SKIPLIST_LATEST */
+int skiplistValVisible(skiplistNode *n, unsigned int i, unsigned long snapshot);
+
 void skiplistFree(skiplist *sl);
 skiplistNode *skiplistInsert(skiplist *sl, void *obj, void *val);
 int skiplistDelete(skiplist *sl, void *obj, void *val);
+
+/* Unlink all the nodes within a range in O(log n), returning them in *first as
+ * a list linked by level[0].forward. Returns the number of unlinked nodes */
+unsigned long skiplistDeleteRange(skiplist *sl, void *min, void *max,
+                                  int minExclusive, int maxExclusive,
+                                  skiplistNode **first);
+/* Free a node and its value array, but not the object and values themselves */
+void skiplistFreeNode(skiplistNode *node);
+
+/* Set the object of a node to an equal one. Concurrent skiplists replace the
+ * node, so the node holding the object is returned */
+skiplistNode *skiplistSetObj(skiplist *sl, skiplistNode *node, void *obj);
 void *skiplistFind(skiplist *sl, void *obj);
+void *skiplistFindAtLeast(skiplist *sl, void *obj, int exclusive);
+void *skiplistFindAtMost(skiplist *sl, void *obj, int exclusive);
 void *skiplistPopHead(skiplist *sl);
 void *skiplistPopTail(skiplist *sl);
 unsigned long skiplistLength(skiplist *sl);
 
+/* Return the number of nodes lower than obj, or not above it if exclusive,
+ * i.e. the 0 based rank of the first node at least obj, in O(log n) */
+unsigned long skiplistRankAtLeast(skiplist *sl, void *obj, int exclusive);
+
+/* Return the node of a 0 based rank in O(log n), or NULL if the rank is out of
+ * range */
+skiplistNode *skiplistNodeAtRank(skiplist *sl, unsigned long rank);
+
 typedef struct {
   skiplistNode *current;
   unsigned int currentValOffset;
+  // iterate from the range max down to the range min
+  int reverse;
   void *rangeMin;
   int minExclusive;
   void *rangeMax;
   int maxExclusive;
   skiplist *sl;
-
+  // the version the iterator reads, SKIPLIST_LATEST unless set after creating
+  // it
+  unsigned long snapshot;
 } skiplistIterator;
 
 skiplistIterator skiplistIterateRange(skiplist *sl, void *min, void *max,
                                       int minExclusive, int maxExclusive);
 
+/* Iterate a range backwards, from the last element not above max down to min */
+skiplistIterator skiplistIterateRangeReverse(skiplist *sl, void *min,
+                                             void *max, int minExclusive,
+                                             int maxExclusive);
+
 skiplistIterator skiplistIterateAll(skiplist *sl);
 void *skiplistIterator_Next(skiplistIterator *it);
 skiplistNode *skiplistIteratorCurrent(skiplistIterator *it);
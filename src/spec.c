@@ -1,5 +1,6 @@
 #include "spec.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include "rmutil/alloc.h"
 
 SISpec SI_NewSpec(int numProps, u_int32_t flags) {
@@ -29,4 +30,17 @@ SIIndexProperty *SISpec_PropertyByName(SISpec *spec, const char *name,
     }
   }
   return NULL;
-}
\ No newline at end of file
+}
+int SISpec_PropertyId(SISpec *spec, const char *prop) {
+  int id = -1;
+  if (*prop == '$') {
+    char *end;
+    id = strtol(prop + 1, &end, 10) - 1;
+    if (end == prop + 1 || *end) {
+      return -1;
+    }
+  } else if (!SISpec_PropertyByName(spec, prop, &id)) {
+    return -1;
+  }
+  return id >= 0 && id < spec->numProps ? id : -1;
+}
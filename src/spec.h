@@ -1,5 +1,6 @@
 #ifndef __SI_SPEC_H__
 #define __SI_SPEC_H__
+#include <stdint.h>
 #include "value.h"
 
 typedef struct {
@@ -11,11 +12,21 @@ typedef struct {
 #define SI_INDEX_DEFAULT = 0x00
 #define SI_INDEX_NAMED 0x1
 #define SI_INDEX_UNIQUE 0x2
+#define SI_INDEX_DEFERRED 0x4
+#define SI_INDEX_PARTITIONED 0x8
+#define SI_INDEX_LSM 0x10
+#define SI_INDEX_CONCURRENT 0x20
+#define SI_INDEX_CACHED 0x40
 
 typedef struct {
   SIIndexProperty *properties;
   size_t numProps;
   u_int32_t flags;
+  // the time span of each partition of PARTITIONED indexes, whose first
+  // property is a TIME
+  int64_t partitionSize;
+  // the memory budget of the result cache of CACHED indexes, in bytes
+  size_t cacheSize;
 } SISpec;
 
 /* Create a new spec, allocate the properties array, and set the flags */
@@ -29,4 +40,8 @@ void SISpec_Free(SISpec *sp);
  * spec is not named */
 SIIndexProperty *SISpec_PropertyByName(SISpec *spec, const char *name, int *id);
 
+/* Resolve a property reference, either a 1-based enumerator like $1 or a
+ * property name, to its property id. Returns -1 if no such property exists */
+int SISpec_PropertyId(SISpec *spec, const char *prop);
+
 #endif
\ No newline at end of file
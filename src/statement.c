@@ -0,0 +1,93 @@
+#include "statement.h"
+#include "rmutil/alloc.h"
+
+/* Set the type of a parameter to the type of the property it's compared with.
+ * Returns 0 if the value is a parameter of an invalid property */
+int statement_paramType(SIStatement *st, SIValue *v, int propId,
+                        SISpec *spec) {
+  if (v->type != T_PARAM) {
+    return 1;
+  }
+  if (propId < 0 || propId >= spec->numProps) {
+    return 0;
+  }
+  st->paramTypes[v->intval] = spec->properties[propId].type;
+  return 1;
+}
+
+/* Type all the parameters of a tree */
+int statement_paramTypes(SIStatement *st, SIQueryNode *n, SISpec *spec) {
+  if (n->type & QN_LOGIC) {
+    return statement_paramTypes(st, n->op.left, spec) &&
+           statement_paramTypes(st, n->op.right, spec);
+  }
+
+  SIPredicate *p = &n->pred;
+  switch (p->t) {
+  case PRED_EQ:
+    return statement_paramType(st, &p->eq.v, p->propId, spec);
+  case PRED_NE:
+    return statement_paramType(st, &p->ne.v, p->propId, spec);
+  case PRED_RNG:
+    return statement_paramType(st, &p->rng.min, p->propId, spec) &&
+           statement_paramType(st, &p->rng.max, p->propId, spec);
+  case PRED_IN:
+    for (size_t i = 0; i < p->in.numvals; i++) {
+      if (!statement_paramType(st, &p->in.vals[i], p->propId, spec)) {
+        return 0;
+      }
+    }
+    return 1;
+  default:
+    return 1;
+  }
+}
+
+SIStatement *SI_NewStatement(SIQuery *q, SISpec *spec, const char **err) {
+  SIStatement *st = malloc(sizeof(SIStatement));
+  st->q = *q;
+  st->plan = NULL;
+  st->numParams = q->numParams;
+  st->paramTypes = calloc(q->numParams + 1, sizeof(SIType));
+  st->returnProps = NULL;
+  st->numReturn = 0;
+  *q = SI_NewQuery();
+
+  if (!statement_paramTypes(st, st->q.root, spec)) {
+    *err = "Invalid parameter property";
+    SIStatement_Free(st);
+    return NULL;
+  }
+  if (st->q.numPredicates == 0 ||
+      NULL == (st->plan = SI_BuildQueryPlan(&st->q, spec))) {
+    *err = "Query cannot be planned";
+    SIStatement_Free(st);
+    return NULL;
+  }
+  return st;
+}
+
+SIQuery SIStatement_Bind(SIStatement *st, SIValue *params, SISpec *spec) {
+  SIQuery q = SI_NewQuery();
+  q.numPredicates = st->q.numPredicates;
+  q.offset = st->q.offset;
+  q.num = st->q.num;
+  if (st->q.numOrderBy) {
+    q.orderBy = malloc(st->q.numOrderBy * sizeof(int));
+    memcpy(q.orderBy, st->q.orderBy, st->q.numOrderBy * sizeof(int));
+    q.numOrderBy = st->q.numOrderBy;
+    q.orderDesc = st->q.orderDesc;
+  }
+  q.plan = SIQueryPlan_Bind(st->plan, params, spec);
+  return q;
+}
+
+void SIStatement_Free(SIStatement *st) {
+  if (st->plan) {
+    SIQueryPlan_Free(st->plan);
+  }
+  SIQuery_Free(&st->q);
+  free(st->paramTypes);
+  free(st->returnProps);
+  free(st);
+}
@@ -0,0 +1,42 @@
+#ifndef __SI_STATEMENT_H__
+#define __SI_STATEMENT_H__
+
+#include "query.h"
+#include "query_plan.h"
+#include "spec.h"
+
+/*
+* Prepared queries.
+*
+* A prepared query is parsed and planned once, with ? parameters in place of
+* some of its values. Each parameter takes the type of the property it is
+* compared with, so the values of an execution are parsed straight into that
+* type, and bound into a copy of the plan's scan keys and filter, without
+* parsing or planning the query again.
+*/
+typedef struct {
+  // the planned query, with its ORDER BY and LIMIT. The plan's filter tree
+  // points into its tree
+  SIQuery q;
+  SIQueryPlan *plan;
+  // the property type of each parameter
+  SIType *paramTypes;
+  int numParams;
+  // the properties returned with each id, as in the RETURN clause of
+  // IDX.SELECT
+  int *returnProps;
+  int numReturn;
+} SIStatement;
+
+/* Prepare a parsed query, whose ORDER BY and LIMIT are already set, taking
+ * ownership of it. Returns NULL and sets err if a parameter is compared with
+ * an invalid property, or if the query can't be planned */
+SIStatement *SI_NewStatement(SIQuery *q, SISpec *spec, const char **err);
+
+/* Bind values to the parameters of a statement, returning a query ready to
+ * execute. The values must be of the parameters' types, and are copied */
+SIQuery SIStatement_Bind(SIStatement *st, SIValue *params, SISpec *spec);
+
+void SIStatement_Free(SIStatement *st);
+
+#endif
@@ -0,0 +1,440 @@
+#include "index.h"
+#include "key.h"
+#include "query_plan.h"
+#include "top_k.h"
+#include <stdint.h>
+#include <sys/param.h>
+#include "rmutil/alloc.h"
+
+/* A read only index, packed in contiguous arrays. Each distinct key is stored
+ * once, and the ids of key i are ids[offsets[i]] to ids[offsets[i + 1] - 1].
+ * The keys are searched through a sparse array of fence keys first, and then
+ * within a single block of SI_STATIC_BLOCK_SIZE keys.
+ *
+ * The first write thaws the index: its entries are moved to a new mutable
+ * index, to which all the calls are delegated from then on. Snapshot cursors
+ * keep reading the packed arrays, which are only freed once they are closed */
+typedef struct {
+  SISpec spec;
+  SIKeyCmpFunc *cmpFuncs;
+  u_int8_t numFuncs;
+  SICmpFuncVector cmpCtx;
+
+  SIMultiKey **keys;
+  size_t numKeys;
+  // every SI_STATIC_BLOCK_SIZE'th key
+  SIMultiKey **fences;
+  size_t numFences;
+  size_t *offsets;
+  SIId *ids;
+  size_t numIds;
+
+  int thawed;
+  SIIndex mutable;
+  // the number of open snapshot cursors
+  int snapshots;
+} staticIndex;
+
+/* Count the keys of an array below a key, or not above it if upper is set. The
+ * loop runs a fixed log2(n) iterations, and the comparison result moves the
+ * base arithmetically rather than through a branch */
+static size_t staticIndex_rank(staticIndex *idx, SIMultiKey **keys, size_t n,
+                               SIMultiKey *key, int upper) {
+  if (n == 0) {
+    return 0;
+  }
+  size_t base = 0;
+  while (n > 1) {
+    size_t half = n / 2;
+    int c = SICmpMultiKey(keys[base + half], key, &idx->cmpCtx);
+    base += (upper ? c <= 0 : c < 0) * half;
+    n -= half;
+  }
+  int c = SICmpMultiKey(keys[base], key, &idx->cmpCtx);
+  return base + (upper ? c <= 0 : c < 0);
+}
+
+/* Find the position of the first key not below a key, or above it if upper is
+ * set. The fences narrow the search down to a single block, so most of the
+ * comparisons touch the small fence array rather than the whole key array */
+size_t staticIndex_Bound(staticIndex *idx, SIMultiKey *key, int upper) {
+  size_t f = staticIndex_rank(idx, idx->fences, idx->numFences, key, upper);
+  if (f == 0) {
+    return 0;
+  }
+  size_t lo = (f - 1) * SI_STATIC_BLOCK_SIZE + 1;
+  size_t hi = MIN(f * SI_STATIC_BLOCK_SIZE, idx->numKeys);
+  return lo + staticIndex_rank(idx, &idx->keys[lo], hi - lo, key, upper);
+}
+
+/* Free the packed arrays. The ids are only freed if the index still owns
+ * them */
+void staticIndex_freeArrays(staticIndex *idx, int freeIds) {
+  for (size_t i = 0; i < idx->numKeys; i++) {
+    SIMultiKey_Free(idx->keys[i]);
+  }
+  for (size_t i = 0; freeIds && i < idx->numIds; i++) {
+    free(idx->ids[i]);
+  }
+  free(idx->keys);
+  free(idx->fences);
+  free(idx->offsets);
+  free(idx->ids);
+  idx->keys = idx->fences = NULL;
+  idx->offsets = NULL;
+  idx->ids = NULL;
+  idx->numKeys = idx->numFences = idx->numIds = 0;
+}
+
+/* Move the entries to a new mutable index, which takes ownership of the ids.
+ * The key values are only borrowed, since the mutable index copies them */
+SIIndex *staticIndex_thaw(staticIndex *idx) {
+  if (idx->thawed) {
+    return &idx->mutable;
+  }
+
+  idx->mutable = SI_NewIndex(idx->spec);
+  SIChangeSet cs = SI_NewChangeSet(idx->numIds);
+  for (size_t i = 0; i < idx->numKeys; i++) {
+    SIMultiKey *k = idx->keys[i];
+    for (size_t j = idx->offsets[i]; j < idx->offsets[i + 1]; j++) {
+      SIChangeSet_AddCahnge(
+          &cs, (SIChange){.type = SI_CHADD,
+                          .id = idx->ids[j],
+                          .v = {.vals = k->keys, .len = k->size, .cap = k->size}});
+    }
+  }
+  idx->mutable.Apply(idx->mutable.ctx, cs);
+  SIChangeSet_Free(&cs);
+
+  if (!idx->snapshots) {
+    staticIndex_freeArrays(idx, 0);
+  }
+  idx->thawed = 1;
+  return &idx->mutable;
+}
+
+int staticIndex_Apply(void *ctx, SIChangeSet cs) {
+  SIIndex *m = staticIndex_thaw(ctx);
+  return m->Apply(m->ctx, cs);
+}
+
+/* Close a snapshot cursor, freeing the arrays if the last one of a thawed
+ * index was holding them */
+void staticIndex_releaseSnapshot(staticIndex *idx) {
+  if (--idx->snapshots == 0 && idx->thawed) {
+    staticIndex_freeArrays(idx, 0);
+  }
+}
+
+size_t staticIndex_Len(void *ctx) {
+  staticIndex *idx = ctx;
+  return idx->thawed ? idx->mutable.Len(idx->mutable.ctx) : idx->numIds;
+}
+
+size_t staticIndex_Estimate(void *ctx, SIQueryPlan *plan) {
+  staticIndex *idx = ctx;
+  if (idx->thawed) {
+    return idx->mutable.Estimate(idx->mutable.ctx, plan);
+  }
+
+  size_t total = 0;
+  siPlanRangeIterator it = SIQueryPlan_IterateRanges(plan);
+  siPlanRange *r;
+  while (NULL != (r = siPlanRangeIterator_Next(&it))) {
+    size_t pos = staticIndex_Bound(idx, r->min, r->minExclusive);
+    size_t end = MAX(pos, staticIndex_Bound(idx, r->max, !r->maxExclusive));
+    total += idx->offsets[end] - idx->offsets[pos];
+  }
+  siPlanRangeIterator_Free(&it);
+  return total;
+}
+
+/* A scan over the keys of the plan ranges */
+typedef struct {
+  SIQueryPlan *plan;
+  staticIndex *idx;
+  siPlanRangeIterator ranges;
+  // the current scan range, NULL if we're done
+  siPlanRange *currentRange;
+  int reverse;
+
+  // the keys left in the current range, as positions [pos, end). Reverse scans
+  // move end down rather than pos up
+  size_t pos;
+  size_t end;
+  // the ids left of the current key, as positions [idPos, idEnd)
+  size_t idPos;
+  size_t idEnd;
+
+  size_t skip;
+  size_t left;
+
+  SIMultiKey *lastKey;
+  int snapshot;
+} staticScanCtx;
+
+/* Move the scan to the plan's next range. Returns 0 if there are no more
+ * ranges to scan */
+int staticScan_NextRange(staticScanCtx *sc) {
+  sc->currentRange = siPlanRangeIterator_Next(&sc->ranges);
+  if (!sc->currentRange) {
+    return 0;
+  }
+  siPlanRange *r = sc->currentRange;
+  sc->pos = staticIndex_Bound(sc->idx, r->min, r->minExclusive);
+  sc->end = MAX(sc->pos, staticIndex_Bound(sc->idx, r->max, !r->maxExclusive));
+  return 1;
+}
+
+/* Get the next key of the current range in scan order, matching the filter.
+ * The filter is evaluated once per key rather than once per id. Returns NULL
+ * once the range is done */
+SIMultiKey *staticScan_NextKey(staticScanCtx *sc) {
+  staticIndex *idx = sc->idx;
+  while (sc->pos < sc->end) {
+    size_t k = sc->reverse ? --sc->end : sc->pos++;
+    if (sc->plan->filter && !SIFilter_Eval(sc->plan->filter, idx->keys[k])) {
+      continue;
+    }
+    sc->idPos = idx->offsets[k];
+    sc->idEnd = idx->offsets[k + 1];
+    return idx->keys[k];
+  }
+  return NULL;
+}
+
+SIId staticScan_next(void *ctx) {
+  staticScanCtx *sc = ctx;
+  while (sc->left && sc->currentRange) {
+    if (sc->idPos < sc->idEnd) {
+      // skipped ids are dropped a whole key at a time
+      if (sc->skip > 0) {
+        size_t n = MIN(sc->skip, sc->idEnd - sc->idPos);
+        sc->skip -= n;
+        if (sc->reverse) {
+          sc->idEnd -= n;
+        } else {
+          sc->idPos += n;
+        }
+        continue;
+      }
+      sc->left--;
+      return sc->idx->ids[sc->reverse ? --sc->idEnd : sc->idPos++];
+    }
+
+    SIMultiKey *mk = staticScan_NextKey(sc);
+    if (mk) {
+      sc->lastKey = mk;
+    } else {
+      staticScan_NextRange(sc);
+    }
+  }
+  return NULL;
+}
+
+void *staticScan_currentKey(void *ctx) {
+  return ((staticScanCtx *)ctx)->lastKey;
+}
+
+void staticScan_free(void *ctx) {
+  staticScanCtx *sc = ctx;
+  if (sc->snapshot) {
+    staticIndex_releaseSnapshot(sc->idx);
+  }
+  siPlanRangeIterator_Free(&sc->ranges);
+  SIQueryPlan_Free(sc->plan);
+  free(sc);
+}
+
+/* A cursor over the sorted ids of a query the index order can't satisfy */
+typedef struct {
+  SIId *ids;
+  SIMultiKey **keys;
+  size_t num;
+  size_t pos;
+  // the index of a snapshot cursor, NULL otherwise
+  staticIndex *snapshotOf;
+} staticSortedCtx;
+
+SIId staticSorted_next(void *ctx) {
+  staticSortedCtx *sc = ctx;
+  return sc->pos < sc->num ? sc->ids[sc->pos++] : NULL;
+}
+
+void *staticSorted_currentKey(void *ctx) {
+  staticSortedCtx *sc = ctx;
+  return sc->pos > 0 ? sc->keys[sc->pos - 1] : NULL;
+}
+
+void staticSorted_free(void *ctx) {
+  staticSortedCtx *sc = ctx;
+  if (sc->snapshotOf) {
+    staticIndex_releaseSnapshot(sc->snapshotOf);
+  }
+  free(sc->ids);
+  free(sc->keys);
+  free(sc);
+}
+
+/* Run the scan to its end, keeping only the first offset+num ids in the
+ * query's order. If each range is scanned in order, we skip to the next range
+ * as soon as a scanned key can no longer make it into the results */
+staticSortedCtx *staticScan_Sort(staticScanCtx *sc, SIQuery *q) {
+  SITopK *tk = SI_NewTopK(q->num ? q->offset + q->num : 0, q->orderBy,
+                          q->numOrderBy, sc->idx->cmpFuncs, q->orderDesc);
+  int rangeOrdered = sc->plan->order == PLAN_ORDER_RANGE;
+
+  while (sc->currentRange) {
+    SIMultiKey *mk;
+    while (NULL != (mk = staticScan_NextKey(sc))) {
+      int pushed = 0;
+      for (size_t i = sc->idPos; i < sc->idEnd; i++) {
+        pushed |= SITopK_Push(tk, mk, sc->idx->ids[i]);
+      }
+      if (!pushed && rangeOrdered) {
+        break;
+      }
+    }
+    staticScan_NextRange(sc);
+  }
+
+  staticSortedCtx *ret = malloc(sizeof(staticSortedCtx));
+  ret->ids = SITopK_Drain(tk, &ret->num, &ret->keys);
+  ret->pos = MIN(q->offset, ret->num);
+  ret->snapshotOf = NULL;
+  SITopK_Free(tk);
+  return ret;
+}
+
+SICursor *staticIndex_Find(void *ctx, SIQuery *q) {
+  staticIndex *idx = ctx;
+  if (idx->thawed) {
+    return idx->mutable.Find(idx->mutable.ctx, q);
+  }
+
+  SIQueryPlan *plan = NULL;
+  SICursor *c = SI_NewCursor(NULL);
+  if (q->numPredicates == 0 ||
+      NULL == (plan = SI_BuildQueryPlan(q, &idx->spec))) {
+    c->error = SI_CURSOR_ERROR;
+    return c;
+  }
+
+  staticScanCtx *sc = calloc(1, sizeof(staticScanCtx));
+  sc->idx = idx;
+  sc->plan = plan;
+  sc->reverse = plan->reverse;
+  sc->skip = q->offset;
+  sc->left = q->num ? q->num : SIZE_MAX;
+  sc->snapshot = q->snapshot;
+  sc->ranges = SIQueryPlan_IterateRanges(plan);
+  staticScan_NextRange(sc);
+  if (q->snapshot) {
+    idx->snapshots++;
+  }
+
+  if (plan->order == PLAN_ORDER_RANGE || plan->order == PLAN_ORDER_SORT) {
+    staticSortedCtx *sorted = staticScan_Sort(sc, q);
+    // the sorted ids take over the scan's snapshot
+    if (q->snapshot) {
+      sorted->snapshotOf = idx;
+    }
+    c->ctx = sorted;
+    c->Next = staticSorted_next;
+    c->CurrentKey = staticSorted_currentKey;
+    c->Release = staticSorted_free;
+    sc->snapshot = 0;
+    staticScan_free(sc);
+    return c;
+  }
+
+  c->ctx = sc;
+  c->Next = staticScan_next;
+  c->CurrentKey = staticScan_currentKey;
+  c->Release = staticScan_free;
+  return c;
+}
+
+/* Deleting thaws the index like any other write */
+int staticIndex_DeleteWhere(void *ctx, SIQuery *q, IndexVisitor cb,
+                            void *visitCtx, size_t *num, SIGarbage **garbage) {
+  SIIndex *m = staticIndex_thaw(ctx);
+  return m->DeleteWhere(m->ctx, q, cb, visitCtx, num, garbage);
+}
+
+void staticIndex_Traverse(void *ctx, IndexVisitor cb, void *visitCtx) {
+  staticIndex *idx = ctx;
+  if (idx->thawed) {
+    idx->mutable.Traverse(idx->mutable.ctx, cb, visitCtx);
+    return;
+  }
+  for (size_t i = 0; i < idx->numKeys; i++) {
+    for (size_t j = idx->offsets[i]; j < idx->offsets[i + 1]; j++) {
+      cb(idx->ids[j], idx->keys[i], visitCtx);
+    }
+  }
+}
+
+void staticIndex_Free(void *ctx) {
+  staticIndex *idx = ctx;
+  if (idx->thawed) {
+    idx->mutable.Free(idx->mutable.ctx);
+  }
+  // a thawed index may still hold its arrays for open snapshots
+  staticIndex_freeArrays(idx, !idx->thawed);
+  free(idx->cmpFuncs);
+  free(idx);
+}
+
+/* Append an entry of the source index. The source is traversed in key order,
+ * so equal keys are adjacent and share a single copy */
+void staticIndex_buildVisitor(SIId id, void *key, void *ctx) {
+  staticIndex *idx = ctx;
+  SIMultiKey *mk = key;
+  if (!idx->numKeys ||
+      SICmpMultiKey(idx->keys[idx->numKeys - 1], mk, &idx->cmpCtx)) {
+    if (idx->numKeys % SI_STATIC_BLOCK_SIZE == 0) {
+      idx->keys = realloc(idx->keys, (idx->numKeys + SI_STATIC_BLOCK_SIZE) *
+                                         sizeof(SIMultiKey *));
+      idx->offsets = realloc(idx->offsets, (idx->numKeys + SI_STATIC_BLOCK_SIZE +
+                                            1) * sizeof(size_t));
+    }
+    idx->offsets[idx->numKeys] = idx->numIds;
+    idx->keys[idx->numKeys++] = SI_NewMultiKey(mk->keys, mk->size);
+  }
+  idx->ids[idx->numIds++] = strdup(id);
+}
+
+SIIndex SI_NewStaticIndex(SIIndex src, SISpec spec) {
+  staticIndex *idx = calloc(1, sizeof(staticIndex));
+  idx->spec = spec;
+  idx->numFuncs = spec.numProps;
+  idx->cmpFuncs = calloc(spec.numProps, sizeof(SIKeyCmpFunc));
+  for (u_int8_t i = 0; i < spec.numProps; i++) {
+    idx->cmpFuncs[i] = SI_KeyCmpFunc(spec.properties[i].type);
+  }
+  idx->cmpCtx = (SICmpFuncVector){.cmpFuncs = idx->cmpFuncs,
+                                  .numFuncs = idx->numFuncs};
+
+  idx->ids = calloc(src.Len(src.ctx) + 1, sizeof(SIId));
+  src.Traverse(src.ctx, staticIndex_buildVisitor, idx);
+
+  idx->offsets = realloc(idx->offsets, (idx->numKeys + 1) * sizeof(size_t));
+  idx->offsets[idx->numKeys] = idx->numIds;
+  idx->numFences = (idx->numKeys + SI_STATIC_BLOCK_SIZE - 1) /
+                   SI_STATIC_BLOCK_SIZE;
+  idx->fences = calloc(idx->numFences + 1, sizeof(SIMultiKey *));
+  for (size_t i = 0; i < idx->numFences; i++) {
+    idx->fences[i] = idx->keys[i * SI_STATIC_BLOCK_SIZE];
+  }
+
+  return (SIIndex){.ctx = idx,
+                   .Apply = staticIndex_Apply,
+                   .Find = staticIndex_Find,
+                   .Traverse = staticIndex_Traverse,
+                   .DeleteWhere = staticIndex_DeleteWhere,
+                   .Len = staticIndex_Len,
+                   .Estimate = staticIndex_Estimate,
+                   .Free = staticIndex_Free};
+}
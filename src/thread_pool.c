@@ -0,0 +1,286 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "thread_pool.h"
+#include "rmutil/alloc.h"
+
+struct siTask {
+  SITaskFunc run;
+  SITaskDoneFunc done;
+  void *arg;
+  int cancelled;
+  // set once the body was run
+  int ran;
+  // the next task in the completion queue
+  SITask *next;
+};
+
+/* A ring buffer of tasks. The owner pushes and pops at the bottom, thieves
+ * take from the top */
+typedef struct {
+  SITask **tasks;
+  size_t head;
+  size_t len;
+  size_t cap;
+} siDeque;
+
+typedef struct {
+  SIThreadPool *pool;
+  size_t id;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  siDeque deques[SI_TASK_NUM_PRIORITIES];
+} siWorker;
+
+struct siThreadPool {
+  siWorker *workers;
+  size_t numWorkers;
+  // the worker getting the next task submitted from outside the pool
+  size_t nextWorker;
+
+  // the number of tasks in the deques, and of tasks whose completion has not
+  // run yet
+  size_t queued;
+  size_t pending;
+
+  int stop;
+  pthread_mutex_t sleepLock;
+  pthread_cond_t wake;
+
+  pthread_mutex_t doneLock;
+  SITask *doneHead;
+  SITask *doneTail;
+};
+
+// the worker running on the current thread, NULL outside of the pools
+static __thread siWorker *currentWorker = NULL;
+
+static void siDeque_Push(siDeque *d, SITask *t) {
+  if (d->len == d->cap) {
+    size_t cap = d->cap ? d->cap * 2 : 16;
+    SITask **tasks = malloc(cap * sizeof(SITask *));
+    for (size_t i = 0; i < d->len; i++) {
+      tasks[i] = d->tasks[(d->head + i) % d->cap];
+    }
+    free(d->tasks);
+    d->tasks = tasks;
+    d->head = 0;
+    d->cap = cap;
+  }
+  d->tasks[(d->head + d->len++) % d->cap] = t;
+}
+
+static SITask *siDeque_PopBottom(siDeque *d) {
+  if (!d->len) {
+    return NULL;
+  }
+  return d->tasks[(d->head + --d->len) % d->cap];
+}
+
+static SITask *siDeque_PopTop(siDeque *d) {
+  if (!d->len) {
+    return NULL;
+  }
+  SITask *t = d->tasks[d->head];
+  d->head = (d->head + 1) % d->cap;
+  d->len--;
+  return t;
+}
+
+/* Find the most urgent task a worker can run, from its own deques first, and
+ * then from the other workers' */
+static SITask *siWorker_FindTask(siWorker *w) {
+  SIThreadPool *p = w->pool;
+  for (int prio = 0; prio < SI_TASK_NUM_PRIORITIES; prio++) {
+    pthread_mutex_lock(&w->lock);
+    SITask *t = siDeque_PopBottom(&w->deques[prio]);
+    pthread_mutex_unlock(&w->lock);
+    if (t) {
+      return t;
+    }
+
+    for (size_t i = 1; i < p->numWorkers; i++) {
+      siWorker *victim = &p->workers[(w->id + i) % p->numWorkers];
+      pthread_mutex_lock(&victim->lock);
+      t = siDeque_PopTop(&victim->deques[prio]);
+      pthread_mutex_unlock(&victim->lock);
+      if (t) {
+        return t;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void siThreadPool_Complete(SIThreadPool *p, SITask *t) {
+  pthread_mutex_lock(&p->doneLock);
+  if (p->doneTail) {
+    p->doneTail->next = t;
+  } else {
+    p->doneHead = t;
+  }
+  p->doneTail = t;
+  pthread_mutex_unlock(&p->doneLock);
+}
+
+static void *siWorker_Main(void *arg) {
+  siWorker *w = arg;
+  SIThreadPool *p = w->pool;
+  currentWorker = w;
+
+  while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+    SITask *t = siWorker_FindTask(w);
+    if (!t) {
+      // submitters signal while holding the lock, so a task queued after we
+      // looked can't be missed
+      pthread_mutex_lock(&p->sleepLock);
+      while (!p->stop && !__atomic_load_n(&p->queued, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&p->wake, &p->sleepLock);
+      }
+      pthread_mutex_unlock(&p->sleepLock);
+      continue;
+    }
+
+    __atomic_sub_fetch(&p->queued, 1, __ATOMIC_ACQ_REL);
+    if (!SITask_IsCancelled(t)) {
+      t->ran = 1;
+      t->run(t, t->arg);
+    }
+    siThreadPool_Complete(p, t);
+  }
+
+  currentWorker = NULL;
+  return NULL;
+}
+
+static void siThreadPool_Stop(SIThreadPool *p, size_t numStarted) {
+  pthread_mutex_lock(&p->sleepLock);
+  __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->sleepLock);
+  for (size_t i = 0; i < numStarted; i++) {
+    pthread_join(p->workers[i].thread, NULL);
+  }
+}
+
+static void siThreadPool_Destroy(SIThreadPool *p) {
+  for (size_t i = 0; i < p->numWorkers; i++) {
+    for (int prio = 0; prio < SI_TASK_NUM_PRIORITIES; prio++) {
+      free(p->workers[i].deques[prio].tasks);
+    }
+    pthread_mutex_destroy(&p->workers[i].lock);
+  }
+  pthread_mutex_destroy(&p->sleepLock);
+  pthread_cond_destroy(&p->wake);
+  pthread_mutex_destroy(&p->doneLock);
+  free(p->workers);
+  free(p);
+}
+
+SIThreadPool *SI_NewThreadPool(size_t numThreads) {
+  if (numThreads == 0) {
+    return NULL;
+  }
+  SIThreadPool *p = calloc(1, sizeof(SIThreadPool));
+  p->numWorkers = numThreads;
+  p->workers = calloc(numThreads, sizeof(siWorker));
+  pthread_mutex_init(&p->sleepLock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_mutex_init(&p->doneLock, NULL);
+  for (size_t i = 0; i < numThreads; i++) {
+    p->workers[i].pool = p;
+    p->workers[i].id = i;
+    pthread_mutex_init(&p->workers[i].lock, NULL);
+  }
+
+  for (size_t i = 0; i < numThreads; i++) {
+    if (pthread_create(&p->workers[i].thread, NULL, siWorker_Main,
+                       &p->workers[i]) != 0) {
+      siThreadPool_Stop(p, i);
+      siThreadPool_Destroy(p);
+      return NULL;
+    }
+  }
+  return p;
+}
+
+SITask *SIThreadPool_Submit(SIThreadPool *p, SITaskPriority prio, SITaskFunc run,
+                            SITaskDoneFunc done, void *arg) {
+  SITask *t = calloc(1, sizeof(SITask));
+  t->run = run;
+  t->done = done;
+  t->arg = arg;
+
+  // tasks spawned by a task stay on its worker, unless they are stolen
+  siWorker *w = currentWorker && currentWorker->pool == p
+                    ? currentWorker
+                    : &p->workers[__atomic_fetch_add(&p->nextWorker, 1,
+                                                     __ATOMIC_RELAXED) %
+                                  p->numWorkers];
+
+  __atomic_add_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+  __atomic_add_fetch(&p->queued, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_lock(&w->lock);
+  siDeque_Push(&w->deques[prio], t);
+  pthread_mutex_unlock(&w->lock);
+
+  pthread_mutex_lock(&p->sleepLock);
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->sleepLock);
+  return t;
+}
+
+void SITask_Cancel(SITask *t) {
+  __atomic_store_n(&t->cancelled, 1, __ATOMIC_RELEASE);
+}
+
+int SITask_IsCancelled(SITask *t) {
+  return __atomic_load_n(&t->cancelled, __ATOMIC_ACQUIRE);
+}
+
+size_t SIThreadPool_Drain(SIThreadPool *p, size_t max) {
+  for (size_t n = 0; n < max; n++) {
+    pthread_mutex_lock(&p->doneLock);
+    SITask *t = p->doneHead;
+    if (t) {
+      p->doneHead = t->next;
+      if (!p->doneHead) {
+        p->doneTail = NULL;
+      }
+    }
+    pthread_mutex_unlock(&p->doneLock);
+    if (!t) {
+      break;
+    }
+
+    if (t->done) {
+      t->done(t->arg, !t->ran);
+    }
+    free(t);
+    __atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+  }
+  return SIThreadPool_Pending(p);
+}
+
+size_t SIThreadPool_Pending(SIThreadPool *p) {
+  return __atomic_load_n(&p->pending, __ATOMIC_ACQUIRE);
+}
+
+size_t SIThreadPool_NumThreads(SIThreadPool *p) { return p->numWorkers; }
+
+void SIThreadPool_Free(SIThreadPool *p) {
+  siThreadPool_Stop(p, p->numWorkers);
+
+  // the workers are gone, the tasks they left are completed as cancelled
+  for (size_t i = 0; i < p->numWorkers; i++) {
+    for (int prio = 0; prio < SI_TASK_NUM_PRIORITIES; prio++) {
+      SITask *t;
+      while (NULL != (t = siDeque_PopTop(&p->workers[i].deques[prio]))) {
+        SITask_Cancel(t);
+        siThreadPool_Complete(p, t);
+      }
+    }
+  }
+  SIThreadPool_Drain(p, SIZE_MAX);
+  siThreadPool_Destroy(p);
+}
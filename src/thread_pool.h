@@ -0,0 +1,65 @@
+#ifndef __SI_THREAD_POOL_H__
+#define __SI_THREAD_POOL_H__
+
+#include <stdlib.h>
+
+/* A work stealing pool of worker threads for long index tasks.
+ *
+ * Each worker has a deque of tasks per priority. Tasks submitted by a worker
+ * go to its own deques, and are run last in first out, while idle workers
+ * steal the oldest tasks from the other workers' deques. Tasks submitted from
+ * other threads are spread over the workers. A worker always runs the most
+ * urgent task it can find, its own or stolen.
+ *
+ * Tasks are not allowed to call back into the server. Once a task is done,
+ * its completion is queued, and run by the owning thread when it drains the
+ * pool, so it can safely touch state the workers can't */
+typedef struct siThreadPool SIThreadPool;
+typedef struct siTask SITask;
+
+typedef enum {
+  SI_TASK_HIGH = 0,
+  SI_TASK_NORMAL = 1,
+  SI_TASK_LOW = 2,
+} SITaskPriority;
+
+#define SI_TASK_NUM_PRIORITIES 3
+
+/* The body of a task, run on a worker thread */
+typedef void (*SITaskFunc)(SITask *t, void *arg);
+
+/* The completion of a task, run by the thread draining the pool. cancelled is
+ * set if the task was cancelled before it started, in which case its body was
+ * never run */
+typedef void (*SITaskDoneFunc)(void *arg, int cancelled);
+
+/* Create a pool of numThreads workers. Returns NULL if the threads could not
+ * be started */
+SIThreadPool *SI_NewThreadPool(size_t numThreads);
+
+/* Queue a task. done may be NULL. The returned handle stays valid until the
+ * task's completion has run */
+SITask *SIThreadPool_Submit(SIThreadPool *p, SITaskPriority prio, SITaskFunc run,
+                            SITaskDoneFunc done, void *arg);
+
+/* Ask a task to stop. A task that has not started yet is not run at all, while
+ * a running task should poll SITask_IsCancelled and return early */
+void SITask_Cancel(SITask *t);
+
+/* Return 1 if a task was cancelled */
+int SITask_IsCancelled(SITask *t);
+
+/* Run up to max completions of done tasks. Returns the number of submitted
+ * tasks whose completion has not run yet */
+size_t SIThreadPool_Drain(SIThreadPool *p, size_t max);
+
+/* Return the number of submitted tasks whose completion has not run yet */
+size_t SIThreadPool_Pending(SIThreadPool *p);
+
+size_t SIThreadPool_NumThreads(SIThreadPool *p);
+
+/* Stop the workers. The queued tasks are cancelled, the running ones waited
+ * for, and all the remaining completions are run before the pool is freed */
+void SIThreadPool_Free(SIThreadPool *p);
+
+#endif
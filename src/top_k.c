@@ -0,0 +1,97 @@
+#include "top_k.h"
+#include "rmutil/priority_queue.h"
+#include "rmutil/alloc.h"
+
+struct siTopK {
+  PriorityQueue *pq;
+  size_t k;
+
+  int *propIds;
+  int numProps;
+  SIKeyCmpFunc *cmpFuncs;
+  int desc;
+};
+
+/* A heap entry. The priority queue comparator takes no context, so each entry
+ * points back to its collector */
+typedef struct {
+  SIMultiKey *key;
+  SIId id;
+  SITopK *tk;
+} topKEntry;
+
+/* Compare two keys in ORDER BY order. A positive result means k1 comes after k2 */
+static inline int topK_cmpKeys(SITopK *tk, SIMultiKey *k1, SIMultiKey *k2) {
+  for (int i = 0; i < tk->numProps; i++) {
+    int p = tk->propIds[i];
+    int rc = tk->cmpFuncs[p](&k1->keys[p], &k2->keys[p], NULL);
+    if (rc != 0) {
+      return tk->desc ? -rc : rc;
+    }
+  }
+  return 0;
+}
+
+/* The heap's top is its greatest entry, which is the one that comes last */
+int topK_cmpEntries(void *p1, void *p2) {
+  topKEntry *e1 = p1, *e2 = p2;
+  return topK_cmpKeys(e1->tk, e1->key, e2->key);
+}
+
+SITopK *SI_NewTopK(size_t k, int *propIds, int numProps, SIKeyCmpFunc *cmpFuncs,
+                   int desc) {
+  SITopK *tk = malloc(sizeof(SITopK));
+  tk->k = k ? k : SIZE_MAX;
+  tk->propIds = propIds;
+  tk->numProps = numProps;
+  tk->cmpFuncs = cmpFuncs;
+  tk->desc = desc;
+  // bounded collectors never grow beyond k + 1 entries
+  tk->pq = NewPriorityQueue(topKEntry, k ? k + 1 : 16, topK_cmpEntries);
+  return tk;
+}
+
+int SITopK_Push(SITopK *tk, SIMultiKey *key, SIId id) {
+  topKEntry e = {.key = key, .id = id, .tk = tk};
+  if (Priority_Queue_Size(tk->pq) < tk->k) {
+    __priority_Queue_PushPtr(tk->pq, &e);
+    return 1;
+  }
+
+  // replace the worst entry, but only if the new one comes before it
+  topKEntry top;
+  Priority_Queue_Top(tk->pq, &top);
+  if (topK_cmpKeys(tk, key, top.key) >= 0) {
+    return 0;
+  }
+  Priority_Queue_Pop(tk->pq);
+  __priority_Queue_PushPtr(tk->pq, &e);
+  return 1;
+}
+
+size_t SITopK_Size(SITopK *tk) { return Priority_Queue_Size(tk->pq); }
+
+SIId *SITopK_Drain(SITopK *tk, size_t *num, SIMultiKey ***keys) {
+  *num = Priority_Queue_Size(tk->pq);
+  SIId *ids = calloc(*num ? *num : 1, sizeof(SIId));
+  if (keys) {
+    *keys = calloc(*num ? *num : 1, sizeof(SIMultiKey *));
+  }
+
+  // the heap pops the last entry first, so we fill the arrays backwards
+  topKEntry e;
+  for (size_t i = *num; i > 0; i--) {
+    Priority_Queue_Top(tk->pq, &e);
+    Priority_Queue_Pop(tk->pq);
+    ids[i - 1] = e.id;
+    if (keys) {
+      (*keys)[i - 1] = e.key;
+    }
+  }
+  return ids;
+}
+
+void SITopK_Free(SITopK *tk) {
+  Priority_Queue_Free(tk->pq);
+  free(tk);
+}
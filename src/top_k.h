@@ -0,0 +1,37 @@
+#ifndef __SI_TOP_K_H__
+#define __SI_TOP_K_H__
+
+#include "key.h"
+#include "value.h"
+
+/* Collects the k first ids of a query in ORDER BY order, for orderings the
+ * index order does not satisfy.
+ *
+ * The ids are kept in a bounded max heap whose top is the worst id kept so
+ * far, so each scanned id costs O(log k) at most, and memory is O(k) regardless
+ * of the number of matching ids. Ties between equal keys are kept in scan
+ * order until they are evicted, and returned in no particular order */
+typedef struct siTopK SITopK;
+
+/* Create a top-k collector ordering by the given property ids, using the
+ * index comparators of each property. A k of 0 means no bound, i.e. a full
+ * sort */
+SITopK *SI_NewTopK(size_t k, int *propIds, int numProps, SIKeyCmpFunc *cmpFuncs,
+                   int desc);
+
+/* Offer an id with its index key. The key is borrowed and must stay valid
+ * until the collector is drained. Returns 1 if the id was kept, 0 if the
+ * collector is full and the id comes after all the ids it holds */
+int SITopK_Push(SITopK *tk, SIMultiKey *key, SIId id);
+
+/* Return the number of ids kept */
+size_t SITopK_Size(SITopK *tk);
+
+/* Remove all the ids from the collector, and return them in order as an
+ * allocated array of *num ids. If keys is not NULL, it is set to an allocated
+ * array of their keys */
+SIId *SITopK_Drain(SITopK *tk, size_t *num, SIMultiKey ***keys);
+
+void SITopK_Free(SITopK *tk);
+
+#endif
@@ -72,6 +72,7 @@ void SIValue_IncRef(SIValue *v) {
 
 SIValue SI_InfVal() { return (SIValue){.intval = 0, .type = T_INF}; }
 SIValue SI_NegativeInfVal() { return (SIValue){.intval = 0, .type = T_NEGINF}; }
+SIValue SI_ParamVal(int pos) { return (SIValue){.intval = pos, .type = T_PARAM}; }
 
 inline int SIValue_IsInf(SIValue *v) { return v && v->type == T_INF; }
 inline int SIValue_IsNegativeInf(SIValue *v) {
@@ -237,12 +238,92 @@ void SIValue_ToString(SIValue v, char *buf, size_t len) {
     case T_NEGINF:
       snprintf(buf, len, "-inf");
       break;
+    case T_PARAM:
+      snprintf(buf, len, "?%d", v.intval + 1);
+      break;
     case T_NULL:
     default:
       snprintf(buf, len, "NULL");
   }
 }
 
+static const char __digitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+/* Format an unsigned integer two digits at a time, which is several times
+ * faster than snprintf */
+size_t __formatUint(u_int64_t u, char *buf) {
+  size_t len = 1;
+  for (u_int64_t x = u; x >= 10; x /= 10) len++;
+
+  char *p = buf + len;
+  while (u >= 100) {
+    int i = (u % 100) * 2;
+    u /= 100;
+    *--p = __digitPairs[i + 1];
+    *--p = __digitPairs[i];
+  }
+  if (u >= 10) {
+    *--p = __digitPairs[u * 2 + 1];
+    *--p = __digitPairs[u * 2];
+  } else {
+    *--p = '0' + u;
+  }
+  return len;
+}
+
+size_t __formatInt(int64_t i, char *buf) {
+  if (i < 0) {
+    *buf = '-';
+    return 1 + __formatUint(-(u_int64_t)i, buf + 1);
+  }
+  return __formatUint(i, buf);
+}
+
+/* Format a floating point number in the shortest form that parses back to the
+ * same value, trying the short precision first. Integral values skip printf
+ * altogether */
+size_t __formatDouble(double d, int isFloat, char *buf) {
+  if (d > -9007199254740992.0 && d < 9007199254740992.0 && d == (int64_t)d) {
+    return __formatInt((int64_t)d, buf);
+  }
+  int n = snprintf(buf, SI_VALUE_FORMAT_MAX, "%.*g", isFloat ? 7 : 15, d);
+  if (isFloat ? strtof(buf, NULL) != (float)d : strtod(buf, NULL) != d) {
+    n = snprintf(buf, SI_VALUE_FORMAT_MAX, "%.*g", isFloat ? 9 : 17, d);
+  }
+  return n;
+}
+
+size_t SIValue_Format(SIValue *v, char *buf) {
+  switch (v->type) {
+    case T_INT32:
+      return __formatInt(v->intval, buf);
+    case T_INT64:
+      return __formatInt(v->longval, buf);
+    case T_UINT:
+      return __formatUint(v->uintval, buf);
+    case T_TIME:
+      return __formatInt(v->timeval, buf);
+    case T_BOOL:
+      *buf = v->boolval ? '1' : '0';
+      return 1;
+    case T_FLOAT:
+      return __formatDouble(v->floatval, 1, buf);
+    case T_DOUBLE:
+      return __formatDouble(v->doubleval, 0, buf);
+    case T_INF:
+      memcpy(buf, "+inf", 4);
+      return 4;
+    case T_NEGINF:
+      memcpy(buf, "-inf", 4);
+      return 4;
+    default:
+      return 0;
+  }
+}
+
 inline SIValue SI_NullVal() { return (SIValue){.intval = 0, .type = T_NULL}; }
 
 SIValueVector SI_NewValueVector(size_t cap) {
@@ -23,6 +23,10 @@ typedef enum {
   T_INF = 0x100,
   T_NEGINF = 0x200,
 
+  // a parameter of a prepared query, to be bound to a value. Its intval is
+  // the parameter's position
+  T_PARAM = 0x400,
+
   //  -- FUTURE TYPES: --
   // T_GEOPOINT
   // T_SET
@@ -104,6 +108,8 @@ SIValue SI_NegativeInfVal();
 int SIValue_IsInf(SIValue *v);
 int SIValue_IsNegativeInf(SIValue *v);
 
+SIValue SI_ParamVal(int pos);
+
 /* Copy the value, incrementing the refcount if needed */
 SIValue SIValue_Copy(SIValue src);
 
@@ -125,4 +131,13 @@ int SI_ParseValue(SIValue *v, char *str, size_t len);
 
 void SIValue_ToString(SIValue v, char *buf, size_t len);
 
+/* The buffer size SIValue_Format needs for any non string value */
+#define SI_VALUE_FORMAT_MAX 32
+
+/* Format a non string value the way it's written in a hash field, i.e.
+ * numbers in their shortest round-trip form and bools as 1/0. buf must hold
+ * SI_VALUE_FORMAT_MAX bytes. Returns the formatted length, without a
+ * terminating NULL */
+size_t SIValue_Format(SIValue *v, char *buf);
+
 #endif
\ No newline at end of file
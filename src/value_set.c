@@ -0,0 +1,112 @@
+#include <ctype.h>
+#include <strings.h>
+#include "value_set.h"
+#include "util/khash.h"
+#include "rmutil/alloc.h"
+
+/* Hash a value consistently with the index comparators - strings are hashed
+ * case insensitively, and numbers by their typed member */
+static inline khint_t __siValueSet_hash(SIValue v) {
+  switch (v.type) {
+  case T_STRING: {
+    khint_t h = 0;
+    for (size_t i = 0; i < v.stringval.len; i++) {
+      h = (h << 5) - h + (khint_t)tolower((unsigned char)v.stringval.str[i]);
+    }
+    return h;
+  }
+  case T_INT32:
+  case T_BOOL:
+    return kh_int_hash_func((u_int32_t)v.intval);
+  case T_INT64:
+    return kh_int64_hash_func((u_int64_t)v.longval);
+  case T_UINT:
+    return kh_int64_hash_func(v.uintval);
+  case T_TIME:
+    return kh_int64_hash_func((u_int64_t)v.timeval);
+  case T_FLOAT: {
+    // -0.0 and 0.0 compare as equal, so they must hash the same
+    double d = v.floatval == 0 ? 0 : v.floatval;
+    u_int64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return kh_int64_hash_func(bits);
+  }
+  case T_DOUBLE: {
+    double d = v.doubleval == 0 ? 0 : v.doubleval;
+    u_int64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    return kh_int64_hash_func(bits);
+  }
+  default:
+    return 0;
+  }
+}
+
+static inline int __siValueSet_equals(SIValue a, SIValue b) {
+  if (a.type != b.type) {
+    // bools are compared as ints by the index
+    if (!((a.type == T_BOOL && b.type == T_INT32) ||
+          (a.type == T_INT32 && b.type == T_BOOL))) {
+      return 0;
+    }
+  }
+  switch (a.type) {
+  case T_STRING:
+    return a.stringval.len == b.stringval.len &&
+           !strncasecmp(a.stringval.str, b.stringval.str, a.stringval.len);
+  case T_INT32:
+  case T_BOOL:
+    return a.intval == b.intval;
+  case T_INT64:
+    return a.longval == b.longval;
+  case T_UINT:
+    return a.uintval == b.uintval;
+  case T_TIME:
+    return a.timeval == b.timeval;
+  case T_FLOAT:
+    return a.floatval == b.floatval;
+  case T_DOUBLE:
+    return a.doubleval == b.doubleval;
+  default:
+    return 1;
+  }
+}
+
+KHASH_INIT(siValSet, SIValue, char, 0, __siValueSet_hash,
+           __siValueSet_equals);
+
+struct siValueSet {
+  khash_t(siValSet) * h;
+};
+
+SIValueSet *SI_NewValueSet(SIValue *vals, size_t num) {
+  SIValueSet *s = malloc(sizeof(SIValueSet));
+  s->h = kh_init(siValSet);
+  kh_resize(siValSet, s->h, num);
+
+  for (size_t i = 0; i < num; i++) {
+    int rc;
+    kh_put(siValSet, s->h, vals[i], &rc);
+    // only keep a reference to values actually added to the set
+    if (rc > 0) {
+      SIValue_IncRef(&vals[i]);
+    }
+  }
+  return s;
+}
+
+int SIValueSet_Contains(SIValueSet *s, SIValue *v) {
+  return kh_get(siValSet, s->h, *v) != kh_end(s->h);
+}
+
+size_t SIValueSet_Size(SIValueSet *s) { return kh_size(s->h); }
+
+void SIValueSet_Free(SIValueSet *s) {
+  for (khiter_t k = kh_begin(s->h); k != kh_end(s->h); ++k) {
+    if (kh_exist(s->h, k)) {
+      SIValue_Free(&kh_key(s->h, k));
+    }
+  }
+  kh_destroy(siValSet, s->h);
+  free(s);
+}
@@ -0,0 +1,26 @@
+#ifndef __SI_VALUE_SET_H__
+#define __SI_VALUE_SET_H__
+
+#include "value.h"
+
+/* A hash set of values, used to evaluate IN predicates in O(1) per scanned key
+ * instead of comparing the key to each value in the list.
+ *
+ * Values must already be cast to the type of the property they are matched
+ * against. Equality follows the index comparators, i.e. strings are compared
+ * case insensitively */
+typedef struct siValueSet SIValueSet;
+
+/* Create a set from a list of values. The set keeps its own reference to each
+ * value */
+SIValueSet *SI_NewValueSet(SIValue *vals, size_t num);
+
+/* Return 1 if the value is in the set, 0 otherwise */
+int SIValueSet_Contains(SIValueSet *s, SIValue *v);
+
+/* Return the number of distinct values in the set */
+size_t SIValueSet_Size(SIValueSet *s);
+
+void SIValueSet_Free(SIValueSet *s);
+
+#endif
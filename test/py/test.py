@@ -1,6 +1,8 @@
 from rmtest import ModuleTestCase
 import redis
 import unittest
+import time
+import threading
 from redis.exceptions import RedisError
 
 
@@ -16,6 +18,14 @@ class SecondaryTestCase(ModuleTestCase('../../build/src/libmodule.so')):
         else:
             return r.execute_command("idx.into", "idx", *cmd.split(" "))
 
+    def waitForBuild(self, r, idx):
+        for _ in range(500):
+            info = r.execute_command('idx.info', idx)
+            if info[info.index('building') + 1] == 0:
+                return
+            time.sleep(0.01)
+        self.fail('index build did not finish')
+
     def testHashIndex(self):
 
         with self.redis() as r:
@@ -63,6 +73,34 @@ class SecondaryTestCase(ModuleTestCase('../../build/src/libmodule.so')):
             self.assertTrue(['user11', ['name11', '21'], 'user12', ['name12', '22'], 'user13', ['name13', '23'], 'user14', ['name14', '24'], 'user41', ['name41', '21'], 'user42', ['name42', '22'], 'user43', ['name43', '23'], 'user44', ['name44', '24']],
                             self.execFromWhere(r, "idx", "name < 'name50' AND (age > 20 AND age < 25)", 'hmget $ name age'))
 
+            # test the directly served read commands
+            self.assertEqual(['user10', 1, 'user11', 1],
+                             self.execFromWhere(r, "idx", "name IN('name10', 'name11')", 'exists $'))
+            self.assertEqual(['user10', 'hash'],
+                             self.execFromWhere(r, "idx", "name = 'name10'", 'type $'))
+            self.assertEqual(['user10', ['name10', None, '20']],
+                             self.execFromWhere(r, "idx", "name = 'name10'", 'hmget $ name foo age'))
+            self.assertEqual(['user10', None],
+                             self.execFromWhere(r, "idx", "name = 'name10'", 'hget $ foo'))
+
+            # test the natively executed write commands
+            self.assertEqual(1, self.execInto(r, 'idx', 'HSET user13 foo bar'))
+            self.assertEqual(['user13', 'name13'],
+                             self.execFromWhere(r, "idx", "name = 'name13'", 'hget $ name'))
+            self.assertEqual(1, self.execInto(r, 'idx', 'HSETNX user13 name foo'))
+            self.assertEqual(['user13', 'name13'],
+                             self.execFromWhere(r, "idx", "name = 'name13'", 'hget $ name'))
+            self.assertEqual(2, self.execInto(r, 'idx', 'HSET $ age 100', "name IN('name14', 'name15')"))
+            self.assertEqual(['user14', 'name14', 'user15', 'name15'],
+                             self.execFromWhere(r, "idx", "age = 100", 'hget $ name'))
+            self.assertEqual(1, self.execInto(r, 'idx', 'HSETNX user100 name name100'))
+            self.assertEqual(['user100', None],
+                             self.execFromWhere(r, "idx", "name = 'name100'", 'hget $ age'))
+            self.assertEqual(1, self.execInto(r, 'idx', 'HDEL user100 name'))
+            self.assertEqual([],
+                             self.execFromWhere(r, "idx", "name = 'name100'", 'hget $ age'))
+            self.assertEqual(0, r.exists('user100'))
+
             # test deletion
             self.assertEqual(['user12', 'name12'],
                              self.execFromWhere(r, "idx", "name = 'name12'", 'hget $ name'))
@@ -99,6 +137,229 @@ class SecondaryTestCase(ModuleTestCase('../../build/src/libmodule.so')):
 
             self.assertEqual(97, r.execute_command('idx.card', 'idx'))
 
+    def testOrderBy(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'schema', 'string', 'int32'))
+
+            for i in range(20):
+                self.assertOk(r.execute_command('idx.insert', 'idx', 'id%d' %
+                                                i, 'user%d' % (i % 2), i))
+
+            self.assertEqual(['id19', 'id17', 'id15'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'user1'", 'ORDER', 'BY', '$2',
+                'DESC', 'LIMIT', 0, 3))
+            self.assertEqual(['id2', 'id4'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'user0'", 'ORDER', 'BY', '$2',
+                'LIMIT', 1, 2))
+
+            # ordering by the second column alone is sorted
+            self.assertEqual(['id19', 'id18', 'id17'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 IN ('user0', 'user1')", 'ORDER', 'BY',
+                '$2', 'DESC', 'LIMIT', 0, 3))
+            self.assertRaises(RedisError, r.execute_command, 'idx.select', 'idx',
+                              'WHERE', "$1 = 'user0'", 'ORDER', 'BY', '$3')
+
+            # return values from the index
+            self.assertEqual([['id19', '19', 'user1'], ['id17', '17', 'user1']],
+                             r.execute_command('idx.select', 'idx', 'WHERE', "$1 = 'user1'",
+                                               'ORDER', 'BY', '$2', 'DESC', 'LIMIT', 0, 2,
+                                               'RETURN', '$2', '$1'))
+            self.assertEqual([['id4', 'user0', '4']],
+                             r.execute_command('idx.select', 'idx', 'WHERE',
+                                               "$1 = 'user0' AND $2 = 4", 'RETURN', 'ALL'))
+            self.assertRaises(RedisError, r.execute_command, 'idx.select', 'idx',
+                              'WHERE', "$1 = 'user0'", 'RETURN', '$3')
+
+    def testDeleteWhere(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'schema', 'string', 'int32'))
+            for i in range(100):
+                self.assertOk(r.execute_command(
+                    'idx.insert', 'idx', 'id%d' % i, 'foo' if i % 2 else 'bar', i))
+
+            self.assertEqual(10, r.execute_command(
+                'idx.delwhere', 'idx', 'WHERE', "$1 = 'foo' AND $2 < 20"))
+            self.assertEqual(90, r.execute_command('idx.card', 'idx'))
+            self.assertEqual([], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'foo' AND $2 < 20"))
+
+            # with a residual filter on the second column
+            self.assertEqual(['id91', 'id93', 'id95', 'id97', 'id99'], sorted(r.execute_command(
+                'idx.delwhere', 'idx', 'WHERE', "$1 >= 'foo' AND $2 > 90", 'WITHIDS')))
+            self.assertEqual([], r.execute_command(
+                'idx.delwhere', 'idx', 'WHERE', "$1 = 'baz'", 'WITHIDS'))
+            self.assertEqual(50, r.execute_command(
+                'idx.delwhere', 'idx', 'WHERE', "$1 IN ('bar', 'baz')"))
+            self.assertEqual(35, r.execute_command('idx.card', 'idx'))
+
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.delwhere', 'idx', 'WHERE', "$2 > 3")
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.delwhere', 'idx', 'WHERE', "$1 = 'foo'", 'FOO')
+
+    def testPartitionedIndex(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'partition', 100, 'schema', 'time', 'int32'))
+            for i in range(10):
+                self.assertOk(r.execute_command(
+                    'idx.insert', 'idx', 'id%d' % i, i * 50, i))
+
+            self.assertEqual(['id3', 'id4', 'id5', 'id6'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 >= UNIX(120) AND $1 < UNIX(320)",
+                'ORDER', 'BY', '$1'))
+            self.assertEqual(['id6', 'id5', 'id4', 'id3'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 >= UNIX(120) AND $1 < UNIX(320)",
+                'ORDER', 'BY', '$1', 'DESC'))
+
+            self.assertEqual(5, r.execute_command(
+                'idx.trim', 'idx', 'BEFORE', 250))
+            self.assertEqual(5, r.execute_command('idx.card', 'idx'))
+            self.assertEqual(0, r.execute_command(
+                'idx.trim', 'idx', 'BEFORE', 250))
+            self.assertEqual(['id5', 'id6', 'id7', 'id8', 'id9'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 >= UNIX(0)", 'ORDER', 'BY', '$1'))
+
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.trim', 'idx', 'AFTER', 250)
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.create', 'idx2', 'partition', 100, 'schema', 'int32', 'time')
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.create', 'idx2', 'partition', 0, 'schema', 'time')
+
+    def testLSMIndex(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'lsm', 'schema', 'string', 'int32'))
+            # enough ids to freeze the memtable to segments
+            for i in range(10000):
+                self.assertOk(r.execute_command(
+                    'idx.insert', 'idx', 'id%d' % i, 'foo' if i % 2 else 'bar', i))
+            self.assertEqual(10000, r.execute_command('idx.card', 'idx'))
+
+            # moving and deleting ids of frozen segments
+            self.assertOk(r.execute_command('idx.insert', 'idx', 'id1', 'baz', 1))
+            self.assertEqual(1, r.execute_command('idx.del', 'idx', 'id3'))
+            self.assertEqual(9999, r.execute_command('idx.card', 'idx'))
+            self.assertEqual(['id1'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'baz'"))
+            self.assertEqual(['id9', 'id7', 'id5'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'foo' AND $2 < 10",
+                'ORDER', 'BY', '$2', 'DESC', 'LIMIT', 0, 3))
+
+            self.assertEqual(5000, r.execute_command(
+                'idx.delwhere', 'idx', 'WHERE', "$1 = 'bar'"))
+            self.assertEqual(4999, r.execute_command('idx.card', 'idx'))
+
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.create', 'idx2', 'lsm', 'unique', 'schema', 'string')
+
+    def testThreadedSelect(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'schema', 'string', 'int32'))
+            p = r.pipeline(transaction=False)
+            for i in range(100000):
+                p.execute_command('idx.insert', 'idx', 'id%d' % i, 'foo', i)
+            p.execute()
+
+            # large scans run on a thread, small ones on the main thread
+            self.assertEqual(100000, len(r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'foo'")))
+            self.assertEqual([['id99999', 'foo', '99999']], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'foo' AND $2 >= 0",
+                'RETURN', 'ALL')[-1:])
+            self.assertEqual(['id0', 'id1'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'foo'", 'LIMIT', 0, 2))
+
+            # writes after a threaded scan are seen by the next one
+            self.assertOk(r.execute_command('idx.insert', 'idx', 'id0', 'bar', 0))
+            self.assertEqual(99999, len(r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'foo'")))
+
+            # transactions can't block, and run on the main thread
+            p = r.pipeline(transaction=True)
+            p.execute_command('idx.select', 'idx', 'WHERE', "$1 = 'foo'")
+            self.assertEqual(99999, len(p.execute()[0]))
+
+            # compacting the index while threaded scans are queued or running
+            # leaves them the structure they were started on
+            results = []
+
+            def scan():
+                c = redis.Redis(**r.connection_pool.connection_kwargs)
+                for _ in range(5):
+                    results.append(len(c.execute_command(
+                        'idx.select', 'idx', 'WHERE', "$1 = 'foo'")))
+
+            threads = [threading.Thread(target=scan) for _ in range(4)]
+            for t in threads:
+                t.start()
+            for _ in range(5):
+                self.assertOk(r.execute_command('idx.compact', 'idx'))
+            for t in threads:
+                t.join()
+            self.assertEqual([99999] * 20, results)
+            self.assertEqual(99999, r.execute_command('idx.card', 'idx'))
+
+    def testConcurrentIndex(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'concurrent', 'schema', 'string', 'int32'))
+            p = r.pipeline(transaction=False)
+            for i in range(100000):
+                p.execute_command('idx.insert', 'idx', 'id%d' % i, 'foo', i)
+            p.execute()
+
+            self.assertEqual(100000, len(r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'foo'")))
+            self.assertOk(r.execute_command('idx.insert', 'idx', 'id0', 'bar', 0))
+            self.assertEqual(['id0'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'bar'"))
+            self.assertEqual(99999, r.execute_command(
+                'idx.delwhere', 'idx', 'WHERE', "$1 = 'foo'"))
+            self.assertEqual(1, r.execute_command('idx.card', 'idx'))
+
+            self.assertRaises(RedisError, r.execute_command, 'idx.compact', 'idx')
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.create', 'idx2', 'concurrent', 'lsm', 'schema', 'string')
+
+    def testCompact(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'schema', 'string', 'int32'))
+            for i in range(100):
+                self.assertOk(r.execute_command(
+                    'idx.insert', 'idx', 'id%d' % i, 'foo' if i % 2 else 'bar', i % 10))
+
+            self.assertOk(r.execute_command('idx.compact', 'idx'))
+            self.assertEqual(100, r.execute_command('idx.card', 'idx'))
+            self.assertEqual(10, len(r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'foo' AND $2 = 3")))
+            self.assertEqual(sorted('id%d' % i for i in range(9, 100, 10)),
+                             sorted(r.execute_command(
+                                 'idx.select', 'idx', 'WHERE', "$1 = 'foo' AND $2 > 8")))
+
+            # writes thaw the index
+            self.assertOk(r.execute_command('idx.insert', 'idx', 'id1', 'baz', 1))
+            self.assertEqual(['id1'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'baz'"))
+            self.assertEqual(50, r.execute_command(
+                'idx.delwhere', 'idx', 'WHERE', "$1 = 'bar'"))
+            self.assertEqual(50, r.execute_command('idx.card', 'idx'))
+
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.compact', 'nosuchidx')
+
     def testUniqueIndex(self):
 
         with self.redis() as r:
@@ -118,9 +379,284 @@ class SecondaryTestCase(ModuleTestCase('../../build/src/libmodule.so')):
 
             self.assertEqual(2, r.execute_command('idx.card', 'idx'))
 
+    def testDeferredIndex(self):
+
+        with self.redis() as r:
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.create', 'idx', 'unique', 'deferred', 'schema', 'string')
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'deferred', 'schema', 'string', 'int32'))
+
+            # the same ids written many times in a single transaction
+            with r.pipeline(transaction=True) as p:
+                for i in range(100):
+                    p.execute_command('idx.insert', 'idx', 'id%d' % (i % 10), 'foo', i)
+                p.execute_command('idx.del', 'idx', 'id0')
+                p.execute_command('idx.card', 'idx')
+                p.execute_command('idx.select', 'idx', 'WHERE', "$2 >= 95")
+                res = p.execute()
+            # reads inside the transaction see the preceding writes
+            self.assertEqual(9, res[-2])
+            self.assertEqual(['id5', 'id6', 'id7', 'id8', 'id9'], sorted(res[-1]))
+
+            self.assertOk(r.execute_command('idx.insert', 'idx', 'id0', 'bar', 1))
+            self.assertEqual(10, r.execute_command('idx.card', 'idx'))
+            self.assertEqual([], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1 = 'foo' AND $2 < 90"))
+
+    def testPrefixTracking(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'type', 'hash', 'prefix', 'user:', 'schema', 'name', 'string', 'age', 'int32'))
+
+            for i in range(10):
+                r.hmset('user:%d' % i, {'name': 'name%d' % i, 'age': i})
+            r.hset('other:1', 'name', 'name1')
+            self.assertEqual(10, r.execute_command('idx.card', 'idx'))
+            self.assertEqual(['user:1'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "name = 'name1'"))
+
+            # multiple writes to a key in a transaction are reindexed once
+            with r.pipeline(transaction=True) as p:
+                for i in range(10):
+                    p.hset('user:1', 'age', 100 + i)
+                p.execute()
+            self.assertEqual(['user:1'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "age = 109"))
+
+            # deleted, renamed and overwritten keys
+            r.delete('user:2')
+            r.rename('user:3', 'user:30')
+            r.set('user:4', 'foo')
+            self.assertEqual(['user:30'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "name IN('name2', 'name3', 'name4')"))
+
+            # expired keys
+            r.pexpire('user:5', 1)
+            time.sleep(0.01)
+            self.assertFalse(r.exists('user:5'))
+            self.assertEqual([], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "name = 'name5'"))
+            self.assertEqual(7, r.execute_command('idx.card', 'idx'))
+
+            self.assertRaises(RedisError, r.execute_command, 'idx.create', 'idx2',
+                              'prefix', 'user:', 'schema', 'string')
+
+            # only the keys of the index's database are tracked
+            with r.pipeline(transaction=True) as p:
+                p.execute_command('select', 1)
+                p.execute_command('idx.create', 'idx', 'type', 'hash', 'prefix', 'user:',
+                                  'schema', 'name', 'string')
+                p.hset('user:1', 'name', 'other')
+                p.execute_command('select', 0)
+                p.execute()
+            self.assertEqual(7, r.execute_command('idx.card', 'idx'))
+            self.assertEqual([], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "name = 'other'"))
+            with r.pipeline(transaction=True) as p:
+                p.execute_command('select', 1)
+                p.execute_command('idx.select', 'idx', 'WHERE', "name = 'other'")
+                p.execute_command('select', 0)
+                self.assertEqual(['user:1'], p.execute()[2])
+
+    def testTrackingFanOut(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'byname', 'type', 'hash', 'prefix', 'user:', 'schema', 'name', 'string'))
+            self.assertOk(r.execute_command(
+                'idx.create', 'byage', 'type', 'hash', 'prefix', 'user:', 'schema', 'age', 'int32', 'name', 'string'))
+            self.assertOk(r.execute_command(
+                'idx.create', 'byagestr', 'type', 'hash', 'prefix', 'user:', 'schema', 'age', 'string'))
+            self.assertOk(r.execute_command(
+                'idx.create', 'admins', 'type', 'hash', 'prefix', 'admin:', 'schema', 'name', 'string'))
+
+            for i in range(10):
+                r.hmset('user:%d' % i, {'name': 'name%d' % i, 'age': i, 'unused': 'foo'})
+            r.hset('admin:1', 'name', 'root')
+
+            for idx in ('byname', 'byage', 'byagestr'):
+                self.assertEqual(10, r.execute_command('idx.card', idx))
+            self.assertEqual(1, r.execute_command('idx.card', 'admins'))
+            self.assertEqual(['user:3'], r.execute_command(
+                'idx.select', 'byage', 'WHERE', "age = 3 AND name = 'name3'"))
+            self.assertEqual(['user:3'], r.execute_command(
+                'idx.select', 'byagestr', 'WHERE', "age = '3'"))
+
+            # a value that only parses for some of the indexes
+            r.hset('user:3', 'age', 'old')
+            self.assertEqual(['user:3'], r.execute_command(
+                'idx.select', 'byagestr', 'WHERE', "age = 'old'"))
+            self.assertEqual(['user:3'], r.execute_command(
+                'idx.select', 'byage', 'WHERE', "age = 3"))
+
+            # indexes dropped from the registry are no longer updated
+            r.delete('byagestr')
+            r.delete('user:4')
+            self.assertEqual(9, r.execute_command('idx.card', 'byname'))
+            self.assertEqual([], r.execute_command(
+                'idx.select', 'byage', 'WHERE', "age = 4"))
+
+    def testIntoNotifies(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'type', 'hash', 'schema', 'name', 'string'))
+            self.assertOk(r.execute_command(
+                'idx.create', 'byage', 'type', 'hash', 'prefix', 'user:', 'schema', 'age', 'int32'))
+
+            # writes through IDX.INTO update the indexes tracking the key
+            self.execInto(r, 'idx', 'HSET user:1 name foo age 10')
+            self.execInto(r, 'idx', 'HMSET user:2 name bar age 20')
+            self.execInto(r, 'idx', 'HSETNX user:3 age 30')
+            self.assertEqual(3, r.execute_command('idx.card', 'byage'))
+            self.assertEqual(['user:2'], r.execute_command(
+                'idx.select', 'byage', 'WHERE', "age = 20"))
+
+            self.execInto(r, 'idx', 'HDEL user:1 age')
+            self.assertEqual([], r.execute_command(
+                'idx.select', 'byage', 'WHERE', "age = 10"))
+            # deleting the last field deletes the key
+            self.execInto(r, 'idx', 'HDEL user:3 age')
+            self.assertFalse(r.exists('user:3'))
+            self.assertEqual(2, r.execute_command('idx.card', 'byage'))
+
+    def testBuild(self):
+
+        with self.redis() as r:
+            for i in range(1000):
+                r.hmset('user:%d' % i, {'name': 'name%d' % i, 'age': i % 100})
+            r.hset('other:1', 'name', 'name1')
+
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'type', 'hash', 'prefix', 'user:', 'build', 'schema', 'name', 'string', 'age', 'int32'))
+            # keys written during the build are indexed with their latest values
+            r.hset('user:1', 'age', 1000)
+            r.delete('user:2')
+
+            self.waitForBuild(r, 'idx')
+
+            self.assertEqual(999, r.execute_command('idx.card', 'idx'))
+            self.assertEqual(['user:1'], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "age = 1000"))
+            self.assertEqual([], r.execute_command(
+                'idx.select', 'idx', 'WHERE', "name = 'name2'"))
+
+            self.assertOk(r.execute_command('idx.rebuild', 'idx'))
+            self.waitForBuild(r, 'idx')
+            self.assertEqual(999, r.execute_command('idx.card', 'idx'))
+
+            # raw indexes cannot be built from the database
+            self.assertOk(r.execute_command(
+                'idx.create', 'raw', 'schema', 'string'))
+            self.assertRaises(RedisError, r.execute_command, 'idx.rebuild', 'raw')
+
     def testTimeFunctions(self):
         pass
 
+    def testMultiSelect(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'schema', 'string', 'int32'))
+            for i in range(100):
+                self.assertOk(r.execute_command(
+                    'idx.insert', 'idx', 'id%d' % i, 'foo' if i % 2 else 'bar', i))
+
+            queries = ["$1 = 'foo' AND $2 < 20", "$1 = 'foo' AND $2 > 10 AND $2 < 30",
+                       "$1 = 'bar' AND $2 != 4 AND $2 < 10", "$1 = 'baz'"]
+            args = []
+            for q in queries:
+                args += ['WHERE', q]
+            res = r.execute_command('idx.mselect', 'idx', *args)
+            self.assertEqual(len(queries), len(res))
+            for q, ids in zip(queries, res):
+                self.assertEqual(sorted(r.execute_command('idx.select', 'idx', 'WHERE', q)),
+                                 sorted(ids))
+
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.mselect', 'idx', 'WHERE', "$1 = 'foo'", 'WHERE')
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.mselect', 'idx', 'WHERE', "$1 = 'foo'", 'FROM', "$1 = 'bar'")
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.mselect', 'idx', 'WHERE', "$1 = ?")
+
+    def testResultCache(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'cache', 100000, 'schema', 'string', 'int32'))
+            for i in range(100):
+                self.assertOk(r.execute_command(
+                    'idx.insert', 'idx', 'id%d' % i, 'foo' if i % 2 else 'bar', i))
+
+            def cached():
+                info = r.execute_command('idx.info', 'idx')
+                return info[info.index('cached_results') + 1]
+
+            q = "$1 = 'foo' AND $2 < 20"
+            res = r.execute_command('idx.select', 'idx', 'WHERE', q)
+            self.assertEqual(10, len(res))
+            self.assertEqual(1, cached())
+            self.assertEqual(res, r.execute_command('idx.select', 'idx', 'WHERE', q))
+            # queries differing only by spacing share their results
+            self.assertEqual(res, r.execute_command(
+                'idx.select', 'idx', 'WHERE', "$1='foo'  and $2<20 "))
+            self.assertEqual(1, cached())
+
+            # writes outside the query's range keep its results
+            self.assertOk(r.execute_command('idx.insert', 'idx', 'id200', 'bar', 5))
+            self.assertEqual(1, cached())
+
+            # writes within it drop them
+            self.assertOk(r.execute_command('idx.insert', 'idx', 'id201', 'foo', 5))
+            self.assertEqual(0, cached())
+            self.assertEqual(11, len(r.execute_command('idx.select', 'idx', 'WHERE', q)))
+
+            self.assertEqual(1, r.execute_command('idx.del', 'idx', 'id1'))
+            self.assertEqual(10, len(r.execute_command('idx.select', 'idx', 'WHERE', q)))
+
+            # queries with LIMIT are cached by their limit too
+            self.assertEqual(3, len(r.execute_command(
+                'idx.select', 'idx', 'WHERE', q, 'LIMIT', 0, 3)))
+            self.assertEqual(2, cached())
+
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.create', 'idx2', 'cache', 'foo', 'schema', 'string')
+
+    def testPreparedQuery(self):
+
+        with self.redis() as r:
+            self.assertOk(r.execute_command(
+                'idx.create', 'idx', 'schema', 'string', 'int32'))
+            for i in range(100):
+                self.assertOk(r.execute_command(
+                    'idx.insert', 'idx', 'id%d' % i, 'foo' if i % 2 else 'bar', i))
+
+            self.assertEqual(2, r.execute_command(
+                'idx.prepare', 'idx', 'q', '$1 = ? AND $2 < ?', 'ORDER BY', '$2', 'DESC'))
+            self.assertEqual(['id9', 'id7', 'id5', 'id3', 'id1'],
+                             r.execute_command('idx.execute', 'idx', 'q', 'foo', 10))
+            self.assertEqual(['id4', 'id2', 'id0'],
+                             r.execute_command('idx.execute', 'idx', 'q', 'bar', 5))
+
+            # prepared queries are saved with the index
+            self.assertOk(r.execute_command('debug', 'reload'))
+            self.assertEqual(['id4', 'id2', 'id0'],
+                             r.execute_command('idx.execute', 'idx', 'q', 'bar', 5))
+
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.execute', 'idx', 'q', 'foo')
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.execute', 'idx', 'q', 'foo', 'bar')
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.execute', 'idx', 'nosuchquery')
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.prepare', 'idx', 'q2', '$2 > NOW')
+            self.assertRaises(RedisError, r.execute_command,
+                              'idx.select', 'idx', 'WHERE', '$1 = ?')
+
 if __name__ == '__main__':
 
     unittest.main()
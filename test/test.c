@@ -1,12 +1,17 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <sched.h>
 #include "minunit.h"
 
 #include "../src/value.h"
 #include "../src/index.h"
+#include "../src/key.h"
 #include "../src/query.h"
+#include "../src/query_plan.h"
 #include "../src/reverse_index.h"
+#include "../src/statement.h"
+#include "../src/result_cache.h"
 #include "../src/rmutil/alloc.h"
 
 int cmpstr(void *p1, void *p2, void *ctx) {
@@ -105,12 +110,67 @@ MU_TEST(testReverseIndex) {
   printf("%d\n", rc);
 }
 
-void testQuery(SIIndex idx, SISpec *spec, const char *str,
-               const char *expectedIds[]) {
-  SIQuery q = SI_NewQuery();
+/* Parse a query into q, ordered by a property if orderBy is set */
+void parseQuery(SIQuery *q, SISpec *spec, const char *str,
+                const char *orderBy) {
+  *q = SI_NewQuery();
   char *parseError = NULL;
-  mu_assert(SI_ParseQuery(&q, str, strlen(str), spec, &parseError), parseError);
+  mu_assert(SI_ParseQuery(q, str, strlen(str), spec, &parseError), parseError);
   mu_check(parseError == NULL);
+  if (orderBy) {
+    mu_check(SIQuery_AddOrderBy(q, orderBy, spec));
+  }
+}
+
+int cmpIdPtrs(const void *p1, const void *p2) {
+  return strcmp(*(const char **)p1, *(const char **)p2);
+}
+
+/* Run a query, collecting the ids it finds into a new array, and copies of
+ * their keys if keys is not NULL. The ids are the index's own */
+void collectIds(SIIndex idx, SIQuery *q, SIId **ids, SIMultiKey ***keys,
+                size_t *num) {
+  *ids = NULL;
+  if (keys) {
+    *keys = NULL;
+  }
+  *num = 0;
+  SICursor *c = idx.Find(idx.ctx, q);
+  size_t cap = 0;
+  SIId id;
+  while (c->error == SI_CURSOR_OK && NULL != (id = c->Next(c->ctx))) {
+    if (*num == cap) {
+      cap = cap ? cap * 2 : 16;
+      *ids = realloc(*ids, cap * sizeof(SIId));
+      if (keys) {
+        *keys = realloc(*keys, cap * sizeof(SIMultiKey *));
+      }
+    }
+    if (keys) {
+      SIMultiKey *mk = c->CurrentKey(c->ctx);
+      (*keys)[*num] = SI_NewMultiKey(mk->keys, mk->size);
+    }
+    (*ids)[(*num)++] = id;
+  }
+  int error = c->error;
+  SICursor_Free(c);
+  mu_check(error == SI_CURSOR_OK);
+}
+
+/* Parse a query and run it, collecting the ids it finds sorted */
+void findIds(SIIndex idx, SISpec *spec, const char *str, SIId **ids,
+             size_t *num) {
+  SIQuery q;
+  parseQuery(&q, spec, str, NULL);
+  collectIds(idx, &q, ids, NULL, num);
+  qsort(*ids, *num, sizeof(SIId), cmpIdPtrs);
+  SIQuery_Free(&q);
+}
+
+void testQuery(SIIndex idx, SISpec *spec, const char *str,
+               const char *expectedIds[]) {
+  SIQuery q;
+  parseQuery(&q, spec, str, NULL);
   SICursor *c = idx.Find(idx.ctx, &q);
   mu_check(c->error == SI_CURSOR_OK);
 
@@ -146,6 +206,173 @@ MU_TEST(testUniqueIndex) {
 
   mu_check(rc == SI_INDEX_DUPLICATE_KEY);
   mu_check(idx.Len(idx.ctx) == 1);
+
+  // re-adding the same values keeps the stored id, and frees the new copy
+  SIIndex plain = SI_NewCompoundIndex((SISpec){.properties = spec.properties,
+                                               .numProps = 1});
+  SIIndex both[] = {idx, plain};
+  for (int i = 0; i < 2; i++) {
+    for (int n = 0; n < 2; n++) {
+      cs = SI_NewChangeSet(1);
+      SIChangeSet_AddCahnge(
+          &cs, SI_NewAddChange(strdup("id3"), 1, SI_StringValC("bar")));
+      mu_check(both[i].Apply(both[i].ctx, cs) == SI_INDEX_OK);
+      SIChangeSet_Free(&cs);
+    }
+    mu_check(both[i].Len(both[i].ctx) == (i ? 1 : 2));
+    SIQuery q = SI_NewQuery();
+    char *parseError = NULL;
+    mu_check(SI_ParseQuery(&q, "$1 = 'bar'", 10, &spec, &parseError));
+    SICursor *c = both[i].Find(both[i].ctx, &q);
+    mu_check(c->error == SI_CURSOR_OK);
+    SIId id = c->Next(c->ctx);
+    mu_check(id && !strcmp(id, "id3"));
+    SICursor_Free(c);
+    SIQuery_Free(&q);
+  }
+}
+
+MU_TEST(testDeferredIndex) {
+  SISpec spec = {
+      .properties = (SIIndexProperty[]){{.type = T_STRING, .name = "name"},
+                                        {.type = T_INT32, .name = "age"}},
+      .numProps = 2,
+      .flags = SI_INDEX_NAMED | SI_INDEX_DEFERRED};
+
+  SIIndex idx = SI_NewDeferredIndex(SI_NewCompoundIndex(spec), &spec);
+
+  // the index owns the ids of additions
+  SIChangeSet cs = SI_NewChangeSet(4);
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id1"), 2,
+                                             SI_StringValC("foo"), SI_IntVal(1)));
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id2"), 2,
+                                             SI_StringValC("bar"), SI_IntVal(2)));
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id1"), 2,
+                                             SI_StringValC("baz"), SI_IntVal(3)));
+  SIChangeSet_AddCahnge(&cs, SI_NewDelChange("id3"));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+
+  // only the last change of each id is kept
+  mu_check(SIDeferredIndex_Pending(idx.ctx) == 3);
+
+  // reading the index applies the pending changes
+  mu_check(idx.Len(idx.ctx) == 2);
+  mu_check(SIDeferredIndex_Pending(idx.ctx) == 0);
+  testQuery(idx, &spec, "name = 'baz'", (const char *[]){"id1", NULL});
+  testQuery(idx, &spec, "name = 'foo'", (const char *[]){NULL});
+
+  cs = SI_NewChangeSet(2);
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id3"), 2,
+                                             SI_StringValC("foo"), SI_IntVal(4)));
+  SIChangeSet_AddCahnge(&cs, SI_NewDelChange("id1"));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+
+  mu_check(SIDeferredIndex_Flush(idx.ctx) == SI_INDEX_OK);
+  mu_check(SIDeferredIndex_Pending(idx.ctx) == 0);
+  mu_check(idx.Len(idx.ctx) == 2);
+  testQuery(idx, &spec, "name = 'foo'", (const char *[]){"id3", NULL});
+  testQuery(idx, &spec, "name = 'baz'", (const char *[]){NULL});
+
+  idx.Free(idx.ctx);
+
+  // the changes the inner index rejects are dropped, and their ids freed
+  SISpec uspec = spec;
+  uspec.flags = SI_INDEX_NAMED | SI_INDEX_UNIQUE;
+  idx = SI_NewDeferredIndex(SI_NewCompoundIndex(uspec), &uspec);
+  cs = SI_NewChangeSet(3);
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id1"), 2,
+                                             SI_StringValC("foo"), SI_IntVal(1)));
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id2"), 2,
+                                             SI_StringValC("foo"), SI_IntVal(1)));
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id3"), 2,
+                                             SI_StringValC("bar"), SI_IntVal(2)));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+
+  // the read that flushed them fails, the next ones see the rest
+  SIQuery q;
+  parseQuery(&q, &uspec, "name = 'bar'", NULL);
+  SICursor *c = idx.Find(idx.ctx, &q);
+  mu_check(c->error == SI_CURSOR_ERROR);
+  SICursor_Free(c);
+  SIQuery_Free(&q);
+  mu_check(SIDeferredIndex_Pending(idx.ctx) == 0);
+  mu_check(idx.Len(idx.ctx) == 2);
+  testQuery(idx, &uspec, "name = 'bar'", (const char *[]){"id3", NULL});
+
+  idx.Free(idx.ctx);
+}
+
+void countVisitor(SIId id, void *key, void *ctx) { ++*(size_t *)ctx; }
+
+/* Delete the ids matching a query, setting the number deleted */
+void deleteWhere(SIIndex idx, SISpec *spec, const char *str, size_t *num) {
+  *num = 0;
+  SIQuery q;
+  parseQuery(&q, spec, str, NULL);
+
+  size_t visited = 0;
+  SIGarbage *g = NULL;
+  mu_check(idx.DeleteWhere(idx.ctx, &q, countVisitor, &visited, num, &g) ==
+           SI_INDEX_OK);
+  mu_check(*num == visited);
+  // release the deleted entries a few at a time
+  while (!SIGarbage_Release(g, 3))
+    ;
+  SIQuery_Free(&q);
+}
+
+MU_TEST(testDeleteWhere) {
+  size_t deleted;
+  SISpec spec = {
+      .properties = (SIIndexProperty[]){{.type = T_STRING, .name = "name"},
+                                        {.type = T_INT32, .name = "age"}},
+      .numProps = 2,
+      .flags = SI_INDEX_NAMED};
+
+  SIIndex idx = SI_NewCompoundIndex(spec);
+  char *names[] = {"bar", "baz", "foo", "qux"};
+  SIChangeSet cs = SI_NewChangeSet(400);
+  for (int i = 0; i < 400; i++) {
+    char id[16];
+    sprintf(id, "id%d", i);
+    SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup(id), 2,
+                                               SI_StringValC(names[i % 4]),
+                                               SI_IntVal(i % 50)));
+  }
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+
+  // whole ranges
+  deleteWhere(idx, &spec, "name = 'foo' AND age < 10", &deleted);
+  mu_check(deleted == 20);
+  mu_check(idx.Len(idx.ctx) == 380);
+  testQuery(idx, &spec, "name = 'foo' AND age < 10", (const char *[]){NULL});
+  deleteWhere(idx, &spec, "name IN ('bar', 'qux')", &deleted);
+  mu_check(deleted == 200);
+  mu_check(idx.Len(idx.ctx) == 180);
+  deleteWhere(idx, &spec, "name = 'bar'", &deleted);
+  mu_check(deleted == 0);
+
+  // a residual filter on the second column
+  deleteWhere(idx, &spec, "name >= 'a' AND age >= 40", &deleted);
+  mu_check(deleted == 40);
+  mu_check(idx.Len(idx.ctx) == 140);
+
+  // the skiplist is still consistent for inserts and lookups
+  cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id1000"), 2,
+                                             SI_StringValC("bar"), SI_IntVal(1)));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  testQuery(idx, &spec, "name = 'bar'", (const char *[]){"id1000", NULL});
+  deleteWhere(idx, &spec, "name >= 'a'", &deleted);
+  mu_check(deleted == 141);
+  mu_check(idx.Len(idx.ctx) == 0);
+
+  idx.Free(idx.ctx);
 }
 
 MU_TEST(testIndexingQuerying) {
@@ -228,8 +455,1213 @@ MU_TEST(testNull) {
   testQuery(idx, &spec, str, (const char *[]){"id4", "id5", NULL});
 }
 
+MU_TEST(testLargeInFilter) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_INT32},
+                                                   {.type = T_STRING}},
+                 .numProps = 2};
+
+  SIIndex idx = SI_NewCompoundIndex(spec);
+
+  char *ids[200];
+  SIChangeSet cs = SI_NewChangeSet(200);
+  for (int i = 0; i < 200; i++) {
+    ids[i] = malloc(16);
+    sprintf(ids[i], "id%d", i);
+    char *s = malloc(16);
+    sprintf(s, "Val%d", i % 50);
+    SIChangeSet_AddCahnge(
+        &cs, SI_NewAddChange(ids[i], 2, SI_IntVal(i % 100), SI_StringValC(s)));
+  }
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+
+  // 100 x 40 values is over the expansion limit, so the second IN is filtered
+  char str[4096];
+  char *p = str + sprintf(str, "$1 IN (");
+  for (int i = 0; i < 100; i++) {
+    p += sprintf(p, "%d%s", i, i < 99 ? ", " : ") AND $2 IN (");
+  }
+  for (int i = 0; i < 40; i++) {
+    p += sprintf(p, "'val%d'%s", i * 50 + 7, i < 39 ? ", " : ")");
+  }
+  testQuery(idx, &spec, str,
+            (const char *[]){"id7", "id57", "id107", "id157", NULL});
+
+  SIQuery q = SI_NewQuery();
+  mu_check(SI_ParseQuery(&q, str, strlen(str), &spec, NULL));
+  SICursor *c = idx.Find(idx.ctx, &q);
+  int n = 0;
+  while (c->Next(c->ctx)) n++;
+  mu_check(n == 4);
+  SICursor_Free(c);
+}
+
+/* run an ordered query and check that exactly the expected ids are returned,
+ * in order */
+void testOrderedQuery(SIIndex idx, SISpec *spec, const char *str,
+                      const char *orderBy, int desc, size_t offset, size_t num,
+                      const char *expectedIds[]) {
+  SIQuery q = SI_NewQuery();
+  mu_check(SI_ParseQuery(&q, str, strlen(str), spec, NULL));
+  mu_check(SIQuery_AddOrderBy(&q, orderBy, spec));
+  q.orderDesc = desc;
+  q.offset = offset;
+  q.num = num;
+
+  SICursor *c = idx.Find(idx.ctx, &q);
+  mu_check(c->error == SI_CURSOR_OK);
+  SIId id;
+  int n = 0;
+  while (NULL != (id = c->Next(c->ctx))) {
+    mu_check(expectedIds[n] != NULL);
+    mu_check(!strcmp(id, expectedIds[n]));
+    n++;
+  }
+  mu_check(expectedIds[n] == NULL);
+  SICursor_Free(c);
+  SIQuery_Free(&q);
+}
+
+MU_TEST(testPartitionedIndex) {
+  size_t deleted;
+  SISpec spec = {
+      .properties = (SIIndexProperty[]){{.type = T_TIME, .name = "ts"},
+                                        {.type = T_INT32, .name = "v"}},
+      .numProps = 2,
+      .flags = SI_INDEX_NAMED | SI_INDEX_PARTITIONED,
+      .partitionSize = 100};
+
+  SIIndex idx = SI_NewCompoundIndex(spec);
+  // two ids per partition
+  SIChangeSet cs = SI_NewChangeSet(11);
+  for (int i = 0; i < 10; i++) {
+    char id[16];
+    sprintf(id, "t%d", i);
+    SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup(id), 2,
+                                               SI_TimeVal(i * 50), SI_IntVal(i)));
+  }
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("tnull"), 2, SI_NullVal(),
+                                             SI_IntVal(10)));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  mu_check(idx.Len(idx.ctx) == 11);
+
+  // ranges spanning several partitions, in both directions
+  testOrderedQuery(idx, &spec, "ts >= UNIX(120) AND ts < UNIX(320)", "ts", 0,
+                   0, 0, (const char *[]){"t3", "t4", "t5", "t6", NULL});
+  testOrderedQuery(idx, &spec, "ts >= UNIX(120) AND ts < UNIX(320)", "ts", 1,
+                   0, 0, (const char *[]){"t6", "t5", "t4", "t3", NULL});
+  testOrderedQuery(idx, &spec, "ts >= UNIX(0)", "v", 1, 0, 3,
+                   (const char *[]){"t9", "t8", "t7", NULL});
+  testOrderedQuery(idx, &spec, "ts IS NULL", "ts", 0, 0, 0,
+                   (const char *[]){"tnull", NULL});
+
+  // moving an id to another partition
+  cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("t0"), 2, SI_TimeVal(460),
+                                             SI_IntVal(0)));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  mu_check(idx.Len(idx.ctx) == 11);
+  testOrderedQuery(idx, &spec, "ts < UNIX(100)", "ts", 0, 0, 0,
+                   (const char *[]){"t1", NULL});
+
+  // trimming drops two whole partitions and a part of a third
+  deleteWhere(idx, &spec, "ts < UNIX(250)", &deleted);
+  mu_check(deleted == 4);
+  mu_check(idx.Len(idx.ctx) == 7);
+  testOrderedQuery(idx, &spec, "ts >= UNIX(0)", "ts", 0, 0, 0,
+                   (const char *[]){"t5", "t6", "t7", "t8", "t9", "t0", NULL});
+
+  // the dropped partitions are recreated on demand
+  cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("t10"), 2, SI_TimeVal(10),
+                                             SI_IntVal(10)));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  testOrderedQuery(idx, &spec, "ts < UNIX(300)", "ts", 0, 0, 0,
+                   (const char *[]){"t10", "t5", NULL});
+  deleteWhere(idx, &spec, "ts >= UNIX(0)", &deleted);
+  mu_check(deleted == 7);
+  mu_check(idx.Len(idx.ctx) == 1);
+
+  idx.Free(idx.ctx);
+}
+
+/* run a query on two indexes and check that they return the same ids,
+ * setting the number of ids if num is not NULL */
+void compareQuery(SIIndex a, SIIndex b, SISpec *spec, const char *str,
+                  size_t *num) {
+  SIId *ids[2];
+  size_t lens[2];
+  findIds(a, spec, str, &ids[0], &lens[0]);
+  findIds(b, spec, str, &ids[1], &lens[1]);
+  if (num) {
+    *num = lens[0];
+  }
+
+  mu_check(lens[0] == lens[1]);
+  for (size_t i = 0; i < lens[0]; i++) {
+    mu_check(!strcmp(ids[0][i], ids[1][i]));
+  }
+  free(ids[0]);
+  free(ids[1]);
+}
+
+MU_TEST(testLSMIndex) {
+  size_t deleted;
+  SISpec spec = {
+      .properties = (SIIndexProperty[]){{.type = T_STRING, .name = "name"},
+                                        {.type = T_INT32, .name = "age"}},
+      .numProps = 2,
+      .flags = SI_INDEX_NAMED | SI_INDEX_LSM};
+  SISpec refSpec = spec;
+  refSpec.flags = SI_INDEX_NAMED;
+
+  // the compound index is the reference for the results
+  SIIndex idx = SI_NewIndex(spec);
+  SIIndex ref = SI_NewIndex(refSpec);
+  char *names[] = {"bar", "baz", "foo", "qux"};
+  const char *queries[] = {"name = 'foo'", "name IN ('bar', 'qux') AND age < 30",
+                           "name >= 'baz' AND age > 90", "name < 'c'", NULL};
+
+  // enough ids to freeze a few memtables, then move all of them
+  for (int r = 0; r < 2; r++) {
+    SIChangeSet cs = SI_NewChangeSet(10000), refCs = SI_NewChangeSet(10000);
+    for (int i = 0; i < 10000; i++) {
+      char id[16];
+      sprintf(id, "id%d", i);
+      SIChangeSet_AddCahnge(&cs, SI_NewAddChange(
+                                     strdup(id), 2, SI_StringValC(names[(i + r) % 4]),
+                                     SI_IntVal((i * 7 + r) % 100)));
+      SIChangeSet_AddCahnge(&refCs, SI_NewAddChange(
+                                        strdup(id), 2, SI_StringValC(names[(i + r) % 4]),
+                                        SI_IntVal((i * 7 + r) % 100)));
+    }
+    mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+    mu_check(ref.Apply(ref.ctx, refCs) == SI_INDEX_OK);
+    SIChangeSet_Free(&cs);
+    SIChangeSet_Free(&refCs);
+  }
+  mu_check(idx.Len(idx.ctx) == 10000);
+  mu_check(SILSMIndex_NumSegments(idx.ctx) >= 1);
+  for (int i = 0; queries[i]; i++) {
+    compareQuery(idx, ref, &spec, queries[i], NULL);
+  }
+
+  // delete ids while a merge is in progress
+  SILSMIndex_Freeze(idx.ctx);
+  SILSMIndex_Compact(idx.ctx, 100);
+  SIChangeSet cs = SI_NewChangeSet(3334);
+  for (int i = 0; i < 10000; i += 3) {
+    char id[16];
+    sprintf(id, "id%d", i);
+    SIChangeSet_AddCahnge(&cs, SI_NewDelChange(strdup(id)));
+  }
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  mu_check(ref.Apply(ref.ctx, cs) == SI_INDEX_OK);
+  for (size_t i = 0; i < cs.numChanges; i++) {
+    free(cs.changes[i].id);
+  }
+  SIChangeSet_Free(&cs);
+  mu_check(idx.Len(idx.ctx) == 6666);
+  for (int i = 0; queries[i]; i++) {
+    compareQuery(idx, ref, &spec, queries[i], NULL);
+  }
+  mu_check(SILSMIndex_Compact(idx.ctx, SIZE_MAX));
+  for (int i = 0; queries[i]; i++) {
+    compareQuery(idx, ref, &spec, queries[i], NULL);
+  }
+
+  // the merged scan is in key order, in both directions
+  for (int desc = 0; desc < 2; desc++) {
+    SIQuery q = SI_NewQuery();
+    mu_check(SI_ParseQuery(&q, "name >= 'baz'", 13, &spec, NULL));
+    mu_check(SIQuery_AddOrderBy(&q, "name", &spec));
+    q.orderDesc = desc;
+    SICursor *c = idx.Find(idx.ctx, &q);
+    SIMultiKey *last = NULL;
+    size_t n = 0;
+    while (NULL != c->Next(c->ctx)) {
+      SIMultiKey *key = c->CurrentKey(c->ctx);
+      if (last) {
+        int rc = si_cmp_string(&last->keys[0], &key->keys[0], NULL);
+        mu_check(desc ? rc >= 0 : rc <= 0);
+      }
+      last = key;
+      n++;
+    }
+    size_t expected;
+    compareQuery(idx, ref, &spec, "name >= 'baz'", &expected);
+    mu_check(n == expected);
+    SICursor_Free(c);
+    SIQuery_Free(&q);
+  }
+
+  size_t num;
+  compareQuery(idx, ref, &spec, "name = 'bar'", &num);
+  deleteWhere(idx, &spec, "name = 'bar'", &deleted);
+  mu_check(deleted == num);
+  mu_check(idx.Len(idx.ctx) == 6666 - num);
+  testQuery(idx, &spec, "name = 'bar'", (const char *[]){NULL});
+
+  idx.Free(idx.ctx);
+  ref.Free(ref.ctx);
+}
+
+MU_TEST(testStaticIndex) {
+  size_t deleted;
+  SISpec spec = {
+      .properties = (SIIndexProperty[]){{.type = T_STRING, .name = "name"},
+                                        {.type = T_INT32, .name = "age"}},
+      .numProps = 2,
+      .flags = SI_INDEX_NAMED};
+  SIIndex src = SI_NewIndex(spec);
+  char *names[] = {"bar", "baz", "foo", "qux"};
+  const char *queries[] = {"name = 'foo'", "name IN ('bar', 'qux') AND age < 30",
+                           "name >= 'baz' AND age > 40", "name < 'c'",
+                           "name = 'qux' AND age = 7", NULL};
+
+  // each key is shared by 4 ids, plus a few ids with keys of their own
+  SIChangeSet cs = SI_NewChangeSet(410);
+  for (int i = 0; i < 400; i++) {
+    char id[16];
+    sprintf(id, "id%d", i);
+    SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup(id), 2,
+                                               SI_StringValC(names[i % 4]),
+                                               SI_IntVal(i % 50)));
+  }
+  for (int i = 50; i < 60; i++) {
+    char id[16];
+    sprintf(id, "u%d", i);
+    SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup(id), 2,
+                                               SI_StringValC("foo"),
+                                               SI_IntVal(i)));
+  }
+  mu_check(src.Apply(src.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+
+  // the source index is not modified, and serves as the reference
+  SIIndex idx = SI_NewStaticIndex(src, spec);
+  mu_check(idx.Len(idx.ctx) == 410);
+  for (int i = 0; queries[i]; i++) {
+    compareQuery(idx, src, &spec, queries[i], NULL);
+  }
+  size_t num;
+  compareQuery(idx, src, &spec, "name = 'foo' AND age = 2", &num);
+  mu_check(num == 4);
+
+  testOrderedQuery(idx, &spec, "name = 'foo' AND age >= 50", "age", 1, 2, 3,
+                   (const char *[]){"u57", "u56", "u55", NULL});
+  testOrderedQuery(idx, &spec, "name IN ('bar', 'foo') AND age >= 55", "age",
+                   1, 0, 2, (const char *[]){"u59", "u58", NULL});
+
+  // forward scans return the ids in the source's order, skipping within keys
+  SIId ids[2][6];
+  SIIndex idxs[2] = {idx, src};
+  for (int i = 0; i < 2; i++) {
+    SIQuery q = SI_NewQuery();
+    mu_check(SI_ParseQuery(&q, "name = 'foo'", 12, &spec, NULL));
+    q.offset = 3;
+    q.num = 6;
+    SICursor *c = idxs[i].Find(idxs[i].ctx, &q);
+    for (int j = 0; j < 6; j++) {
+      ids[i][j] = c->Next(c->ctx);
+      mu_check(ids[i][j] != NULL);
+    }
+    mu_check(c->Next(c->ctx) == NULL);
+    SICursor_Free(c);
+    SIQuery_Free(&q);
+  }
+  for (int j = 0; j < 6; j++) {
+    mu_check(!strcmp(ids[0][j], ids[1][j]));
+  }
+
+  // writes thaw the index
+  for (int i = 0; i < 2; i++) {
+    SIChangeSet wcs = SI_NewChangeSet(2);
+    SIChangeSet_AddCahnge(&wcs, SI_NewAddChange(strdup("new"), 2,
+                                                SI_StringValC("foo"),
+                                                SI_IntVal(7)));
+    SIChangeSet_AddCahnge(&wcs, SI_NewDelChange("id2"));
+    mu_check(idxs[i].Apply(idxs[i].ctx, wcs) == SI_INDEX_OK);
+    SIChangeSet_Free(&wcs);
+  }
+  mu_check(idx.Len(idx.ctx) == 410);
+  for (int i = 0; queries[i]; i++) {
+    compareQuery(idx, src, &spec, queries[i], NULL);
+  }
+
+  compareQuery(idx, src, &spec, "name = 'bar'", &num);
+  deleteWhere(idx, &spec, "name = 'bar'", &deleted);
+  mu_check(deleted == num);
+  deleteWhere(src, &spec, "name = 'bar'", &deleted);
+  mu_check(deleted == num);
+  mu_check(idx.Len(idx.ctx) == 410 - num);
+  for (int i = 0; queries[i]; i++) {
+    compareQuery(idx, src, &spec, queries[i], NULL);
+  }
+
+  idx.Free(idx.ctx);
+  src.Free(src.ctx);
+}
+
+typedef struct {
+  SIIndex idx;
+  pthread_rwlock_t *lock;
+  SIQuery *queries;
+  size_t numQueries;
+  // the number of scans that saw a partially applied change set
+  size_t torn;
+} lockedReader;
+
+void *lockedReader_Run(void *p) {
+  lockedReader *r = p;
+  for (size_t i = 0; i < r->numQueries; i++) {
+    pthread_rwlock_rdlock(r->lock);
+    SICursor *c = r->idx.Find(r->idx.ctx, &r->queries[i]);
+    size_t n = 0;
+    while (c->error == SI_CURSOR_OK && NULL != c->Next(c->ctx)) {
+      n++;
+    }
+    SICursor_Free(c);
+    pthread_rwlock_unlock(r->lock);
+    // the ids are written in pairs
+    r->torn += n % 2;
+  }
+  return NULL;
+}
+
+MU_TEST(testLockedIndex) {
+  size_t deleted;
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_INT32}},
+                 .numProps = 1};
+  pthread_rwlock_t lock;
+  pthread_rwlock_init(&lock, NULL);
+  SIIndex idx = SI_NewLockedIndex(SI_NewCompoundIndex(spec), &spec, &lock);
+
+  lockedReader readers[4];
+  pthread_t threads[4];
+  for (int t = 0; t < 4; t++) {
+    readers[t] = (lockedReader){.idx = SILockedIndex_Inner(idx.ctx),
+                                .lock = &lock,
+                                .queries = calloc(50, sizeof(SIQuery)),
+                                .numQueries = 50};
+    for (int i = 0; i < 50; i++) {
+      readers[t].queries[i] = SI_NewQuery();
+      mu_check(SI_ParseQuery(&readers[t].queries[i], "$1 >= 0", 7, &spec,
+                             NULL));
+    }
+    mu_check(!pthread_create(&threads[t], NULL, lockedReader_Run, &readers[t]));
+  }
+
+  for (int i = 0; i < 1000; i += 2) {
+    SIChangeSet cs = SI_NewChangeSet(2);
+    for (int j = i; j < i + 2; j++) {
+      char *id = malloc(16);
+      sprintf(id, "id%d", j);
+      SIChangeSet_AddCahnge(&cs, SI_NewAddChange(id, 1, SI_IntVal(j)));
+    }
+    mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+    SIChangeSet_Free(&cs);
+  }
+
+  for (int t = 0; t < 4; t++) {
+    pthread_join(threads[t], NULL);
+    mu_check(readers[t].torn == 0);
+    for (int i = 0; i < 50; i++) {
+      SIQuery_Free(&readers[t].queries[i]);
+    }
+    free(readers[t].queries);
+  }
+  mu_check(idx.Len(idx.ctx) == 1000);
+
+  // a write made while a reader holds the lock is buffered rather than waiting
+  // for it, and applied before the next read
+  pthread_rwlock_rdlock(&lock);
+  SIChangeSet cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs,
+                        SI_NewAddChange(strdup("id1000"), 1, SI_IntVal(1000)));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  SIIndex inner = SILockedIndex_Inner(idx.ctx);
+  mu_check(inner.Len(inner.ctx) == 1000);
+  pthread_rwlock_unlock(&lock);
+  mu_check(idx.Len(idx.ctx) == 1001);
+  deleteWhere(idx, &spec, "$1 >= 500", &deleted);
+  mu_check(deleted == 501);
+
+  idx.Free(idx.ctx);
+  pthread_rwlock_destroy(&lock);
+}
+
+MU_TEST(testEstimate) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_STRING},
+                                                   {.type = T_INT32}},
+                 .numProps = 2};
+
+  SIIndex indexes[] = {SI_NewCompoundIndex(spec), SI_NewLSMIndex(spec),
+                       SI_NewCompoundIndex(spec)};
+  for (int n = 0; n < 3; n++) {
+    SIChangeSet cs = SI_NewChangeSet(1000);
+    for (int i = 0; i < 1000; i++) {
+      char *id = malloc(16);
+      sprintf(id, "id%d", i);
+      SIChangeSet_AddCahnge(
+          &cs, SI_NewAddChange(id, 2, SI_StringValC(i % 2 ? "u1" : "u0"),
+                               SI_IntVal(i)));
+      // half the LSM index's entries are in a segment
+      if (n == 1 && i == 499) {
+        mu_check(indexes[n].Apply(indexes[n].ctx, cs) == SI_INDEX_OK);
+        SIChangeSet_Free(&cs);
+        cs = SI_NewChangeSet(500);
+        SILSMIndex_Freeze(indexes[n].ctx);
+      }
+    }
+    mu_check(indexes[n].Apply(indexes[n].ctx, cs) == SI_INDEX_OK);
+    SIChangeSet_Free(&cs);
+  }
+  SIIndex src = indexes[2];
+  indexes[2] = SI_NewStaticIndex(src, spec);
+
+  const char *queries[] = {"$1 = 'u0' AND $2 < 100", "$1 = 'u1'",
+                           "$1 IN ('u0', 'u1') AND $2 >= 990", "$1 = 'u2'",
+                           // filters are not considered
+                           "$1 = 'u0' AND $2 < 100 AND $2 != 4"};
+  size_t expected[] = {50, 500, 10, 0, 50};
+  for (int n = 0; n < 3; n++) {
+    for (int i = 0; i < 5; i++) {
+      SIQuery q = SI_NewQuery();
+      mu_check(SI_ParseQuery(&q, queries[i], strlen(queries[i]), &spec, NULL));
+      SIQueryPlan *plan = SI_BuildQueryPlan(&q, &spec);
+      mu_check(plan != NULL);
+      mu_check(indexes[n].Estimate(indexes[n].ctx, plan) == expected[i]);
+      SIQueryPlan_Free(plan);
+      SIQuery_Free(&q);
+    }
+    indexes[n].Free(indexes[n].ctx);
+  }
+  src.Free(src.ctx);
+}
+
+/* Scan a CONCURRENT index without the lock, checking that the keys come in
+ * order and each id is under one of its keys */
+void *concurrentReader_Run(void *p) {
+  lockedReader *r = p;
+  for (size_t i = 0; i < r->numQueries; i++) {
+    SICursor *c = r->idx.Find(r->idx.ctx, &r->queries[i]);
+    int last = -1;
+    SIId id;
+    while (c->error == SI_CURSOR_OK && NULL != (id = c->Next(c->ctx))) {
+      SIMultiKey *mk = c->CurrentKey(c->ctx);
+      int k = mk->keys[0].intval;
+      if (k < last || k % 10000 != atoi(id + 2) % 100) {
+        r->torn++;
+      }
+      last = k;
+    }
+    SICursor_Free(c);
+  }
+  return NULL;
+}
+
+MU_TEST(testConcurrentIndex) {
+  size_t deleted;
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_INT32}},
+                 .numProps = 1,
+                 .flags = SI_INDEX_CONCURRENT};
+  SIIndex idx = SI_NewCompoundIndex(spec);
+
+  lockedReader readers[4];
+  pthread_t threads[4];
+  for (int t = 0; t < 4; t++) {
+    readers[t] = (lockedReader){
+        .idx = idx, .queries = calloc(100, sizeof(SIQuery)), .numQueries = 100};
+    for (int i = 0; i < 100; i++) {
+      readers[t].queries[i] = SI_NewQuery();
+      mu_check(SI_ParseQuery(&readers[t].queries[i], "$1 >= 0", 7, &spec,
+                             NULL));
+    }
+    mu_check(
+        !pthread_create(&threads[t], NULL, concurrentReader_Run, &readers[t]));
+  }
+
+  // ids are added, moved to another key that other ids share, and deleted,
+  // while the readers scan
+  for (int round = 0; round < 5; round++) {
+    for (int i = 0; i < 1000; i += 10) {
+      SIChangeSet cs = SI_NewChangeSet(10);
+      for (int j = i; j < i + 10; j++) {
+        char *id = malloc(16);
+        sprintf(id, "id%d", j);
+        SIChangeSet_AddCahnge(&cs, SI_NewAddChange(id, 1, SI_IntVal(j % 100)));
+      }
+      mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+      SIChangeSet_Free(&cs);
+    }
+    mu_check(idx.Len(idx.ctx) == 1000);
+    for (int j = 0; j < 1000; j += 3) {
+      SIChangeSet cs = SI_NewChangeSet(1);
+      char *id = malloc(16);
+      sprintf(id, "id%d", j);
+      SIChangeSet_AddCahnge(&cs,
+                            SI_NewAddChange(id, 1, SI_IntVal(10000 + j % 100)));
+      mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+      SIChangeSet_Free(&cs);
+    }
+    mu_check(idx.Len(idx.ctx) == 1000);
+    deleteWhere(idx, &spec, "$1 >= 10000", &deleted);
+    mu_check(deleted == 334);
+    mu_check(idx.Len(idx.ctx) == 666);
+  }
+
+  for (int t = 0; t < 4; t++) {
+    pthread_join(threads[t], NULL);
+    mu_check(readers[t].torn == 0);
+    for (int i = 0; i < 100; i++) {
+      SIQuery_Free(&readers[t].queries[i]);
+    }
+    free(readers[t].queries);
+  }
+
+  idx.Free(idx.ctx);
+}
+
+/* Open a snapshot cursor over a query, parsed into q */
+void openSnapshot(SIIndex idx, SIQuery *q, SISpec *spec, const char *str,
+                  SICursor **c) {
+  parseQuery(q, spec, str, NULL);
+  q->snapshot = 1;
+  *c = idx.Find(idx.ctx, q);
+}
+
+void countQuery(SIIndex idx, SISpec *spec, const char *str, size_t *num) {
+  SIQuery q;
+  parseQuery(&q, spec, str, NULL);
+  SIId *ids;
+  collectIds(idx, &q, &ids, NULL, num);
+  free(ids);
+  SIQuery_Free(&q);
+}
+
+void applyAdd(SIIndex idx, const char *fmt, int n, int key) {
+  char *id = malloc(16);
+  sprintf(id, fmt, n);
+  SIChangeSet cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(id, 1, SI_IntVal(key)));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+}
+
+MU_TEST(testSnapshotCursor) {
+  size_t deleted, count;
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_INT32}},
+                 .numProps = 1};
+  SISpec concurrent = spec;
+  concurrent.flags = SI_INDEX_CONCURRENT;
+
+  for (int t = 0; t < 4; t++) {
+    SIIndex idx = t == 1 ? SI_NewCompoundIndex(concurrent)
+                         : t == 3 ? SI_NewLSMIndex(spec)
+                                  : SI_NewCompoundIndex(spec);
+    for (int i = 0; i < 200; i++) {
+      applyAdd(idx, "id%d", i, i);
+    }
+    if (t == 2) {
+      SIIndex src = idx;
+      idx = SI_NewStaticIndex(src, spec);
+      src.Free(src.ctx);
+    }
+
+    // each id is moved past the scan as it is returned, new ids are added
+    // ahead of it and ids it has yet to reach are deleted. The snapshot still
+    // returns each of the original ids exactly once
+    SIQuery q;
+    SICursor *c;
+    openSnapshot(idx, &q, &spec, "$1 >= 0", &c);
+    int seen[200] = {0};
+    size_t n = 0;
+    SIId id;
+    while (c->error == SI_CURSOR_OK && NULL != (id = c->Next(c->ctx))) {
+      mu_check(!strncmp(id, "id", 2));
+      int k = atoi(id + 2);
+      mu_check(k >= 0 && k < 200 && !seen[k]);
+      seen[k] = 1;
+      n++;
+
+      applyAdd(idx, "id%d", k, 1000 + k);
+      if (k % 10 == 0) {
+        applyAdd(idx, "new%d", k, k + 1);
+      } else if (k % 10 == 5 && k + 50 < 200) {
+        char del[16];
+        sprintf(del, "id%d", k + 50);
+        SIChangeSet cs = SI_NewChangeSet(1);
+        SIChangeSet_AddCahnge(&cs, SI_NewDelChange(del));
+        mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+        SIChangeSet_Free(&cs);
+      }
+    }
+    mu_check(n == 200);
+    SICursor_Free(c);
+    SIQuery_Free(&q);
+
+    // the deleted ids were moved back once the scan reached them
+    mu_check(idx.Len(idx.ctx) == 220);
+    countQuery(idx, &spec, "$1 >= 1000", &count);
+    mu_check(count == 200);
+    countQuery(idx, &spec, "$1 < 1000", &count);
+    mu_check(count == 20);
+
+    // bulk deletes don't change what an open snapshot returns
+    openSnapshot(idx, &q, &spec, "$1 >= 0", &c);
+    deleteWhere(idx, &spec, "$1 < 1000", &deleted);
+    mu_check(deleted == 20);
+    n = 0;
+    while (c->error == SI_CURSOR_OK && NULL != c->Next(c->ctx)) {
+      n++;
+    }
+    mu_check(n == 220);
+    SICursor_Free(c);
+    SIQuery_Free(&q);
+
+    // the next write collects what the snapshots kept
+    applyAdd(idx, "id%d", 0, 2000);
+    mu_check(idx.Len(idx.ctx) == 200);
+    countQuery(idx, &spec, "$1 >= 0", &count);
+    mu_check(count == 200);
+    countQuery(idx, &spec, "$1 >= 1001", &count);
+    mu_check(count == 200);
+
+    idx.Free(idx.ctx);
+  }
+}
+
+MU_TEST(testOrderBy) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_STRING},
+                                                   {.type = T_INT32}},
+                 .numProps = 2};
+
+  SIIndex idx = SI_NewCompoundIndex(spec);
+
+  SIChangeSet cs = SI_NewChangeSet(100);
+  for (int i = 0; i < 100; i++) {
+    char *id = malloc(16);
+    sprintf(id, "id%d", i);
+    char *s = malloc(16);
+    sprintf(s, "u%d", i % 2);
+    SIChangeSet_AddCahnge(
+        &cs, SI_NewAddChange(id, 2, SI_StringValC(s), SI_IntVal(i)));
+  }
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+
+  // latest entries of a user, the first column is fixed by the equality
+  testOrderedQuery(idx, &spec, "$1 = 'u1'", "$2", 1, 0, 3,
+                   (const char *[]){"id99", "id97", "id95", NULL});
+  testOrderedQuery(idx, &spec, "$1 = 'u0' AND $2 >= 10", "$2", 0, 1, 2,
+                   (const char *[]){"id12", "id14", NULL});
+  testOrderedQuery(idx, &spec, "$1 = 'u0' AND $2 < 7", "$2", 1, 0, 0,
+                   (const char *[]){"id6", "id4", "id2", "id0", NULL});
+  testOrderedQuery(idx, &spec, "$1 = 'u0' AND $2 > 92", "$2", 1, 0, 0,
+                   (const char *[]){"id98", "id96", "id94", NULL});
+
+  // IN values are scanned in index order, regardless of the query order
+  testOrderedQuery(idx, &spec, "$1 IN ('u0', 'u1', 'u0') AND $2 < 3", "$1", 1,
+                   0, 0, (const char *[]){"id1", "id2", "id0", NULL});
+  testOrderedQuery(idx, &spec, "$1 IN ('u1', 'u0') AND $2 < 3", "$1", 0, 0,
+                   0, (const char *[]){"id0", "id2", "id1", NULL});
+
+  // the cursor exposes the key of each returned id
+  SIQuery q = SI_NewQuery();
+  const char *str = "$1 = 'u1' AND $2 > 95";
+  mu_check(SI_ParseQuery(&q, str, strlen(str), &spec, NULL));
+  SICursor *c = idx.Find(idx.ctx, &q);
+  mu_check(c->error == SI_CURSOR_OK);
+  mu_check(c->Next(c->ctx) != NULL);
+  SIMultiKey *mk = c->CurrentKey(c->ctx);
+  mu_check(mk != NULL && mk->size == 2);
+  mu_check(!strncmp(mk->keys[0].stringval.str, "u1", 2));
+  mu_check(mk->keys[1].intval == 97);
+  SICursor_Free(c);
+  SIQuery_Free(&q);
+
+  q = SI_NewQuery();
+  mu_check(!SIQuery_AddOrderBy(&q, "$3", &spec));
+  mu_check(!SIQuery_AddOrderBy(&q, "$0", &spec));
+  mu_check(q.numOrderBy == 0);
+}
+
+int cmpIntDesc(const void *p1, const void *p2) {
+  return *(int *)p2 - *(int *)p1;
+}
+
+MU_TEST(testTopK) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_STRING},
+                                                   {.type = T_INT32}},
+                 .numProps = 2};
+
+  SIIndex idx = SI_NewCompoundIndex(spec);
+
+  // unique prices in three categories, not correlated with the ids
+  int prices[100];
+  SIChangeSet cs = SI_NewChangeSet(100);
+  for (int i = 0; i < 100; i++) {
+    char *id = malloc(16);
+    sprintf(id, "id%d", i);
+    char *s = malloc(16);
+    sprintf(s, "c%d", i % 3);
+    prices[i] = (i * 37) % 100;
+    SIChangeSet_AddCahnge(
+        &cs, SI_NewAddChange(id, 2, SI_StringValC(s), SI_IntVal(prices[i])));
+  }
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+
+  // the expected top prices of categories c0 and c1, by brute force
+  int top[100], n = 0;
+  for (int i = 0; i < 100; i++) {
+    if (i % 3 != 2) {
+      top[n++] = prices[i];
+    }
+  }
+  qsort(top, n, sizeof(int), cmpIntDesc);
+  char expected[4][16];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 100; j++) {
+      if (prices[j] == top[i]) {
+        sprintf(expected[i], "id%d", j);
+      }
+    }
+  }
+
+  // each category range is scanned in price order
+  testOrderedQuery(
+      idx, &spec, "$1 IN ('c0', 'c1')", "$2", 1, 0, 3,
+      (const char *[]){expected[0], expected[1], expected[2], NULL});
+  testOrderedQuery(idx, &spec, "$1 IN ('c0', 'c1')", "$2", 1, 1, 2,
+                   (const char *[]){expected[1], expected[2], NULL});
+
+  // a range on the first column needs a full top-k sort
+  testOrderedQuery(idx, &spec, "$1 >= 'c0' AND $1 < 'c2'", "$2", 1, 0, 3,
+                   (const char *[]){expected[0], expected[1], expected[2], NULL});
+
+  // without a limit all the ids are sorted
+  SIQuery q = SI_NewQuery();
+  const char *str = "$1 <= 'c2'";
+  mu_check(SI_ParseQuery(&q, str, strlen(str), &spec, NULL));
+  mu_check(SIQuery_AddOrderBy(&q, "$2", &spec));
+  SICursor *c = idx.Find(idx.ctx, &q);
+  mu_check(c->error == SI_CURSOR_OK);
+  SIId id;
+  int i = 0;
+  while (NULL != (id = c->Next(c->ctx))) {
+    int price = -1;
+    for (int j = 0; j < 100; j++) {
+      sprintf(expected[3], "id%d", j);
+      if (!strcmp(expected[3], id)) {
+        price = prices[j];
+      }
+    }
+    mu_check(price == i);
+    i++;
+  }
+  mu_check(i == 100);
+  SICursor_Free(c);
+  SIQuery_Free(&q);
+}
+
 ///////////////////////////////////
 
+typedef struct {
+  SIId *ids;
+  int *vals;
+  size_t num;
+} scanResult;
+
+/* Run a query, collecting its ids and the values of their second property */
+void runScan(SIIndex idx, SISpec *spec, const char *str, const char *orderBy,
+             int desc, size_t offset, size_t num, scanResult *r) {
+  SIQuery q;
+  parseQuery(&q, spec, str, orderBy);
+  q.orderDesc = desc;
+  q.offset = offset;
+  q.num = num;
+
+  SIMultiKey **keys;
+  collectIds(idx, &q, &r->ids, &keys, &r->num);
+  r->vals = calloc(r->num + 1, sizeof(int));
+  for (size_t i = 0; i < r->num; i++) {
+    r->vals[i] = keys[i]->keys[1].intval;
+    SIMultiKey_Free(keys[i]);
+  }
+  free(keys);
+  SIQuery_Free(&q);
+}
+
+/* Check a parallel scan returns what a scan on a single thread does. Sorted
+ * ties are in no particular order, so only their sort values are compared */
+void testParallelQuery(SIIndex idx, SISpec *spec, SIThreadPool *p,
+                       const char *str, const char *orderBy, int desc,
+                       size_t offset, size_t num, size_t expected) {
+  SI_SetScanThreadPool(NULL, 0);
+  scanResult serial, parallel;
+  runScan(idx, spec, str, orderBy, desc, offset, num, &serial);
+  SI_SetScanThreadPool(p, 1000);
+  runScan(idx, spec, str, orderBy, desc, offset, num, &parallel);
+  // the scan was split, so there are helper tasks to drain
+  mu_check(SIThreadPool_Pending(p) > 0);
+  while (SIThreadPool_Drain(p, 1000)) {
+    sched_yield();
+  }
+
+  mu_check(serial.num == expected);
+  mu_check(parallel.num == expected);
+  for (size_t i = 0; i < serial.num; i++) {
+    mu_check(serial.vals[i] == parallel.vals[i]);
+    if (!orderBy || strcmp(orderBy, "$2")) {
+      mu_check(!strcmp(serial.ids[i], parallel.ids[i]));
+    }
+  }
+  free(serial.ids);
+  free(serial.vals);
+  free(parallel.ids);
+  free(parallel.vals);
+}
+
+MU_TEST(testParallelScan) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_INT32},
+                                                   {.type = T_INT32}},
+                 .numProps = 2};
+  SIIndex idx = SI_NewCompoundIndex(spec);
+
+  // pairs of ids share a key, so parts end in the middle of posting lists
+  SIChangeSet cs = SI_NewChangeSet(20000);
+  for (int i = 0; i < 20000; i++) {
+    char *id = malloc(16);
+    sprintf(id, "id%d", i);
+    SIChangeSet_AddCahnge(&cs, SI_NewAddChange(id, 2, SI_IntVal((i / 2) % 50),
+                                               SI_IntVal(i / 4)));
+  }
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+
+  SIThreadPool *p = SI_NewThreadPool(4);
+  // a residual filter on the second property
+  testParallelQuery(idx, &spec, p, "$1 >= 10 AND $1 < 40 AND $2 >= 2500",
+                    NULL, 0, 0, 0, 6000);
+  testParallelQuery(idx, &spec, p, "$1 >= 10 AND $1 < 40 AND $2 >= 2500",
+                    NULL, 0, 30, 100, 100);
+  // a reverse scan in index order
+  testParallelQuery(idx, &spec, p, "$1 >= 0 AND $2 > 100",
+                    "$1", 1, 5, 50, 50);
+  // top-k of each range, and a full sort
+  testParallelQuery(idx, &spec, p, "$1 IN (3, 7, 11, 13, 17, 19) AND $2 >= 0",
+                    "$2", 1, 0, 10, 10);
+  testParallelQuery(idx, &spec, p, "$1 > 5 AND $2 < 3000", "$2", 0, 0, 0,
+                    10560);
+  SI_SetScanThreadPool(NULL, 0);
+
+  SIThreadPool_Free(p);
+  idx.Free(idx.ctx);
+}
+
+/* execute a prepared query with the given values, and check its ids */
+void testExecute(SIIndex idx, SISpec *spec, SIStatement *st, SIValue *params,
+                 const char *expectedIds[]) {
+  SIQuery q = SIStatement_Bind(st, params, spec);
+  SICursor *c = idx.Find(idx.ctx, &q);
+  mu_check(c->error == SI_CURSOR_OK);
+  SIId id;
+  int n = 0;
+  while (NULL != (id = c->Next(c->ctx))) {
+    mu_check(expectedIds[n] != NULL);
+    mu_check(!strcmp(id, expectedIds[n]));
+    n++;
+  }
+  mu_check(expectedIds[n] == NULL);
+  SICursor_Free(c);
+  SIQuery_Free(&q);
+}
+
+/* Prepare a query, setting the statement, or NULL and the error */
+void prepare(SISpec *spec, const char *str, const char *orderBy,
+             SIStatement **st, const char **err) {
+  SIQuery q;
+  parseQuery(&q, spec, str, orderBy);
+  *st = SI_NewStatement(&q, spec, err);
+}
+
+MU_TEST(testPreparedQuery) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_STRING},
+                                                   {.type = T_INT32}},
+                 .numProps = 2};
+
+  SIIndex idx = SI_NewCompoundIndex(spec);
+  SIChangeSet cs = SI_NewChangeSet(20);
+  for (int i = 0; i < 20; i++) {
+    char *id = malloc(16);
+    sprintf(id, "id%d", i);
+    char *s = malloc(16);
+    sprintf(s, "u%d", i % 2);
+    SIChangeSet_AddCahnge(
+        &cs, SI_NewAddChange(id, 2, SI_StringValC(s), SI_IntVal(i)));
+  }
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+
+  // parameters in the scan ranges
+  const char *err = NULL;
+  SIStatement *st;
+  prepare(&spec, "$1 = ? AND $2 < ?", NULL, &st, &err);
+  mu_check(st != NULL && st->numParams == 2);
+  mu_check(st->paramTypes[0] == T_STRING && st->paramTypes[1] == T_INT32);
+  testExecute(idx, &spec, st,
+              (SIValue[]){SI_StringValC("u1"), SI_IntVal(6)},
+              (const char *[]){"id1", "id3", "id5", NULL});
+  testExecute(idx, &spec, st,
+              (SIValue[]){SI_StringValC("u0"), SI_IntVal(3)},
+              (const char *[]){"id0", "id2", NULL});
+  SIStatement_Free(st);
+
+  // parameters in the filter
+  prepare(&spec, "$1 = 'u0' AND $2 < 7 AND $2 != ?", NULL, &st, &err);
+  mu_check(st != NULL && st->numParams == 1);
+  testExecute(idx, &spec, st, (SIValue[]){SI_IntVal(4)},
+              (const char *[]){"id0", "id2", "id6", NULL});
+  testExecute(idx, &spec, st, (SIValue[]){SI_IntVal(0)},
+              (const char *[]){"id2", "id4", "id6", NULL});
+  SIStatement_Free(st);
+
+  // ordered scans sort the keys once they are bound
+  prepare(&spec, "$1 IN (?, ?) AND $2 < 3", "$1", &st, &err);
+  mu_check(st != NULL);
+  testExecute(idx, &spec, st,
+              (SIValue[]){SI_StringValC("u1"), SI_StringValC("u0")},
+              (const char *[]){"id0", "id2", "id1", NULL});
+  testExecute(idx, &spec, st,
+              (SIValue[]){SI_StringValC("u0"), SI_StringValC("u0")},
+              (const char *[]){"id0", "id2", NULL});
+  SIStatement_Free(st);
+
+  // parameters must be compared with valid properties, and the query must
+  // have a scan range
+  prepare(&spec, "$1 = 'u0' AND $3 = ?", NULL, &st, &err);
+  mu_check(st == NULL);
+  mu_check(!strcmp(err, "Invalid parameter property"));
+  prepare(&spec, "$2 = ?", NULL, &st, &err);
+  mu_check(st == NULL);
+  mu_check(!strcmp(err, "Query cannot be planned"));
+
+  idx.Free(idx.ctx);
+}
+
+/* plan a query, keeping its compiled filter */
+void planQuery(SISpec *spec, const char *str, SIQueryPlan **plan) {
+  SIQuery q;
+  parseQuery(&q, spec, str, NULL);
+  *plan = q.numPredicates ? SI_BuildQueryPlan(&q, spec) : NULL;
+  SIQuery_Free(&q);
+  mu_check(*plan != NULL);
+  (*plan)->filterTree = NULL;
+}
+
+void testUnion(SIIndex idx, SISpec *spec, const char **queries, int num,
+               size_t expectedRanges) {
+  SIQueryPlan *plans[num];
+  for (int i = 0; i < num; i++) {
+    planQuery(spec, queries[i], &plans[i]);
+  }
+  SIQuery q = SI_NewQuery();
+  q.numPredicates = 1;
+  q.plan = SI_NewUnionPlan(plans, num, spec);
+  mu_check(q.plan->numRanges == expectedRanges);
+
+  // a single scan matched against each query yields what each query finds
+  SIId matched[num][200];
+  size_t lens[num];
+  memset(lens, 0, sizeof(lens));
+  SICursor *c = idx.Find(idx.ctx, &q);
+  mu_check(c->error == SI_CURSOR_OK);
+  SIId id;
+  while (NULL != (id = c->Next(c->ctx))) {
+    SIMultiKey *mk = c->CurrentKey(c->ctx);
+    for (int i = 0; i < num; i++) {
+      if (SIQueryPlan_Match(plans[i], mk, spec)) {
+        matched[i][lens[i]++] = id;
+      }
+    }
+  }
+  for (int i = 0; i < num; i++) {
+    SIId *expected;
+    size_t n;
+    findIds(idx, spec, queries[i], &expected, &n);
+    qsort(matched[i], lens[i], sizeof(SIId), cmpIdPtrs);
+    mu_check(n > 0 && lens[i] == n);
+    for (size_t j = 0; j < n && j < lens[i]; j++) {
+      mu_check(!strcmp(matched[i][j], expected[j]));
+    }
+    free(expected);
+    SIQueryPlan_Free(plans[i]);
+  }
+  SICursor_Free(c);
+  SIQuery_Free(&q);
+}
+
+MU_TEST(testUnionScan) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_STRING},
+                                                   {.type = T_INT32}},
+                 .numProps = 2};
+
+  SIIndex indexes[] = {SI_NewCompoundIndex(spec), SI_NewLSMIndex(spec)};
+  for (int n = 0; n < 2; n++) {
+    SIIndex idx = indexes[n];
+    SIChangeSet cs = SI_NewChangeSet(200);
+    for (int i = 0; i < 200; i++) {
+      char *id = malloc(16);
+      sprintf(id, "id%d", i);
+      char *s = malloc(16);
+      sprintf(s, "u%d", i % 4);
+      SIChangeSet_AddCahnge(
+          &cs, SI_NewAddChange(id, 2, SI_StringValC(s), SI_IntVal(i)));
+    }
+    mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+    SIChangeSet_Free(&cs);
+
+    // overlapping ranges are merged, ranges of a prefix swallow the ranges
+    // within it
+    testUnion(idx, &spec,
+              (const char *[]){"$1 = 'u0' AND $2 < 100",
+                               "$1 = 'u0' AND $2 >= 60 AND $2 < 160",
+                               "$1 IN ('u1', 'u3') AND $2 = 41",
+                               "$1 = 'u3'"},
+              4, 3);
+    // touching ranges are merged, disjoint ones aren't, and filters are
+    // evaluated per query
+    testUnion(idx, &spec,
+              (const char *[]){"$1 = 'u2' AND $2 < 50 AND $2 != 10",
+                               "$1 = 'u2' AND $2 >= 50 AND $2 < 90",
+                               "$1 = 'u2' AND $2 > 150", "$1 > 'u2'"},
+              4, 2);
+    idx.Free(idx.ctx);
+  }
+}
+
+/* run a query and cache its results by its text */
+void cacheResults(SIIndex idx, SIResultCache *rc, SISpec *spec,
+                  const char *str) {
+  SIQuery q = SI_NewQuery();
+  q.numPredicates = 1;
+  planQuery(spec, str, &q.plan);
+  unsigned long version = SIResultCache_Version(rc);
+  SICursor *c = idx.Find(idx.ctx, &q);
+  mu_check(c->error == SI_CURSOR_OK);
+  SIId ids[100];
+  size_t n = 0;
+  while (n < 100 && NULL != (ids[n] = c->Next(c->ctx))) {
+    n++;
+  }
+  SIResultCache_Put(rc, str, strlen(str), q.plan, ids, n, version);
+  SICursor_Free(c);
+  SIQuery_Free(&q);
+}
+
+/* check the number of cached ids of a query, -1 if it isn't cached */
+int cachedResults(SIResultCache *rc, const char *str) {
+  size_t num;
+  SIId *ids = SIResultCache_Get(rc, str, strlen(str), &num);
+  return ids ? (int)num : -1;
+}
+
+MU_TEST(testResultCache) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_STRING},
+                                                   {.type = T_INT32}},
+                 .numProps = 2};
+  SIResultCache *rc = SI_NewResultCache(1 << 20);
+  SIIndex idx = SI_NewCachedIndex(SI_NewCompoundIndex(spec), rc, &spec);
+  SIChangeSet cs = SI_NewChangeSet(20);
+  for (int i = 0; i < 20; i++) {
+    char *id = malloc(16);
+    sprintf(id, "id%d", i);
+    SIChangeSet_AddCahnge(&cs, SI_NewAddChange(id, 2,
+                                               SI_StringValC(i % 2 ? "u1" : "u0"),
+                                               SI_IntVal(i)));
+  }
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+
+  const char *q1 = "$1 = 'u0' AND $2 < 10", *q2 = "$1 = 'u1' AND $2 > 10";
+  cacheResults(idx, rc, &spec, q1);
+  cacheResults(idx, rc, &spec, q2);
+  mu_check(SIResultCache_Len(rc) == 2);
+  mu_check(cachedResults(rc, q1) == 5 && cachedResults(rc, q2) == 5);
+
+  // a key outside both queries' ranges keeps them
+  cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id101"), 2,
+                                             SI_StringValC("u1"), SI_IntVal(5)));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  mu_check(cachedResults(rc, q1) == 5 && cachedResults(rc, q2) == 5);
+
+  // a key within the ranges of a query drops its results
+  cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs, SI_NewAddChange(strdup("id102"), 2,
+                                             SI_StringValC("u0"), SI_IntVal(3)));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  mu_check(cachedResults(rc, q1) == -1 && cachedResults(rc, q2) == 5);
+
+  // deleting an id drops the results holding it, and only them
+  cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs, SI_NewDelChange("id2"));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  mu_check(cachedResults(rc, q2) == 5);
+  cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs, SI_NewDelChange("id13"));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  mu_check(cachedResults(rc, q2) == -1);
+
+  // results read before a change are not cached
+  unsigned long version = SIResultCache_Version(rc);
+  cs = SI_NewChangeSet(1);
+  SIChangeSet_AddCahnge(&cs, SI_NewDelChange("id4"));
+  mu_check(idx.Apply(idx.ctx, cs) == SI_INDEX_OK);
+  SIChangeSet_Free(&cs);
+  SIQueryPlan *plan;
+  planQuery(&spec, q1, &plan);
+  SIResultCache_Put(rc, q1, strlen(q1), plan, (SIId[]){"id0"}, 1, version);
+  mu_check(cachedResults(rc, q1) == -1);
+
+  // bulk deletes drop the results whose ranges overlap the deleted ones
+  cacheResults(idx, rc, &spec, q1);
+  cacheResults(idx, rc, &spec, q2);
+  mu_check(cachedResults(rc, q1) == 4 && cachedResults(rc, q2) == 4);
+  SIQuery q = SI_NewQuery();
+  q.numPredicates = 1;
+  planQuery(&spec, "$1 = 'u1' AND $2 > 16", &q.plan);
+  size_t num;
+  SIGarbage *g;
+  mu_check(idx.DeleteWhere(idx.ctx, &q, NULL, NULL, &num, &g) == SI_INDEX_OK);
+  mu_check(num == 2);
+  SIGarbage_Release(g, SIZE_MAX);
+  SIQuery_Free(&q);
+  mu_check(cachedResults(rc, q1) == 4 && cachedResults(rc, q2) == -1);
+
+  // the least recently used results are dropped to stay within the budget
+  SIResultCache *small = SI_NewResultCache(SIResultCache_Memory(rc) * 2);
+  SIId ids[] = {"id0", "id6", "id8"};
+  SIResultCache_Put(small, "a", 1, plan, ids, 3, 0);
+  SIResultCache_Put(small, "b", 1, plan, ids, 3, 0);
+  mu_check(cachedResults(small, "a") == 3);
+  SIResultCache_Put(small, "c", 1, plan, ids, 3, 0);
+  mu_check(SIResultCache_Len(small) == 2);
+  mu_check(cachedResults(small, "a") == 3 && cachedResults(small, "b") == -1);
+  SIResultCache_Free(small);
+
+  SIQueryPlan_Free(plan);
+  idx.Free(idx.ctx);
+  SIResultCache_Free(rc);
+}
+
 MU_TEST_SUITE(test_index) {
   // MU_SUITE_CONFIGURE(&test_setup, &test_teardown);
 
@@ -241,7 +1673,23 @@ int main(int argc, char **argv) {
   MU_RUN_TEST(testIndex);
   MU_RUN_TEST(testReverseIndex);
   MU_RUN_TEST(testUniqueIndex);
+  MU_RUN_TEST(testDeferredIndex);
+  MU_RUN_TEST(testDeleteWhere);
   MU_RUN_TEST(testNull);
+  MU_RUN_TEST(testLargeInFilter);
+  MU_RUN_TEST(testOrderBy);
+  MU_RUN_TEST(testTopK);
+  MU_RUN_TEST(testPartitionedIndex);
+  MU_RUN_TEST(testLSMIndex);
+  MU_RUN_TEST(testStaticIndex);
+  MU_RUN_TEST(testLockedIndex);
+  MU_RUN_TEST(testEstimate);
+  MU_RUN_TEST(testConcurrentIndex);
+  MU_RUN_TEST(testSnapshotCursor);
+  MU_RUN_TEST(testParallelScan);
+  MU_RUN_TEST(testPreparedQuery);
+  MU_RUN_TEST(testUnionScan);
+  MU_RUN_TEST(testResultCache);
 
   MU_REPORT();
   return minunit_status;
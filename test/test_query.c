@@ -1,11 +1,13 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "minunit.h"
 
 #include "../src/value.h"
 #include "../src/index.h"
 #include "../src/query.h"
 #include "../src/query_plan.h"
+#include "../src/query_cache.h"
 #include "../src/rmutil/alloc.h"
 
 MU_TEST(testQueryParser) {
@@ -87,6 +89,131 @@ MU_TEST(testQueryExecution) {
   SIQueryPlan *qp = SI_BuildQueryPlan(&q, &spec);
 }
 
+/* format "$n IN (0, 1, ..., num-1)" into buf */
+char *inPredicate(char *buf, int prop, int num) {
+  char *p = buf + sprintf(buf, "$%d IN (", prop);
+  for (int i = 0; i < num; i++) {
+    p += sprintf(p, "%d%s", i, i < num - 1 ? ", " : ")");
+  }
+  return buf;
+}
+
+MU_TEST(testQueryPlanInExpansion) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{T_INT32}, {T_INT32}},
+                 .numProps = 2};
+  char in1[2048], in2[2048], str[4096];
+
+  // a small product is fully expanded
+  sprintf(str, "%s AND %s", inPredicate(in1, 1, 10), inPredicate(in2, 2, 10));
+  SIQuery q = SI_NewQuery();
+  mu_check(SI_ParseQuery(&q, str, strlen(str), &spec, NULL));
+  SIQueryPlan *qp = SI_BuildQueryPlan(&q, &spec);
+  mu_check(qp != NULL);
+  mu_check(qp->numColumns == 2);
+  mu_check(qp->numRanges == 100);
+  mu_check(qp->filterTree == NULL);
+  mu_check(qp->filter == NULL);
+
+  // the ranges are expanded lazily, in key order
+  siPlanRangeIterator it = SIQueryPlan_IterateRanges(qp);
+  siPlanRange *rng;
+  size_t n = 0;
+  while (NULL != (rng = siPlanRangeIterator_Next(&it))) {
+    mu_check(rng->min->size == 2);
+    mu_check(rng->min->keys[0].longval == n / 10);
+    mu_check(rng->max->keys[1].longval == n % 10);
+    n++;
+  }
+  mu_check(n == 100);
+  siPlanRangeIterator_Free(&it);
+  SIQueryPlan_Free(qp);
+  SIQuery_Free(&q);
+
+  // 200 x 200 only expands the first column, the second becomes a filter
+  sprintf(str, "%s AND %s", inPredicate(in1, 1, 200),
+          inPredicate(in2, 2, 200));
+  q = SI_NewQuery();
+  mu_check(SI_ParseQuery(&q, str, strlen(str), &spec, NULL));
+  qp = SI_BuildQueryPlan(&q, &spec);
+  mu_check(qp != NULL);
+  mu_check(qp->numColumns == 1);
+  mu_check(qp->numRanges == 200);
+  mu_check(qp->filterTree != NULL);
+  mu_check(qp->filterTree->type == QN_PRED);
+  mu_check(qp->filterTree->pred.t == PRED_IN);
+  mu_check(qp->filterTree->pred.propId == 1);
+  mu_check(qp->filter != NULL);
+  mu_check(qp->filter->numInstrs == 1);
+  mu_check(qp->filter->instrs[0].set != NULL);
+  mu_check(SIValueSet_Size(qp->filter->instrs[0].set) == 200);
+
+  SIValue v = SI_IntVal(199);
+  mu_check(SIValueSet_Contains(qp->filter->instrs[0].set, &v));
+  v = SI_IntVal(200);
+  mu_check(!SIValueSet_Contains(qp->filter->instrs[0].set, &v));
+  SIQueryPlan_Free(qp);
+  SIQuery_Free(&q);
+}
+
+/* compile a WHERE expression into a filter, without building a plan */
+SIFilter *compileFilter(const char *str, SISpec *spec) {
+  SIQuery q = SI_NewQuery();
+  if (!SI_ParseQuery(&q, str, strlen(str), spec, NULL)) {
+    return NULL;
+  }
+  SIFilter *f = SI_CompileFilter(q.root, spec);
+  SIQuery_Free(&q);
+  return f;
+}
+
+int filterMatches(SIFilter *f, SIValue v1, SIValue v2) {
+  SIValue vals[] = {v1, v2};
+  SIMultiKey *mk = SI_NewMultiKey(vals, 2);
+  int rc = SIFilter_Eval(f, mk);
+  SIMultiKey_Free(mk);
+  return rc;
+}
+
+MU_TEST(testFilterProgram) {
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_INT32, .name = "age"},
+                                                   {.type = T_STRING, .name = "name"}},
+                 .numProps = 2,
+                 .flags = SI_INDEX_NAMED};
+
+  SIFilter *f = compileFilter(
+      "(age > 10 AND age <= 20) OR name IN ('foo', 'bar') OR name IS NULL",
+      &spec);
+  mu_check(f != NULL);
+  mu_check(f->numInstrs == 4);
+  // the last instruction of an OR chain decides the result
+  mu_check(f->instrs[3].onTrue == SI_FILTER_ACCEPT);
+  mu_check(f->instrs[3].onFalse == SI_FILTER_REJECT);
+
+  mu_check(filterMatches(f, SI_IntVal(11), SI_StringValC("baz")));
+  mu_check(filterMatches(f, SI_IntVal(20), SI_StringValC("baz")));
+  mu_check(!filterMatches(f, SI_IntVal(10), SI_StringValC("baz")));
+  mu_check(!filterMatches(f, SI_IntVal(21), SI_StringValC("baz")));
+  mu_check(filterMatches(f, SI_IntVal(21), SI_StringValC("FOO")));
+  mu_check(filterMatches(f, SI_IntVal(1), SI_StringValC("bar")));
+  mu_check(filterMatches(f, SI_IntVal(1), SI_NullVal()));
+  mu_check(!filterMatches(f, SI_NullVal(), SI_StringValC("baz")));
+
+  // short circuit - a match on the first range skips the IN lookup
+  f->numSteps = 0;
+  filterMatches(f, SI_IntVal(15), SI_StringValC("baz"));
+  mu_check(f->numSteps == 2);
+  SIFilter_Free(f);
+
+  f = compileFilter("name LIKE 'fo%' AND age >= 3", &spec);
+  mu_check(f != NULL);
+  mu_check(filterMatches(f, SI_IntVal(4), SI_StringValC("foo")));
+  mu_check(filterMatches(f, SI_IntVal(3), SI_StringValC("Fox")));
+  mu_check(!filterMatches(f, SI_IntVal(2), SI_StringValC("foo")));
+  mu_check(!filterMatches(f, SI_IntVal(4), SI_StringValC("bar")));
+  mu_check(!filterMatches(f, SI_NullVal(), SI_StringValC("fox")));
+  SIFilter_Free(f);
+}
+
 SIQueryError validateQuery(const char *str, SISpec *spec) {
   SIQuery q = SI_NewQuery();
   char *parseError = NULL;
@@ -204,13 +331,167 @@ MU_TEST(testTimeFunctions) {
   mu_assert_int_eq(86400 * 2, q.root->pred.eq.v.timeval);
 }
 
+/* Parse queries naming the thread's number, checking each tree */
+void *parserThread_Run(void *p) {
+  int t = *(int *)p;
+  SISpec spec = {.properties = (SIIndexProperty[]){{.type = T_STRING, .name = "name"},
+                                                   {.type = T_INT32, .name = "age"}},
+                 .numProps = 2,
+                 .flags = SI_INDEX_NAMED};
+  char str[128], name[16];
+  sprintf(name, "thread%d", t);
+  sprintf(str, "name = '%s' AND (age > %d OR age IS NULL)", name, t);
+  for (int i = 0; i < 2000; i++) {
+    SIQuery q = SI_NewQuery();
+    char *err = NULL;
+    if (!SI_ParseQuery(&q, str, strlen(str), &spec, &err) ||
+        q.numPredicates != 3 || q.root->type != QN_LOGIC ||
+        q.root->op.op != OP_AND ||
+        strcmp(q.root->op.left->pred.eq.v.stringval.str, name) ||
+        q.root->op.right->op.left->pred.rng.min.longval != t ||
+        q.root->op.right->op.right->pred.propId != 1) {
+      *(int *)p = -1;
+    }
+    SIQuery_Free(&q);
+  }
+  return NULL;
+}
+
+MU_TEST(testParserReentrant) {
+  pthread_t threads[4];
+  int ids[4];
+  for (int t = 0; t < 4; t++) {
+    ids[t] = t;
+    mu_check(!pthread_create(&threads[t], NULL, parserThread_Run, &ids[t]));
+  }
+  for (int t = 0; t < 4; t++) {
+    pthread_join(threads[t], NULL);
+    mu_check(ids[t] == t);
+  }
+
+  SIQuery q = SI_NewQuery();
+  char *err = NULL;
+  const char *str = "$1 != 3";
+  mu_check(SI_ParseQuery(&q, str, strlen(str), NULL, &err));
+  mu_check(q.root->type == QN_PRED && q.root->pred.t == PRED_NE);
+  mu_check(q.root->pred.ne.v.longval == 3);
+  SIQuery_Free(&q);
+
+  str = "$1 = 'foo' 'bar'";
+  mu_check(!SI_ParseQuery(&q, str, strlen(str), NULL, &err));
+  mu_check(!strcmp(err, "Syntax error in WHERE line 1 near ''bar''"));
+  mu_check(q.root == NULL && q.numPredicates == 0);
+  free(err);
+
+  str = "$1 = 1 AND\n$2 = )";
+  mu_check(!SI_ParseQuery(&q, str, strlen(str), NULL, &err));
+  mu_check(!strcmp(err, "Syntax error in WHERE line 2 near ')'"));
+  free(err);
+
+  // nesting is bounded
+  char deep[512];
+  memset(deep, '(', 300);
+  strcpy(deep + 300, "$1 = 1");
+  mu_check(!SI_ParseQuery(&q, deep, strlen(deep), NULL, NULL));
+}
+
+MU_TEST(testQueryCache) {
+  SISpec spec = {.properties =
+                     (SIIndexProperty[]){{.type = T_INT32, .name = "foo"},
+                                         {.type = T_INT32, .name = "bar"}},
+                 .numProps = 2,
+                 .flags = SI_INDEX_NAMED};
+  SIQueryCache *c = SI_NewQueryCache(2);
+  char *err = NULL;
+
+  const char *str = "foo = 2 AND bar > 3";
+  SIQuery q = SI_NewQuery();
+  mu_check(SIQueryCache_Parse(c, &q, str, strlen(str), &spec, &err));
+  mu_check(q.plan != NULL && q.root == NULL && q.numPredicates == 2);
+  SIQueryPlan *cached = q.plan->shared;
+  mu_check(cached != NULL && SIQueryCache_Len(c) == 1);
+
+  // executions get their own copies, with their own filter counters
+  SIQueryPlan *p1 = SI_BuildQueryPlan(&q, &spec);
+  SIQueryPlan *p2 = SI_BuildQueryPlan(&q, &spec);
+  mu_check(p1 != p2 && p1->shared == cached && p2->shared == cached);
+  mu_check(p1->numRanges == 1 && p1->order == PLAN_ORDER_NONE);
+  SIQueryPlan_Free(p2);
+  SIQuery_Free(&q);
+
+  // the same text hits the cache, even after the query's plan is gone
+  q = SI_NewQuery();
+  mu_check(SIQueryCache_Parse(c, &q, str, strlen(str), &spec, &err));
+  mu_check(err == NULL && q.plan->shared == cached);
+  SIQuery_Free(&q);
+
+  // a different ORDER BY replaces the cached plan
+  q = SI_NewQuery();
+  mu_check(SIQuery_AddOrderBy(&q, "bar", &spec));
+  q.orderDesc = 1;
+  mu_check(SIQueryCache_Parse(c, &q, str, strlen(str), &spec, &err));
+  mu_check(q.plan->shared != cached && q.plan->reverse);
+  mu_check(q.plan->order == PLAN_ORDER_SCAN && SIQueryCache_Len(c) == 1);
+  SIQuery_Free(&q);
+  // the first execution's copy still holds the old plan
+  mu_check(p1->numColumns == 2 && p1->columns[1].keys[0].min.intval == 3);
+  SIQueryPlan_Free(p1);
+
+  // NOW and TODAY queries are planned on every execution
+  str = "bar < NOW";
+  q = SI_NewQuery();
+  mu_check(SIQueryCache_Parse(c, &q, str, strlen(str), &spec, &err));
+  mu_check(q.timeDependent && q.plan == NULL && q.root != NULL);
+  mu_check(SIQueryCache_Len(c) == 1);
+  SIQuery_Free(&q);
+
+  // errors are not cached
+  str = "foo = ";
+  q = SI_NewQuery();
+  mu_check(!SIQueryCache_Parse(c, &q, str, strlen(str), &spec, &err));
+  mu_check(err != NULL && SIQueryCache_Len(c) == 1);
+  free(err);
+  SIQuery_Free(&q);
+
+  // queries that can't be planned are cached with their tree
+  str = "bar = 1";
+  q = SI_NewQuery();
+  mu_check(SIQueryCache_Parse(c, &q, str, strlen(str), &spec, &err));
+  mu_check(q.plan == NULL && q.root != NULL && SIQueryCache_Len(c) == 2);
+  mu_check(SI_BuildQueryPlan(&q, &spec) == NULL);
+  SIQuery_Free(&q);
+
+  // the least recently used query is evicted
+  str = "foo IN (1, 2, 3)";
+  q = SI_NewQuery();
+  mu_check(SIQueryCache_Parse(c, &q, str, strlen(str), &spec, &err));
+  mu_check(q.plan->numRanges == 3 && SIQueryCache_Len(c) == 2);
+  SIQuery_Free(&q);
+  str = "bar = 1";
+  q = SI_NewQuery();
+  mu_check(SIQueryCache_Parse(c, &q, str, strlen(str), &spec, &err));
+  mu_check(err == NULL && SIQueryCache_Len(c) == 2);
+  SIQuery_Free(&q);
+  str = "foo = 2 AND bar > 3";
+  q = SI_NewQuery();
+  mu_check(SIQueryCache_Parse(c, &q, str, strlen(str), &spec, &err));
+  mu_check(SIQueryCache_Len(c) == 2);
+  SIQuery_Free(&q);
+
+  SIQueryCache_Free(c);
+}
+
 int main(int argc, char **argv) {
   RMUTil_InitAlloc();
   // return testIndex();
   MU_RUN_TEST(testQueryParser);
   MU_RUN_TEST(testQueryPlan);
+  MU_RUN_TEST(testQueryPlanInExpansion);
+  MU_RUN_TEST(testFilterProgram);
   MU_RUN_TEST(testQueryNormalize);
   MU_RUN_TEST(testTimeFunctions);
+  MU_RUN_TEST(testParserReentrant);
+  MU_RUN_TEST(testQueryCache);
   MU_REPORT();
   return minunit_status;
 }
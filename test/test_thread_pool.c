@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+#include "minunit.h"
+
+#include "../src/thread_pool.h"
+#include "../src/rmutil/alloc.h"
+
+typedef struct {
+  size_t ran;
+  size_t done;
+  size_t cancelled;
+} taskCounters;
+
+void countTask(SITask *t, void *arg) {
+  __atomic_add_fetch(&((taskCounters *)arg)->ran, 1, __ATOMIC_RELAXED);
+}
+
+/* Completions run on the draining thread, so they need no atomics */
+void countDone(void *arg, int cancelled) {
+  taskCounters *c = arg;
+  c->done++;
+  c->cancelled += cancelled;
+}
+
+/* Wait for all the submitted tasks, running their completions */
+void drainAll(SIThreadPool *p) {
+  while (SIThreadPool_Drain(p, 1000)) {
+    sched_yield();
+  }
+}
+
+/* Holds a worker until it is opened, so tests can queue tasks behind it */
+typedef struct {
+  int open;
+  int entered;
+} gate;
+
+void gateTask(SITask *t, void *arg) {
+  gate *g = arg;
+  __atomic_store_n(&g->entered, 1, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&g->open, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+}
+
+void waitEntered(gate *g) {
+  while (!__atomic_load_n(&g->entered, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+}
+
+MU_TEST(testRunAll) {
+  SIThreadPool *p = SI_NewThreadPool(4);
+  mu_check(p != NULL);
+  mu_check(SIThreadPool_NumThreads(p) == 4);
+
+  taskCounters c = {0};
+  for (int i = 0; i < 10000; i++) {
+    SIThreadPool_Submit(p, i % SI_TASK_NUM_PRIORITIES, countTask, countDone,
+                        &c);
+  }
+  drainAll(p);
+  mu_check(c.ran == 10000);
+  mu_check(c.done == 10000);
+  mu_check(c.cancelled == 0);
+  mu_check(SIThreadPool_Pending(p) == 0);
+
+  SIThreadPool_Free(p);
+  mu_check(SI_NewThreadPool(0) == NULL);
+}
+
+typedef struct {
+  int order[4];
+  int num;
+} runOrder;
+
+typedef struct {
+  runOrder *o;
+  int val;
+} orderedTask;
+
+void recordTask(SITask *t, void *arg) {
+  orderedTask *ot = arg;
+  ot->o->order[ot->o->num++] = ot->val;
+}
+
+MU_TEST(testPriorities) {
+  SIThreadPool *p = SI_NewThreadPool(1);
+  gate g = {0};
+  SIThreadPool_Submit(p, SI_TASK_NORMAL, gateTask, NULL, &g);
+  waitEntered(&g);
+
+  // the single worker is busy, so the tasks run by priority once it's free
+  runOrder o = {.num = 0};
+  orderedTask tasks[4] = {{&o, 2}, {&o, 1}, {&o, 0}, {&o, 3}};
+  SIThreadPool_Submit(p, SI_TASK_LOW, recordTask, NULL, &tasks[0]);
+  SIThreadPool_Submit(p, SI_TASK_NORMAL, recordTask, NULL, &tasks[1]);
+  SIThreadPool_Submit(p, SI_TASK_HIGH, recordTask, NULL, &tasks[2]);
+  SIThreadPool_Submit(p, SI_TASK_LOW, recordTask, NULL, &tasks[3]);
+  __atomic_store_n(&g.open, 1, __ATOMIC_RELEASE);
+  drainAll(p);
+
+  mu_check(o.num == 4);
+  mu_check(o.order[0] == 0);
+  mu_check(o.order[1] == 1);
+  // tasks of the same priority run last in first out on their worker
+  mu_check(o.order[2] == 3);
+  mu_check(o.order[3] == 2);
+  SIThreadPool_Free(p);
+}
+
+void cancellableTask(SITask *t, void *arg) {
+  while (!SITask_IsCancelled(t)) {
+    sched_yield();
+  }
+  __atomic_add_fetch(&((taskCounters *)arg)->ran, 1, __ATOMIC_RELAXED);
+}
+
+MU_TEST(testCancel) {
+  SIThreadPool *p = SI_NewThreadPool(1);
+  gate g = {0};
+  SIThreadPool_Submit(p, SI_TASK_NORMAL, gateTask, NULL, &g);
+  waitEntered(&g);
+
+  // a queued task is not run at all
+  taskCounters c = {0};
+  SITask *t = SIThreadPool_Submit(p, SI_TASK_NORMAL, countTask, countDone, &c);
+  SITask_Cancel(t);
+  __atomic_store_n(&g.open, 1, __ATOMIC_RELEASE);
+  drainAll(p);
+  mu_check(c.ran == 0);
+  mu_check(c.done == 1);
+  mu_check(c.cancelled == 1);
+
+  // a running task sees the cancellation
+  c = (taskCounters){0};
+  t = SIThreadPool_Submit(p, SI_TASK_NORMAL, cancellableTask, countDone, &c);
+  SITask_Cancel(t);
+  drainAll(p);
+  mu_check(c.done == 1);
+  mu_check(c.ran + c.cancelled == 1);
+
+  // freeing the pool cancels the queued tasks
+  g = (gate){0};
+  c = (taskCounters){0};
+  SIThreadPool_Submit(p, SI_TASK_NORMAL, gateTask, NULL, &g);
+  waitEntered(&g);
+  for (int i = 0; i < 10; i++) {
+    SIThreadPool_Submit(p, SI_TASK_LOW, countTask, countDone, &c);
+  }
+  __atomic_store_n(&g.open, 1, __ATOMIC_RELEASE);
+  SIThreadPool_Free(p);
+  mu_check(c.done == 10);
+  mu_check(c.ran + c.cancelled == 10);
+}
+
+typedef struct {
+  SIThreadPool *pool;
+  int depth;
+  size_t *leaves;
+} spawnTask;
+
+void freeSpawn(void *arg, int cancelled) { free(arg); }
+
+/* Spawn a binary tree of tasks from the workers, so they are stolen */
+void treeTask(SITask *t, void *arg) {
+  spawnTask *st = arg;
+  if (st->depth == 0) {
+    __atomic_add_fetch(st->leaves, 1, __ATOMIC_RELAXED);
+  } else {
+    for (int i = 0; i < 2; i++) {
+      spawnTask *child = malloc(sizeof(spawnTask));
+      *child = (spawnTask){st->pool, st->depth - 1, st->leaves};
+      SIThreadPool_Submit(st->pool, SI_TASK_NORMAL, treeTask, freeSpawn, child);
+    }
+  }
+}
+
+MU_TEST(testSpawn) {
+  SIThreadPool *p = SI_NewThreadPool(4);
+  size_t leaves = 0;
+  spawnTask *root = malloc(sizeof(spawnTask));
+  *root = (spawnTask){p, 12, &leaves};
+  SIThreadPool_Submit(p, SI_TASK_NORMAL, treeTask, freeSpawn, root);
+  drainAll(p);
+  mu_check(leaves == 1 << 12);
+  SIThreadPool_Free(p);
+}
+
+double __elapsed(struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) +
+         (end.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+void sumTask(SITask *t, void *arg) {
+  volatile size_t sum = 0;
+  for (size_t i = 0; i < 20000; i++) {
+    sum += i;
+  }
+  countTask(t, arg);
+}
+
+/* Throughput of small tasks, submitted from outside the pool and spawned by
+ * the workers */
+MU_TEST(benchmarkThroughput) {
+  for (size_t threads = 1; threads <= 8; threads *= 2) {
+    SIThreadPool *p = SI_NewThreadPool(threads);
+    taskCounters c = {0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < 20000; i++) {
+      SIThreadPool_Submit(p, SI_TASK_NORMAL, sumTask, NULL, &c);
+    }
+    drainAll(p);
+    double submitted = __elapsed(&start);
+
+    size_t leaves = 0;
+    spawnTask *root = malloc(sizeof(spawnTask));
+    *root = (spawnTask){p, 14, &leaves};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    SIThreadPool_Submit(p, SI_TASK_NORMAL, treeTask, freeSpawn, root);
+    drainAll(p);
+    double spawned = __elapsed(&start);
+
+    mu_check(c.ran == 20000);
+    printf("\n%zd threads: %.0f submitted tasks/sec, %.0f spawned tasks/sec",
+           threads, 20000 / submitted, ((2 << 14) - 1) / spawned);
+    SIThreadPool_Free(p);
+  }
+}
+
+int main(int argc, char **argv) {
+  MU_RUN_TEST(testRunAll);
+  MU_RUN_TEST(testPriorities);
+  MU_RUN_TEST(testCancel);
+  MU_RUN_TEST(testSpawn);
+  MU_RUN_TEST(benchmarkThroughput);
+  MU_REPORT();
+  return minunit_status;
+}
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include "minunit.h"
 
 #include "../src/value.h"
@@ -108,10 +110,43 @@ MU_TEST(testValueCast) {
   SIValue_Free(&v);
 }
 
+#define check_format(val, expected)                                            \
+  {                                                                            \
+    SIValue v = val;                                                           \
+    char buf[SI_VALUE_FORMAT_MAX];                                             \
+    size_t n = SIValue_Format(&v, buf);                                        \
+    mu_check(n == strlen(expected));                                           \
+    mu_check(!strncmp(buf, expected, n));                                      \
+  }
+
+MU_TEST(testValueFormat) {
+  check_format(SI_IntVal(0), "0");
+  check_format(SI_IntVal(7), "7");
+  check_format(SI_IntVal(-1337), "-1337");
+  check_format(SI_IntVal(INT32_MIN), "-2147483648");
+  check_format(SI_LongVal(INT64_MIN), "-9223372036854775808");
+  check_format(SI_LongVal(1234567890123), "1234567890123");
+  check_format(SI_UintVal(UINT64_MAX), "18446744073709551615");
+  check_format(SI_TimeVal(1480000000), "1480000000");
+  check_format(SI_BoolVal(1), "1");
+  check_format(SI_BoolVal(0), "0");
+
+  // floating point numbers are formatted in their shortest round-trip form
+  check_format(SI_DoubleVal(100), "100");
+  check_format(SI_DoubleVal(-2.5), "-2.5");
+  check_format(SI_DoubleVal(0.1), "0.1");
+  check_format(SI_DoubleVal(3.141), "3.141");
+  check_format(SI_DoubleVal(1.0 / 3), "0.33333333333333331");
+  check_format(SI_DoubleVal(1e300), "1e+300");
+  check_format(SI_FloatVal(0.1f), "0.1");
+  check_format(SI_FloatVal(16777216.0f), "16777216");
+}
+
 int main(int argc, char **argv) {
   // RMUTil_InitAlloc();
   MU_RUN_TEST(testValue);
   MU_RUN_TEST(testValueCast);
+  MU_RUN_TEST(testValueFormat);
   MU_REPORT();
   return minunit_status;
 }
\ No newline at end of file